@@ -288,6 +288,25 @@ CREATE ACCESS METHOD ivfflat TYPE INDEX HANDLER ivfflathandler;
 
 -- COMMENT ON ACCESS METHOD ivfflat IS 'ivfflat index access method';
 
+CREATE FUNCTION ivfflat_centers(regclass) RETURNS SETOF vector
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION ivfflat_rebalance(regclass, float8 DEFAULT 4) RETURNS integer
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION ivfflat_list_stats(regclass, OUT list integer, OUT tuples bigint, OUT pages integer) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE VIEW ivfflat_lists AS
+	SELECT indexrelid, (s).list, (s).tuples, (s).pages
+	FROM (
+		SELECT c.oid::regclass AS indexrelid, ivfflat_list_stats(c.oid) AS s
+		FROM pg_class c JOIN pg_am a ON a.oid = c.relam
+		JOIN pg_index i ON i.indexrelid = c.oid
+		WHERE a.amname = 'ivfflat' AND c.relpersistence <> 't'
+		AND has_table_privilege(i.indrelid, 'SELECT')
+	) t;
+
 CREATE FUNCTION hnswbuild(internal, internal, internal) RETURNS internal
 	AS 'MODULE_PATHNAME' LANGUAGE C;
 
@@ -331,6 +350,92 @@ CREATE ACCESS METHOD hnsw TYPE INDEX HANDLER hnswhandler;
 
 -- COMMENT ON ACCESS METHOD hnsw IS 'hnsw index access method';
 
+CREATE FUNCTION diskannbuild(internal, internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannbuildempty(internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskanninsert(internal, internal, internal, internal, internal, internal) RETURNS boolean
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannbulkdelete(internal, internal, internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannvacuumcleanup(internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskanncostestimate(internal, internal, internal, internal, internal, internal, internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannoptions(internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannvalidate(internal) RETURNS boolean
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannbeginscan(internal, internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannrescan(internal, internal, internal, internal, internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskanngettuple(internal, internal) RETURNS boolean
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannendscan(internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION diskannhandler(internal) RETURNS index_am_handler
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE ACCESS METHOD diskann TYPE INDEX HANDLER diskannhandler;
+
+-- COMMENT ON ACCESS METHOD diskann IS 'diskann index access method';
+
+CREATE FUNCTION sparseinvbuild(internal, internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvbuildempty(internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvinsert(internal, internal, internal, internal, internal, internal) RETURNS boolean
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvbulkdelete(internal, internal, internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvvacuumcleanup(internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvcostestimate(internal, internal, internal, internal, internal, internal, internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvoptions(internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvvalidate(internal) RETURNS boolean
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvbeginscan(internal, internal, internal) RETURNS internal
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvrescan(internal, internal, internal, internal, internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvgettuple(internal, internal) RETURNS boolean
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvendscan(internal) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sparseinvhandler(internal) RETURNS index_am_handler
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE ACCESS METHOD sparseinv TYPE INDEX HANDLER sparseinvhandler;
+
+-- COMMENT ON ACCESS METHOD sparseinv IS 'sparseinv index access method';
+
 -- access method private functions
 
 CREATE FUNCTION ivfflat_halfvec_support(internal) RETURNS internal
@@ -401,6 +506,22 @@ CREATE OPERATOR CLASS vector_l1_ops
 	OPERATOR 1 <+> (vector, vector) FOR ORDER BY float_ops,
 	FUNCTION 1 l1_distance(vector, vector);
 
+CREATE OPERATOR CLASS vector_l2_ops
+	FOR TYPE vector USING diskann AS
+	OPERATOR 1 <-> (vector, vector) FOR ORDER BY float_ops,
+	FUNCTION 1 vector_l2_squared_distance(vector, vector);
+
+CREATE OPERATOR CLASS vector_ip_ops
+	FOR TYPE vector USING diskann AS
+	OPERATOR 1 <#> (vector, vector) FOR ORDER BY float_ops,
+	FUNCTION 1 vector_negative_inner_product(vector, vector);
+
+CREATE OPERATOR CLASS vector_cosine_ops
+	FOR TYPE vector USING diskann AS
+	OPERATOR 1 <=> (vector, vector) FOR ORDER BY float_ops,
+	FUNCTION 1 vector_negative_inner_product(vector, vector),
+	FUNCTION 2 vector_norm(vector);
+
 -- halfvec type
 
 CREATE TYPE halfvec;
@@ -960,3 +1081,57 @@ CREATE OPERATOR CLASS sparsevec_l1_ops
 	OPERATOR 1 <+> (sparsevec, sparsevec) FOR ORDER BY float_ops,
 	FUNCTION 1 l1_distance(sparsevec, sparsevec),
 	FUNCTION 3 hnsw_sparsevec_support(internal);
+
+CREATE OPERATOR CLASS sparsevec_ip_ops
+	FOR TYPE sparsevec USING sparseinv AS
+	OPERATOR 1 <#> (sparsevec, sparsevec) FOR ORDER BY float_ops,
+	FUNCTION 1 sparsevec_negative_inner_product(sparsevec, sparsevec);
+
+-- hnsw functions
+
+CREATE FUNCTION hnsw_filtered_search(regclass, vector, tid[], integer) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_filtered_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_filtered_search(regclass, halfvec, tid[], integer) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_filtered_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_filtered_search(regclass, bit, tid[], integer) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_filtered_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_filtered_search(regclass, sparsevec, tid[], integer) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_filtered_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_range_search(regclass, vector, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_range_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_range_search(regclass, halfvec, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_range_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_range_search(regclass, bit, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_range_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_range_search(regclass, sparsevec, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'hnsw_range_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_batch_search(regclass, vector[], integer, OUT query integer, OUT id tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'hnsw_batch_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_batch_search(regclass, halfvec[], integer, OUT query integer, OUT id tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'hnsw_batch_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_batch_search(regclass, bit[], integer, OUT query integer, OUT id tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'hnsw_batch_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION hnsw_batch_search(regclass, sparsevec[], integer, OUT query integer, OUT id tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'hnsw_batch_search' LANGUAGE C STABLE STRICT;
+
+-- ivfflat functions
+
+CREATE FUNCTION ivfflat_range_search(regclass, vector, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'ivfflat_range_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION ivfflat_range_search(regclass, halfvec, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'ivfflat_range_search' LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION ivfflat_range_search(regclass, bit, float8) RETURNS tid[]
+	AS 'MODULE_PATHNAME', 'ivfflat_range_search' LANGUAGE C STABLE STRICT;
@@ -66,3 +66,33 @@ jaccard_distance(PG_FUNCTION_ARGS)
 
 	PG_RETURN_FLOAT8(BitJaccardDistance(VARBITBYTES(a), VARBITS(a), VARBITS(b), 0, 0, 0));
 }
+
+/*
+ * Get the distances between a bit vector and a batch of bit vectors
+ *
+ * Calls the popcount kernels directly instead of going through fmgr for
+ * each value
+ */
+void
+BitDistanceBatch(FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances)
+{
+	VarBit	   *a;
+
+	if (procinfo->fn_addr != hamming_distance)
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+		return;
+	}
+
+	a = DatumGetVarBitP(q);
+
+	for (int i = 0; i < n; i++)
+	{
+		VarBit	   *b = DatumGetVarBitP(values[i]);
+
+		CheckDims(a, b);
+
+		distances[i] = (double) BitHammingDistance(VARBITBYTES(a), VARBITS(a), VARBITS(b), 0);
+	}
+}
@@ -4,6 +4,7 @@
 #include "utils/varbit.h"
 
 VarBit	   *InitBitVector(int dim);
+void		BitDistanceBatch(FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances);
 
 extern "C" {
     Datum hamming_distance(PG_FUNCTION_ARGS);
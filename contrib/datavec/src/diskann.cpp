@@ -0,0 +1,361 @@
+#include "postgres.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "access/amapi.h"
+#include "access/reloptions.h"
+#include "commands/vacuum.h"
+#include "diskann.h"
+#include "miscadmin.h"
+#include "utils/guc.h"
+#include "utils/selfuncs.h"
+
+#if PG_VERSION_NUM < 150000
+#define MarkGUCPrefixReserved(x) EmitWarningsOnPlaceholders(x)
+#endif
+
+int			diskann_search_list_size;
+int			diskann_beam_width;
+int			diskann_pq_cache_size;
+static relopt_kind diskann_relopt_kind;
+
+/*
+ * Initialize index options and variables
+ */
+void
+DiskannInit(void)
+{
+	diskann_relopt_kind = add_reloption_kind();
+	add_int_reloption(diskann_relopt_kind, "max_degree", "Max number of neighbors",
+					  DISKANN_DEFAULT_MAX_DEGREE, DISKANN_MIN_MAX_DEGREE, DISKANN_MAX_MAX_DEGREE
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+	add_int_reloption(diskann_relopt_kind, "build_list_size", "Size of the candidate list for construction",
+					  DISKANN_DEFAULT_BUILD_LIST_SIZE, DISKANN_MIN_BUILD_LIST_SIZE, DISKANN_MAX_BUILD_LIST_SIZE
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+	add_real_reloption(diskann_relopt_kind, "alpha", "Pruning factor for long-range neighbors",
+					   DISKANN_DEFAULT_ALPHA, DISKANN_MIN_ALPHA, DISKANN_MAX_ALPHA
+#if PG_VERSION_NUM >= 130000
+					   ,AccessExclusiveLock
+#endif
+		);
+	add_int_reloption(diskann_relopt_kind, "pq_m", "Number of product quantization subquantizers",
+					  DISKANN_DEFAULT_PQ_M, DISKANN_MIN_PQ_M, DISKANN_MAX_PQ_M
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+
+	DefineCustomIntVariable("diskann.search_list_size", "Sets the size of the candidate list for search",
+							"Valid range is 1..1000.", &diskann_search_list_size,
+							DISKANN_DEFAULT_SEARCH_LIST_SIZE, DISKANN_MIN_SEARCH_LIST_SIZE, DISKANN_MAX_SEARCH_LIST_SIZE, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("diskann.beam_width", "Sets the number of nodes read together during search",
+							"Valid range is 1..64.", &diskann_beam_width,
+							DISKANN_DEFAULT_BEAM_WIDTH, DISKANN_MIN_BEAM_WIDTH, DISKANN_MAX_BEAM_WIDTH, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("diskann.pq_cache_size", "Sets the max memory for cached product quantization codes",
+							"Zero disables caches.", &diskann_pq_cache_size,
+							DISKANN_DEFAULT_PQ_CACHE_SIZE, 0, INT_MAX, PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	MarkGUCPrefixReserved("diskann");
+}
+
+/*
+ * Estimate the cost of an index scan
+ */
+static void
+diskanncostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_count,
+							 Cost *indexStartupCost, Cost *indexTotalCost,
+							 Selectivity *indexSelectivity, double *indexCorrelation)
+{
+	GenericCosts costs;
+
+	/* Never use index without order */
+	if (path->indexorderbys == NULL)
+	{
+		*indexStartupCost = DBL_MAX;
+		*indexTotalCost = DBL_MAX;
+		*indexSelectivity = 0;
+		*indexCorrelation = 0;
+		return;
+	}
+
+	MemSet(&costs, 0, sizeof(costs));
+
+	/* Each node in the candidate list is read once */
+	costs.numIndexTuples = Min(diskann_search_list_size, path->indexinfo->tuples);
+
+	genericcostestimate(root, path, loop_count, costs.numIndexTuples, &costs.indexStartupCost,
+						&costs.indexTotalCost, &costs.indexSelectivity, &costs.indexCorrelation);
+
+	/* Use total cost since most work happens before first tuple is returned */
+	*indexStartupCost = costs.indexTotalCost;
+	*indexTotalCost = costs.indexTotalCost;
+	*indexSelectivity = costs.indexSelectivity;
+	*indexCorrelation = costs.indexCorrelation;
+}
+
+/*
+ * Parse and validate the reloptions
+ */
+static bytea *
+diskannoptions_internal(Datum reloptions, bool validate)
+{
+	static const relopt_parse_elt tab[] = {
+		{"max_degree", RELOPT_TYPE_INT, offsetof(DiskannOptions, maxDegree)},
+		{"build_list_size", RELOPT_TYPE_INT, offsetof(DiskannOptions, buildListSize)},
+		{"alpha", RELOPT_TYPE_REAL, offsetof(DiskannOptions, alpha)},
+		{"pq_m", RELOPT_TYPE_INT, offsetof(DiskannOptions, pqM)}
+	};
+
+#if PG_VERSION_NUM >= 130000
+	return (bytea *) build_reloptions(reloptions, validate,
+									  diskann_relopt_kind,
+									  sizeof(DiskannOptions),
+									  tab, lengthof(tab));
+#else
+	relopt_value *options;
+	int			numoptions;
+	DiskannOptions *rdopts;
+
+	options = parseRelOptions(reloptions, validate, diskann_relopt_kind, &numoptions);
+	rdopts = (DiskannOptions *) allocateReloptStruct(sizeof(DiskannOptions), options, numoptions);
+	fillRelOptions((void *) rdopts, sizeof(DiskannOptions), options, numoptions,
+				   validate, tab, lengthof(tab));
+
+	return (bytea *) rdopts;
+#endif
+}
+
+/*
+ * Validate catalog entries for the specified operator class
+ */
+static bool
+diskannvalidate_internal(Oid opclassoid)
+{
+	return true;
+}
+
+/*
+ * Define index handler
+ *
+ * See https://www.postgresql.org/docs/current/index-api.html
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannhandler);
+Datum
+diskannhandler(PG_FUNCTION_ARGS)
+{
+	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+	amroutine->amstrategies = 0;
+	amroutine->amsupport = 2;
+#if PG_VERSION_NUM >= 130000
+	amroutine->amoptsprocnum = 0;
+#endif
+	amroutine->amcanorder = false;
+	amroutine->amcanorderbyop = true;
+	amroutine->amcanbackward = false;	/* can change direction mid-scan */
+	amroutine->amcanunique = false;
+	amroutine->amcanmulticol = false;
+	amroutine->amoptionalkey = true;
+	amroutine->amsearcharray = false;
+	amroutine->amsearchnulls = false;
+	amroutine->amstorage = false;
+	amroutine->amclusterable = false;
+	amroutine->ampredlocks = false;
+	amroutine->amcanparallel = false;
+	amroutine->amcaninclude = false;
+#if PG_VERSION_NUM >= 130000
+	amroutine->amusemaintenanceworkmem = false; /* not used during VACUUM */
+	amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
+#endif
+	amroutine->amkeytype = InvalidOid;
+
+	/* Interface functions */
+	errno_t rc;
+	rc = strcpy_s(amroutine->ambuildfuncname, NAMEDATALEN, "diskannbuild");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->ambuildemptyfuncname, NAMEDATALEN, "diskannbuildempty");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->aminsertfuncname, NAMEDATALEN, "diskanninsert");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->ambulkdeletefuncname, NAMEDATALEN, "diskannbulkdelete");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amvacuumcleanupfuncname, NAMEDATALEN, "diskannvacuumcleanup");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amcostestimatefuncname, NAMEDATALEN, "diskanncostestimate");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amoptionsfuncname, NAMEDATALEN, "diskannoptions");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amvalidatefuncname, NAMEDATALEN, "diskannvalidate");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->ambeginscanfuncname, NAMEDATALEN, "diskannbeginscan");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amrescanfuncname, NAMEDATALEN, "diskannrescan");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amgettuplefuncname, NAMEDATALEN, "diskanngettuple");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amendscanfuncname, NAMEDATALEN, "diskannendscan");
+	securec_check(rc, "\0", "\0");
+
+	PG_RETURN_POINTER(amroutine);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannbuild);
+Datum
+diskannbuild(PG_FUNCTION_ARGS)
+{
+	Relation heap = (Relation)PG_GETARG_POINTER(0);
+	Relation index = (Relation)PG_GETARG_POINTER(1);
+	IndexInfo *indexinfo = (IndexInfo *)PG_GETARG_POINTER(2);
+	IndexBuildResult *result = diskannbuild_internal(heap, index, indexinfo);
+
+	PG_RETURN_POINTER(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannbuildempty);
+Datum
+diskannbuildempty(PG_FUNCTION_ARGS)
+{
+	Relation index = (Relation)PG_GETARG_POINTER(0);
+	diskannbuildempty_internal(index);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskanninsert);
+Datum
+diskanninsert(PG_FUNCTION_ARGS)
+{
+	Relation rel = (Relation)PG_GETARG_POINTER(0);
+	Datum * values = (Datum *)PG_GETARG_POINTER(1);
+	bool *isnull = (bool *)PG_GETARG_POINTER(2);
+	ItemPointer ht_ctid = (ItemPointer)PG_GETARG_POINTER(3);
+	Relation heaprel = (Relation)PG_GETARG_POINTER(4);
+	IndexUniqueCheck checkunique = (IndexUniqueCheck)PG_GETARG_INT32(5);
+	bool result = diskanninsert_internal(rel, values, isnull, ht_ctid, heaprel, checkunique);
+
+	PG_RETURN_BOOL(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannbulkdelete);
+Datum
+diskannbulkdelete(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo *info = (IndexVacuumInfo *)PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult *volatile stats = (IndexBulkDeleteResult *)PG_GETARG_POINTER(1);
+	IndexBulkDeleteCallback callback = (IndexBulkDeleteCallback)PG_GETARG_POINTER(2);
+	void *callback_state = (void *)PG_GETARG_POINTER(3);
+	stats = diskannbulkdelete_internal(info, stats, callback, callback_state);
+
+	PG_RETURN_POINTER(stats);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannvacuumcleanup);
+Datum
+diskannvacuumcleanup(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo *info = (IndexVacuumInfo *)PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult *stats = (IndexBulkDeleteResult *)PG_GETARG_POINTER(1);
+	stats = diskannvacuumcleanup_internal(info, stats);
+
+	PG_RETURN_POINTER(stats);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskanncostestimate);
+Datum
+diskanncostestimate(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	IndexPath *path = (IndexPath *)PG_GETARG_POINTER(1);
+	double loopcount = (double)PG_GETARG_FLOAT8(2);
+	Cost *startupcost = (Cost *)PG_GETARG_POINTER(3);
+	Cost *totalcost = (Cost *)PG_GETARG_POINTER(4);
+	Selectivity *selectivity = (Selectivity *)PG_GETARG_POINTER(5);
+	double *correlation = (double *)PG_GETARG_POINTER(6);
+	diskanncostestimate_internal(root, path, loopcount, startupcost, totalcost, selectivity, correlation);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannoptions);
+Datum
+diskannoptions(PG_FUNCTION_ARGS)
+{
+	Datum reloptions = PG_GETARG_DATUM(0);
+	bool validate = PG_GETARG_BOOL(1);
+	bytea *result = diskannoptions_internal(reloptions, validate);
+
+	if (NULL != result)
+		PG_RETURN_BYTEA_P(result);
+
+	PG_RETURN_NULL();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannvalidate);
+Datum
+diskannvalidate(PG_FUNCTION_ARGS)
+{
+	Oid opclassoid = PG_GETARG_OID(0);
+	bool result = diskannvalidate_internal(opclassoid);
+
+	PG_RETURN_BOOL(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannbeginscan);
+Datum
+diskannbeginscan(PG_FUNCTION_ARGS)
+{
+	Relation rel = (Relation)PG_GETARG_POINTER(0);
+	int nkeys = PG_GETARG_INT32(1);
+	int norderbys = PG_GETARG_INT32(2);
+	IndexScanDesc scan = diskannbeginscan_internal(rel, nkeys, norderbys);
+
+	PG_RETURN_POINTER(scan);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannrescan);
+Datum
+diskannrescan(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc scan = (IndexScanDesc)PG_GETARG_POINTER(0);
+	ScanKey scankey = (ScanKey)PG_GETARG_POINTER(1);
+	int nkeys = PG_GETARG_INT32(2);
+	ScanKey orderbys = (ScanKey)PG_GETARG_POINTER(3);
+	int norderbys = PG_GETARG_INT32(4);
+	diskannrescan_internal(scan, scankey, nkeys, orderbys, norderbys);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskanngettuple);
+Datum
+diskanngettuple(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc scan = (IndexScanDesc)PG_GETARG_POINTER(0);
+	ScanDirection direction = (ScanDirection)PG_GETARG_INT32(1);
+
+	if (NULL == scan)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid arguments for function diskanngettuple")));
+
+	bool result = diskanngettuple_internal(scan, direction);
+
+	PG_RETURN_BOOL(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(diskannendscan);
+Datum
+diskannendscan(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc scan = (IndexScanDesc)PG_GETARG_POINTER(0);
+	diskannendscan_internal(scan);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,323 @@
+#ifndef DISKANN_H
+#define DISKANN_H
+
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "ivfflat.h"			/* for product quantization */
+#include "nodes/execnodes.h"
+#include "vector.h"
+
+#define DISKANN_MAX_DIM 2000
+
+/* Support functions */
+#define DISKANN_DISTANCE_PROC 1
+#define DISKANN_NORM_PROC 2
+
+#define DISKANN_VERSION	1
+#define DISKANN_MAGIC_NUMBER 0xD15CA4A1
+#define DISKANN_PAGE_ID	0xFF92
+
+/* Page lock */
+#define DISKANN_UPDATE_LOCK	0
+
+/* Preserved page numbers */
+#define DISKANN_METAPAGE_BLKNO	0
+#define DISKANN_HEAD_BLKNO		1	/* first codebook or node page */
+
+/* DiskANN parameters */
+#define DISKANN_DEFAULT_MAX_DEGREE	64
+#define DISKANN_MIN_MAX_DEGREE	4
+#define DISKANN_MAX_MAX_DEGREE	512
+#define DISKANN_DEFAULT_BUILD_LIST_SIZE	100
+#define DISKANN_MIN_BUILD_LIST_SIZE	4
+#define DISKANN_MAX_BUILD_LIST_SIZE	1000
+#define DISKANN_DEFAULT_ALPHA	1.2
+#define DISKANN_MIN_ALPHA	1.0
+#define DISKANN_MAX_ALPHA	2.0
+#define DISKANN_DEFAULT_PQ_M	0		/* dimensions / 4, rounded down to a divisor */
+#define DISKANN_MIN_PQ_M	0
+#define DISKANN_MAX_PQ_M	DISKANN_MAX_DIM
+#define DISKANN_DEFAULT_SEARCH_LIST_SIZE	100
+#define DISKANN_MIN_SEARCH_LIST_SIZE	1
+#define DISKANN_MAX_SEARCH_LIST_SIZE	1000
+#define DISKANN_DEFAULT_BEAM_WIDTH	4
+#define DISKANN_MIN_BEAM_WIDTH	1
+#define DISKANN_MAX_BEAM_WIDTH	64
+#define DISKANN_DEFAULT_PQ_CACHE_SIZE	(1024 * 1024)	/* kB */
+#define DISKANN_MAX_PQ_CACHES	64
+#define DISKANN_PQ_MAX_SAMPLES	(IVFFLAT_PQ_CODEWORDS * 100)
+#define DISKANN_UPDATE_RETRIES	3
+
+/* Make graph robust against non-HOT updates */
+#define DISKANN_HEAPTIDS 10
+
+#define DISKANN_INVALID_NODE	((uint32) 0xFFFFFFFF)
+
+/* Node flags */
+#define DISKANN_NODE_FREE	0x0001	/* on the free list, next in neighbors[0] */
+
+/* Build phases */
+/* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
+#define PROGRESS_DISKANN_PHASE_LOAD		2
+
+#define DISKANN_MAX_SIZE (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(DiskannPageOpaqueData)) - sizeof(ItemIdData))
+
+/*
+ * Nodes have a fixed size so a node number maps directly to a tid and a node
+ * is never split across pages
+ */
+#define DISKANN_NODE_SIZE(maxDegree, dimensions, pqM) \
+	MAXALIGN(offsetof(DiskannNodeTupleData, neighbors) + sizeof(uint32) * (maxDegree) + VECTOR_SIZE(dimensions) + (pqM))
+#define DiskannNodesPerPage(nodeSize) \
+	((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(DiskannPageOpaqueData))) / ((nodeSize) + sizeof(ItemIdData)))
+
+#define DiskannNodeValue(ntup, maxDegree) \
+	((Vector *) ((char *) (ntup) + offsetof(DiskannNodeTupleData, neighbors) + sizeof(uint32) * (maxDegree)))
+#define DiskannNodeCodes(ntup, maxDegree, dimensions) \
+	((uint8 *) DiskannNodeValue(ntup, maxDegree) + VECTOR_SIZE(dimensions))
+
+/* Nodes without heap TIDs stay in the graph for navigation only */
+#define DiskannNodeIsDeleted(ntup) (!ItemPointerIsValid(&(ntup)->heaptids[0]))
+#define DiskannNodeIsFree(ntup) (((ntup)->flags & DISKANN_NODE_FREE) != 0)
+
+#define DiskannPageGetOpaque(page)	((DiskannPageOpaque) PageGetSpecialPointer(page))
+#define DiskannPageGetMeta(page)	((DiskannMetaPageData *) PageGetContents(page))
+
+/* Variables */
+extern int	diskann_search_list_size;
+extern int	diskann_beam_width;
+extern int	diskann_pq_cache_size;
+
+typedef struct DiskannOptions
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int			maxDegree;		/* max number of neighbors */
+	int			buildListSize;	/* size of the candidate list for build */
+	double		alpha;			/* pruning factor */
+	int			pqM;			/* number of subquantizers */
+}			DiskannOptions;
+
+typedef struct DiskannMetaPageData
+{
+	uint32		magicNumber;
+	uint32		version;
+	uint32		dimensions;
+	uint16		maxDegree;
+	uint16		buildListSize;
+	float		alpha;
+	uint16		pqM;
+	bool		pqTrained;
+	uint16		nodeSize;
+	uint16		nodesPerPage;
+	BlockNumber codebookPage;
+	BlockNumber nodeStartPage;
+	uint32		nodeCount;
+	uint32		entryNode;
+	uint32		freeNode;		/* first node freed by vacuum */
+}			DiskannMetaPageData;
+
+typedef DiskannMetaPageData * DiskannMetaPage;
+
+typedef struct DiskannPageOpaqueData
+{
+	BlockNumber nextblkno;
+	uint16		unused;
+	uint16		page_id;		/* for identification of DiskANN indexes */
+}			DiskannPageOpaqueData;
+
+typedef DiskannPageOpaqueData * DiskannPageOpaque;
+
+/*
+ * Node on disk
+ *
+ * The neighbor slots are followed by the value and its product quantization
+ * codes, so a single page read has everything needed to expand a node
+ */
+typedef struct DiskannNodeTupleData
+{
+	ItemPointerData heaptids[DISKANN_HEAPTIDS];
+	uint16		degree;
+	uint16		flags;
+	uint32		neighbors[FLEXIBLE_ARRAY_MEMBER];
+}			DiskannNodeTupleData;
+
+typedef DiskannNodeTupleData * DiskannNodeTuple;
+
+/* Node loaded in memory */
+typedef struct DiskannNodeData
+{
+	uint32		id;
+	float		distance;
+	int			heaptidsLength;
+	ItemPointerData heaptids[DISKANN_HEAPTIDS];
+	int			degree;
+	uint32	   *neighbors;
+	Vector	   *value;
+}			DiskannNodeData;
+
+typedef DiskannNodeData * DiskannNode;
+
+/*
+ * Product quantization codes cached in instance memory
+ *
+ * Codes are appended in node order. Codes below the count seen when the
+ * cache is pinned only change when an insert reuses a node freed by vacuum,
+ * which only affects the distances used to navigate.
+ */
+typedef struct DiskannPqCache
+{
+	Size		size;
+	int			refcount;
+	bool		invalid;
+	int			pqM;
+	uint32		capacity;
+	uint32		count;
+	uint8	   *codes;
+}			DiskannPqCache;
+
+typedef struct DiskannBuildState
+{
+	/* Info */
+	Relation	heap;
+	Relation	index;
+	IndexInfo  *indexInfo;
+	ForkNumber	forkNum;
+
+	/* Settings */
+	int			dimensions;
+	int			maxDegree;
+	int			buildListSize;
+	float		alpha;
+	int			pqM;
+
+	/* Statistics */
+	double		indtuples;
+	double		reltuples;
+
+	/* Support functions */
+	FmgrInfo   *procinfo;
+	FmgrInfo   *normprocinfo;
+	Oid			collation;
+
+	/* In-memory graph */
+	Size		valueSize;
+	uint32		nodeCount;
+	uint32		maxNodes;
+	uint32		memoryNodes;	/* max nodes that fit in maintenance_work_mem */
+	char	   *values;
+	ItemPointerData *heaptids;
+	uint16	   *degrees;
+	uint32	   *neighbors;
+	bool		flushed;
+
+	/* Quantizer */
+	IvfflatQuantizer quantizer;
+
+	/* Memory */
+	MemoryContext graphCtx;
+	MemoryContext tmpCtx;
+}			DiskannBuildState;
+
+typedef struct DiskannVacuumState
+{
+	/* Info */
+	Relation	index;
+	IndexBulkDeleteResult *stats;
+	IndexBulkDeleteCallback callback;
+	void	   *callback_state;
+
+	/* Settings */
+	DiskannMetaPageData metap;
+
+	/* Support functions */
+	FmgrInfo   *procinfo;
+	Oid			collation;
+
+	/* Variables */
+	bool	   *deleted;		/* nodes without heap TIDs */
+	BufferAccessStrategy bas;
+	MemoryContext tmpCtx;
+}			DiskannVacuumState;
+
+typedef struct DiskannScanOpaqueData
+{
+	bool		first;
+	List	   *w;
+	MemoryContext tmpCtx;
+
+	/* Support functions */
+	FmgrInfo   *procinfo;
+	FmgrInfo   *normprocinfo;
+	Oid			collation;
+}			DiskannScanOpaqueData;
+
+typedef DiskannScanOpaqueData * DiskannScanOpaque;
+
+/* Methods */
+int			DiskannGetMaxDegree(Relation index);
+int			DiskannGetBuildListSize(Relation index);
+float		DiskannGetAlpha(Relation index);
+int			DiskannGetPqM(Relation index, int dimensions);
+FmgrInfo   *DiskannOptionalProcInfo(Relation index, uint16 procnum);
+Datum		DiskannNormValue(Oid collation, Datum value);
+bool		DiskannCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
+Buffer		DiskannNewBuffer(Relation index, ForkNumber forkNum);
+void		DiskannInitPage(Buffer buf, Page page);
+void		DiskannInit(void);
+void		DiskannGetMetaPageInfo(Relation index, DiskannMetaPage metap);
+void		DiskannNodeTid(const DiskannMetaPageData * metap, uint32 node, BlockNumber *blkno, OffsetNumber *offno);
+void		DiskannSetNodeTuple(const DiskannMetaPageData * metap, DiskannNodeTuple ntup, const ItemPointerData *heaptids, int heaptidsLength, const uint32 *neighbors, int degree, const Vector * value, const uint8 *codes);
+DiskannNode DiskannLoadNode(Relation index, const DiskannMetaPageData * metap, uint32 id, Datum q, FmgrInfo *procinfo, Oid collation, bool loadValue);
+List	   *DiskannSearch(Relation index, const DiskannMetaPageData * metap, Datum q, int l, int beamWidth, FmgrInfo *procinfo, Oid collation, const DiskannPqCache * cache, uint32 cacheCount, bool loadValues);
+int			DiskannRobustPrune(const uint32 *ids, const float *distances, const Datum *values, int n, int maxDegree, float alpha, FmgrInfo *procinfo, Oid collation, uint32 *neighbors);
+bool		DiskannUpdateNeighbors(Relation index, const DiskannMetaPageData * metap, uint32 node, const uint32 *oldNeighbors, int oldDegree, const uint32 *neighbors, int degree, bool building);
+int			DiskannPruneNeighbors(Relation index, const DiskannMetaPageData * metap, DiskannNode n, const uint32 *extraIds, const Datum *extraValues, int extraLength, FmgrInfo *procinfo, Oid collation, uint32 *neighbors);
+bool		DiskannInsertTupleOnDisk(Relation index, Datum value, ItemPointer heaptid, bool building);
+const		IvfflatQuantizerData *DiskannGetQuantizer(Relation index, const DiskannMetaPageData * metap);
+DiskannPqCache *DiskannPinPqCache(Relation index, const DiskannMetaPageData * metap, uint32 *count);
+void		DiskannUnpinPqCache(DiskannPqCache * cache);
+void		DiskannUpdatePqCache(Relation index, uint32 node, const uint8 *codes);
+
+extern "C" {
+    Datum diskannhandler(PG_FUNCTION_ARGS);
+    Datum diskannbuild(PG_FUNCTION_ARGS);
+    Datum diskannbuildempty(PG_FUNCTION_ARGS);
+    Datum diskanninsert(PG_FUNCTION_ARGS);
+    Datum diskannbulkdelete(PG_FUNCTION_ARGS);
+    Datum diskannvacuumcleanup(PG_FUNCTION_ARGS);
+    Datum diskanncostestimate(PG_FUNCTION_ARGS);
+    Datum diskannoptions(PG_FUNCTION_ARGS);
+    Datum diskannvalidate(PG_FUNCTION_ARGS);
+    Datum diskannbeginscan(PG_FUNCTION_ARGS);
+    Datum diskannrescan(PG_FUNCTION_ARGS);
+    Datum diskanngettuple(PG_FUNCTION_ARGS);
+    Datum diskannendscan(PG_FUNCTION_ARGS);
+}
+
+/* Index access methods */
+IndexBuildResult *diskannbuild_internal(Relation heap, Relation index, IndexInfo *indexInfo);
+void		diskannbuildempty_internal(Relation index);
+bool		diskanninsert_internal(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heap, IndexUniqueCheck checkUnique);
+IndexBulkDeleteResult *diskannbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state);
+IndexBulkDeleteResult *diskannvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats);
+IndexScanDesc diskannbeginscan_internal(Relation index, int nkeys, int norderbys);
+void		diskannrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
+bool		diskanngettuple_internal(IndexScanDesc scan, ScanDirection dir);
+void		diskannendscan_internal(IndexScanDesc scan);
+
+/* Node number hash table */
+typedef struct NodeHashEntry
+{
+	uint32		node;
+	char		status;
+}			NodeHashEntry;
+
+#define SH_PREFIX nodehash
+#define SH_ELEMENT_TYPE NodeHashEntry
+#define SH_KEY_TYPE uint32
+#define SH_SCOPE extern
+#define SH_DECLARE
+#include "lib/simplehash.h"
+
+#endif
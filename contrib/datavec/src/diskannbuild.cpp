@@ -0,0 +1,876 @@
+/*
+ * The DiskANN build happens in two phases:
+ *
+ * 1. In-memory phase
+ *
+ * Vectors are collected in memory until the table is scanned or the nodes no
+ * longer fit in maintenance_work_mem. The graph is then built with the
+ * Vamana algorithm (see BuildGraphInMemory()): starting from the medoid, each
+ * node is searched for in random order and its neighbors are chosen with
+ * RobustPrune, first with alpha = 1 and then with the configured alpha.
+ * Product quantization codebooks are trained on a sample of the nodes, and
+ * the meta page, codebook pages and node pages are written in node order
+ * (see FlushGraph()).
+ *
+ * 2. On-disk phase
+ *
+ * If the nodes did not fit in memory, the remaining vectors are inserted one
+ * by one, just like on INSERT, except the inserts are not WAL-logged.
+ *
+ * After we have finished building the graph, we perform one more scan through
+ * the index and write all the pages to the WAL.
+ */
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/xloginsert.h"
+#include "catalog/index.h"
+#include "diskann.h"
+#include "miscadmin.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_progress.h"
+#else
+#include "pgstat.h"
+#endif
+
+#if PG_VERSION_NUM >= 130000
+#define CALLBACK_ITEM_POINTER ItemPointer tid
+#else
+#define CALLBACK_ITEM_POINTER HeapTuple hup
+#endif
+
+#define PROGRESS_CREATEIDX_TUPLES_DONE 0
+
+#define DISKANN_CODEBOOK_CHUNK_SIZE	(MAXALIGN_DOWN(DISKANN_MAX_SIZE) / sizeof(float))
+
+/* Candidate during in-memory search */
+typedef struct DiskannBuildCandidate
+{
+	uint32		node;
+	float		distance;
+	bool		expanded;
+}			DiskannBuildCandidate;
+
+/* Scratch space for in-memory search */
+typedef struct DiskannBuildSearch
+{
+	DiskannBuildCandidate *candidates;
+	uint32	   *epochs;
+	uint32		epoch;
+	uint32	   *visited;
+	float	   *visitedDistances;
+	int			visitedLength;
+	int			maxVisited;
+	Datum	   *batchValues;
+	uint32	   *batchNodes;
+	double	   *batchDistances;
+}			DiskannBuildSearch;
+
+#define BuildNodeValue(buildstate, node) \
+	((Vector *) ((buildstate)->values + (Size) (node) * (buildstate)->valueSize))
+#define BuildNodeNeighbors(buildstate, node) \
+	((buildstate)->neighbors + (Size) (node) * (buildstate)->maxDegree)
+
+/*
+ * Add a new page
+ */
+static void
+DiskannBuildAppendPage(Relation index, Buffer *buf, Page *page, ForkNumber forkNum)
+{
+	/* Add a new page */
+	Buffer		newbuf = DiskannNewBuffer(index, forkNum);
+
+	/* Update previous page */
+	DiskannPageGetOpaque(*page)->nextblkno = BufferGetBlockNumber(newbuf);
+
+	/* Commit */
+	MarkBufferDirty(*buf);
+	UnlockReleaseBuffer(*buf);
+
+	/* Can take a while, so ensure we can interrupt */
+	/* Needs to be called when no buffer locks are held */
+	LockBuffer(newbuf, BUFFER_LOCK_UNLOCK);
+	CHECK_FOR_INTERRUPTS();
+	LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
+
+	/* Prepare new page */
+	*buf = newbuf;
+	*page = BufferGetPage(*buf);
+	DiskannInitPage(*buf, *page);
+}
+
+/*
+ * Add a candidate to the sorted list, dropping the furthest if full
+ */
+static void
+AddBuildCandidate(DiskannBuildCandidate * candidates, int *length, int l, uint32 node, float distance)
+{
+	int			i;
+
+	if (*length == l)
+	{
+		if (distance >= candidates[l - 1].distance)
+			return;
+
+		i = l - 1;
+	}
+	else
+		i = (*length)++;
+
+	while (i > 0 && candidates[i - 1].distance > distance)
+	{
+		candidates[i] = candidates[i - 1];
+		i--;
+	}
+
+	candidates[i].node = node;
+	candidates[i].distance = distance;
+	candidates[i].expanded = false;
+}
+
+/*
+ * Greedy search in memory (Algorithm 1 from the Vamana paper)
+ *
+ * Collects the expanded nodes other than self in search->visited
+ */
+static void
+SearchInMemory(DiskannBuildState * buildstate, DiskannBuildSearch * search, uint32 self, uint32 entry)
+{
+	FmgrInfo   *procinfo = buildstate->procinfo;
+	Oid			collation = buildstate->collation;
+	int			l = buildstate->buildListSize;
+	Datum		q = PointerGetDatum(BuildNodeValue(buildstate, self));
+	DiskannBuildCandidate *candidates = search->candidates;
+	int			length = 0;
+
+	/* Epochs avoid clearing visited marks between searches */
+	if (++search->epoch == 0)
+	{
+		MemSet(search->epochs, 0, sizeof(uint32) * buildstate->nodeCount);
+		search->epoch = 1;
+	}
+
+	search->visitedLength = 0;
+	search->epochs[self] = search->epoch;
+	search->epochs[entry] = search->epoch;
+	AddBuildCandidate(candidates, &length, l, entry,
+					  (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, PointerGetDatum(BuildNodeValue(buildstate, entry)))));
+
+	for (;;)
+	{
+		DiskannBuildCandidate *c = NULL;
+		uint32	   *neighbors;
+		int			n = 0;
+
+		for (int i = 0; i < length; i++)
+		{
+			if (!candidates[i].expanded)
+			{
+				c = &candidates[i];
+				break;
+			}
+		}
+
+		if (c == NULL)
+			break;
+
+		c->expanded = true;
+
+		if (c->node != self)
+		{
+			if (search->visitedLength == search->maxVisited)
+			{
+				search->maxVisited *= 2;
+				search->visited = (uint32 *) repalloc(search->visited, sizeof(uint32) * search->maxVisited);
+				search->visitedDistances = (float *) repalloc(search->visitedDistances, sizeof(float) * search->maxVisited);
+			}
+
+			search->visited[search->visitedLength] = c->node;
+			search->visitedDistances[search->visitedLength] = c->distance;
+			search->visitedLength++;
+		}
+
+		neighbors = BuildNodeNeighbors(buildstate, c->node);
+		for (int i = 0; i < buildstate->degrees[c->node]; i++)
+		{
+			uint32		e = neighbors[i];
+
+			if (search->epochs[e] == search->epoch)
+				continue;
+
+			search->epochs[e] = search->epoch;
+			search->batchNodes[n] = e;
+			search->batchValues[n] = PointerGetDatum(BuildNodeValue(buildstate, e));
+			n++;
+		}
+
+		VectorDistanceBatch(procinfo, collation, q, search->batchValues, n, search->batchDistances);
+
+		for (int i = 0; i < n; i++)
+			AddBuildCandidate(candidates, &length, l, search->batchNodes[i], (float) search->batchDistances[i]);
+	}
+}
+
+/*
+ * Prune the neighbors of a node in memory
+ */
+static void
+PruneInMemory(DiskannBuildState * buildstate, uint32 node, const uint32 *ids, const float *distances, int n, float alpha)
+{
+	Datum	   *values = (Datum *) palloc(sizeof(Datum) * Max(n, 1));
+
+	for (int i = 0; i < n; i++)
+		values[i] = PointerGetDatum(BuildNodeValue(buildstate, ids[i]));
+
+	buildstate->degrees[node] = DiskannRobustPrune(ids, distances, values, n, buildstate->maxDegree, alpha, buildstate->procinfo, buildstate->collation, BuildNodeNeighbors(buildstate, node));
+
+	pfree(values);
+}
+
+/*
+ * Add a reverse edge, pruning the neighbors if full
+ */
+static void
+AddReverseEdge(DiskannBuildState * buildstate, uint32 node, uint32 neighbor, float alpha)
+{
+	uint32	   *neighbors = BuildNodeNeighbors(buildstate, node);
+	int			degree = buildstate->degrees[node];
+	Datum		q = PointerGetDatum(BuildNodeValue(buildstate, node));
+	uint32	   *ids;
+	float	   *distances;
+	Datum	   *values;
+	double	   *batchDistances;
+
+	for (int i = 0; i < degree; i++)
+	{
+		if (neighbors[i] == neighbor)
+			return;
+	}
+
+	if (degree < buildstate->maxDegree)
+	{
+		neighbors[buildstate->degrees[node]++] = neighbor;
+		return;
+	}
+
+	ids = (uint32 *) palloc(sizeof(uint32) * (degree + 1));
+	distances = (float *) palloc(sizeof(float) * (degree + 1));
+	values = (Datum *) palloc(sizeof(Datum) * (degree + 1));
+	batchDistances = (double *) palloc(sizeof(double) * (degree + 1));
+
+	memcpy(ids, neighbors, sizeof(uint32) * degree);
+	ids[degree] = neighbor;
+
+	for (int i = 0; i <= degree; i++)
+		values[i] = PointerGetDatum(BuildNodeValue(buildstate, ids[i]));
+
+	VectorDistanceBatch(buildstate->procinfo, buildstate->collation, q, values, degree + 1, batchDistances);
+
+	for (int i = 0; i <= degree; i++)
+		distances[i] = (float) batchDistances[i];
+
+	PruneInMemory(buildstate, node, ids, distances, degree + 1, alpha);
+
+	pfree(ids);
+	pfree(distances);
+	pfree(values);
+	pfree(batchDistances);
+}
+
+/*
+ * Find the node closest to the centroid
+ */
+static uint32
+FindMedoid(DiskannBuildState * buildstate)
+{
+	int			dimensions = buildstate->dimensions;
+	double	   *centroid = (double *) palloc0(sizeof(double) * dimensions);
+	uint32		medoid = 0;
+	double		minDistance = DBL_MAX;
+
+	for (uint32 i = 0; i < buildstate->nodeCount; i++)
+	{
+		Vector	   *vec = BuildNodeValue(buildstate, i);
+
+		for (int d = 0; d < dimensions; d++)
+			centroid[d] += vec->x[d];
+	}
+
+	for (int d = 0; d < dimensions; d++)
+		centroid[d] /= buildstate->nodeCount;
+
+	for (uint32 i = 0; i < buildstate->nodeCount; i++)
+	{
+		Vector	   *vec = BuildNodeValue(buildstate, i);
+		double		distance = 0;
+
+		for (int d = 0; d < dimensions; d++)
+		{
+			double		diff = vec->x[d] - centroid[d];
+
+			distance += diff * diff;
+		}
+
+		if (distance < minDistance)
+		{
+			minDistance = distance;
+			medoid = i;
+		}
+	}
+
+	pfree(centroid);
+
+	return medoid;
+}
+
+/*
+ * Build the graph for the nodes in memory (Algorithm 3 from the Vamana paper)
+ */
+static void
+BuildGraphInMemory(DiskannBuildState * buildstate, uint32 *order, uint32 medoid)
+{
+	uint32		nodeCount = buildstate->nodeCount;
+	int			maxDegree = buildstate->maxDegree;
+	int			l = buildstate->buildListSize;
+	float		alphas[2];
+	int			passes = 0;
+	DiskannBuildSearch search;
+	uint32	   *ids;
+	float	   *distances;
+	MemoryContext oldCtx;
+
+	/* First pass connects nearby nodes, second adds long-range edges */
+	alphas[passes++] = 1.0;
+	if (buildstate->alpha > 1.0)
+		alphas[passes++] = buildstate->alpha;
+
+	search.candidates = (DiskannBuildCandidate *) palloc(sizeof(DiskannBuildCandidate) * l);
+	search.epochs = (uint32 *) palloc0_huge(CurrentMemoryContext, sizeof(uint32) * nodeCount);
+	search.epoch = 0;
+	search.maxVisited = l * 2;
+	search.visited = (uint32 *) palloc(sizeof(uint32) * search.maxVisited);
+	search.visitedDistances = (float *) palloc(sizeof(float) * search.maxVisited);
+	search.batchValues = (Datum *) palloc(sizeof(Datum) * maxDegree);
+	search.batchNodes = (uint32 *) palloc(sizeof(uint32) * maxDegree);
+	search.batchDistances = (double *) palloc(sizeof(double) * maxDegree);
+
+	for (int pass = 0; pass < passes; pass++)
+	{
+		float		alpha = alphas[pass];
+
+		for (uint32 i = 0; i < nodeCount; i++)
+		{
+			uint32		node = order[i];
+			uint32	   *neighbors = BuildNodeNeighbors(buildstate, node);
+			int			degree = buildstate->degrees[node];
+			int			n;
+			uint32		newNeighbors[DISKANN_MAX_MAX_DEGREE];
+			int			newDegree;
+
+			CHECK_FOR_INTERRUPTS();
+
+			SearchInMemory(buildstate, &search, node, medoid);
+
+			oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+			/* Candidates are the visited nodes and the current neighbors, and pruning skips duplicates */
+			n = search.visitedLength;
+			ids = (uint32 *) palloc(sizeof(uint32) * (n + degree));
+			distances = (float *) palloc(sizeof(float) * (n + degree));
+			memcpy(ids, search.visited, sizeof(uint32) * n);
+			memcpy(distances, search.visitedDistances, sizeof(float) * n);
+
+			for (int j = 0; j < degree; j++)
+			{
+				ids[n] = neighbors[j];
+				distances[n] = (float) DatumGetFloat8(FunctionCall2Coll(buildstate->procinfo, buildstate->collation,
+																		PointerGetDatum(BuildNodeValue(buildstate, node)),
+																		PointerGetDatum(BuildNodeValue(buildstate, neighbors[j]))));
+				n++;
+			}
+
+			PruneInMemory(buildstate, node, ids, distances, n, alpha);
+
+			/* Copy since neighbors can be pruned by reverse edges */
+			newDegree = buildstate->degrees[node];
+			memcpy(newNeighbors, neighbors, sizeof(uint32) * newDegree);
+
+			for (int j = 0; j < newDegree; j++)
+				AddReverseEdge(buildstate, newNeighbors[j], node, alpha);
+
+			MemoryContextSwitchTo(oldCtx);
+			MemoryContextReset(buildstate->tmpCtx);
+		}
+	}
+
+	pfree(search.candidates);
+	pfree(search.epochs);
+	pfree(search.visited);
+	pfree(search.visitedDistances);
+	pfree(search.batchValues);
+	pfree(search.batchNodes);
+	pfree(search.batchDistances);
+}
+
+/*
+ * Train the quantizer on a sample of the nodes in memory
+ */
+static void
+TrainQuantizer(DiskannBuildState * buildstate, const uint32 *order)
+{
+	int			dimensions = buildstate->dimensions;
+	int			numSamples = (int) Min(buildstate->nodeCount, (uint32) DISKANN_PQ_MAX_SAMPLES);
+	float	   *x;
+
+	/* Order is random, so its prefix is a random sample */
+	x = (float *) palloc_extended(sizeof(float) * Max(numSamples, 1) * dimensions, MCXT_ALLOC_HUGE);
+	for (int i = 0; i < numSamples; i++)
+		memcpy(x + (Size) i * dimensions, BuildNodeValue(buildstate, order[i])->x, sizeof(float) * dimensions);
+
+	buildstate->quantizer = IvfflatQuantizerInit(IVFFLAT_QUANTIZER_PQ, dimensions, buildstate->pqM);
+	IvfflatPqTrainFloats(x, numSamples, buildstate->quantizer);
+
+	pfree(x);
+}
+
+/*
+ * Write the codebook after the metapage
+ */
+static BlockNumber
+WriteCodebook(DiskannBuildState * buildstate)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	IvfflatQuantizer quantizer = buildstate->quantizer;
+	int			total = IVFFLAT_PQ_CODEWORDS * quantizer->dimensions;
+	int			offset = 0;
+	Buffer		buf;
+	Page		page;
+	BlockNumber startPage;
+
+	buf = DiskannNewBuffer(index, forkNum);
+	page = BufferGetPage(buf);
+	DiskannInitPage(buf, page);
+	startPage = BufferGetBlockNumber(buf);
+
+	while (offset < total)
+	{
+		int			count = Min(total - offset, (int) DISKANN_CODEBOOK_CHUNK_SIZE);
+		Size		itemsz = sizeof(float) * count;
+
+		/* Check for free space */
+		if (PageGetFreeSpace(page) < itemsz)
+			DiskannBuildAppendPage(index, &buf, &page, forkNum);
+
+		/* Add the item */
+		if (PageAddItem(page, (Item) (quantizer->codebook + offset), itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		offset += count;
+	}
+
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	return startPage;
+}
+
+/*
+ * Write the nodes in memory in node order
+ */
+static void
+WriteNodes(DiskannBuildState * buildstate, const DiskannMetaPageData * metap)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	DiskannNodeTuple ntup = (DiskannNodeTuple) palloc0(metap->nodeSize);
+	uint8	   *codes = (uint8 *) palloc(Max(metap->pqM, 1));
+	Buffer		buf = InvalidBuffer;
+	Page		page = NULL;
+
+	for (uint32 node = 0; node < buildstate->nodeCount; node++)
+	{
+		Vector	   *value = BuildNodeValue(buildstate, node);
+		BlockNumber blkno;
+		OffsetNumber offno;
+
+		DiskannNodeTid(metap, node, &blkno, &offno);
+
+		/* Nodes never cross pages */
+		if (offno == FirstOffsetNumber)
+		{
+			if (BufferIsValid(buf))
+				DiskannBuildAppendPage(index, &buf, &page, forkNum);
+			else
+			{
+				buf = DiskannNewBuffer(index, forkNum);
+				page = BufferGetPage(buf);
+				DiskannInitPage(buf, page);
+			}
+
+			if (BufferGetBlockNumber(buf) != blkno)
+				elog(ERROR, "unexpected diskann node page %u in index \"%s\"", BufferGetBlockNumber(buf), RelationGetRelationName(index));
+		}
+
+		if (buildstate->quantizer != NULL)
+			IvfflatQuantize(buildstate->quantizer, value->x, codes);
+
+		DiskannSetNodeTuple(metap, ntup, &buildstate->heaptids[node], 1,
+							BuildNodeNeighbors(buildstate, node), buildstate->degrees[node],
+							value, buildstate->quantizer != NULL ? codes : NULL);
+
+		if (PageAddItem(page, (Item) ntup, metap->nodeSize, InvalidOffsetNumber, false, false) != offno)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	}
+
+	if (BufferIsValid(buf))
+	{
+		/* Node pages are found by number, not by chain */
+		DiskannPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	pfree(ntup);
+	pfree(codes);
+}
+
+/*
+ * Build the graph for the nodes in memory and write it to disk
+ */
+static void
+FlushGraph(DiskannBuildState * buildstate)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	uint32		nodeCount = buildstate->nodeCount;
+	DiskannMetaPageData meta;
+	uint32	   *order = NULL;
+	uint32		medoid = 0;
+	Buffer		buf;
+	Page		page;
+
+	if (nodeCount > 0)
+	{
+		/* Random order with the medoid first */
+		medoid = FindMedoid(buildstate);
+		order = (uint32 *) palloc_extended(sizeof(uint32) * nodeCount, MCXT_ALLOC_HUGE);
+		for (uint32 i = 0; i < nodeCount; i++)
+			order[i] = i;
+
+		for (uint32 i = nodeCount - 1; i > 0; i--)
+		{
+			uint32		j = RandomInt() % (i + 1);
+			uint32		tmp = order[i];
+
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+
+		for (uint32 i = 0; i < nodeCount; i++)
+		{
+			if (order[i] == medoid)
+			{
+				order[i] = order[0];
+				order[0] = medoid;
+				break;
+			}
+		}
+
+		BuildGraphInMemory(buildstate, order, medoid);
+		TrainQuantizer(buildstate, order);
+	}
+
+	/* Create the metapage */
+	buf = DiskannNewBuffer(index, forkNum);
+	page = BufferGetPage(buf);
+	DiskannInitPage(buf, page);
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	MemSet(&meta, 0, sizeof(DiskannMetaPageData));
+	meta.magicNumber = DISKANN_MAGIC_NUMBER;
+	meta.version = DISKANN_VERSION;
+	meta.dimensions = buildstate->dimensions;
+	meta.maxDegree = buildstate->maxDegree;
+	meta.buildListSize = buildstate->buildListSize;
+	meta.alpha = buildstate->alpha;
+	meta.pqM = buildstate->pqM;
+	meta.pqTrained = buildstate->quantizer != NULL;
+	meta.nodeSize = DISKANN_NODE_SIZE(buildstate->maxDegree, buildstate->dimensions, buildstate->pqM);
+	meta.nodesPerPage = DiskannNodesPerPage(meta.nodeSize);
+	meta.codebookPage = meta.pqTrained ? WriteCodebook(buildstate) : InvalidBlockNumber;
+	meta.nodeStartPage = RelationGetNumberOfBlocksInFork(index, forkNum);
+	meta.nodeCount = nodeCount;
+	meta.entryNode = nodeCount > 0 ? medoid : DISKANN_INVALID_NODE;
+	meta.freeNode = DISKANN_INVALID_NODE;
+
+	WriteNodes(buildstate, &meta);
+
+	/* Set metapage data */
+	buf = ReadBufferExtended(index, forkNum, DISKANN_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	memcpy(DiskannPageGetMeta(page), &meta, sizeof(DiskannMetaPageData));
+	((PageHeader) page)->pd_lower =
+		((char *) DiskannPageGetMeta(page) + sizeof(DiskannMetaPageData)) - (char *) page;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	/* Free the graph */
+	MemoryContextReset(buildstate->graphCtx);
+	buildstate->values = NULL;
+	buildstate->heaptids = NULL;
+	buildstate->degrees = NULL;
+	buildstate->neighbors = NULL;
+	buildstate->quantizer = NULL;
+	buildstate->flushed = true;
+
+	if (order != NULL)
+		pfree(order);
+}
+
+/*
+ * Make room for another node in memory
+ */
+static void
+GrowGraph(DiskannBuildState * buildstate)
+{
+	uint32		maxNodes = buildstate->maxNodes == 0 ? 1024 : buildstate->maxNodes * 2;
+	MemoryContext oldCtx = MemoryContextSwitchTo(buildstate->graphCtx);
+
+	maxNodes = Min(maxNodes, buildstate->memoryNodes);
+
+	if (buildstate->maxNodes == 0)
+	{
+		buildstate->values = (char *) palloc_extended(buildstate->valueSize * maxNodes, MCXT_ALLOC_HUGE);
+		buildstate->heaptids = (ItemPointerData *) palloc_extended(sizeof(ItemPointerData) * maxNodes, MCXT_ALLOC_HUGE);
+		buildstate->degrees = (uint16 *) palloc_extended(sizeof(uint16) * maxNodes, MCXT_ALLOC_HUGE);
+		buildstate->neighbors = (uint32 *) palloc_extended(sizeof(uint32) * buildstate->maxDegree * maxNodes, MCXT_ALLOC_HUGE);
+	}
+	else
+	{
+		buildstate->values = (char *) repalloc_huge(buildstate->values, buildstate->valueSize * maxNodes);
+		buildstate->heaptids = (ItemPointerData *) repalloc_huge(buildstate->heaptids, sizeof(ItemPointerData) * maxNodes);
+		buildstate->degrees = (uint16 *) repalloc_huge(buildstate->degrees, sizeof(uint16) * maxNodes);
+		buildstate->neighbors = (uint32 *) repalloc_huge(buildstate->neighbors, sizeof(uint32) * buildstate->maxDegree * maxNodes);
+	}
+
+	buildstate->maxNodes = maxNodes;
+
+	MemoryContextSwitchTo(oldCtx);
+}
+
+/*
+ * Insert tuple
+ */
+static bool
+InsertTuple(Relation index, Datum *values, ItemPointer heaptid, DiskannBuildState * buildstate)
+{
+	uint32		node;
+
+	/* Detoast once for all calls */
+	Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+	/* Normalize if needed */
+	if (buildstate->normprocinfo != NULL)
+	{
+		if (!DiskannCheckNorm(buildstate->normprocinfo, buildstate->collation, value))
+			return false;
+
+		value = DiskannNormValue(buildstate->collation, value);
+	}
+
+	/* Are we in the on-disk phase? */
+	if (buildstate->flushed)
+		return DiskannInsertTupleOnDisk(index, value, heaptid, true);
+
+	if (buildstate->nodeCount == buildstate->memoryNodes)
+	{
+		ereport(NOTICE,
+				(errmsg("diskann graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64) buildstate->indtuples),
+				 errdetail("Building will take significantly more time."),
+				 errhint("Increase maintenance_work_mem to speed up builds.")));
+
+		FlushGraph(buildstate);
+
+		return DiskannInsertTupleOnDisk(index, value, heaptid, true);
+	}
+
+	if (buildstate->nodeCount == buildstate->maxNodes)
+		GrowGraph(buildstate);
+
+	node = buildstate->nodeCount++;
+	memcpy(BuildNodeValue(buildstate, node), DatumGetPointer(value), buildstate->valueSize);
+	buildstate->heaptids[node] = *heaptid;
+	buildstate->degrees[node] = 0;
+
+	return true;
+}
+
+/*
+ * Callback for table_index_build_scan
+ */
+static void
+BuildCallback(Relation index, CALLBACK_ITEM_POINTER, Datum *values,
+			  const bool *isnull, bool tupleIsAlive, void *state)
+{
+	DiskannBuildState *buildstate = (DiskannBuildState *) state;
+	MemoryContext oldCtx;
+
+#if PG_VERSION_NUM < 130000
+	ItemPointer tid = &hup->t_self;
+#endif
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	/* Use memory context */
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+	/* Insert tuple */
+	if (InsertTuple(index, values, tid, buildstate))
+		UpdateProgress(PROGRESS_CREATEIDX_TUPLES_DONE, ++buildstate->indtuples);
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+}
+
+/*
+ * Initialize the build state
+ */
+static void
+InitBuildState(DiskannBuildState * buildstate, Relation heap, Relation index, IndexInfo *indexInfo, ForkNumber forkNum)
+{
+	Size		nodeSize;
+	Size		memoryPerNode;
+
+	buildstate->heap = heap;
+	buildstate->index = index;
+	buildstate->indexInfo = indexInfo;
+	buildstate->forkNum = forkNum;
+
+	buildstate->maxDegree = DiskannGetMaxDegree(index);
+	buildstate->buildListSize = DiskannGetBuildListSize(index);
+	buildstate->alpha = DiskannGetAlpha(index);
+	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
+
+	/* Require column to have dimensions to be indexed */
+	if (buildstate->dimensions < 0)
+		elog(ERROR, "column does not have dimensions");
+
+	if (buildstate->dimensions > DISKANN_MAX_DIM)
+		elog(ERROR, "column cannot have more than %d dimensions for diskann index", DISKANN_MAX_DIM);
+
+	if (buildstate->buildListSize < buildstate->maxDegree)
+		elog(ERROR, "build_list_size must be greater than or equal to max_degree");
+
+	buildstate->pqM = DiskannGetPqM(index, buildstate->dimensions);
+	if (buildstate->dimensions % buildstate->pqM != 0)
+		elog(ERROR, "dimensions must be divisible by pq_m");
+
+	nodeSize = DISKANN_NODE_SIZE(buildstate->maxDegree, buildstate->dimensions, buildstate->pqM);
+	if (nodeSize > DISKANN_MAX_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("diskann node size %zu exceeds the maximum %zu", nodeSize, (Size) DISKANN_MAX_SIZE),
+				 errhint("Reduce max_degree or pq_m.")));
+
+	buildstate->reltuples = 0;
+	buildstate->indtuples = 0;
+
+	/* Get support functions */
+	buildstate->procinfo = index_getprocinfo(index, 1, DISKANN_DISTANCE_PROC);
+	buildstate->normprocinfo = DiskannOptionalProcInfo(index, DISKANN_NORM_PROC);
+	buildstate->collation = index->rd_indcollation[0];
+
+	/* Value, heap tid, degree, neighbors and visited mark */
+	buildstate->valueSize = VECTOR_SIZE(buildstate->dimensions);
+	memoryPerNode = buildstate->valueSize + sizeof(ItemPointerData) + sizeof(uint16) + sizeof(uint32) * (buildstate->maxDegree + 1);
+	buildstate->memoryNodes = (uint32) Min(Max(u_sess->attr.attr_memory.maintenance_work_mem * 1024L / (long) memoryPerNode, 1L), (long) (DISKANN_INVALID_NODE - 1));
+	buildstate->nodeCount = 0;
+	buildstate->maxNodes = 0;
+	buildstate->values = NULL;
+	buildstate->heaptids = NULL;
+	buildstate->degrees = NULL;
+	buildstate->neighbors = NULL;
+	buildstate->flushed = false;
+	buildstate->quantizer = NULL;
+
+	buildstate->graphCtx = AllocSetContextCreate(CurrentMemoryContext,
+												 "Diskann build graph context",
+												 ALLOCSET_DEFAULT_SIZES);
+	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+											   "Diskann build temporary context",
+											   ALLOCSET_DEFAULT_SIZES);
+}
+
+/*
+ * Free resources
+ */
+static void
+FreeBuildState(DiskannBuildState * buildstate)
+{
+	MemoryContextDelete(buildstate->graphCtx);
+	MemoryContextDelete(buildstate->tmpCtx);
+}
+
+/*
+ * Build the index
+ */
+static void
+BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
+		   DiskannBuildState * buildstate, ForkNumber forkNum)
+{
+	InitBuildState(buildstate, heap, index, indexInfo, forkNum);
+
+	/* Add tuples to graph */
+	if (heap != NULL)
+		buildstate->reltuples = IndexBuildHeapScan(heap, index, indexInfo,
+												   true, BuildCallback, (void *) buildstate, NULL);
+
+	/* Flush pages */
+	if (!buildstate->flushed)
+		FlushGraph(buildstate);
+
+	if (RelationNeedsWAL(index) || forkNum == INIT_FORKNUM)
+		log_newpage_range(index, forkNum, 0, RelationGetNumberOfBlocksInFork(index, forkNum), true);
+
+	FreeBuildState(buildstate);
+}
+
+/*
+ * Build the index for a logged table
+ */
+IndexBuildResult *
+diskannbuild_internal(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	IndexBuildResult *result;
+	DiskannBuildState buildstate;
+
+	BuildIndex(heap, index, indexInfo, &buildstate, MAIN_FORKNUM);
+
+	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+	result->heap_tuples = buildstate.reltuples;
+	result->index_tuples = buildstate.indtuples;
+
+	return result;
+}
+
+/*
+ * Build the index for an unlogged table
+ */
+void
+diskannbuildempty_internal(Relation index)
+{
+	IndexInfo  *indexInfo = BuildIndexInfo(index);
+	DiskannBuildState buildstate;
+
+	BuildIndex(NULL, index, indexInfo, &buildstate, INIT_FORKNUM);
+}
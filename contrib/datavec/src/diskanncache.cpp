@@ -0,0 +1,371 @@
+#include "postgres.h"
+
+#include <pthread.h>
+
+#include "diskann.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Cached product quantization codes for an index
+ *
+ * Caches live in instance memory so every session can use them, and are
+ * keyed by relfilenode so rewrites of the index get a new cache. Codes only
+ * change when an insert reuses a node freed by vacuum, which updates the
+ * cache in place, so a cache otherwise only needs to catch up with nodes
+ * added since it was loaded.
+ */
+typedef struct DiskannPqCacheSlot
+{
+	bool		used;
+	bool		building;		/* loading or catching up */
+	bool		failed;
+	RelFileNode node;
+	uint32		failedNodeCount;
+	uint64		lastUsed;
+	DiskannPqCache *cache;
+}			DiskannPqCacheSlot;
+
+static DiskannPqCacheSlot pqCacheSlots[DISKANN_MAX_PQ_CACHES];
+static Size pqCacheUsed = 0;
+static uint64 pqCacheClock = 0;
+static pthread_mutex_t pqCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Free a cache (lock must be held)
+ */
+static void
+FreePqCache(DiskannPqCache * cache)
+{
+	pqCacheUsed -= cache->size;
+	pfree(cache);
+}
+
+/*
+ * Drop the cache of a slot (lock must be held)
+ */
+static void
+DropPqCache(DiskannPqCacheSlot * slot)
+{
+	if (slot->cache == NULL)
+		return;
+
+	/* Pinned caches are freed when unpinned */
+	slot->cache->invalid = true;
+	if (slot->cache->refcount == 0)
+		FreePqCache(slot->cache);
+
+	slot->cache = NULL;
+}
+
+/*
+ * Evict the least recently used cache that is not in use (lock must be held)
+ */
+static bool
+EvictPqCache(void)
+{
+	DiskannPqCacheSlot *victim = NULL;
+
+	for (int i = 0; i < DISKANN_MAX_PQ_CACHES; i++)
+	{
+		DiskannPqCacheSlot *slot = &pqCacheSlots[i];
+
+		if (!slot->used || slot->building)
+			continue;
+
+		if (slot->cache != NULL && slot->cache->refcount > 0)
+			continue;
+
+		if (victim == NULL || slot->lastUsed < victim->lastUsed)
+			victim = slot;
+	}
+
+	if (victim == NULL)
+		return false;
+
+	DropPqCache(victim);
+	victim->used = false;
+	return true;
+}
+
+/*
+ * Find the slot for an index (lock must be held)
+ */
+static DiskannPqCacheSlot *
+FindPqCacheSlot(RelFileNode node)
+{
+	for (int i = 0; i < DISKANN_MAX_PQ_CACHES; i++)
+	{
+		DiskannPqCacheSlot *slot = &pqCacheSlots[i];
+
+		if (slot->used && RelFileNodeEquals(slot->node, node))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a slot for an index (lock must be held)
+ */
+static DiskannPqCacheSlot *
+AddPqCacheSlot(RelFileNode node)
+{
+	for (;;)
+	{
+		for (int i = 0; i < DISKANN_MAX_PQ_CACHES; i++)
+		{
+			DiskannPqCacheSlot *slot = &pqCacheSlots[i];
+
+			if (slot->used)
+				continue;
+
+			MemSet(slot, 0, sizeof(DiskannPqCacheSlot));
+			slot->used = true;
+			slot->node = node;
+			return slot;
+		}
+
+		if (!EvictPqCache())
+			return NULL;
+	}
+}
+
+/*
+ * Allocate a cache within diskann.pq_cache_size (lock must be held)
+ */
+static DiskannPqCache *
+AllocPqCache(int pqM, uint32 capacity)
+{
+	Size		maxSize = (Size) diskann_pq_cache_size * 1024;
+	Size		size = MAXALIGN(sizeof(DiskannPqCache)) + MAXALIGN((Size) capacity * pqM);
+	DiskannPqCache *cache;
+
+	/* Make room by evicting caches that are not in use */
+	while (pqCacheUsed + size > maxSize)
+	{
+		if (!EvictPqCache())
+			return NULL;
+	}
+
+	cache = (DiskannPqCache *) MemoryContextAllocExtended(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), size, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+	if (cache == NULL)
+		return NULL;
+
+	pqCacheUsed += size;
+
+	cache->size = size;
+	cache->refcount = 0;
+	cache->invalid = false;
+	cache->pqM = pqM;
+	cache->capacity = capacity;
+	cache->count = 0;
+	cache->codes = (uint8 *) cache + MAXALIGN(sizeof(DiskannPqCache));
+
+	return cache;
+}
+
+/*
+ * Read the codes of nodes [start, end) in physical order
+ */
+static void
+ReadCodes(Relation index, const DiskannMetaPageData * metap, uint32 start, uint32 end, uint8 *codes)
+{
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	Buffer		buf = InvalidBuffer;
+	Page		page = NULL;
+
+	for (uint32 node = start; node < end; node++)
+	{
+		BlockNumber blkno;
+		OffsetNumber offno;
+		DiskannNodeTuple ntup;
+
+		DiskannNodeTid(metap, node, &blkno, &offno);
+
+		if (!BufferIsValid(buf) || BufferGetBlockNumber(buf) != blkno)
+		{
+			if (BufferIsValid(buf))
+				UnlockReleaseBuffer(buf);
+
+			CHECK_FOR_INTERRUPTS();
+
+			buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+		}
+
+		if (offno > PageGetMaxOffsetNumber(page))
+			elog(ERROR, "diskann node %u not found in index \"%s\"", node, RelationGetRelationName(index));
+
+		ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+		memcpy(codes + (Size) (node - start) * metap->pqM, DiskannNodeCodes(ntup, metap->maxDegree, metap->dimensions), metap->pqM);
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+
+	FreeAccessStrategy(bas);
+}
+
+/*
+ * Read codes into a pinned cache while the slot is marked as building
+ */
+static void
+FillPqCache(Relation index, const DiskannMetaPageData * metap, DiskannPqCacheSlot * slot, DiskannPqCache * cache, uint32 start, uint32 end)
+{
+	PG_TRY();
+	{
+		ReadCodes(index, metap, start, end, cache->codes + (Size) start * cache->pqM);
+	}
+	PG_CATCH();
+	{
+		pthread_mutex_lock(&pqCacheLock);
+		slot->building = false;
+		cache->refcount--;
+		if (cache->refcount == 0 && cache->invalid)
+			FreePqCache(cache);
+		pthread_mutex_unlock(&pqCacheLock);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pthread_mutex_lock(&pqCacheLock);
+	slot->building = false;
+	if (end > cache->count)
+		cache->count = end;
+	pthread_mutex_unlock(&pqCacheLock);
+}
+
+/*
+ * Get the codes for an index, loading them if needed
+ *
+ * Codes of nodes below count can be used until the cache is unpinned.
+ * Returns NULL if caching is disabled or the codes do not fit.
+ */
+DiskannPqCache *
+DiskannPinPqCache(Relation index, const DiskannMetaPageData * metap, uint32 *count)
+{
+	DiskannPqCacheSlot *slot;
+	DiskannPqCache *cache;
+	uint32		nodeCount = metap->nodeCount;
+	uint32		start;
+
+	if (diskann_pq_cache_size == 0 || !metap->pqTrained || nodeCount == 0)
+		return NULL;
+
+	pthread_mutex_lock(&pqCacheLock);
+
+	slot = FindPqCacheSlot(index->rd_node);
+
+	/* Drop caches without room for new nodes */
+	if (slot != NULL && slot->cache != NULL && !slot->building && nodeCount > slot->cache->capacity)
+		DropPqCache(slot);
+
+	if (slot != NULL && slot->cache != NULL)
+	{
+		cache = slot->cache;
+		cache->refcount++;
+		slot->lastUsed = ++pqCacheClock;
+
+		/* Catch up with new nodes unless another session is */
+		if (slot->building || cache->count >= nodeCount)
+		{
+			*count = cache->count;
+			pthread_mutex_unlock(&pqCacheLock);
+			return cache;
+		}
+
+		slot->building = true;
+		start = cache->count;
+		pthread_mutex_unlock(&pqCacheLock);
+
+		FillPqCache(index, metap, slot, cache, start, nodeCount);
+		*count = nodeCount;
+		return cache;
+	}
+
+	/* Another session is loading or the codes did not fit */
+	if (slot != NULL && (slot->building || (slot->failed && slot->failedNodeCount == nodeCount)))
+	{
+		pthread_mutex_unlock(&pqCacheLock);
+		return NULL;
+	}
+
+	if (slot == NULL)
+		slot = AddPqCacheSlot(index->rd_node);
+
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock(&pqCacheLock);
+		return NULL;
+	}
+
+	/* Leave room for inserts */
+	cache = AllocPqCache(metap->pqM, nodeCount + nodeCount / 4 + 1024);
+	if (cache == NULL)
+	{
+		slot->failed = true;
+		slot->failedNodeCount = nodeCount;
+		pthread_mutex_unlock(&pqCacheLock);
+		ereport(DEBUG1, (errmsg("diskann codes do not fit in diskann.pq_cache_size")));
+		return NULL;
+	}
+
+	slot->failed = false;
+	slot->building = true;
+	slot->lastUsed = ++pqCacheClock;
+	slot->cache = cache;
+	cache->refcount++;
+
+	pthread_mutex_unlock(&pqCacheLock);
+
+	FillPqCache(index, metap, slot, cache, 0, nodeCount);
+	*count = nodeCount;
+	return cache;
+}
+
+/*
+ * Release a cache after use
+ */
+void
+DiskannUnpinPqCache(DiskannPqCache * cache)
+{
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_lock(&pqCacheLock);
+
+	cache->refcount--;
+	if (cache->refcount == 0 && cache->invalid)
+		FreePqCache(cache);
+
+	pthread_mutex_unlock(&pqCacheLock);
+}
+
+/*
+ * Update the cached codes of a reused node
+ *
+ * Sessions using the cache may see either codes, which only affects the
+ * distances used to navigate
+ */
+void
+DiskannUpdatePqCache(Relation index, uint32 node, const uint8 *codes)
+{
+	DiskannPqCacheSlot *slot;
+
+	pthread_mutex_lock(&pqCacheLock);
+
+	slot = FindPqCacheSlot(index->rd_node);
+	if (slot != NULL && slot->cache != NULL)
+	{
+		/* The codes being read may predate the reuse */
+		if (slot->building)
+			DropPqCache(slot);
+		else if (node < slot->cache->count)
+			memcpy(slot->cache->codes + (Size) node * slot->cache->pqM, codes, slot->cache->pqM);
+	}
+
+	pthread_mutex_unlock(&pqCacheLock);
+}
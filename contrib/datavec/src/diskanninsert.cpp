@@ -0,0 +1,521 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "diskann.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/datum.h"
+#include "utils/memutils.h"
+
+/*
+ * Replace the neighbors of a node if they have not changed since they were
+ * read
+ */
+bool
+DiskannUpdateNeighbors(Relation index, const DiskannMetaPageData * metap, uint32 node, const uint32 *oldNeighbors, int oldDegree, const uint32 *neighbors, int degree, bool building)
+{
+	BlockNumber blkno;
+	OffsetNumber offno;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	DiskannNodeTuple ntup;
+
+	DiskannNodeTid(metap, node, &blkno, &offno);
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+	/* Another backend changed the neighbors */
+	if (ntup->degree != oldDegree || memcmp(ntup->neighbors, oldNeighbors, sizeof(uint32) * oldDegree) != 0)
+	{
+		if (!building)
+			GenericXLogAbort(state);
+		UnlockReleaseBuffer(buf);
+		return false;
+	}
+
+	/* Update neighbors, modifying the tuple on the page directly */
+	ntup->degree = degree;
+	for (int i = 0; i < metap->maxDegree; i++)
+		ntup->neighbors[i] = i < degree ? neighbors[i] : DISKANN_INVALID_NODE;
+
+	/* Commit */
+	if (building)
+		MarkBufferDirty(buf);
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
+/*
+ * Prune the neighbors of a node along with extra candidates
+ *
+ * Returns the number of neighbors selected
+ */
+int
+DiskannPruneNeighbors(Relation index, const DiskannMetaPageData * metap, DiskannNode n, const uint32 *extraIds, const Datum *extraValues, int extraLength, FmgrInfo *procinfo, Oid collation, uint32 *neighbors)
+{
+	int			length = n->degree + extraLength;
+	uint32	   *ids = (uint32 *) palloc(sizeof(uint32) * Max(length, 1));
+	float	   *distances = (float *) palloc(sizeof(float) * Max(length, 1));
+	Datum	   *values = (Datum *) palloc(sizeof(Datum) * Max(length, 1));
+	int			count = 0;
+
+	for (int i = 0; i < n->degree; i++)
+	{
+		DiskannNode neighbor = DiskannLoadNode(index, metap, n->neighbors[i], PointerGetDatum(n->value), procinfo, collation, true);
+
+		ids[count] = neighbor->id;
+		distances[count] = neighbor->distance;
+		values[count] = PointerGetDatum(neighbor->value);
+		count++;
+	}
+
+	for (int i = 0; i < extraLength; i++)
+	{
+		ids[count] = extraIds[i];
+		distances[count] = (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, PointerGetDatum(n->value), extraValues[i]));
+		values[count] = extraValues[i];
+		count++;
+	}
+
+	return DiskannRobustPrune(ids, distances, values, count, metap->maxDegree, metap->alpha, procinfo, collation, neighbors);
+}
+
+/*
+ * Add an edge from a neighbor back to the new node
+ *
+ * Neighbors are read without a lock and only written if they have not
+ * changed, so the edge is dropped if other backends keep winning the race
+ */
+static void
+AddReverseEdge(Relation index, const DiskannMetaPageData * metap, uint32 node, uint32 newNode, Datum newValue, FmgrInfo *procinfo, Oid collation, bool building)
+{
+	uint32	   *neighbors = (uint32 *) palloc(sizeof(uint32) * (metap->maxDegree + 1));
+
+	for (int attempt = 0; attempt < DISKANN_UPDATE_RETRIES; attempt++)
+	{
+		DiskannNode n = DiskannLoadNode(index, metap, node, PointerGetDatum(NULL), procinfo, collation, true);
+		int			degree;
+		bool		found = false;
+
+		for (int i = 0; i < n->degree; i++)
+		{
+			if (n->neighbors[i] == newNode)
+			{
+				found = true;
+				break;
+			}
+		}
+
+		if (found)
+			return;
+
+		if (n->degree < metap->maxDegree)
+		{
+			memcpy(neighbors, n->neighbors, sizeof(uint32) * n->degree);
+			neighbors[n->degree] = newNode;
+			degree = n->degree + 1;
+		}
+		else
+			degree = DiskannPruneNeighbors(index, metap, n, &newNode, &newValue, 1, procinfo, collation, neighbors);
+
+		if (DiskannUpdateNeighbors(index, metap, node, n->neighbors, n->degree, neighbors, degree, building))
+			return;
+	}
+}
+
+/*
+ * Add a heap TID to an existing node
+ */
+static bool
+AddDuplicateOnDisk(Relation index, const DiskannMetaPageData * metap, uint32 node, ItemPointer heaptid, bool building)
+{
+	BlockNumber blkno;
+	OffsetNumber offno;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	DiskannNodeTuple ntup;
+	int			i;
+
+	DiskannNodeTid(metap, node, &blkno, &offno);
+
+	/* Read page */
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	/* Find space */
+	ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+	for (i = 0; i < DISKANN_HEAPTIDS; i++)
+	{
+		if (!ItemPointerIsValid(&ntup->heaptids[i]))
+			break;
+	}
+
+	/* Either deleted or we lost our chance to another backend */
+	if (i == 0 || i == DISKANN_HEAPTIDS)
+	{
+		if (!building)
+			GenericXLogAbort(state);
+		UnlockReleaseBuffer(buf);
+		return false;
+	}
+
+	/* Add heap TID, modifying the tuple on the page directly */
+	ntup->heaptids[i] = *heaptid;
+
+	/* Commit */
+	if (building)
+		MarkBufferDirty(buf);
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
+/*
+ * Find a node with the same value
+ */
+static bool
+FindDuplicateOnDisk(Relation index, const DiskannMetaPageData * metap, List *w, Datum value, ItemPointer heaptid, bool building)
+{
+	ListCell   *lc;
+
+	foreach(lc, w)
+	{
+		DiskannNode n = (DiskannNode) lfirst(lc);
+
+		/* Exit early since ordered by distance */
+		if (!datumIsEqual(value, PointerGetDatum(n->value), false, -1))
+			return false;
+
+		if (AddDuplicateOnDisk(index, metap, n->id, heaptid, building))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add a node to the index
+ *
+ * Nodes freed by vacuum are reused first. Otherwise the node is added at the
+ * end. Node numbers are assigned under the metapage lock, so node pages are
+ * always added in order.
+ */
+static uint32
+AddNodeOnDisk(Relation index, DiskannMetaPage metap, ItemPointer heaptid, const uint32 *neighbors, int degree, Datum value, const uint8 *codes, bool building)
+{
+	Buffer		metabuf;
+	Buffer		buf;
+	Page		metapage;
+	Page		page;
+	GenericXLogState *state = NULL;
+	DiskannMetaPage latest;
+	DiskannNodeTuple ntup = (DiskannNodeTuple) palloc(metap->nodeSize);
+	BlockNumber blkno;
+	OffsetNumber offno;
+	uint32		node;
+	bool		reused;
+	bool		newPage;
+
+	metabuf = ReadBuffer(index, DISKANN_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+
+	node = DiskannPageGetMeta(BufferGetPage(metabuf))->freeNode;
+	reused = node != DISKANN_INVALID_NODE;
+
+	if (!reused)
+	{
+		node = DiskannPageGetMeta(BufferGetPage(metabuf))->nodeCount;
+		if (node == DISKANN_INVALID_NODE)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("diskann index \"%s\" has too many nodes", RelationGetRelationName(index))));
+	}
+
+	DiskannNodeTid(metap, node, &blkno, &offno);
+	newPage = !reused && offno == FirstOffsetNumber;
+
+	if (newPage)
+	{
+		LockRelationForExtension(index, ExclusiveLock);
+		buf = DiskannNewBuffer(index, MAIN_FORKNUM);
+		UnlockRelationForExtension(index, ExclusiveLock);
+
+		/* Node pages are always added by the metapage lock holder */
+		if (BufferGetBlockNumber(buf) != blkno)
+			elog(ERROR, "unexpected diskann node page %u in index \"%s\"", BufferGetBlockNumber(buf), RelationGetRelationName(index));
+	}
+	else
+	{
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	}
+
+	if (building)
+	{
+		metapage = BufferGetPage(metabuf);
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+		page = GenericXLogRegisterBuffer(state, buf, newPage ? GENERIC_XLOG_FULL_IMAGE : 0);
+	}
+
+	if (newPage)
+		DiskannInitPage(buf, page);
+
+	DiskannSetNodeTuple(metap, ntup, heaptid, 1, neighbors, degree, (Vector *) DatumGetPointer(value), codes);
+
+	latest = DiskannPageGetMeta(metapage);
+
+	if (reused)
+	{
+		DiskannNodeTuple freeNode;
+
+		if (offno > PageGetMaxOffsetNumber(page))
+			elog(ERROR, "diskann node %u not found in index \"%s\"", node, RelationGetRelationName(index));
+
+		freeNode = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+		if (!DiskannNodeIsFree(freeNode))
+			elog(ERROR, "diskann node %u in index \"%s\" is not free", node, RelationGetRelationName(index));
+
+		/* Pop the node from the free list */
+		latest->freeNode = freeNode->neighbors[0];
+		memcpy(freeNode, ntup, metap->nodeSize);
+	}
+	else
+	{
+		if (PageAddItem(page, (Item) ntup, metap->nodeSize, InvalidOffsetNumber, false, false) != offno)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		latest->nodeCount++;
+	}
+
+	/* Update metapage */
+	if (latest->entryNode == DISKANN_INVALID_NODE)
+		latest->entryNode = node;
+
+	/* Commit */
+	if (building)
+	{
+		MarkBufferDirty(metabuf);
+		MarkBufferDirty(buf);
+	}
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(metabuf);
+
+	if (reused)
+	{
+		/* Cached codes belong to the node that was freed */
+		if (codes != NULL)
+			DiskannUpdatePqCache(index, node, codes);
+	}
+	else
+		metap->nodeCount = node + 1;
+
+	return node;
+}
+
+/*
+ * Insert a tuple into the index
+ */
+bool
+DiskannInsertTupleOnDisk(Relation index, Datum value, ItemPointer heaptid, bool building)
+{
+	DiskannMetaPageData metap;
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, DISKANN_DISTANCE_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	const		IvfflatQuantizerData *quantizer;
+	uint8	   *codes = NULL;
+	DiskannPqCache *volatile cache = NULL;
+	uint32		cacheCount = 0;
+	List	   *w = NIL;
+	uint32	   *neighbors;
+	int			degree = 0;
+	uint32		node;
+	ListCell   *lc;
+	MemoryContext tmpCtx;
+	MemoryContext oldCtx;
+
+	/*
+	 * Get a shared lock. This allows vacuum to ensure no in-flight inserts
+	 * before repairing graph. Use a page lock so it does not interfere with
+	 * buffer lock (or reads when vacuuming).
+	 */
+	LockPage(index, DISKANN_UPDATE_LOCK, ShareLock);
+
+	DiskannGetMetaPageInfo(index, &metap);
+
+	/* Encode once for the node */
+	quantizer = DiskannGetQuantizer(index, &metap);
+	if (quantizer != NULL)
+	{
+		codes = (uint8 *) palloc(metap.pqM);
+		IvfflatQuantize(quantizer, ((Vector *) DatumGetPointer(value))->x, codes);
+	}
+
+	/* Find candidates */
+	if (metap.entryNode != DISKANN_INVALID_NODE)
+	{
+		cache = DiskannPinPqCache(index, &metap, &cacheCount);
+
+		PG_TRY();
+		{
+			w = DiskannSearch(index, &metap, value, metap.buildListSize, diskann_beam_width, procinfo, collation, cache, cacheCount, true);
+		}
+		PG_CATCH();
+		{
+			DiskannUnpinPqCache(cache);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		DiskannUnpinPqCache(cache);
+	}
+
+	/* Look for duplicate */
+	if (FindDuplicateOnDisk(index, &metap, w, value, heaptid, building))
+	{
+		UnlockPage(index, DISKANN_UPDATE_LOCK, ShareLock);
+		return true;
+	}
+
+	/* Choose neighbors */
+	neighbors = (uint32 *) palloc(sizeof(uint32) * metap.maxDegree);
+	if (w != NIL)
+	{
+		int			length = list_length(w);
+		uint32	   *ids = (uint32 *) palloc(sizeof(uint32) * length);
+		float	   *distances = (float *) palloc(sizeof(float) * length);
+		Datum	   *values = (Datum *) palloc(sizeof(Datum) * length);
+		int			i = 0;
+
+		foreach(lc, w)
+		{
+			DiskannNode n = (DiskannNode) lfirst(lc);
+
+			/* Do not link to nodes that vacuum is removing from the graph */
+			if (n->heaptidsLength == 0)
+				continue;
+
+			ids[i] = n->id;
+			distances[i] = n->distance;
+			values[i] = PointerGetDatum(n->value);
+			i++;
+		}
+
+		degree = DiskannRobustPrune(ids, distances, values, i, metap.maxDegree, metap.alpha, procinfo, collation, neighbors);
+	}
+
+	/* Add node */
+	node = AddNodeOnDisk(index, &metap, heaptid, neighbors, degree, value, codes, building);
+
+	/* Add reverse edges */
+	tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+								   "Diskann insert neighbor context",
+								   ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+	for (int i = 0; i < degree; i++)
+	{
+		AddReverseEdge(index, &metap, neighbors[i], node, value, procinfo, collation, building);
+		MemoryContextReset(tmpCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(tmpCtx);
+
+	/* Release lock */
+	UnlockPage(index, DISKANN_UPDATE_LOCK, ShareLock);
+
+	return true;
+}
+
+/*
+ * Insert a tuple into the index
+ */
+static void
+DiskannInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
+{
+	Datum		value;
+	FmgrInfo   *normprocinfo;
+	Oid			collation = index->rd_indcollation[0];
+
+	/* Detoast once for all calls */
+	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+	/* Normalize if needed */
+	normprocinfo = DiskannOptionalProcInfo(index, DISKANN_NORM_PROC);
+	if (normprocinfo != NULL)
+	{
+		if (!DiskannCheckNorm(normprocinfo, collation, value))
+			return;
+
+		value = DiskannNormValue(collation, value);
+	}
+
+	DiskannInsertTupleOnDisk(index, value, heap_tid, false);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+bool
+diskanninsert_internal(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+					   Relation heap, IndexUniqueCheck checkUnique)
+{
+	MemoryContext oldCtx;
+	MemoryContext insertCtx;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return false;
+
+	/* Create memory context */
+	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Diskann insert temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(insertCtx);
+
+	/* Insert tuple */
+	DiskannInsertTuple(index, values, isnull, heap_tid);
+
+	/* Delete memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(insertCtx);
+
+	return false;
+}
@@ -0,0 +1,194 @@
+#include "postgres.h"
+
+#include "access/relscan.h"
+#include "diskann.h"
+#include "pgstat.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Get items, using the cached codes if enabled
+ */
+static List *
+GetScanItems(IndexScanDesc scan, Datum q)
+{
+	DiskannScanOpaque so = (DiskannScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	DiskannMetaPageData metap;
+	DiskannPqCache *volatile cache;
+	uint32		cacheCount = 0;
+	List	   *w;
+
+	DiskannGetMetaPageInfo(index, &metap);
+
+	if (metap.entryNode == DISKANN_INVALID_NODE)
+		return NIL;
+
+	cache = DiskannPinPqCache(index, &metap, &cacheCount);
+
+	PG_TRY();
+	{
+		w = DiskannSearch(index, &metap, q, diskann_search_list_size, diskann_beam_width, so->procinfo, so->collation, cache, cacheCount, false);
+	}
+	PG_CATCH();
+	{
+		DiskannUnpinPqCache(cache);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	DiskannUnpinPqCache(cache);
+
+	return w;
+}
+
+/*
+ * Get scan value
+ */
+static Datum
+GetScanValue(IndexScanDesc scan)
+{
+	DiskannScanOpaque so = (DiskannScanOpaque) scan->opaque;
+	Datum		value;
+
+	if (scan->orderByData->sk_flags & SK_ISNULL)
+		value = PointerGetDatum(NULL);
+	else
+	{
+		value = scan->orderByData->sk_argument;
+
+		/* Value should not be compressed or toasted */
+		Assert(!VARATT_IS_COMPRESSED(DatumGetPointer(value)));
+		Assert(!VARATT_IS_EXTENDED(DatumGetPointer(value)));
+
+		/* Normalize if needed */
+		if (so->normprocinfo != NULL)
+			value = DiskannNormValue(so->collation, value);
+	}
+
+	return value;
+}
+
+/*
+ * Prepare for an index scan
+ */
+IndexScanDesc
+diskannbeginscan_internal(Relation index, int nkeys, int norderbys)
+{
+	IndexScanDesc scan;
+	DiskannScanOpaque so;
+
+	scan = RelationGetIndexScan(index, nkeys, norderbys);
+
+	so = (DiskannScanOpaque) palloc(sizeof(DiskannScanOpaqueData));
+	so->first = true;
+	so->w = NIL;
+	so->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+									   "Diskann scan temporary context",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	/* Set support functions */
+	so->procinfo = index_getprocinfo(index, 1, DISKANN_DISTANCE_PROC);
+	so->normprocinfo = DiskannOptionalProcInfo(index, DISKANN_NORM_PROC);
+	so->collation = index->rd_indcollation[0];
+
+	scan->opaque = so;
+
+	return scan;
+}
+
+/*
+ * Start or restart an index scan
+ */
+void
+diskannrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+	DiskannScanOpaque so = (DiskannScanOpaque) scan->opaque;
+
+	so->first = true;
+	so->w = NIL;
+	MemoryContextReset(so->tmpCtx);
+
+	if (keys && scan->numberOfKeys > 0)
+		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+}
+
+/*
+ * Fetch the next tuple in the given scan
+ */
+bool
+diskanngettuple_internal(IndexScanDesc scan, ScanDirection dir)
+{
+	DiskannScanOpaque so = (DiskannScanOpaque) scan->opaque;
+	MemoryContext oldCtx = MemoryContextSwitchTo(so->tmpCtx);
+
+	/*
+	 * Index can be used to scan backward, but Postgres doesn't support
+	 * backward scan on operators
+	 */
+	Assert(ScanDirectionIsForward(dir));
+
+	if (so->first)
+	{
+		Datum		value;
+
+		/* Count index scan for stats */
+		pgstat_count_index_scan(scan->indexRelation);
+
+		/* Safety check */
+		if (scan->orderByData == NULL)
+			elog(ERROR, "cannot scan diskann index without order");
+
+		/* Requires MVCC-compliant snapshot as not able to maintain a pin */
+		/* https://www.postgresql.org/docs/current/index-locking.html */
+		if (!IsMVCCSnapshot(scan->xs_snapshot))
+			elog(ERROR, "non-MVCC snapshots are not supported with diskann");
+
+		/* Get scan value */
+		value = GetScanValue(scan);
+
+		so->w = GetScanItems(scan, value);
+		so->first = false;
+	}
+
+	while (list_length(so->w) > 0)
+	{
+		DiskannNode node = (DiskannNode) linitial(so->w);
+		ItemPointer heaptid;
+
+		/* Move to next node if no valid heap TIDs */
+		if (node->heaptidsLength == 0)
+		{
+			so->w = list_delete_first(so->w);
+			continue;
+		}
+
+		heaptid = &node->heaptids[--node->heaptidsLength];
+
+		MemoryContextSwitchTo(oldCtx);
+
+		scan->xs_ctup.t_self = *heaptid;
+		scan->xs_recheck = false;
+		return true;
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	return false;
+}
+
+/*
+ * End a scan and release resources
+ */
+void
+diskannendscan_internal(IndexScanDesc scan)
+{
+	DiskannScanOpaque so = (DiskannScanOpaque) scan->opaque;
+
+	MemoryContextDelete(so->tmpCtx);
+
+	pfree(so);
+	scan->opaque = NULL;
+}
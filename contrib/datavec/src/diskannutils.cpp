@@ -0,0 +1,638 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/reloptions.h"
+#include "diskann.h"
+#include "fmgr.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/hashutils.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+/* Node number hash table */
+#define VALGRIND_MAKE_MEM_DEFINED(addr, size) do {} while (0)
+
+#define SH_PREFIX		nodehash
+#define SH_ELEMENT_TYPE	NodeHashEntry
+#define SH_KEY_TYPE		uint32
+#define	SH_KEY			node
+#define SH_HASH_KEY(tb, key)	murmurhash32(key)
+#define SH_EQUAL(tb, a, b)		(a == b)
+#define	SH_SCOPE		extern
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/* Candidate during search */
+typedef struct DiskannCandidate
+{
+	uint32		node;
+	float		distance;
+	bool		expanded;
+}			DiskannCandidate;
+
+/* Candidate during pruning */
+typedef struct DiskannPruneItem
+{
+	int			idx;
+	float		distance;
+}			DiskannPruneItem;
+
+/*
+ * Get the max number of neighbors in the index
+ */
+int
+DiskannGetMaxDegree(Relation index)
+{
+	DiskannOptions *opts = (DiskannOptions *) index->rd_options;
+
+	if (opts)
+		return opts->maxDegree;
+
+	return DISKANN_DEFAULT_MAX_DEGREE;
+}
+
+/*
+ * Get the size of the candidate list for construction
+ */
+int
+DiskannGetBuildListSize(Relation index)
+{
+	DiskannOptions *opts = (DiskannOptions *) index->rd_options;
+
+	if (opts)
+		return opts->buildListSize;
+
+	return DISKANN_DEFAULT_BUILD_LIST_SIZE;
+}
+
+/*
+ * Get the pruning factor
+ */
+float
+DiskannGetAlpha(Relation index)
+{
+	DiskannOptions *opts = (DiskannOptions *) index->rd_options;
+
+	if (opts)
+		return (float) opts->alpha;
+
+	return DISKANN_DEFAULT_ALPHA;
+}
+
+/*
+ * Get the number of product quantization subquantizers
+ *
+ * Defaults to the largest divisor of dimensions that is at most
+ * dimensions / 4, like ivfflat
+ */
+int
+DiskannGetPqM(Relation index, int dimensions)
+{
+	DiskannOptions *opts = (DiskannOptions *) index->rd_options;
+	int			m;
+
+	if (opts && opts->pqM != DISKANN_DEFAULT_PQ_M)
+		return opts->pqM;
+
+	for (m = Max(dimensions / 4, 1); m > 1; m--)
+	{
+		if (dimensions % m == 0)
+			break;
+	}
+
+	return m;
+}
+
+/*
+ * Get proc
+ */
+FmgrInfo *
+DiskannOptionalProcInfo(Relation index, uint16 procnum)
+{
+	if (!OidIsValid(index_getprocid(index, 1, procnum)))
+		return NULL;
+
+	return index_getprocinfo(index, 1, procnum);
+}
+
+/*
+ * Normalize value
+ */
+Datum
+DiskannNormValue(Oid collation, Datum value)
+{
+	return DirectFunctionCall1Coll(l2_normalize, collation, value);
+}
+
+/*
+ * Check if non-zero norm
+ */
+bool
+DiskannCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value)
+{
+	return DatumGetFloat8(FunctionCall1Coll(procinfo, collation, value)) > 0;
+}
+
+/*
+ * New buffer
+ */
+Buffer
+DiskannNewBuffer(Relation index, ForkNumber forkNum)
+{
+	Buffer		buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	return buf;
+}
+
+/*
+ * Init page
+ */
+void
+DiskannInitPage(Buffer buf, Page page)
+{
+	PageInit(page, BufferGetPageSize(buf), sizeof(DiskannPageOpaqueData));
+	DiskannPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+	DiskannPageGetOpaque(page)->page_id = DISKANN_PAGE_ID;
+}
+
+/*
+ * Get a copy of the metapage
+ */
+void
+DiskannGetMetaPageInfo(Relation index, DiskannMetaPage metap)
+{
+	Buffer		buf;
+	Page		page;
+
+	buf = ReadBuffer(index, DISKANN_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	memcpy(metap, DiskannPageGetMeta(page), sizeof(DiskannMetaPageData));
+	UnlockReleaseBuffer(buf);
+
+	if (unlikely(metap->magicNumber != DISKANN_MAGIC_NUMBER))
+		elog(ERROR, "diskann index is not valid");
+}
+
+/*
+ * Get the tid of a node
+ */
+void
+DiskannNodeTid(const DiskannMetaPageData * metap, uint32 node, BlockNumber *blkno, OffsetNumber *offno)
+{
+	*blkno = metap->nodeStartPage + node / metap->nodesPerPage;
+	*offno = FirstOffsetNumber + node % metap->nodesPerPage;
+}
+
+/*
+ * Set the contents of a node tuple
+ */
+void
+DiskannSetNodeTuple(const DiskannMetaPageData * metap, DiskannNodeTuple ntup, const ItemPointerData *heaptids, int heaptidsLength, const uint32 *neighbors, int degree, const Vector * value, const uint8 *codes)
+{
+	MemSet(ntup, 0, metap->nodeSize);
+
+	for (int i = 0; i < DISKANN_HEAPTIDS; i++)
+	{
+		if (i < heaptidsLength)
+			ntup->heaptids[i] = heaptids[i];
+		else
+			ItemPointerSetInvalid(&ntup->heaptids[i]);
+	}
+
+	ntup->degree = degree;
+	for (int i = 0; i < metap->maxDegree; i++)
+		ntup->neighbors[i] = i < degree ? neighbors[i] : DISKANN_INVALID_NODE;
+
+	memcpy(DiskannNodeValue(ntup, metap->maxDegree), value, VECTOR_SIZE(metap->dimensions));
+
+	if (codes != NULL)
+		memcpy(DiskannNodeCodes(ntup, metap->maxDegree, metap->dimensions), codes, metap->pqM);
+}
+
+/*
+ * Load a node and its distance to the query
+ */
+DiskannNode
+DiskannLoadNode(Relation index, const DiskannMetaPageData * metap, uint32 id, Datum q, FmgrInfo *procinfo, Oid collation, bool loadValue)
+{
+	DiskannNode node = (DiskannNode) palloc(sizeof(DiskannNodeData));
+	BlockNumber blkno;
+	OffsetNumber offno;
+	Buffer		buf;
+	Page		page;
+	DiskannNodeTuple ntup;
+	Vector	   *value;
+
+	DiskannNodeTid(metap, id, &blkno, &offno);
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	if (offno > PageGetMaxOffsetNumber(page))
+		elog(ERROR, "diskann node %u not found in index \"%s\"", id, RelationGetRelationName(index));
+
+	ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+	value = DiskannNodeValue(ntup, metap->maxDegree);
+
+	node->id = id;
+	node->heaptidsLength = 0;
+	for (int i = 0; i < DISKANN_HEAPTIDS; i++)
+	{
+		/* Stop at first unused */
+		if (!ItemPointerIsValid(&ntup->heaptids[i]))
+			break;
+
+		node->heaptids[node->heaptidsLength++] = ntup->heaptids[i];
+	}
+
+	node->degree = Min(ntup->degree, metap->maxDegree);
+	node->neighbors = (uint32 *) palloc(sizeof(uint32) * metap->maxDegree);
+	memcpy(node->neighbors, ntup->neighbors, sizeof(uint32) * node->degree);
+
+	/* Distances are zero without a value */
+	if (DatumGetPointer(q) == NULL)
+		node->distance = 0;
+	else
+		node->distance = (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, PointerGetDatum(value)));
+
+	if (loadValue)
+	{
+		node->value = (Vector *) palloc(VECTOR_SIZE(metap->dimensions));
+		memcpy(node->value, value, VECTOR_SIZE(metap->dimensions));
+	}
+	else
+		node->value = NULL;
+
+	UnlockReleaseBuffer(buf);
+
+	return node;
+}
+
+/*
+ * Add a candidate to the sorted list, dropping the furthest if full
+ */
+static void
+AddCandidate(DiskannCandidate * candidates, int *length, int l, uint32 node, float distance)
+{
+	int			i;
+
+	if (*length == l)
+	{
+		if (distance >= candidates[l - 1].distance)
+			return;
+
+		i = l - 1;
+	}
+	else
+		i = (*length)++;
+
+	while (i > 0 && candidates[i - 1].distance > distance)
+	{
+		candidates[i] = candidates[i - 1];
+		i--;
+	}
+
+	candidates[i].node = node;
+	candidates[i].distance = distance;
+	candidates[i].expanded = false;
+}
+
+/*
+ * Get the distance used to order a candidate
+ *
+ * Uses the cached product quantization codes when available, and reads the
+ * node otherwise
+ */
+static float
+CandidateDistance(Relation index, const DiskannMetaPageData * metap, uint32 node, Datum q, FmgrInfo *procinfo, Oid collation, const DiskannPqCache * cache, uint32 cacheCount, const float *table)
+{
+	DiskannNode n;
+	float		distance;
+
+	if (table != NULL && node < cacheCount)
+	{
+		const uint8 *codes = cache->codes + (Size) node * cache->pqM;
+
+		distance = 0;
+		for (int j = 0; j < cache->pqM; j++)
+			distance += table[j * IVFFLAT_PQ_CODEWORDS + codes[j]];
+
+		return distance;
+	}
+
+	n = DiskannLoadNode(index, metap, node, q, procinfo, collation, false);
+	distance = n->distance;
+	pfree(n->neighbors);
+	pfree(n);
+
+	return distance;
+}
+
+/*
+ * Compare node distances
+ */
+static int
+CompareNodeDistances(const void *a, const void *b)
+{
+	DiskannNode na = *((DiskannNode *) a);
+	DiskannNode nb = *((DiskannNode *) b);
+
+	if (na->distance < nb->distance)
+		return -1;
+
+	if (na->distance > nb->distance)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Beam search from the entry node
+ *
+ * Candidates are ordered by approximate distance, and the closest
+ * beamWidth unexpanded candidates are read together each round. The reads
+ * for a round are issued before any of them are waited on, so the nodes of a
+ * round are fetched in parallel when the operating system supports it.
+ *
+ * Returns the expanded nodes sorted by exact distance
+ */
+List *
+DiskannSearch(Relation index, const DiskannMetaPageData * metap, Datum q, int l, int beamWidth, FmgrInfo *procinfo, Oid collation, const DiskannPqCache * cache, uint32 cacheCount, bool loadValues)
+{
+	DiskannCandidate *candidates;
+	int			length = 0;
+	uint32	   *beamNodes;
+	DiskannNode *beam;
+	DiskannNode *expanded;
+	int			expandedLength = 0;
+	int			maxExpanded = l;
+	nodehash_hash *v;
+	float	   *table = NULL;
+	List	   *w = NIL;
+	bool		found;
+
+	if (metap->entryNode == DISKANN_INVALID_NODE)
+		return NIL;
+
+	/* Navigate with quantized distances when codes are cached */
+	if (cache != NULL && DatumGetPointer(q) != NULL)
+	{
+		const		IvfflatQuantizerData *quantizer = DiskannGetQuantizer(index, metap);
+		int			metric = IvfflatGetQuantizerMetric(procinfo);
+
+		if (quantizer != NULL && metric >= 0)
+		{
+			table = (float *) palloc(sizeof(float) * quantizer->pqM * IVFFLAT_PQ_CODEWORDS);
+			IvfflatPqComputeTable(quantizer, metric, ((Vector *) DatumGetPointer(q))->x, table);
+		}
+	}
+
+	candidates = (DiskannCandidate *) palloc(sizeof(DiskannCandidate) * l);
+	beamNodes = (uint32 *) palloc(sizeof(uint32) * beamWidth);
+	beam = (DiskannNode *) palloc(sizeof(DiskannNode) * beamWidth);
+	expanded = (DiskannNode *) palloc(sizeof(DiskannNode) * maxExpanded);
+	v = nodehash_create(CurrentMemoryContext, 256, NULL);
+
+	nodehash_insert(v, metap->entryNode, &found);
+	AddCandidate(candidates, &length, l, metap->entryNode,
+				 CandidateDistance(index, metap, metap->entryNode, q, procinfo, collation, cache, cacheCount, table));
+
+	for (;;)
+	{
+		int			n = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Closest unexpanded candidates form the beam */
+		for (int i = 0; i < length && n < beamWidth; i++)
+		{
+			if (candidates[i].expanded)
+				continue;
+
+			candidates[i].expanded = true;
+			beamNodes[n++] = candidates[i].node;
+		}
+
+		if (n == 0)
+			break;
+
+		/* Start reads for the whole beam before waiting on any of them */
+		for (int i = 0; i < n; i++)
+		{
+			BlockNumber blkno;
+			OffsetNumber offno;
+
+			DiskannNodeTid(metap, beamNodes[i], &blkno, &offno);
+			PrefetchBuffer(index, MAIN_FORKNUM, blkno);
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			beam[i] = DiskannLoadNode(index, metap, beamNodes[i], q, procinfo, collation, loadValues);
+
+			if (expandedLength == maxExpanded)
+			{
+				maxExpanded *= 2;
+				expanded = (DiskannNode *) repalloc(expanded, sizeof(DiskannNode) * maxExpanded);
+			}
+			expanded[expandedLength++] = beam[i];
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			for (int j = 0; j < beam[i]->degree; j++)
+			{
+				uint32		e = beam[i]->neighbors[j];
+
+				nodehash_insert(v, e, &found);
+				if (found)
+					continue;
+
+				AddCandidate(candidates, &length, l, e,
+							 CandidateDistance(index, metap, e, q, procinfo, collation, cache, cacheCount, table));
+			}
+		}
+	}
+
+	/* Order by exact distance */
+	qsort(expanded, expandedLength, sizeof(DiskannNode), CompareNodeDistances);
+
+	for (int i = 0; i < expandedLength; i++)
+		w = lappend(w, expanded[i]);
+
+	nodehash_destroy(v);
+	pfree(candidates);
+	pfree(beamNodes);
+	pfree(beam);
+	pfree(expanded);
+	if (table != NULL)
+		pfree(table);
+
+	return w;
+}
+
+/*
+ * Scale a distance by the pruning factor
+ *
+ * Negative distances from inner product are divided instead, so a larger
+ * alpha always keeps more neighbors
+ */
+static inline float
+AlphaScale(float distance, float alpha)
+{
+	return distance >= 0 ? distance * alpha : distance / alpha;
+}
+
+/*
+ * Compare prune candidates
+ */
+static int
+ComparePruneItems(const void *a, const void *b)
+{
+	const		DiskannPruneItem *ia = (const DiskannPruneItem *) a;
+	const		DiskannPruneItem *ib = (const DiskannPruneItem *) b;
+
+	if (ia->distance < ib->distance)
+		return -1;
+
+	if (ia->distance > ib->distance)
+		return 1;
+
+	return ia->idx - ib->idx;
+}
+
+/*
+ * Algorithm 2 from the Vamana paper (RobustPrune)
+ *
+ * distances are to the node being pruned. A candidate is dropped when a
+ * selected neighbor is closer to it by a factor of alpha, which keeps some
+ * long-range edges when alpha > 1.
+ *
+ * Returns the number of neighbors selected
+ */
+int
+DiskannRobustPrune(const uint32 *ids, const float *distances, const Datum *values, int n, int maxDegree, float alpha, FmgrInfo *procinfo, Oid collation, uint32 *neighbors)
+{
+	DiskannPruneItem *items = (DiskannPruneItem *) palloc(sizeof(DiskannPruneItem) * Max(n, 1));
+	bool	   *pruned = (bool *) palloc0(sizeof(bool) * Max(n, 1));
+	int			count = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		items[i].idx = i;
+		items[i].distance = distances[i];
+	}
+
+	qsort(items, n, sizeof(DiskannPruneItem), ComparePruneItems);
+
+	for (int i = 0; i < n && count < maxDegree; i++)
+	{
+		int			a = items[i].idx;
+		bool		duplicate = false;
+
+		if (pruned[a])
+			continue;
+
+		for (int k = 0; k < count; k++)
+		{
+			if (neighbors[k] == ids[a])
+			{
+				duplicate = true;
+				break;
+			}
+		}
+
+		if (duplicate)
+			continue;
+
+		neighbors[count++] = ids[a];
+
+		for (int j = i + 1; j < n; j++)
+		{
+			int			b = items[j].idx;
+			float		distance;
+
+			if (pruned[b])
+				continue;
+
+			distance = (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, values[a], values[b]));
+			if (AlphaScale(distance, alpha) <= distances[b])
+				pruned[b] = true;
+		}
+	}
+
+	pfree(items);
+	pfree(pruned);
+
+	return count;
+}
+
+/*
+ * Load the codebook
+ */
+static void
+LoadCodebook(Relation index, IvfflatQuantizer quantizer, BlockNumber nextblkno)
+{
+	int			total = IVFFLAT_PQ_CODEWORDS * quantizer->dimensions;
+	int			offset = 0;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		buf = ReadBuffer(index, nextblkno);
+		Page		page;
+		OffsetNumber maxoffno;
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			ItemId		itemid = PageGetItemId(page, offno);
+			int			count = ItemIdGetLength(itemid) / sizeof(float);
+
+			if (offset + count > total)
+				elog(ERROR, "diskann codebook is not valid");
+
+			memcpy(quantizer->codebook + offset, PageGetItem(page, itemid), sizeof(float) * count);
+			offset += count;
+		}
+
+		nextblkno = DiskannPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	if (offset != total)
+		elog(ERROR, "diskann codebook is not valid");
+}
+
+/*
+ * Get the quantizer for an index
+ *
+ * The codebook is immutable after the build, so it is cached in
+ * rd_amcache. Returns NULL if the index was built without data to train on.
+ */
+const		IvfflatQuantizerData *
+DiskannGetQuantizer(Relation index, const DiskannMetaPageData * metap)
+{
+	if (!metap->pqTrained)
+		return NULL;
+
+	if (index->rd_amcache == NULL)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(index->rd_indexcxt);
+		IvfflatQuantizer q = IvfflatQuantizerInit(IVFFLAT_QUANTIZER_PQ, metap->dimensions, metap->pqM);
+
+		MemoryContextSwitchTo(oldCtx);
+
+		LoadCodebook(index, q, metap->codebookPage);
+
+		index->rd_amcache = q;
+	}
+
+	return (const IvfflatQuantizerData *) index->rd_amcache;
+}
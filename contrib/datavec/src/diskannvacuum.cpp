@@ -0,0 +1,515 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "commands/vacuum.h"
+#include "diskann.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Check if a node has no heap TIDs
+ *
+ * Nodes added after vacuum started are not tracked and are live
+ */
+static inline bool
+IsDeleted(DiskannVacuumState * vacuumstate, uint32 node)
+{
+	return node < vacuumstate->metap.nodeCount && vacuumstate->deleted[node];
+}
+
+/*
+ * Remove deleted heap TIDs
+ *
+ * Nodes without heap TIDs stay on disk, since node numbers map directly to
+ * tids, and the entry node stays the entry node. Nodes freed by an earlier
+ * vacuum are not tracked, since nothing points to them.
+ */
+static void
+RemoveHeapTids(DiskannVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	DiskannMetaPage metap = &vacuumstate->metap;
+	IndexBulkDeleteResult *stats = vacuumstate->stats;
+	uint32		node = 0;
+
+	while (node < metap->nodeCount)
+	{
+		BlockNumber blkno;
+		OffsetNumber offno;
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		bool		updated = false;
+
+		vacuum_delay_point();
+
+		DiskannNodeTid(metap, node, &blkno, &offno);
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		/* Iterate over nodes on the page */
+		for (; node < metap->nodeCount && offno <= PageGetMaxOffsetNumber(page); node++, offno = OffsetNumberNext(offno))
+		{
+			DiskannNodeTuple ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+			int			idx = 0;
+			bool		itemUpdated = false;
+
+			for (int i = 0; i < DISKANN_HEAPTIDS; i++)
+			{
+				/* Stop at first unused */
+				if (!ItemPointerIsValid(&ntup->heaptids[i]))
+					break;
+
+				if (vacuumstate->callback(&ntup->heaptids[i], vacuumstate->callback_state, InvalidOid, InvalidBktId))
+				{
+					itemUpdated = true;
+					stats->tuples_removed++;
+				}
+				else
+				{
+					/* Move to front of list */
+					ntup->heaptids[idx++] = ntup->heaptids[i];
+					stats->num_index_tuples++;
+				}
+			}
+
+			if (itemUpdated)
+			{
+				/* Mark rest as invalid */
+				for (int i = idx; i < DISKANN_HEAPTIDS; i++)
+					ItemPointerSetInvalid(&ntup->heaptids[i]);
+
+				updated = true;
+			}
+
+			vacuumstate->deleted[node] = DiskannNodeIsDeleted(ntup) && !DiskannNodeIsFree(ntup);
+		}
+
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+
+		UnlockReleaseBuffer(buf);
+
+		/* Page has fewer nodes than expected */
+		if (offno == FirstOffsetNumber)
+			elog(ERROR, "diskann node %u not found in index \"%s\"", node, RelationGetRelationName(index));
+	}
+}
+
+/*
+ * Add a repair candidate if not already present
+ */
+static void
+AddRepairCandidate(uint32 *ids, int *length, uint32 id)
+{
+	for (int i = 0; i < *length; i++)
+	{
+		if (ids[i] == id)
+			return;
+	}
+
+	ids[(*length)++] = id;
+}
+
+/*
+ * Remove deleted neighbors with the buffer lock held
+ *
+ * Used when the neighbors keep changing during a repair
+ */
+static void
+FilterNeighbors(DiskannVacuumState * vacuumstate, uint32 node)
+{
+	Relation	index = vacuumstate->index;
+	DiskannMetaPage metap = &vacuumstate->metap;
+	BlockNumber blkno;
+	OffsetNumber offno;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	DiskannNodeTuple ntup;
+	int			degree = 0;
+
+	DiskannNodeTid(metap, node, &blkno, &offno);
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+	for (int i = 0; i < ntup->degree; i++)
+	{
+		if (!IsDeleted(vacuumstate, ntup->neighbors[i]))
+			ntup->neighbors[degree++] = ntup->neighbors[i];
+	}
+
+	for (int i = degree; i < ntup->degree; i++)
+		ntup->neighbors[i] = DISKANN_INVALID_NODE;
+
+	if (degree != ntup->degree)
+	{
+		ntup->degree = degree;
+		GenericXLogFinish(state);
+	}
+	else
+		GenericXLogAbort(state);
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Replace deleted neighbors of a node with their neighbors
+ *
+ * Like delete consolidation in FreshDiskANN, the live neighbors of deleted
+ * neighbors become candidates and the result is pruned with RobustPrune
+ */
+static void
+RepairNode(DiskannVacuumState * vacuumstate, uint32 node)
+{
+	Relation	index = vacuumstate->index;
+	DiskannMetaPage metap = &vacuumstate->metap;
+	FmgrInfo   *procinfo = vacuumstate->procinfo;
+	Oid			collation = vacuumstate->collation;
+	uint32	   *neighbors = (uint32 *) palloc(sizeof(uint32) * metap->maxDegree);
+
+	for (int attempt = 0; attempt < DISKANN_UPDATE_RETRIES; attempt++)
+	{
+		DiskannNode n = DiskannLoadNode(index, metap, node, PointerGetDatum(NULL), procinfo, collation, true);
+		uint32	   *ids = (uint32 *) palloc(sizeof(uint32) * metap->maxDegree * (metap->maxDegree + 1));
+		float	   *distances;
+		Datum	   *values;
+		int			length = 0;
+		int			degree;
+		bool		needsRepair = false;
+
+		for (int i = 0; i < n->degree; i++)
+		{
+			uint32		e = n->neighbors[i];
+			DiskannNode d;
+
+			if (!IsDeleted(vacuumstate, e))
+			{
+				AddRepairCandidate(ids, &length, e);
+				continue;
+			}
+
+			needsRepair = true;
+
+			d = DiskannLoadNode(index, metap, e, PointerGetDatum(NULL), procinfo, collation, false);
+			for (int j = 0; j < d->degree; j++)
+			{
+				uint32		c = d->neighbors[j];
+
+				if (c != node && !IsDeleted(vacuumstate, c))
+					AddRepairCandidate(ids, &length, c);
+			}
+		}
+
+		if (!needsRepair)
+			return;
+
+		distances = (float *) palloc(sizeof(float) * Max(length, 1));
+		values = (Datum *) palloc(sizeof(Datum) * Max(length, 1));
+
+		for (int i = 0; i < length; i++)
+		{
+			DiskannNode c = DiskannLoadNode(index, metap, ids[i], PointerGetDatum(n->value), procinfo, collation, true);
+
+			distances[i] = c->distance;
+			values[i] = PointerGetDatum(c->value);
+		}
+
+		degree = DiskannRobustPrune(ids, distances, values, length, metap->maxDegree, metap->alpha, procinfo, collation, neighbors);
+
+		if (DiskannUpdateNeighbors(index, metap, node, n->neighbors, n->degree, neighbors, degree, false))
+			return;
+	}
+
+	/* Lost the race with inserts too many times */
+	FilterNeighbors(vacuumstate, node);
+}
+
+/*
+ * Repair nodes that point to deleted nodes
+ *
+ * Returns true if there are deleted nodes
+ */
+static bool
+RepairGraph(DiskannVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	DiskannMetaPage metap = &vacuumstate->metap;
+	DiskannMetaPageData latest;
+	uint32	   *repairs = (uint32 *) palloc(sizeof(uint32) * metap->nodesPerPage);
+	uint32		node = 0;
+	bool		anyDeleted = false;
+
+	for (uint32 i = 0; i < metap->nodeCount; i++)
+	{
+		if (vacuumstate->deleted[i])
+		{
+			anyDeleted = true;
+			break;
+		}
+	}
+
+	if (!anyDeleted)
+		return false;
+
+	/*
+	 * Wait for in-flight inserts, which may have linked to nodes deleted by
+	 * the first pass. Later inserts do not link to deleted nodes.
+	 */
+	LockPage(index, DISKANN_UPDATE_LOCK, ExclusiveLock);
+	UnlockPage(index, DISKANN_UPDATE_LOCK, ExclusiveLock);
+
+	/* Include nodes added since the first pass, which may point to deleted nodes */
+	DiskannGetMetaPageInfo(index, &latest);
+
+	/*
+	 * Get a shared lock. Inserts hold the same lock, and neighbors are only
+	 * replaced if they have not changed since they were read.
+	 */
+	LockPage(index, DISKANN_UPDATE_LOCK, ShareLock);
+
+	while (node < latest.nodeCount)
+	{
+		BlockNumber blkno;
+		OffsetNumber offno;
+		Buffer		buf;
+		Page		page;
+		int			nrepairs = 0;
+
+		vacuum_delay_point();
+
+		DiskannNodeTid(metap, node, &blkno, &offno);
+
+		/* Find nodes to repair */
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		for (; node < latest.nodeCount && offno <= PageGetMaxOffsetNumber(page); node++, offno = OffsetNumberNext(offno))
+		{
+			DiskannNodeTuple ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			/* Deleted nodes are unreachable once repaired, except the entry */
+			if (IsDeleted(vacuumstate, node) && node != latest.entryNode)
+				continue;
+
+			for (int i = 0; i < ntup->degree; i++)
+			{
+				if (IsDeleted(vacuumstate, ntup->neighbors[i]))
+				{
+					repairs[nrepairs++] = node;
+					break;
+				}
+			}
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		if (offno == FirstOffsetNumber)
+			elog(ERROR, "diskann node %u not found in index \"%s\"", node, RelationGetRelationName(index));
+
+		for (int i = 0; i < nrepairs; i++)
+		{
+			MemoryContext oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
+
+			RepairNode(vacuumstate, repairs[i]);
+
+			MemoryContextSwitchTo(oldCtx);
+			MemoryContextReset(vacuumstate->tmpCtx);
+		}
+	}
+
+	UnlockPage(index, DISKANN_UPDATE_LOCK, ShareLock);
+
+	pfree(repairs);
+
+	return true;
+}
+
+/*
+ * Add deleted nodes to the free list so inserts can reuse them
+ *
+ * Once the graph is repaired, no node points to a deleted node. The entry
+ * node is kept since searches start there.
+ */
+static void
+FreeNodes(DiskannVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	DiskannMetaPage metap = &vacuumstate->metap;
+	uint32		node = 0;
+
+	while (node < metap->nodeCount)
+	{
+		BlockNumber blkno;
+		OffsetNumber offno;
+		uint32		end;
+		bool		anyDeleted = false;
+		Buffer		metabuf;
+		Buffer		buf;
+		Page		metapage;
+		Page		page;
+		GenericXLogState *state;
+		DiskannMetaPage latest;
+		bool		updated = false;
+
+		vacuum_delay_point();
+
+		DiskannNodeTid(metap, node, &blkno, &offno);
+		end = Min(node - (offno - FirstOffsetNumber) + metap->nodesPerPage, metap->nodeCount);
+
+		for (uint32 i = node; i < end; i++)
+		{
+			if (vacuumstate->deleted[i])
+			{
+				anyDeleted = true;
+				break;
+			}
+		}
+
+		if (!anyDeleted)
+		{
+			node = end;
+			continue;
+		}
+
+		/* Lock the metapage first like inserts */
+		metabuf = ReadBuffer(index, DISKANN_METAPAGE_BLKNO);
+		LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+		state = GenericXLogStart(index);
+		metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+		latest = DiskannPageGetMeta(metapage);
+
+		for (; node < end; node++, offno = OffsetNumberNext(offno))
+		{
+			DiskannNodeTuple ntup;
+
+			if (!vacuumstate->deleted[node] || node == latest->entryNode)
+				continue;
+
+			if (offno > PageGetMaxOffsetNumber(page))
+				elog(ERROR, "diskann node %u not found in index \"%s\"", node, RelationGetRelationName(index));
+
+			/* Deleted nodes never get heap TIDs again, but check anyway */
+			ntup = (DiskannNodeTuple) PageGetItem(page, PageGetItemId(page, offno));
+			if (!DiskannNodeIsDeleted(ntup) || DiskannNodeIsFree(ntup))
+				continue;
+
+			for (int i = 0; i < metap->maxDegree; i++)
+				ntup->neighbors[i] = DISKANN_INVALID_NODE;
+
+			/* Push the node on the free list */
+			ntup->degree = 0;
+			ntup->flags |= DISKANN_NODE_FREE;
+			ntup->neighbors[0] = latest->freeNode;
+			latest->freeNode = node;
+			updated = true;
+		}
+
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+
+		UnlockReleaseBuffer(buf);
+		UnlockReleaseBuffer(metabuf);
+	}
+}
+
+/*
+ * Initialize the vacuum state
+ */
+static void
+InitVacuumState(DiskannVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	index = info->index;
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	vacuumstate->index = index;
+	vacuumstate->stats = stats;
+	vacuumstate->callback = callback;
+	vacuumstate->callback_state = callback_state;
+	vacuumstate->procinfo = index_getprocinfo(index, 1, DISKANN_DISTANCE_PROC);
+	vacuumstate->collation = index->rd_indcollation[0];
+	vacuumstate->bas = GetAccessStrategy(BAS_BULKREAD);
+	vacuumstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												"Diskann vacuum temporary context",
+												ALLOCSET_DEFAULT_SIZES);
+
+	DiskannGetMetaPageInfo(index, &vacuumstate->metap);
+	vacuumstate->deleted = (bool *) palloc0_huge(CurrentMemoryContext, sizeof(bool) * Max(vacuumstate->metap.nodeCount, 1));
+}
+
+/*
+ * Free resources
+ */
+static void
+FreeVacuumState(DiskannVacuumState * vacuumstate)
+{
+	pfree(vacuumstate->deleted);
+	FreeAccessStrategy(vacuumstate->bas);
+	MemoryContextDelete(vacuumstate->tmpCtx);
+}
+
+/*
+ * Bulk delete tuples from the index
+ */
+IndexBulkDeleteResult *
+diskannbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+						   IndexBulkDeleteCallback callback, void *callback_state)
+{
+	DiskannVacuumState vacuumstate;
+
+	InitVacuumState(&vacuumstate, info, stats, callback, callback_state);
+
+	/* Pass 1: Remove heap TIDs */
+	RemoveHeapTids(&vacuumstate);
+
+	/* Pass 2: Repair graph */
+	if (RepairGraph(&vacuumstate))
+	{
+		/* Pass 3: Free deleted nodes */
+		FreeNodes(&vacuumstate);
+	}
+
+	FreeVacuumState(&vacuumstate);
+
+	return vacuumstate.stats;
+}
+
+/*
+ * Clean up after a VACUUM operation
+ */
+IndexBulkDeleteResult *
+diskannvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	Relation	rel = info->index;
+
+	if (info->analyze_only)
+		return stats;
+
+	/* stats is NULL if ambulkdelete not called */
+	/* OK to return NULL if index not changed */
+	if (stats == NULL)
+		return NULL;
+
+	stats->num_pages = RelationGetNumberOfBlocks(rel);
+
+	return stats;
+}
@@ -692,6 +692,88 @@ halfvec_l1_distance(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) HalfvecL1Distance(a->dim, a->x, b->x));
 }
 
+/*
+ * Get the distances from q to many half vectors
+ *
+ * Resolves the distance function once per batch instead of going through
+ * fmgr for each value, and prefetches the next value
+ */
+void
+HalfvecDistanceBatch(FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances)
+{
+	HalfVector *a;
+	float		(*distance) (int dim, half * ax, half * bx);
+	bool		negate = false;
+	bool		root = false;
+	bool		spherical = false;
+
+	if (procinfo->fn_addr == halfvec_l2_squared_distance)
+		distance = HalfvecL2SquaredDistance;
+	else if (procinfo->fn_addr == halfvec_negative_inner_product)
+	{
+		distance = HalfvecInnerProduct;
+		negate = true;
+	}
+	else if (procinfo->fn_addr == halfvec_l2_distance)
+	{
+		distance = HalfvecL2SquaredDistance;
+		root = true;
+	}
+	else if (procinfo->fn_addr == halfvec_spherical_distance)
+	{
+		distance = HalfvecInnerProduct;
+		spherical = true;
+	}
+	else if (procinfo->fn_addr == halfvec_l1_distance)
+		distance = HalfvecL1Distance;
+	else
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+		return;
+	}
+
+	a = DatumGetHalfVector(q);
+
+	for (int i = 0; i < n; i++)
+	{
+		HalfVector *b;
+		float		d;
+
+		if (i + 1 < n)
+			VECTOR_PREFETCH(DatumGetPointer(values[i + 1]));
+
+		b = DatumGetHalfVector(values[i]);
+		CheckDims(a, b);
+
+		d = distance(a->dim, a->x, b->x);
+		if (negate)
+			distances[i] = (double) -d;
+		else if (root)
+			distances[i] = sqrt((double) d);
+		else if (spherical)
+		{
+			double		similarity = (double) d;
+
+			/* Prevent NaN with acos with loss of precision */
+			if (similarity > 1)
+				similarity = 1;
+			else if (similarity < -1)
+				similarity = -1;
+
+			distances[i] = acos(similarity) / M_PI;
+		}
+		else
+			distances[i] = (double) d;
+
+		if ((Pointer) b != DatumGetPointer(values[i]))
+			pfree(b);
+	}
+
+	if ((Pointer) a != DatumGetPointer(q))
+		pfree(a);
+}
+
 /*
  * Get the dimensions of a half vector
  */
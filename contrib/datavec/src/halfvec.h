@@ -43,6 +43,13 @@
 #define FLT16_SUPPORT
 #endif
 
+/* Prefetch memory that will be read soon */
+#if defined(__GNUC__) || defined(__clang__)
+#define VECTOR_PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#define VECTOR_PREFETCH(ptr) ((void) 0)
+#endif
+
 //TODO support _Float16
 #ifdef FLT16_SUPPORT
 #define half float
@@ -68,6 +75,7 @@ typedef struct HalfVector
 }			HalfVector;
 
 HalfVector *InitHalfVector(int dim);
+void		HalfvecDistanceBatch(FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances);
 
 extern "C" {
     Datum halfvec_in(PG_FUNCTION_ARGS);
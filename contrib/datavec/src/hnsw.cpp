@@ -8,17 +8,109 @@
 #include "commands/vacuum.h"
 #include "hnsw.h"
 #include "miscadmin.h"
+#include "optimizer/cost.h"
+#include "optimizer/predtest.h"
 #include "utils/guc.h"
 #include "utils/selfuncs.h"
+#include "utils/spccache.h"
 
 #if PG_VERSION_NUM < 150000
 #define MarkGUCPrefixReserved(x) EmitWarningsOnPlaceholders(x)
 #endif
 
 int			hnsw_ef_search;
+int			hnsw_iterative_scan;
+int			hnsw_max_scan_tuples;
 int			hnsw_lock_tranche_id;
 static relopt_kind hnsw_relopt_kind;
 
+static const struct config_enum_entry hnsw_iterative_scan_options[] = {
+	{"off", HNSW_ITERATIVE_SCAN_OFF, false},
+	{"relaxed_order", HNSW_ITERATIVE_SCAN_RELAXED, false},
+	{"strict_order", HNSW_ITERATIVE_SCAN_STRICT, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Validate the graph_cache reloption
+ */
+static void
+HnswValidateGraphCache(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "off") != 0 && strcmp(value, "upper") != 0 && strcmp(value, "all") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for graph_cache: \"%s\"", value),
+				 errdetail("Valid values are \"off\", \"upper\", and \"all\".")));
+}
+
+/*
+ * Validate the build_method reloption
+ */
+static void
+HnswValidateBuildMethod(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "insert") != 0 && strcmp(value, "merge") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for build_method: \"%s\"", value),
+				 errdetail("Valid values are \"insert\" and \"merge\".")));
+}
+
+/*
+ * Validate the vacuum_repair reloption
+ */
+static void
+HnswValidateVacuumRepair(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "full") != 0 && strcmp(value, "incremental") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for vacuum_repair: \"%s\"", value),
+				 errdetail("Valid values are \"full\" and \"incremental\".")));
+}
+
+/*
+ * Validate the page_order reloption
+ */
+static void
+HnswValidatePageOrder(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "insert") != 0 && strcmp(value, "bfs") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for page_order: \"%s\"", value),
+				 errdetail("Valid values are \"insert\" and \"bfs\".")));
+}
+
+/*
+ * Validate the quantizer reloption
+ */
+static void
+HnswValidateQuantizer(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "none") != 0 && strcmp(value, "binary") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for quantizer: \"%s\"", value),
+				 errdetail("Valid values are \"none\" and \"binary\".")));
+}
+
 /*
  * Initialize index options and variables
  */
@@ -40,16 +132,79 @@ HnswInit(void)
 					  ,AccessExclusiveLock
 #endif
 		);
+	add_string_reloption(hnsw_relopt_kind, "graph_cache", "Layers of the graph to cache in memory",
+						 "off", HnswValidateGraphCache);
+	add_string_reloption(hnsw_relopt_kind, "build_method", "Method for building graphs larger than maintenance_work_mem",
+						 "insert", HnswValidateBuildMethod);
+	add_string_reloption(hnsw_relopt_kind, "vacuum_repair", "How vacuum repairs elements with deleted neighbors",
+						 "full", HnswValidateVacuumRepair);
+	add_string_reloption(hnsw_relopt_kind, "quantizer", "Quantizer for the values stored in the graph",
+						 "none", HnswValidateQuantizer);
+	add_string_reloption(hnsw_relopt_kind, "page_order", "Order of elements on pages written by builds",
+						 "insert", HnswValidatePageOrder);
 
 	DefineCustomIntVariable("hnsw.ef_search", "Sets the size of the dynamic candidate list for search",
 							"Valid range is 1..1000.", &hnsw_ef_search,
 							HNSW_DEFAULT_EF_SEARCH, HNSW_MIN_EF_SEARCH, HNSW_MAX_EF_SEARCH, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomEnumVariable("hnsw.iterative_scan", "Sets the mode for iterative scans",
+							 NULL, &hnsw_iterative_scan,
+							 HNSW_ITERATIVE_SCAN_OFF, hnsw_iterative_scan_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.max_scan_tuples", "Sets the max number of tuples to visit for iterative scans",
+							NULL, &hnsw_max_scan_tuples,
+							HNSW_DEFAULT_MAX_SCAN_TUPLES, HNSW_MIN_MAX_SCAN_TUPLES, HNSW_MAX_MAX_SCAN_TUPLES, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.graph_cache_size", "Sets the max memory for cached graphs",
+							"Zero disables graph caches.", &hnsw_graph_cache_size,
+							HNSW_DEFAULT_GRAPH_CACHE_SIZE, 0, INT_MAX, PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.vacuum_workers", "Sets the number of background workers for repairing the graph during vacuum",
+							"Zero repairs the graph serially.", &hnsw_vacuum_workers,
+							0, 0, HNSW_MAX_VACUUM_WORKERS, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.filter_exact_limit", "Sets the max number of filtered rows to scan exactly",
+							"Larger filters search the graph.", &hnsw_filter_exact_limit,
+							HNSW_DEFAULT_FILTER_EXACT_LIMIT, 0, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("hnsw");
 }
 
+/*
+ * Get the selectivity of filters on the table
+ *
+ * Filters implied by the predicate of a partial index remove no rows from
+ * the scan.
+ */
+static Selectivity
+HnswFilterSelectivity(PlannerInfo *root, IndexOptInfo *indexinfo)
+{
+	List	   *clauses = NIL;
+	ListCell   *lc;
+
+	foreach(lc, indexinfo->rel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		if (indexinfo->indpred != NIL && predicate_implied_by(list_make1(rinfo->clause), indexinfo->indpred))
+			continue;
+
+		clauses = lappend(clauses, rinfo);
+	}
+
+	if (clauses == NIL)
+		return 1.0;
+
+	return clauselist_selectivity(root, clauses, indexinfo->rel->relid, JOIN_INNER, NULL, false);
+}
+
 /*
  * Estimate the cost of an index scan
+ *
+ * Vacuum and analyze measure the elements visited by a search, which is
+ * scaled to the current ef_search. With a limit and filters that remove
+ * most rows, the scan needs more than ef_search candidates, so exact scans
+ * win for selective filters.
  */
 static void
 hnswcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_count,
@@ -59,6 +214,11 @@ hnswcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_count,
 	GenericCosts costs;
 	int			m;
 	int			entryLevel;
+	int			statsEfSearch;
+	double		statsRows;
+	double		statsVisited;
+	double		spc_seq_page_cost;
+	double		tuples = path->indexinfo->tuples;
 	Relation	index;
 
 	/* Never use index without order */
@@ -75,18 +235,63 @@ hnswcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_count,
 
 	index = index_open(path->indexinfo->indexoid, NoLock);
 	HnswGetMetaPageInfo(index, &m, NULL);
+	HnswGetSearchStats(index, &statsEfSearch, &statsRows, &statsVisited);
 	index_close(index, NoLock);
 
-	/* Approximate entry level */
-	entryLevel = (int) -log(1.0 / path->indexinfo->tuples) * HnswGetMl(m);
+	if (statsEfSearch > 0)
+	{
+		/* Visited elements grow with ef_search and the log of the rows */
+		costs.numIndexTuples = statsVisited * hnsw_ef_search / statsEfSearch;
+		if (statsRows > 1 && tuples > 1)
+			costs.numIndexTuples *= log(tuples) / log(statsRows);
+	}
+	else
+	{
+		/* Approximate entry level */
+		entryLevel = (int) -log(1.0 / tuples) * HnswGetMl(m);
+
+		/* Account for number of tuples (or entry level), m, and ef_search */
+		costs.numIndexTuples = (entryLevel + hnsw_ef_search) * m;
+	}
 
-	/* TODO Improve estimate of visited tuples (currently underestimates) */
-	/* Account for number of tuples (or entry level), m, and ef_search */
-	costs.numIndexTuples = (entryLevel + 2) * m;
+	/* The limit only applies to this scan without joins */
+	if (root->limit_tuples > 0 && bms_membership(root->all_baserels) == BMS_SINGLETON)
+	{
+		Selectivity selectivity = HnswFilterSelectivity(root, path->indexinfo);
+		double		needed = root->limit_tuples / Max(selectivity, 1e-10);
+
+		/*
+		 * Visit more of the graph for each ef_search candidates needed. Scans
+		 * that are not iterative return incomplete results instead, which is
+		 * no better than the extra work.
+		 */
+		if (needed > hnsw_ef_search)
+		{
+			costs.numIndexTuples *= needed / hnsw_ef_search;
+
+			if (hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF && costs.numIndexTuples > hnsw_max_scan_tuples)
+				costs.numIndexTuples = hnsw_max_scan_tuples;
+		}
+	}
 
 	genericcostestimate(root, path, loop_count, costs.numIndexTuples, &costs.indexStartupCost,
 			&costs.indexTotalCost, &costs.indexSelectivity, &costs.indexCorrelation);
 
+	/* Pages visited by the generic cost estimator, which it does not return */
+	if (path->indexinfo->pages > 1 && tuples > 1)
+		costs.numIndexPages = ceil(Min(costs.numIndexTuples, tuples) * path->indexinfo->pages / tuples);
+	else
+		costs.numIndexPages = 1.0;
+
+	get_tablespace_page_costs(path->indexinfo->reltablespace, &costs.spc_random_page_cost, &spc_seq_page_cost);
+
+	/*
+	 * Change some page cost from random to sequential for a single scan,
+	 * since searches from the same entry point share pages
+	 */
+	if (loop_count <= 1)
+		costs.indexTotalCost -= 0.5 * costs.numIndexPages * (costs.spc_random_page_cost - spc_seq_page_cost);
+
 	/* Use total cost since most work happens before first tuple is returned */
 	*indexStartupCost = costs.indexTotalCost;
 	*indexTotalCost = costs.indexTotalCost;
@@ -103,6 +308,11 @@ hnswoptions_internal(Datum reloptions, bool validate)
 	static const relopt_parse_elt tab[] = {
 		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, m)},
 		{"ef_construction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
+		{"graph_cache", RELOPT_TYPE_STRING, offsetof(HnswOptions, graphCache)},
+		{"build_method", RELOPT_TYPE_STRING, offsetof(HnswOptions, buildMethod)},
+		{"vacuum_repair", RELOPT_TYPE_STRING, offsetof(HnswOptions, vacuumRepair)},
+		{"quantizer", RELOPT_TYPE_STRING, offsetof(HnswOptions, quantizer)},
+		{"page_order", RELOPT_TYPE_STRING, offsetof(HnswOptions, pageOrder)},
 		{"parallel_workers", RELOPT_TYPE_INT, offsetof(StdRdOptions, parallel_workers)}
 	};
 
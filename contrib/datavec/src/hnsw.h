@@ -6,6 +6,7 @@
 #include "access/genam.h"
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
+#include "nodes/tidbitmap.h"
 #include "port.h"				/* for random() */
 #include "vector.h"
 
@@ -29,6 +30,9 @@
 #define HNSW_UPDATE_LOCK 	0
 #define HNSW_SCAN_LOCK		1
 
+/* Scan key strategy for range searches, which the planner never uses */
+#define HNSW_RANGE_STRATEGY	1
+
 /* HNSW parameters */
 #define HNSW_DEFAULT_M	16
 #define HNSW_MIN_M	2
@@ -39,6 +43,40 @@
 #define HNSW_DEFAULT_EF_SEARCH	40
 #define HNSW_MIN_EF_SEARCH		1
 #define HNSW_MAX_EF_SEARCH		1000
+#define HNSW_DEFAULT_MAX_SCAN_TUPLES	20000
+#define HNSW_MIN_MAX_SCAN_TUPLES	1
+#define HNSW_MAX_MAX_SCAN_TUPLES	INT_MAX
+#define HNSW_DEFAULT_GRAPH_CACHE_SIZE	(1024 * 1024)	/* kB */
+#define HNSW_MAX_GRAPH_CACHES	64
+#define HNSW_GRAPH_CACHE_MAX_STALE	0.1	/* fraction of nodes */
+#define HNSW_MAX_SEGMENTS	32
+#define HNSW_MERGE_CHUNK_SIZE	8	/* blocks */
+#define HNSW_MAX_VACUUM_WORKERS	32
+#define HNSW_VACUUM_CHUNK_SIZE	8	/* blocks */
+#define HNSW_DEFAULT_FILTER_EXACT_LIMIT	1000
+#define HNSW_STATS_SAMPLES	20
+#define HNSW_STATS_CHANGE	0.1	/* fraction of rows */
+
+/* Graph cache modes */
+#define HNSW_GRAPH_CACHE_OFF	0
+#define HNSW_GRAPH_CACHE_UPPER	1
+#define HNSW_GRAPH_CACHE_ALL	2
+
+/* Build methods */
+#define HNSW_BUILD_INSERT	0
+#define HNSW_BUILD_MERGE	1
+
+/* Vacuum repair modes */
+#define HNSW_VACUUM_REPAIR_FULL	0
+#define HNSW_VACUUM_REPAIR_INCREMENTAL	1
+
+/* Page orders */
+#define HNSW_PAGE_ORDER_INSERT	0
+#define HNSW_PAGE_ORDER_BFS	1
+
+/* Quantizers */
+#define HNSW_QUANTIZER_NONE	0
+#define HNSW_QUANTIZER_BINARY	1
 
 /* Tuple types */
 #define HNSW_ELEMENT_TUPLE_TYPE  1
@@ -139,7 +177,19 @@
 
 /* Variables */
 extern int	hnsw_ef_search;
+extern int	hnsw_iterative_scan;
+extern int	hnsw_max_scan_tuples;
 extern int	hnsw_lock_tranche_id;
+extern int	hnsw_graph_cache_size;
+extern int	hnsw_vacuum_workers;
+extern int	hnsw_filter_exact_limit;
+
+typedef enum HnswIterativeScanMode
+{
+	HNSW_ITERATIVE_SCAN_OFF,
+	HNSW_ITERATIVE_SCAN_RELAXED,
+	HNSW_ITERATIVE_SCAN_STRICT
+}			HnswIterativeScanMode;
 
 typedef struct HnswElementData HnswElementData;
 typedef struct HnswNeighborArray HnswNeighborArray;
@@ -217,6 +267,7 @@ struct HnswElementData
 	uint8		heaptidsLength;
 	uint8		level;
 	uint8		deleted;
+	uint8		version;
 	uint32		hash;
 	HnswNeighborsPtr neighbors;
 	BlockNumber blkno;
@@ -255,8 +306,23 @@ typedef struct HnswOptions
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			m;				/* number of connections */
 	int			efConstruction; /* size of dynamic candidate list */
+	int			graphCache;		/* graph cache mode (string offset) */
+	int			buildMethod;	/* build method (string offset) */
+	int			vacuumRepair;	/* vacuum repair mode (string offset) */
+	int			quantizer;		/* quantizer (string offset) */
+	int			pageOrder;		/* page order (string offset) */
 }			HnswOptions;
 
+/* Graph written to disk by a merge build */
+typedef struct HnswSegment
+{
+	BlockNumber startBlkno;
+	BlockNumber endBlkno;		/* last block */
+	BlockNumber entryBlkno;
+	OffsetNumber entryOffno;
+	int16		entryLevel;
+}			HnswSegment;
+
 typedef struct HnswGraph
 {
 	/* Graph state */
@@ -277,6 +343,10 @@ typedef struct HnswGraph
 	/* Flushed state */
 	LWLock		flushLock;
 	bool		flushed;
+
+	/* Segment state */
+	int			segmentCount;
+	HnswSegment segments[HNSW_MAX_SEGMENTS];
 }			HnswGraph;
 
 typedef struct HnswShared
@@ -297,6 +367,23 @@ typedef struct HnswShared
 	ParallelHeapScanDescData heapdesc;
 }			HnswShared;
 
+typedef struct HnswMergeShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	ForkNumber	forkNum;
+	int			m;
+	int			efConstruction;
+	int			segmentCount;
+	HnswSegment segments[HNSW_MAX_SEGMENTS];
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	BlockNumber nextBlkno;
+}			HnswMergeShared;
+
 typedef struct HnswLeader
 {
 	int			nparticipanttuplesorts;
@@ -314,6 +401,8 @@ typedef struct HnswTypeInfo
 	int			maxDimensions;
 	Datum		(*normalize) (PG_FUNCTION_ARGS);
 	void		(*checkValue) (Pointer v);
+	void		(*distanceBatch) (FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances);
+	Datum		(*quantize) (PG_FUNCTION_ARGS);
 }			HnswTypeInfo;
 
 typedef struct HnswBuildState
@@ -329,6 +418,8 @@ typedef struct HnswBuildState
 	int			dimensions;
 	int			m;
 	int			efConstruction;
+	int			buildMethod;
+	int			pageOrder;
 
 	/* Statistics */
 	double		indtuples;
@@ -367,6 +458,11 @@ typedef struct HnswMetaPageData
 	OffsetNumber entryOffno;
 	int16		entryLevel;
 	BlockNumber insertPage;
+
+	/* Search statistics from the last vacuum or analyze, zero if none */
+	uint16		statsEfSearch;
+	float		statsRows;		/* rows indexed when measured */
+	float		statsVisited;	/* elements visited per search */
 }			HnswMetaPageData;
 
 typedef HnswMetaPageData * HnswMetaPage;
@@ -385,7 +481,7 @@ typedef struct HnswElementTupleData
 	uint8		type;
 	uint8		level;
 	uint8		deleted;
-	uint8		unused;
+	uint8		version;
 	ItemPointerData heaptids[HNSW_HEAPTIDS];
 	ItemPointerData neighbortid;
 	uint16		unused2;
@@ -397,13 +493,20 @@ typedef HnswElementTupleData * HnswElementTuple;
 typedef struct HnswNeighborTupleData
 {
 	uint8		type;
-	uint8		unused;
+	uint8		version;
 	uint16		count;
 	ItemPointerData indextids[FLEXIBLE_ARRAY_MEMBER];
 }			HnswNeighborTupleData;
 
 typedef HnswNeighborTupleData * HnswNeighborTuple;
 
+typedef union
+{
+	struct pointerhash_hash *pointers;
+	struct offsethash_hash *offsets;
+	struct tidhash_hash *tids;
+}			visited_hash;
+
 typedef struct HnswScanOpaqueData
 {
 	const		HnswTypeInfo *typeInfo;
@@ -411,6 +514,29 @@ typedef struct HnswScanOpaqueData
 	List	   *w;
 	MemoryContext tmpCtx;
 
+	/* Iterative scans */
+	Datum		q;
+	int			m;
+	visited_hash v;
+	pairingheap *discarded;
+	int64		tuples;
+	double		previousDistance;
+
+	/* Filtering */
+	struct tidhash_hash *filter;
+
+	/* Range searches */
+	bool		range;
+	double		radius;
+
+	/* Reranking */
+	bool		rerank;
+	Datum		rerankq;
+	FmgrInfo   *rerankprocinfo;
+	IndexInfo  *indexInfo;
+	EState	   *estate;
+	TupleTableSlot *slot;
+
 	/* Support functions */
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
@@ -419,6 +545,33 @@ typedef struct HnswScanOpaqueData
 
 typedef HnswScanOpaqueData * HnswScanOpaque;
 
+/*
+ * Decoded graph in compact arrays
+ *
+ * Nodes are sorted by index tid. The neighbors of each node keep the layout
+ * of its neighbor tuple, with node numbers instead of tids (and -1 for empty
+ * slots). Values are only cached for nodes in the upper layers. Nodes whose
+ * neighbors changed on disk after the build are marked stale.
+ */
+typedef struct HnswGraphCache
+{
+	Size		size;
+	int			m;
+	bool		layer0;
+	int			refcount;
+	bool		invalid;
+	int			nodeCount;
+	ItemPointerData *tids;
+	uint8	   *levels;
+	uint8	   *versions;
+	Size	   *valueOffsets;
+	int64	   *neighborOffsets;
+	int32	   *neighbors;
+	char	   *values;
+	bool	   *stale;
+	int			staleCount;
+}			HnswGraphCache;
+
 typedef struct HnswVacuumState
 {
 	/* Info */
@@ -430,9 +583,11 @@ typedef struct HnswVacuumState
 	/* Settings */
 	int			m;
 	int			efConstruction;
+	int			repair;
 
 	/* Support functions */
 	FmgrInfo   *procinfo;
+	const		HnswTypeInfo *typeInfo;
 	Oid			collation;
 
 	/* Variables */
@@ -440,11 +595,29 @@ typedef struct HnswVacuumState
 	BufferAccessStrategy bas;
 	HnswNeighborTuple ntup;
 	HnswElementData highestPoint;
+	int64		localRepairs;
+	int64		searchRepairs;
 
 	/* Memory */
 	MemoryContext tmpCtx;
 }			HnswVacuumState;
 
+typedef struct HnswVacuumShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	struct tidhash_hash *deleted;
+	BlockNumber endBlkno;		/* first block not repaired */
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	BlockNumber nextBlkno;
+	int64		localRepairs;
+	int64		searchRepairs;
+}			HnswVacuumShared;
+
 /* Methods */
 int			HnswGetM(Relation index);
 int			HnswGetEfConstruction(Relation index);
@@ -454,13 +627,16 @@ bool		HnswCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
 Buffer		HnswNewBuffer(Relation index, ForkNumber forkNum);
 void		HnswInitPage(Buffer buf, Page page);
 void		HnswInit(void);
-List	   *HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, FmgrInfo *procinfo, Oid collation, int m, bool inserting, HnswElement skipElement);
+List	   *HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, FmgrInfo *procinfo, Oid collation, const HnswTypeInfo * typeInfo, int m, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples, const HnswGraphCache * cache, struct tidhash_hash *filter);
+bool		HnswElementMatchesFilter(HnswElement element, struct tidhash_hash *filter);
 HnswElement HnswGetEntryPoint(Relation index);
 void		HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint);
+void		HnswGetSearchStats(Relation index, int *efSearch, double *rows, double *visited);
+void		HnswUpdateSearchStats(Relation index, double rows);
 void	   *HnswAlloc(HnswAllocator * allocator, Size size);
 HnswElement HnswInitElement(char *base, ItemPointer tid, int m, double ml, int maxLevel, HnswAllocator * alloc);
 HnswElement HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno);
-void		HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, FmgrInfo *procinfo, Oid collation, int m, int efConstruction, bool existing);
+void		HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, FmgrInfo *procinfo, Oid collation, const HnswTypeInfo * typeInfo, int m, int efConstruction, bool existing);
 HnswCandidate *HnswEntryCandidate(char *base, HnswElement em, Datum q, Relation rel, FmgrInfo *procinfo, Oid collation, bool loadVec);
 void		HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, ForkNumber forkNum, bool building);
 void		HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m);
@@ -474,6 +650,22 @@ void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element
 void		HnswUpdateConnection(char *base, HnswElement element, HnswCandidate * hc, int lm, int lc, int *updateIdx, Relation index, FmgrInfo *procinfo, Oid collation);
 void		HnswLoadNeighbors(HnswElement element, Relation index, int m);
 const		HnswTypeInfo *HnswGetTypeInfo(Relation index);
+int			HnswGetGraphCacheMode(Relation index);
+int			HnswGetBuildMethod(Relation index);
+int			HnswGetVacuumRepair(Relation index);
+int			HnswGetQuantizer(Relation index);
+int			HnswGetPageOrder(Relation index);
+FmgrInfo   *HnswGetDistanceProcInfo(Relation index);
+double		HnswRangeDistance(Relation index, double radius);
+List	   *HnswSelectNeighbors(char *base, List *c, int lm, int lc, FmgrInfo *procinfo, Oid collation, HnswElement element);
+void		HnswMergeSegments(Relation index, ForkNumber forkNum, HnswSegment * segments, int segmentCount, int m, int efConstruction, int nworkers);
+HnswGraphCache *HnswPinGraphCache(Relation index, int m);
+void		HnswUnpinGraphCache(HnswGraphCache * cache);
+void		HnswInvalidateGraphCache(Relation index);
+void		HnswUpdateGraphCache(Relation index, HnswElement element, bool updateEntry);
+HnswElement HnswCacheSearchUpperLayers(const HnswGraphCache * cache, HnswElement entryPoint, Datum q, const HnswTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation);
+bool		HnswCacheLoadNeighbors(const HnswGraphCache * cache, HnswElement element, int m);
+void		HnswSetScanFilter(IndexScanDesc scan, TIDBitmap *tbm);
 
 extern "C" {
     Datum hnswhandler(PG_FUNCTION_ARGS);
@@ -492,6 +684,9 @@ extern "C" {
     Datum hnsw_halfvec_support(PG_FUNCTION_ARGS);
     Datum hnsw_bit_support(PG_FUNCTION_ARGS);
     Datum hnsw_sparsevec_support(PG_FUNCTION_ARGS);
+    Datum hnsw_filtered_search(PG_FUNCTION_ARGS);
+    Datum hnsw_range_search(PG_FUNCTION_ARGS);
+    Datum hnsw_batch_search(PG_FUNCTION_ARGS);
 }
 
 /* Index access methods */
@@ -0,0 +1,492 @@
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
+#include "funcapi.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "parser/parse_coerce.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+/*
+ * Upper layer element shared by the queries of a batch
+ */
+typedef struct HnswBatchEntry
+{
+	ItemPointerData tid;		/* hash key */
+	HnswElement element;
+	Datum		value;
+	bool		neighborsLoaded;
+}			HnswBatchEntry;
+
+typedef struct HnswBatchQuery
+{
+	int32		query;
+	Datum		value;
+	HnswCandidate *entry;
+}			HnswBatchQuery;
+
+typedef struct HnswBatchResult
+{
+	int32		query;
+	int32		rank;
+	ItemPointerData tid;
+}			HnswBatchResult;
+
+typedef struct HnswBatchState
+{
+	Relation	index;
+	const		HnswTypeInfo *typeInfo;
+	FmgrInfo   *procinfo;
+	Oid			collation;
+	int			m;
+	HTAB	   *elements;
+	Datum	   *values;
+	double	   *distances;
+	HnswBatchEntry **neighbors;
+}			HnswBatchState;
+
+/*
+ * Get an upper layer element, loading it on first use
+ */
+static HnswBatchEntry *
+GetBatchEntry(HnswBatchState * bs, BlockNumber blkno, OffsetNumber offno)
+{
+	char	   *base = NULL;
+	ItemPointerData tid;
+	HnswBatchEntry *entry;
+	bool		found;
+
+	ItemPointerSet(&tid, blkno, offno);
+	entry = (HnswBatchEntry *) hash_search(bs->elements, &tid, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		entry->element = HnswInitElementFromBlock(blkno, offno);
+		HnswLoadElement(entry->element, NULL, NULL, bs->index, bs->procinfo, bs->collation, true, NULL);
+		entry->value = PointerGetDatum(HnswPtrAccess(base, entry->element->value));
+		entry->neighborsLoaded = false;
+	}
+
+	return entry;
+}
+
+/*
+ * Search the upper layers for a query with elements shared by the batch
+ *
+ * Each element is read from the index once per batch, and the distances
+ * to a neighborhood are computed at once.
+ */
+static HnswCandidate *
+SearchUpperLayers(HnswBatchState * bs, HnswElement entryPoint, Datum q)
+{
+	char	   *base = NULL;
+	HnswBatchEntry *cur = GetBatchEntry(bs, entryPoint->blkno, entryPoint->offno);
+	double		distance = DatumGetFloat8(FunctionCall2Coll(bs->procinfo, bs->collation, q, cur->value));
+	HnswCandidate *hc;
+
+	/* Greedy search is the same as Algorithm 2 with ef = 1 */
+	for (int lc = entryPoint->level; lc >= 1; lc--)
+	{
+		bool		changed = true;
+
+		while (changed)
+		{
+			HnswNeighborArray *neighborhood;
+			int			n = 0;
+
+			changed = false;
+
+			if (!cur->neighborsLoaded)
+			{
+				HnswLoadNeighbors(cur->element, bs->index, bs->m);
+				cur->neighborsLoaded = true;
+			}
+
+			/* Make robust to issues */
+			if (cur->element->level < lc)
+				break;
+
+			neighborhood = HnswGetNeighbors(base, cur->element, lc);
+			for (int i = 0; i < neighborhood->length; i++)
+			{
+				HnswElement e = (HnswElement) HnswPtrAccess(base, neighborhood->items[i].element);
+				HnswBatchEntry *ne = GetBatchEntry(bs, e->blkno, e->offno);
+
+				if (ne->element->level < lc)
+					continue;
+
+				bs->neighbors[n] = ne;
+				bs->values[n++] = ne->value;
+			}
+
+			if (bs->typeInfo->distanceBatch != NULL)
+				bs->typeInfo->distanceBatch(bs->procinfo, bs->collation, q, bs->values, n, bs->distances);
+			else
+			{
+				for (int i = 0; i < n; i++)
+					bs->distances[i] = DatumGetFloat8(FunctionCall2Coll(bs->procinfo, bs->collation, q, bs->values[i]));
+			}
+
+			for (int i = 0; i < n; i++)
+			{
+				if (bs->distances[i] < distance)
+				{
+					cur = bs->neighbors[i];
+					distance = bs->distances[i];
+					changed = true;
+				}
+			}
+		}
+	}
+
+	hc = (HnswCandidate *) palloc(sizeof(HnswCandidate));
+	HnswPtrStore(base, hc->element, cur->element);
+	hc->distance = (float) distance;
+	return hc;
+}
+
+/*
+ * Compare queries by entry element for layer 0
+ */
+static int
+CompareBatchQueries(const void *a, const void *b)
+{
+	char	   *base = NULL;
+	const		HnswBatchQuery *qa = (const HnswBatchQuery *) a;
+	const		HnswBatchQuery *qb = (const HnswBatchQuery *) b;
+	HnswElement ea = (HnswElement) HnswPtrAccess(base, qa->entry->element);
+	HnswElement eb = (HnswElement) HnswPtrAccess(base, qb->entry->element);
+
+	if (ea->blkno != eb->blkno)
+		return ea->blkno < eb->blkno ? -1 : 1;
+
+	if (ea->offno != eb->offno)
+		return ea->offno < eb->offno ? -1 : 1;
+
+	return qa->query < qb->query ? -1 : (qa->query > qb->query ? 1 : 0);
+}
+
+/*
+ * Compare results by query and rank
+ */
+static int
+CompareBatchResults(const void *a, const void *b)
+{
+	const		HnswBatchResult *ra = (const HnswBatchResult *) a;
+	const		HnswBatchResult *rb = (const HnswBatchResult *) b;
+
+	if (ra->query != rb->query)
+		return ra->query < rb->query ? -1 : 1;
+
+	return ra->rank < rb->rank ? -1 : (ra->rank > rb->rank ? 1 : 0);
+}
+
+/*
+ * Find the nearest rows for a batch of queries
+ *
+ * Queries share the setup, the scan lock, and the elements read in the
+ * upper layers. Layer 0 is searched for queries with the same entry
+ * element one after another, so their pages are likely still in cache.
+ */
+static HnswBatchResult *
+BatchSearch(Relation heap, Relation index, HnswBatchQuery * queries, int nqueries, int k, Snapshot snapshot, int *nresults)
+{
+	char	   *base = NULL;
+	HnswBatchState bs;
+	HASHCTL		hashctl;
+	HnswElement entryPoint;
+	HnswGraphCache *cache;
+	MemoryContext batchCtx;
+	MemoryContext queryCtx;
+	MemoryContext oldCtx;
+	HnswBatchResult *results;
+	int			n = 0;
+	int			maxResults = 64;
+	int			ef = Max(hnsw_ef_search, k);
+
+	results = (HnswBatchResult *) palloc(sizeof(HnswBatchResult) * maxResults);
+
+	bs.index = index;
+	bs.typeInfo = HnswGetTypeInfo(index);
+	bs.procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	bs.collation = index->rd_indcollation[0];
+
+	HnswGetMetaPageInfo(index, &bs.m, &entryPoint);
+	if (entryPoint == NULL)
+	{
+		*nresults = 0;
+		return results;
+	}
+
+	batchCtx = AllocSetContextCreate(CurrentMemoryContext,
+									 "Hnsw batch search context",
+									 ALLOCSET_DEFAULT_SIZES);
+	queryCtx = AllocSetContextCreate(CurrentMemoryContext,
+									 "Hnsw batch query context",
+									 ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(batchCtx);
+
+	MemSet(&hashctl, 0, sizeof(hashctl));
+	hashctl.keysize = sizeof(ItemPointerData);
+	hashctl.entrysize = sizeof(HnswBatchEntry);
+	hashctl.hash = tag_hash;
+	hashctl.hcxt = batchCtx;
+	bs.elements = hash_create("Hnsw batch elements", 256, &hashctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	bs.values = (Datum *) palloc(sizeof(Datum) * bs.m);
+	bs.distances = (double *) palloc(sizeof(double) * bs.m);
+	bs.neighbors = (HnswBatchEntry * *) palloc(sizeof(HnswBatchEntry *) * bs.m);
+
+	cache = HnswPinGraphCache(index, bs.m);
+
+	/*
+	 * Elements read for earlier queries must not be deleted and replaced
+	 * while the batch runs, so the scan lock is held for the whole batch
+	 */
+	LockPage(index, HNSW_SCAN_LOCK, ShareLock);
+
+	PG_TRY();
+	{
+		/* Find the entry element in layer 1 for each query */
+		for (int i = 0; i < nqueries; i++)
+		{
+			HnswElement element = NULL;
+
+			CHECK_FOR_INTERRUPTS();
+
+			if (cache != NULL)
+				element = HnswCacheSearchUpperLayers(cache, entryPoint, queries[i].value, bs.typeInfo, bs.procinfo, bs.collation);
+
+			if (element != NULL)
+				queries[i].entry = HnswEntryCandidate(base, element, queries[i].value, index, bs.procinfo, bs.collation, false);
+			else
+				queries[i].entry = SearchUpperLayers(&bs, entryPoint, queries[i].value);
+		}
+
+		qsort(queries, nqueries, sizeof(HnswBatchQuery), CompareBatchQueries);
+
+		/* Search layer 0 for each query */
+		for (int i = 0; i < nqueries; i++)
+		{
+			HnswElement entry;
+			HnswCandidate *ep;
+			List	   *w;
+			int			count = 0;
+
+			CHECK_FOR_INTERRUPTS();
+
+			MemoryContextSwitchTo(queryCtx);
+
+			/*
+			 * Neighbors loaded by the search only live as long as the query,
+			 * so each query gets its own copy of the entry element
+			 */
+			entry = (HnswElement) palloc(sizeof(HnswElementData));
+			memcpy(entry, HnswPtrAccess(base, queries[i].entry->element), sizeof(HnswElementData));
+			HnswPtrStore(base, entry->neighbors, (HnswNeighborArrayPtr *) NULL);
+
+			ep = (HnswCandidate *) palloc(sizeof(HnswCandidate));
+			HnswPtrStore(base, ep->element, entry);
+			ep->distance = queries[i].entry->distance;
+
+			w = HnswSearchLayer(base, queries[i].value, list_make1(ep), ef, 0, index, bs.procinfo, bs.collation, bs.typeInfo, bs.m, false, NULL, NULL, NULL, true, NULL, cache, NULL);
+
+			MemoryContextSwitchTo(oldCtx);
+
+			/* Results are farthest first */
+			for (int j = list_length(w) - 1; j >= 0 && count < k; j--)
+			{
+				HnswCandidate *hc = (HnswCandidate *) list_nth(w, j);
+				HnswElement element = (HnswElement) HnswPtrAccess(base, hc->element);
+
+				for (int t = 0; t < element->heaptidsLength && count < k; t++)
+				{
+					ItemPointerData tid = element->heaptids[t];
+
+					/* Follow HOT chains to the visible version */
+					if (!heap_hot_search(&tid, heap, snapshot, NULL))
+						continue;
+
+					if (n == maxResults)
+					{
+						maxResults *= 2;
+						results = (HnswBatchResult *) repalloc(results, sizeof(HnswBatchResult) * maxResults);
+					}
+
+					results[n].query = queries[i].query;
+					results[n].rank = count;
+					results[n].tid = tid;
+					n++;
+					count++;
+				}
+			}
+
+			MemoryContextReset(queryCtx);
+			MemoryContextSwitchTo(batchCtx);
+		}
+	}
+	PG_CATCH();
+	{
+		HnswUnpinGraphCache(cache);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	UnlockPage(index, HNSW_SCAN_LOCK, ShareLock);
+	HnswUnpinGraphCache(cache);
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(queryCtx);
+	MemoryContextDelete(batchCtx);
+
+	qsort(results, n, sizeof(HnswBatchResult), CompareBatchResults);
+
+	*nresults = n;
+	return results;
+}
+
+/*
+ * Find the nearest rows for each query in an array
+ *
+ * Returns the position of the query in the array and the heap tid of each
+ * result, with results for a query in order of distance. This replaces a
+ * scan for each row of a join when many queries are searched at once.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_batch_search);
+Datum
+hnsw_batch_search(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	HnswBatchResult *results;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid			relid = PG_GETARG_OID(0);
+		ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(1);
+		int			k = PG_GETARG_INT32(2);
+		Oid			queryType = ARR_ELEMTYPE(arr);
+		Snapshot	snapshot = GetActiveSnapshot();
+		MemoryContext oldCtx;
+		TupleDesc	tupdesc;
+		Relation	index;
+		Relation	heap;
+		FmgrInfo   *normprocinfo;
+		Oid			collation;
+		const		HnswTypeInfo *typeInfo;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+		HnswBatchQuery *queries;
+		int			nqueries = 0;
+		int			nresults;
+		AclResult	aclresult;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		if (k < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("k must be greater than or equal to zero")));
+
+		index = index_open(relid, AccessShareLock);
+		if (index->rd_rel->relam != get_am_oid("hnsw", false))
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+		if (!IsBinaryCoercible(queryType, index->rd_opcintype[0]))
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("query type %s does not match index type %s",
+							format_type_be(queryType), format_type_be(index->rd_opcintype[0]))));
+
+		typeInfo = HnswGetTypeInfo(index);
+		if (typeInfo->quantize != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("batch search is not supported for quantized hnsw indexes")));
+
+		heap = heap_open(index->rd_index->indrelid, AccessShareLock);
+
+		aclresult = pg_class_aclcheck(RelationGetRelid(heap), GetUserId(), ACL_SELECT);
+		if (aclresult != ACLCHECK_OK)
+			aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(heap));
+
+		normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
+		collation = index->rd_indcollation[0];
+
+		get_typlenbyvalalign(queryType, &typlen, &typbyval, &typalign);
+		deconstruct_array(arr, queryType, typlen, typbyval, typalign, &elems, &nulls, &nelems);
+
+		queries = (HnswBatchQuery *) palloc(sizeof(HnswBatchQuery) * Max(nelems, 1));
+		for (int i = 0; i < nelems; i++)
+		{
+			Datum		value;
+
+			if (nulls[i])
+				continue;
+
+			value = PointerGetDatum(PG_DETOAST_DATUM(elems[i]));
+
+			/* Zero vectors are not indexed for cosine distance */
+			if (normprocinfo != NULL)
+			{
+				if (!HnswCheckNorm(normprocinfo, collation, value))
+					continue;
+
+				value = HnswNormValue(typeInfo, collation, value);
+			}
+
+			queries[nqueries].query = i + 1;
+			queries[nqueries].value = value;
+			queries[nqueries].entry = NULL;
+			nqueries++;
+		}
+
+		if (k > 0 && nqueries > 0)
+			funcctx->user_fctx = BatchSearch(heap, index, queries, nqueries, k, snapshot, &nresults);
+		else
+			nresults = 0;
+
+		funcctx->max_calls = nresults;
+
+		heap_close(heap, AccessShareLock);
+		index_close(index, AccessShareLock);
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	results = (HnswBatchResult *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		HnswBatchResult *result = &results[funcctx->call_cntr];
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+
+		values[0] = Int32GetDatum(result->query);
+		values[1] = PointerGetDatum(&result->tid);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -31,6 +31,15 @@
  * WAL-log the individual inserts. If the graph fit completely in memory and
  * was fully built in the in-memory phase, the on-disk phase is skipped.
  *
+ * With build_method = merge, the on-disk phase is replaced. When the graph
+ * runs out of memory, it is written to disk as a segment (see SpillSegment())
+ * and a new graph is started in the same memory. Each segment is a complete
+ * graph over part of the rows, with its own entry point. After the last
+ * segment is written, the segments are connected by searching the other
+ * segments for each element and rewriting its neighbor tuple (see
+ * HnswMergeSegments()). If there are more than HNSW_MAX_SEGMENTS segments,
+ * they are merged and the remaining rows are inserted on disk.
+ *
  * After we have finished building the graph, we perform one more scan through
  * the index and write all the pages to the WAL.
  */
@@ -153,8 +162,10 @@ CreateGraphPages(HnswBuildState * buildstate)
 	HnswElement entryPoint;
 	Buffer		buf;
 	Page		page;
-	HnswElementPtr iter = buildstate->graph->head;
+	HnswGraph  *graph = buildstate->graph;
+	HnswElementPtr iter = graph->head;
 	char	   *base = buildstate->hnswarea;
+	BlockNumber startBlkno;
 
 	/* Calculate sizes */
 	maxSize = HNSW_MAX_SIZE;
@@ -167,6 +178,18 @@ CreateGraphPages(HnswBuildState * buildstate)
 	buf = HnswNewBuffer(index, forkNum);
 	page = BufferGetPage(buf);
 	HnswInitPage(buf, page);
+	startBlkno = BufferGetBlockNumber(buf);
+
+	/* Link to the previous segment */
+	if (graph->segmentCount > 0)
+	{
+		Buffer		pbuf = ReadBufferExtended(index, forkNum, graph->segments[graph->segmentCount - 1].endBlkno, RBM_NORMAL, NULL);
+
+		LockBuffer(pbuf, BUFFER_LOCK_EXCLUSIVE);
+		HnswPageGetOpaque(BufferGetPage(pbuf))->nextblkno = startBlkno;
+		MarkBufferDirty(pbuf);
+		UnlockReleaseBuffer(pbuf);
+	}
 
 	while (!HnswPtrIsNull(base, iter))
 	{
@@ -232,8 +255,20 @@ CreateGraphPages(HnswBuildState * buildstate)
 	MarkBufferDirty(buf);
 	UnlockReleaseBuffer(buf);
 
-	entryPoint = (HnswElement)HnswPtrAccess(base, buildstate->graph->entryPoint);
-	HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, entryPoint, insertPage, forkNum, true);
+	entryPoint = (HnswElement)HnswPtrAccess(base, graph->entryPoint);
+	HnswUpdateMetaPage(index, graph->segmentCount == 0 ? HNSW_UPDATE_ENTRY_ALWAYS : HNSW_UPDATE_ENTRY_GREATER, entryPoint, insertPage, forkNum, true);
+
+	/* Record segment */
+	if (entryPoint != NULL)
+	{
+		HnswSegment *segment = &graph->segments[graph->segmentCount++];
+
+		segment->startBlkno = startBlkno;
+		segment->endBlkno = insertPage;
+		segment->entryBlkno = entryPoint->blkno;
+		segment->entryOffno = entryPoint->offno;
+		segment->entryLevel = entryPoint->level;
+	}
 
 	pfree(etup);
 	pfree(ntup);
@@ -290,23 +325,143 @@ WriteNeighborTuples(HnswBuildState * buildstate)
 }
 
 /*
- * Flush pages
+ * Relink the element list in breadth-first order from the entry point
+ *
+ * Pages are written in list order, so this places an element next to most
+ * of its neighbors. Layer 0 neighbors are visited before upper layer ones
+ * since most of a search happens there. Elements that cannot be reached are
+ * kept at the end in their previous order.
  */
 static void
-FlushPages(HnswBuildState * buildstate)
+ReorderGraph(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+	HnswElement entryPoint = (HnswElement) HnswPtrAccess(base, graph->entryPoint);
+	HnswElementPtr iter = graph->head;
+	HnswElement *queue;
+	struct pointerhash_hash *visited;
+	int			count = 0;
+	int			head = 0;
+	int			tail = 0;
+	bool		found;
+
+	if (entryPoint == NULL)
+		return;
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		count++;
+		iter = ((HnswElement) HnswPtrAccess(base, iter))->next;
+	}
+
+	queue = (HnswElement *) palloc_extended(sizeof(HnswElement) * count, MCXT_ALLOC_HUGE);
+	visited = pointerhash_create(CurrentMemoryContext, count, NULL);
+
+	pointerhash_insert(visited, (uintptr_t) entryPoint, &found);
+	queue[tail++] = entryPoint;
+
+	while (head < tail)
+	{
+		HnswElement element = queue[head++];
+
+		for (int lc = 0; lc <= element->level; lc++)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+			for (int i = 0; i < neighbors->length; i++)
+			{
+				HnswElement e = (HnswElement) HnswPtrAccess(base, neighbors->items[i].element);
+
+				pointerhash_insert(visited, (uintptr_t) e, &found);
+				if (!found)
+					queue[tail++] = e;
+			}
+		}
+	}
+
+	/* Add unreachable elements */
+	iter = graph->head;
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = (HnswElement) HnswPtrAccess(base, iter);
+
+		iter = element->next;
+
+		pointerhash_insert(visited, (uintptr_t) element, &found);
+		if (!found)
+			queue[tail++] = element;
+	}
+
+	Assert(tail == count);
+
+	/* Relink */
+	HnswPtrStore(base, graph->head, queue[0]);
+	for (int i = 0; i < count; i++)
+		HnswPtrStore(base, queue[i]->next, i + 1 < count ? queue[i + 1] : (HnswElement) NULL);
+
+	pointerhash_destroy(visited);
+	pfree(queue);
+}
+
+/*
+ * Write the graph to disk
+ */
+static void
+WriteGraph(HnswBuildState * buildstate)
 {
 #ifdef HNSW_MEMORY
 	elog(INFO, "memory: %zu MB", buildstate->graph->memoryUsed / (1024 * 1024));
 #endif
 
-	CreateMetaPage(buildstate);
+	if (buildstate->graph->segmentCount == 0)
+		CreateMetaPage(buildstate);
+
+	if (buildstate->pageOrder == HNSW_PAGE_ORDER_BFS)
+		ReorderGraph(buildstate);
+
 	CreateGraphPages(buildstate);
 	WriteNeighborTuples(buildstate);
+}
+
+/*
+ * Flush pages
+ */
+static void
+FlushPages(HnswBuildState * buildstate)
+{
+	WriteGraph(buildstate);
 
 	buildstate->graph->flushed = true;
 	MemoryContextReset(buildstate->graphCtx);
 }
 
+/*
+ * Write the graph as a segment and start a new graph in the same memory
+ */
+static void
+SpillSegment(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+
+	WriteGraph(buildstate);
+
+	ereport(DEBUG1,
+			(errmsg("hnsw graph segment %d written after " INT64_FORMAT " tuples", graph->segmentCount, (int64) graph->indtuples)));
+
+	HnswPtrStore(base, graph->head, (HnswElement) NULL);
+	HnswPtrStore(base, graph->entryPoint, (HnswElement) NULL);
+	graph->memoryUsed = 0;
+
+	if (base == NULL)
+		MemoryContextReset(buildstate->graphCtx);
+#if PG_VERSION_NUM < 140005
+	else
+		graph->memoryUsed += MAXALIGN(1);
+#endif
+}
+
 /*
  * Add a heap TID to an existing element
  */
@@ -458,7 +613,7 @@ InsertTupleInMemory(HnswBuildState * buildstate, HnswElement element)
 	}
 
 	/* Find neighbors for element */
-	HnswFindElementNeighbors(base, element, entryPoint, NULL, procinfo, collation, m, efConstruction, false);
+	HnswFindElementNeighbors(base, element, entryPoint, NULL, procinfo, collation, buildstate->typeInfo, m, efConstruction, false);
 
 	/* Update graph in memory */
 	UpdateGraphInMemory(procinfo, collation, element, m, efConstruction, entryPoint, buildstate);
@@ -498,50 +653,68 @@ InsertTuple(Relation index, Datum *values, const bool *isnull, ItemPointer heapt
 		value = HnswNormValue(typeInfo, buildstate->collation, value);
 	}
 
+	/* Quantize if needed */
+	if (typeInfo->quantize != NULL)
+		value = DirectFunctionCall1(typeInfo->quantize, value);
+
 	/* Get datum size */
 	valueSize = VARSIZE_ANY(DatumGetPointer(value));
 
-	/* Ensure graph not flushed when inserting */
-	LWLockAcquire(flushLock, LW_SHARED);
-
-	/* Are we in the on-disk phase? */
-	if (graph->flushed)
+	for (;;)
 	{
-		LWLockRelease(flushLock);
+		/* Ensure graph not flushed when inserting */
+		LWLockAcquire(flushLock, LW_SHARED);
 
-		return HnswInsertTupleOnDisk(index, value, values, isnull, heaptid, true);
-	}
+		/* Are we in the on-disk phase? */
+		if (graph->flushed)
+		{
+			LWLockRelease(flushLock);
 
-	/*
-	 * In a parallel build, the HnswElement is allocated from the shared
-	 * memory area, so we need to coordinate with other processes.
-	 */
-	LWLockAcquire(&graph->allocatorLock, LW_EXCLUSIVE);
+			return HnswInsertTupleOnDisk(index, value, values, isnull, heaptid, true);
+		}
+
+		/*
+		 * In a parallel build, the HnswElement is allocated from the shared
+		 * memory area, so we need to coordinate with other processes.
+		 */
+		LWLockAcquire(&graph->allocatorLock, LW_EXCLUSIVE);
+
+		/*
+		 * Check that we have enough memory available for the new element now
+		 * that we have the allocator lock.
+		 */
+		if (graph->memoryUsed < graph->memoryTotal)
+			break;
 
-	/*
-	 * Check that we have enough memory available for the new element now that
-	 * we have the allocator lock, and flush pages if needed.
-	 */
-	if (graph->memoryUsed >= graph->memoryTotal)
-	{
 		LWLockRelease(&graph->allocatorLock);
 
 		LWLockRelease(flushLock);
 		LWLockAcquire(flushLock, LW_EXCLUSIVE);
 
-		if (!graph->flushed)
+		/* Another process may have already flushed or spilled the graph */
+		if (!graph->flushed && graph->memoryUsed >= graph->memoryTotal)
 		{
-			ereport(NOTICE,
-					(errmsg("hnsw graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64) graph->indtuples),
-					 errdetail("Building will take significantly more time."),
-					 errhint("Increase maintenance_work_mem to speed up builds.")));
-
-			FlushPages(buildstate);
+			if (buildstate->buildMethod == HNSW_BUILD_MERGE && graph->segmentCount < HNSW_MAX_SEGMENTS - 1)
+				SpillSegment(buildstate);
+			else
+			{
+				ereport(NOTICE,
+						(errmsg("hnsw graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64) graph->indtuples),
+						 errdetail("Building will take significantly more time."),
+						 errhint("Increase maintenance_work_mem to speed up builds.")));
+
+				FlushPages(buildstate);
+
+				/* Connect segments before inserting on disk */
+				if (graph->segmentCount > 1)
+				{
+					HnswMergeSegments(index, buildstate->forkNum, graph->segments, graph->segmentCount, buildstate->m, buildstate->efConstruction, 0);
+					graph->segmentCount = 1;
+				}
+			}
 		}
 
 		LWLockRelease(flushLock);
-
-		return HnswInsertTupleOnDisk(index, value, values, isnull, heaptid, true);
 	}
 
 	/* Ok, we can proceed to allocate the element */
@@ -618,6 +791,7 @@ InitGraph(HnswGraph * graph, char *base, long memoryTotal)
 	graph->memoryUsed = 0;
 	graph->memoryTotal = memoryTotal;
 	graph->flushed = false;
+	graph->segmentCount = 0;
 	graph->indtuples = 0;
 	SpinLockInit(&graph->lock);
 	LWLockInitialize(&graph->entryLock, hnsw_lock_tranche_id);
@@ -681,6 +855,8 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 
 	buildstate->m = HnswGetM(index);
 	buildstate->efConstruction = HnswGetEfConstruction(index);
+	buildstate->buildMethod = HnswGetBuildMethod(index);
+	buildstate->pageOrder = HnswGetPageOrder(index);
 	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
 
 	/* Disallow varbit since require fixed dimensions */
@@ -701,7 +877,7 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 	buildstate->indtuples = 0;
 
 	/* Get support functions */
-	buildstate->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	buildstate->procinfo = HnswGetDistanceProcInfo(index);
 	buildstate->normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
 	buildstate->collation = index->rd_indcollation[0];
 
@@ -899,6 +1075,8 @@ static void
 BuildGraph(HnswBuildState * buildstate, ForkNumber forkNum)
 {
 	int parallel_workers = 0;
+	HnswSegment segments[HNSW_MAX_SEGMENTS];
+	int			segmentCount;
 
 	 /* Calculate parallel workers */
 	if (buildstate->heap != NULL)
@@ -931,9 +1109,17 @@ serial_build:
 	if (!buildstate->graph->flushed)
 		FlushPages(buildstate);
 
+	/* Copy segments since shared state is freed at end of parallel build */
+	segmentCount = buildstate->graph->segmentCount;
+	memcpy(segments, buildstate->graph->segments, sizeof(HnswSegment) * segmentCount);
+
 	/* End parallel build */
 	if (buildstate->hnswleader)
 		HnswEndParallel();
+
+	/* Connect segments */
+	if (segmentCount > 1)
+		HnswMergeSegments(buildstate->index, forkNum, segments, segmentCount, buildstate->m, buildstate->efConstruction, parallel_workers);
 }
 
 /*
@@ -0,0 +1,883 @@
+#include "postgres.h"
+
+#include <pthread.h>
+
+#include "access/xlog.h"
+#include "catalog/pg_class.h"
+#include "hnsw.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+
+/*
+ * Cached graph for an index
+ *
+ * Caches live in instance memory so every session can use them, and are
+ * keyed by relfilenode so rewrites of the index get a new cache. Caches of
+ * indexes that were dropped or rewritten are freed before building others.
+ */
+typedef struct HnswGraphCacheSlot
+{
+	bool		used;
+	bool		building;
+	bool		failed;
+	RelFileNode node;
+	Oid			relid;
+	uint64		changeCount;	/* incremented each time graph changes */
+	uint64		failedChangeCount;
+	uint64		lastUsed;
+	HnswGraphCache *cache;
+}			HnswGraphCacheSlot;
+
+int			hnsw_graph_cache_size;
+
+static HnswGraphCacheSlot graphCacheSlots[HNSW_MAX_GRAPH_CACHES];
+static Size graphCacheUsed = 0;
+static uint64 graphCacheClock = 0;
+static pthread_mutex_t graphCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Get the neighbor slots of a node at a layer
+ *
+ * Slots keep the layout of the neighbor tuple, so layer lc starts at
+ * (level - lc) * m and layer 0 has 2 * m slots
+ */
+static inline int32 *
+GetCacheNeighbors(const HnswGraphCache * cache, int node, int lc)
+{
+	return &cache->neighbors[cache->neighborOffsets[node] + (cache->levels[node] - lc) * cache->m];
+}
+
+/*
+ * Get the cached value of a node
+ */
+static inline Datum
+GetCacheValue(const HnswGraphCache * cache, int node)
+{
+	return PointerGetDatum(cache->values + cache->valueOffsets[node]);
+}
+
+/*
+ * Find a node by index tid
+ */
+static int
+FindCacheNode(const ItemPointerData *tids, int nodeCount, BlockNumber blkno, OffsetNumber offno)
+{
+	ItemPointerData tid;
+	int			lo = 0;
+	int			hi = nodeCount - 1;
+
+	ItemPointerSet(&tid, blkno, offno);
+
+	while (lo <= hi)
+	{
+		int			mid = lo + (hi - lo) / 2;
+		int			cmp = ItemPointerCompare((ItemPointer) &tids[mid], &tid);
+
+		if (cmp == 0)
+			return mid;
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+/*
+ * Free a cache (lock must be held)
+ */
+static void
+FreeGraphCache(HnswGraphCache * cache)
+{
+	graphCacheUsed -= cache->size;
+	pfree(cache);
+}
+
+/*
+ * Drop the cache of a slot (lock must be held)
+ */
+static void
+DropGraphCache(HnswGraphCacheSlot * slot)
+{
+	if (slot->cache == NULL)
+		return;
+
+	/* Pinned caches are freed when unpinned */
+	slot->cache->invalid = true;
+	if (slot->cache->refcount == 0)
+		FreeGraphCache(slot->cache);
+
+	slot->cache = NULL;
+}
+
+/*
+ * Evict the least recently used cache that is not in use (lock must be held)
+ */
+static bool
+EvictGraphCache(void)
+{
+	HnswGraphCacheSlot *victim = NULL;
+
+	for (int i = 0; i < HNSW_MAX_GRAPH_CACHES; i++)
+	{
+		HnswGraphCacheSlot *slot = &graphCacheSlots[i];
+
+		if (!slot->used || slot->building)
+			continue;
+
+		if (slot->cache != NULL && slot->cache->refcount > 0)
+			continue;
+
+		if (victim == NULL || slot->lastUsed < victim->lastUsed)
+			victim = slot;
+	}
+
+	if (victim == NULL)
+		return false;
+
+	DropGraphCache(victim);
+	victim->used = false;
+	return true;
+}
+
+/*
+ * Drop all caches (lock must be held)
+ */
+static void
+DropAllGraphCaches(void)
+{
+	for (int i = 0; i < HNSW_MAX_GRAPH_CACHES; i++)
+	{
+		HnswGraphCacheSlot *slot = &graphCacheSlots[i];
+
+		if (!slot->used)
+			continue;
+
+		/* Discard builds in progress */
+		slot->changeCount++;
+		DropGraphCache(slot);
+	}
+}
+
+/*
+ * Find the slot for an index (lock must be held)
+ */
+static HnswGraphCacheSlot *
+FindGraphCacheSlot(RelFileNode node)
+{
+	for (int i = 0; i < HNSW_MAX_GRAPH_CACHES; i++)
+	{
+		HnswGraphCacheSlot *slot = &graphCacheSlots[i];
+
+		if (slot->used && RelFileNodeEquals(slot->node, node))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a slot for an index (lock must be held)
+ */
+static HnswGraphCacheSlot *
+AddGraphCacheSlot(RelFileNode node, Oid relid)
+{
+	for (;;)
+	{
+		for (int i = 0; i < HNSW_MAX_GRAPH_CACHES; i++)
+		{
+			HnswGraphCacheSlot *slot = &graphCacheSlots[i];
+
+			if (slot->used)
+				continue;
+
+			MemSet(slot, 0, sizeof(HnswGraphCacheSlot));
+			slot->used = true;
+			slot->node = node;
+			slot->relid = relid;
+			return slot;
+		}
+
+		if (!EvictGraphCache())
+			return NULL;
+	}
+}
+
+/*
+ * Free the caches of dropped or rewritten indexes in the database of an index
+ *
+ * Catalog lookups cannot happen with the lock held, so candidates are
+ * collected first. Caches of other databases are left to eviction.
+ */
+static void
+DropStaleGraphCaches(Relation index)
+{
+	RelFileNode nodes[HNSW_MAX_GRAPH_CACHES];
+	Oid			relids[HNSW_MAX_GRAPH_CACHES];
+	bool		stale[HNSW_MAX_GRAPH_CACHES];
+	int			n = 0;
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	for (int i = 0; i < HNSW_MAX_GRAPH_CACHES; i++)
+	{
+		HnswGraphCacheSlot *slot = &graphCacheSlots[i];
+
+		if (!slot->used || slot->building || slot->node.dbNode != index->rd_node.dbNode)
+			continue;
+
+		nodes[n] = slot->node;
+		relids[n] = slot->relid;
+		n++;
+	}
+
+	pthread_mutex_unlock(&graphCacheLock);
+
+	for (int i = 0; i < n; i++)
+	{
+		HeapTuple	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relids[i]));
+
+		stale[i] = true;
+		if (HeapTupleIsValid(tuple))
+		{
+			stale[i] = ((Form_pg_class) GETSTRUCT(tuple))->relfilenode != nodes[i].relNode;
+			ReleaseSysCache(tuple);
+		}
+	}
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswGraphCacheSlot *slot;
+
+		if (!stale[i])
+			continue;
+
+		slot = FindGraphCacheSlot(nodes[i]);
+		if (slot == NULL || slot->building)
+			continue;
+
+		/* Pinned caches are freed when unpinned */
+		DropGraphCache(slot);
+		slot->used = false;
+	}
+
+	pthread_mutex_unlock(&graphCacheLock);
+}
+
+/*
+ * Reserve memory for a cache
+ */
+static bool
+ReserveGraphCache(Size size)
+{
+	Size		maxSize = (Size) hnsw_graph_cache_size * 1024;
+	bool		reserved = false;
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	/* Make room by evicting caches that are not in use */
+	while (graphCacheUsed + size > maxSize)
+	{
+		if (!EvictGraphCache())
+			break;
+	}
+
+	if (graphCacheUsed + size <= maxSize)
+	{
+		graphCacheUsed += size;
+		reserved = true;
+	}
+
+	pthread_mutex_unlock(&graphCacheLock);
+
+	return reserved;
+}
+
+/*
+ * Release memory reserved for a cache
+ */
+static void
+ReleaseGraphCache(Size size)
+{
+	pthread_mutex_lock(&graphCacheLock);
+	graphCacheUsed -= size;
+	pthread_mutex_unlock(&graphCacheLock);
+}
+
+/*
+ * Decode the graph from the index
+ *
+ * Nodes are collected in physical order, so they are sorted by tid. Values
+ * are only kept for elements in the upper layers.
+ */
+static HnswGraphCache *
+BuildGraphCache(Relation index, int m, bool layer0)
+{
+	MemoryContext tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												 "Hnsw graph cache build context",
+												 ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	int			maxNodes = 1024;
+	int			nodeCount = 0;
+	Size		maxValuesSize = BLCKSZ;
+	Size		valuesSize = 0;
+	int64		neighborCount = 0;
+	ItemPointerData *tids = (ItemPointerData *) palloc(sizeof(ItemPointerData) * maxNodes);
+	ItemPointerData *neighbortids = (ItemPointerData *) palloc(sizeof(ItemPointerData) * maxNodes);
+	uint8	   *levels = (uint8 *) palloc(maxNodes);
+	uint8	   *versions = (uint8 *) palloc(maxNodes);
+	Size	   *valueOffsets = (Size *) palloc(sizeof(Size) * maxNodes);
+	char	   *values = (char *) palloc(maxValuesSize);
+	int64	   *neighborOffsets;
+	int32	   *neighbors;
+	Buffer		buf = InvalidBuffer;
+	HnswGraphCache *cache;
+	Size		size;
+	char	   *ptr;
+
+	/* Collect elements */
+	while (BlockNumberIsValid(blkno))
+	{
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			if (!HnswIsElementTuple(etup) || etup->deleted)
+				continue;
+
+			/* Only upper layers are needed without layer 0 */
+			if (!layer0 && etup->level == 0)
+				continue;
+
+			if (nodeCount == maxNodes)
+			{
+				maxNodes *= 2;
+				tids = (ItemPointerData *) repalloc_huge(tids, sizeof(ItemPointerData) * maxNodes);
+				neighbortids = (ItemPointerData *) repalloc_huge(neighbortids, sizeof(ItemPointerData) * maxNodes);
+				levels = (uint8 *) repalloc_huge(levels, maxNodes);
+				versions = (uint8 *) repalloc_huge(versions, maxNodes);
+				valueOffsets = (Size *) repalloc_huge(valueOffsets, sizeof(Size) * maxNodes);
+			}
+
+			ItemPointerSet(&tids[nodeCount], blkno, offno);
+			neighbortids[nodeCount] = etup->neighbortid;
+			levels[nodeCount] = etup->level;
+			versions[nodeCount] = etup->version;
+			valueOffsets[nodeCount] = 0;
+
+			if (etup->level > 0)
+			{
+				Size		valueSize = VARSIZE_ANY(&etup->data);
+
+				while (valuesSize + MAXALIGN(valueSize) > maxValuesSize)
+				{
+					maxValuesSize *= 2;
+					values = (char *) repalloc_huge(values, maxValuesSize);
+				}
+
+				memcpy(values + valuesSize, &etup->data, valueSize);
+				valueOffsets[nodeCount] = valuesSize;
+				valuesSize += MAXALIGN(valueSize);
+			}
+
+			neighborCount += layer0 ? (etup->level + 2) * m : etup->level * m;
+			nodeCount++;
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Decode neighbors */
+	neighborOffsets = (int64 *) palloc_huge(CurrentMemoryContext, sizeof(int64) * (nodeCount + 1));
+	neighbors = (int32 *) palloc_huge(CurrentMemoryContext, sizeof(int32) * Max(neighborCount, 1));
+	buf = InvalidBuffer;
+	neighborCount = 0;
+
+	for (int i = 0; i < nodeCount; i++)
+	{
+		BlockNumber neighborPage = ItemPointerGetBlockNumber(&neighbortids[i]);
+		int			slots = layer0 ? (levels[i] + 2) * m : levels[i] * m;
+		HnswNeighborTuple ntup;
+		bool		valid;
+
+		/* Neighbor tuples are usually on the same page as the previous node */
+		if (!BufferIsValid(buf) || BufferGetBlockNumber(buf) != neighborPage)
+		{
+			if (BufferIsValid(buf))
+				UnlockReleaseBuffer(buf);
+
+			CHECK_FOR_INTERRUPTS();
+
+			buf = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, bas);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+		}
+
+		ntup = (HnswNeighborTuple) PageGetItem(BufferGetPage(buf), PageGetItemId(BufferGetPage(buf), ItemPointerGetOffsetNumber(&neighbortids[i])));
+
+		/* Same checks as loading neighbors */
+		valid = HnswIsNeighborTuple(ntup) && ntup->count == (levels[i] + 2) * m && ntup->version == versions[i];
+
+		neighborOffsets[i] = neighborCount;
+		for (int j = 0; j < slots; j++)
+		{
+			ItemPointer indextid = &ntup->indextids[j];
+			int			node = -1;
+
+			if (valid && ItemPointerIsValid(indextid))
+				node = FindCacheNode(tids, nodeCount, ItemPointerGetBlockNumber(indextid), ItemPointerGetOffsetNumber(indextid));
+
+			neighbors[neighborCount++] = node;
+		}
+	}
+	neighborOffsets[nodeCount] = neighborCount;
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+
+	FreeAccessStrategy(bas);
+
+	/* Copy to a single chunk */
+	size = MAXALIGN(sizeof(HnswGraphCache));
+	size += MAXALIGN(sizeof(ItemPointerData) * nodeCount);
+	size += MAXALIGN(nodeCount) * 2;
+	size += MAXALIGN(sizeof(Size) * nodeCount);
+	size += MAXALIGN(sizeof(int64) * (nodeCount + 1));
+	size += MAXALIGN(sizeof(int32) * neighborCount);
+	size += MAXALIGN(valuesSize);
+	size += MAXALIGN(sizeof(bool) * nodeCount);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	cache = NULL;
+	if (ReserveGraphCache(size))
+	{
+		ptr = (char *) MemoryContextAllocExtended(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), size, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+
+		if (ptr == NULL)
+			ReleaseGraphCache(size);
+		else
+		{
+			cache = (HnswGraphCache *) ptr;
+			ptr += MAXALIGN(sizeof(HnswGraphCache));
+
+			cache->size = size;
+			cache->m = m;
+			cache->layer0 = layer0;
+			cache->refcount = 0;
+			cache->invalid = false;
+			cache->nodeCount = nodeCount;
+
+			cache->tids = (ItemPointerData *) ptr;
+			memcpy(ptr, tids, sizeof(ItemPointerData) * nodeCount);
+			ptr += MAXALIGN(sizeof(ItemPointerData) * nodeCount);
+
+			cache->levels = (uint8 *) ptr;
+			memcpy(ptr, levels, nodeCount);
+			ptr += MAXALIGN(nodeCount);
+
+			cache->versions = (uint8 *) ptr;
+			memcpy(ptr, versions, nodeCount);
+			ptr += MAXALIGN(nodeCount);
+
+			cache->valueOffsets = (Size *) ptr;
+			memcpy(ptr, valueOffsets, sizeof(Size) * nodeCount);
+			ptr += MAXALIGN(sizeof(Size) * nodeCount);
+
+			cache->neighborOffsets = (int64 *) ptr;
+			memcpy(ptr, neighborOffsets, sizeof(int64) * (nodeCount + 1));
+			ptr += MAXALIGN(sizeof(int64) * (nodeCount + 1));
+
+			cache->neighbors = (int32 *) ptr;
+			memcpy(ptr, neighbors, sizeof(int32) * neighborCount);
+			ptr += MAXALIGN(sizeof(int32) * neighborCount);
+
+			cache->values = ptr;
+			memcpy(ptr, values, valuesSize);
+			ptr += MAXALIGN(valuesSize);
+
+			cache->stale = (bool *) ptr;
+			MemSet(ptr, 0, sizeof(bool) * nodeCount);
+			cache->staleCount = 0;
+		}
+	}
+
+	MemoryContextDelete(tmpCtx);
+
+	return cache;
+}
+
+/*
+ * Get the cache for an index, building it if needed
+ *
+ * Returns NULL if caching is disabled for the index or the cache is not
+ * available. The cache must be unpinned after use.
+ */
+HnswGraphCache *
+HnswPinGraphCache(Relation index, int m)
+{
+	int			mode = HnswGetGraphCacheMode(index);
+	HnswGraphCacheSlot *slot;
+	HnswGraphCache *cache;
+	uint64		changeCount;
+
+	if (mode == HNSW_GRAPH_CACHE_OFF || hnsw_graph_cache_size == 0)
+		return NULL;
+
+	/*
+	 * Redo does not maintain caches, so do not use them during recovery, and
+	 * drop any built before the server became a standby
+	 */
+	if (RecoveryInProgress())
+	{
+		pthread_mutex_lock(&graphCacheLock);
+		DropAllGraphCaches();
+		pthread_mutex_unlock(&graphCacheLock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	slot = FindGraphCacheSlot(index->rd_node);
+	if (slot != NULL && slot->cache != NULL && slot->cache->layer0 == (mode == HNSW_GRAPH_CACHE_ALL))
+	{
+		cache = slot->cache;
+		cache->refcount++;
+		slot->lastUsed = ++graphCacheClock;
+		pthread_mutex_unlock(&graphCacheLock);
+		return cache;
+	}
+
+	/* Another session is building or the graph did not fit */
+	if (slot != NULL && (slot->building || (slot->failed && slot->failedChangeCount == slot->changeCount)))
+	{
+		pthread_mutex_unlock(&graphCacheLock);
+		return NULL;
+	}
+
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock(&graphCacheLock);
+
+		/* Make room from indexes that no longer use their caches */
+		DropStaleGraphCaches(index);
+
+		pthread_mutex_lock(&graphCacheLock);
+
+		/* Recheck after reacquiring lock */
+		slot = FindGraphCacheSlot(index->rd_node);
+		if (slot != NULL)
+		{
+			pthread_mutex_unlock(&graphCacheLock);
+			return NULL;
+		}
+
+		slot = AddGraphCacheSlot(index->rd_node, RelationGetRelid(index));
+	}
+	else
+		DropGraphCache(slot);
+
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock(&graphCacheLock);
+		return NULL;
+	}
+
+	slot->building = true;
+	slot->lastUsed = ++graphCacheClock;
+	changeCount = slot->changeCount;
+
+	pthread_mutex_unlock(&graphCacheLock);
+
+	PG_TRY();
+	{
+		cache = BuildGraphCache(index, m, mode == HNSW_GRAPH_CACHE_ALL);
+	}
+	PG_CATCH();
+	{
+		pthread_mutex_lock(&graphCacheLock);
+		slot->building = false;
+		pthread_mutex_unlock(&graphCacheLock);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	slot->building = false;
+
+	if (cache == NULL)
+	{
+		slot->failed = true;
+		slot->failedChangeCount = changeCount;
+		ereport(DEBUG1, (errmsg("hnsw graph cache does not fit in hnsw.graph_cache_size")));
+	}
+	else if (slot->changeCount != changeCount)
+	{
+		/* Graph changed during build */
+		FreeGraphCache(cache);
+		cache = NULL;
+	}
+	else
+	{
+		slot->failed = false;
+		slot->cache = cache;
+		cache->refcount++;
+	}
+
+	pthread_mutex_unlock(&graphCacheLock);
+
+	return cache;
+}
+
+/*
+ * Release a cache after use
+ */
+void
+HnswUnpinGraphCache(HnswGraphCache * cache)
+{
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	cache->refcount--;
+	if (cache->refcount == 0 && cache->invalid)
+		FreeGraphCache(cache);
+
+	pthread_mutex_unlock(&graphCacheLock);
+}
+
+/*
+ * Invalidate the cache for an index
+ *
+ * Called with HNSW_UPDATE_LOCK held after the graph changes on disk
+ */
+void
+HnswInvalidateGraphCache(Relation index)
+{
+	HnswGraphCacheSlot *slot;
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	slot = FindGraphCacheSlot(index->rd_node);
+	if (slot != NULL)
+	{
+		slot->changeCount++;
+		DropGraphCache(slot);
+	}
+
+	pthread_mutex_unlock(&graphCacheLock);
+}
+
+/*
+ * Update the cache for an index after an insert
+ *
+ * Called with HNSW_UPDATE_LOCK held after the element is added on disk.
+ * Elements only in layer 0 leave the upper layers and entry point unchanged,
+ * so the cache is kept. With layer 0 cached, the element is not a node, so
+ * neighbors that may now point to it are marked stale and loaded from disk
+ * until too many are stale and the cache is rebuilt.
+ */
+void
+HnswUpdateGraphCache(Relation index, HnswElement element, bool updateEntry)
+{
+	char	   *base = NULL;
+	HnswGraphCacheSlot *slot;
+	HnswGraphCache *cache;
+
+	pthread_mutex_lock(&graphCacheLock);
+
+	slot = FindGraphCacheSlot(index->rd_node);
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock(&graphCacheLock);
+		return;
+	}
+
+	cache = slot->cache;
+
+	/* Also discards a build in progress, which may have missed the change */
+	if (cache == NULL || element->level > 0 || updateEntry)
+	{
+		slot->changeCount++;
+		DropGraphCache(slot);
+		pthread_mutex_unlock(&graphCacheLock);
+		return;
+	}
+
+	if (cache->layer0)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, 0);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswElement e = (HnswElement) HnswPtrAccess(base, neighbors->items[i].element);
+			int			node = FindCacheNode(cache->tids, cache->nodeCount, e->blkno, e->offno);
+
+			if (node >= 0 && !cache->stale[node])
+			{
+				cache->stale[node] = true;
+				cache->staleCount++;
+			}
+		}
+
+		if (cache->staleCount > cache->nodeCount * HNSW_GRAPH_CACHE_MAX_STALE)
+		{
+			slot->changeCount++;
+			DropGraphCache(slot);
+		}
+	}
+
+	pthread_mutex_unlock(&graphCacheLock);
+}
+
+/*
+ * Search the upper layers with the cache
+ *
+ * Returns the closest element in layer 1, or NULL if the cache does not
+ * match the entry point
+ */
+HnswElement
+HnswCacheSearchUpperLayers(const HnswGraphCache * cache, HnswElement entryPoint, Datum q, const HnswTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation)
+{
+	int			m = cache->m;
+	int			node = FindCacheNode(cache->tids, cache->nodeCount, entryPoint->blkno, entryPoint->offno);
+	double		distance = 0;
+	int		   *nodes;
+	Datum	   *values;
+	double	   *distances;
+	HnswElement element;
+
+	if (node < 0 || cache->levels[node] != entryPoint->level || entryPoint->level == 0)
+		return NULL;
+
+	nodes = (int *) palloc(sizeof(int) * m);
+	values = (Datum *) palloc(sizeof(Datum) * m);
+	distances = (double *) palloc(sizeof(double) * m);
+
+	/* Distances are zero without a value */
+	if (DatumGetPointer(q) != NULL)
+	{
+		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, GetCacheValue(cache, node)));
+
+		/* Greedy search is the same as Algorithm 2 with ef = 1 */
+		for (int lc = entryPoint->level; lc >= 1; lc--)
+		{
+			bool		changed = true;
+
+			while (changed)
+			{
+				int32	   *neighbors = GetCacheNeighbors(cache, node, lc);
+				int			n = 0;
+
+				changed = false;
+
+				for (int i = 0; i < m; i++)
+				{
+					int			e = neighbors[i];
+
+					/* Make robust to issues */
+					if (e < 0 || cache->levels[e] < lc)
+						continue;
+
+					nodes[n] = e;
+					values[n++] = GetCacheValue(cache, e);
+				}
+
+				if (typeInfo->distanceBatch != NULL)
+					typeInfo->distanceBatch(procinfo, collation, q, values, n, distances);
+				else
+				{
+					for (int i = 0; i < n; i++)
+						distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+				}
+
+				for (int i = 0; i < n; i++)
+				{
+					if (distances[i] < distance)
+					{
+						node = nodes[i];
+						distance = distances[i];
+						changed = true;
+					}
+				}
+			}
+		}
+	}
+
+	pfree(nodes);
+	pfree(values);
+	pfree(distances);
+
+	element = HnswInitElementFromBlock(ItemPointerGetBlockNumber(&cache->tids[node]), ItemPointerGetOffsetNumber(&cache->tids[node]));
+	element->level = cache->levels[node];
+	return element;
+}
+
+/*
+ * Load neighbors from the cache
+ *
+ * Returns false if layer 0 is not cached or the element has changed
+ */
+bool
+HnswCacheLoadNeighbors(const HnswGraphCache * cache, HnswElement element, int m)
+{
+	char	   *base = NULL;
+	int			node;
+	int32	   *neighbors;
+	int			neighborCount = (element->level + 2) * m;
+
+	if (!cache->layer0)
+		return false;
+
+	node = FindCacheNode(cache->tids, cache->nodeCount, element->blkno, element->offno);
+	if (node < 0 || cache->levels[node] != element->level || cache->versions[node] != element->version || cache->stale[node])
+		return false;
+
+	HnswInitNeighbors(base, element, m, NULL);
+
+	neighbors = GetCacheNeighbors(cache, node, element->level);
+	for (int i = 0; i < neighborCount; i++)
+	{
+		HnswElement e;
+		int			level;
+		HnswCandidate *hc;
+		HnswNeighborArray *neighborArray;
+
+		if (neighbors[i] < 0)
+			continue;
+
+		e = HnswInitElementFromBlock(ItemPointerGetBlockNumber(&cache->tids[neighbors[i]]), ItemPointerGetOffsetNumber(&cache->tids[neighbors[i]]));
+
+		/* Calculate level based on offset */
+		level = element->level - i / m;
+		if (level < 0)
+			level = 0;
+
+		neighborArray = HnswGetNeighbors(base, element, level);
+		hc = &neighborArray->items[neighborArray->length++];
+		HnswPtrStore(base, hc->element, e);
+	}
+
+	return true;
+}
@@ -0,0 +1,339 @@
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "catalog/index.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
+#include "executor/executor.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "parser/parse_coerce.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/relcache.h"
+#include "utils/snapmgr.h"
+
+int			hnsw_filter_exact_limit;
+
+typedef struct HnswFilterResult
+{
+	ItemPointerData tid;
+	double		distance;
+}			HnswFilterResult;
+
+/*
+ * Compare result distances
+ */
+static int
+CompareFilterResults(const void *a, const void *b)
+{
+	if (((const HnswFilterResult *) a)->distance < ((const HnswFilterResult *) b)->distance)
+		return -1;
+
+	if (((const HnswFilterResult *) a)->distance > ((const HnswFilterResult *) b)->distance)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Build a bitmap from an array of heap tids
+ */
+static TIDBitmap *
+BuildFilterBitmap(ArrayType *arr, int *ntids)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	ItemPointer tids;
+	TIDBitmap  *tbm;
+	long		maxbytes;
+	int			n = 0;
+
+	deconstruct_array(arr, TIDOID, sizeof(ItemPointerData), false, 's', &elems, &nulls, &nelems);
+
+	tids = (ItemPointer) palloc(sizeof(ItemPointerData) * Max(nelems, 1));
+	for (int i = 0; i < nelems; i++)
+	{
+		if (!nulls[i])
+			tids[n++] = *((ItemPointer) DatumGetPointer(elems[i]));
+	}
+
+	/* Leave room for a page per tid so the bitmap is never lossy */
+	maxbytes = Max(u_sess->attr.attr_memory.work_mem * 1024L, (long) n * 128);
+	tbm = tbm_create(maxbytes);
+	tbm_get_handler(tbm)._add_tuples(tbm, tids, n, false, InvalidOid, InvalidBktId);
+
+	pfree(tids);
+	pfree(elems);
+	pfree(nulls);
+
+	*ntids = n;
+	return tbm;
+}
+
+/*
+ * Add the root of the HOT chain of each tid in the bitmap
+ *
+ * The graph stores root tids, while filters usually hold the tids of the
+ * visible versions.
+ */
+static void
+AddRootTids(Relation heap, TIDBitmap *tbm)
+{
+	TBMIterator *iterator = tbm_get_handler(tbm)._begin_iterate(tbm);
+	TBMIterateResult *tbmres;
+	OffsetNumber root_offsets[MaxHeapTuplesPerPage];
+	int			maxRoots = 256;
+	int			nroots = 0;
+	ItemPointer roots = (ItemPointer) palloc(sizeof(ItemPointerData) * maxRoots);
+
+	while ((tbmres = tbm_iterate(iterator)) != NULL)
+	{
+		Buffer		buf;
+		Page		page;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (tbmres->blockno >= RelationGetNumberOfBlocks(heap))
+			continue;
+
+		buf = ReadBuffer(heap, tbmres->blockno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		MemSet(root_offsets, InvalidOffsetNumber, sizeof(root_offsets));
+		heap_get_root_tuples(page, root_offsets);
+
+		for (int i = 0; i < tbmres->ntuples; i++)
+		{
+			OffsetNumber offno = tbmres->offsets[i];
+			OffsetNumber root;
+
+			if (offno < FirstOffsetNumber || offno > MaxHeapTuplesPerPage)
+				continue;
+
+			root = root_offsets[offno - 1];
+			if (root == InvalidOffsetNumber || root == offno)
+				continue;
+
+			if (nroots == maxRoots)
+			{
+				maxRoots *= 2;
+				roots = (ItemPointer) repalloc(roots, sizeof(ItemPointerData) * maxRoots);
+			}
+
+			ItemPointerSet(&roots[nroots++], tbmres->blockno, root);
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	tbm_end_iterate(iterator);
+
+	tbm_get_handler(tbm)._add_tuples(tbm, roots, nroots, false, InvalidOid, InvalidBktId);
+	pfree(roots);
+}
+
+/*
+ * Get the distance of each row in the bitmap
+ *
+ * Rows are fetched in physical order and the indexed value is computed the
+ * same way as for inserts, so results match what the graph would return.
+ */
+static int
+ExactSearch(Relation heap, Relation index, TIDBitmap *tbm, Datum q, Snapshot snapshot, HnswFilterResult * results)
+{
+	IndexInfo  *indexInfo = BuildIndexInfo(index);
+	EState	   *estate = CreateExecutorState();
+	ExprContext *econtext = GetPerTupleExprContext(estate);
+	TupleTableSlot *slot = MakeSingleTupleTableSlot(RelationGetDescr(heap));
+	const		HnswTypeInfo *typeInfo = HnswGetTypeInfo(index);
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	FmgrInfo   *normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	TBMIterator *iterator = tbm_get_handler(tbm)._begin_iterate(tbm);
+	TBMIterateResult *tbmres;
+	bool		seen[MaxHeapTuplesPerPage];
+	int			n = 0;
+
+	econtext->ecxt_scantuple = slot;
+
+	while ((tbmres = tbm_iterate(iterator)) != NULL)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		/* HOT chains stay on a page, so a version is only seen once */
+		MemSet(seen, 0, sizeof(seen));
+
+		for (int i = 0; i < tbmres->ntuples; i++)
+		{
+			HeapTupleData tuple;
+			Buffer		buf;
+			Datum		values[INDEX_MAX_KEYS];
+			bool		isnull[INDEX_MAX_KEYS];
+			MemoryContext oldCtx;
+
+			ItemPointerSet(&tuple.t_self, tbmres->blockno, tbmres->offsets[i]);
+
+			/*
+			 * Follow HOT chains from root tids to the visible version like
+			 * the graph search, and fall back to the tid as is, since chains
+			 * cannot be followed from versions after the root
+			 */
+			if (!heap_hot_search(&tuple.t_self, heap, snapshot, NULL))
+				ItemPointerSet(&tuple.t_self, tbmres->blockno, tbmres->offsets[i]);
+
+			if (!heap_fetch(heap, snapshot, &tuple, &buf, false, NULL))
+				continue;
+
+			/* Filter has both the root and the visible version */
+			if (seen[ItemPointerGetOffsetNumber(&tuple.t_self) - 1])
+			{
+				ReleaseBuffer(buf);
+				continue;
+			}
+			seen[ItemPointerGetOffsetNumber(&tuple.t_self) - 1] = true;
+
+			oldCtx = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+			(void) ExecStoreTuple(&tuple, slot, InvalidBuffer, false);
+			FormIndexDatum(indexInfo, slot, estate, values, isnull);
+
+			if (!isnull[0])
+			{
+				Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+				/* Zero vectors are not indexed for cosine distance */
+				if (normprocinfo == NULL || HnswCheckNorm(normprocinfo, collation, value))
+				{
+					if (normprocinfo != NULL)
+						value = HnswNormValue(typeInfo, collation, value);
+
+					results[n].tid = tuple.t_self;
+					results[n].distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, value));
+					n++;
+				}
+			}
+
+			MemoryContextSwitchTo(oldCtx);
+
+			ExecClearTuple(slot);
+			ReleaseBuffer(buf);
+			ResetExprContext(econtext);
+		}
+	}
+
+	tbm_end_iterate(iterator);
+	ExecDropSingleTupleTableSlot(slot);
+	FreeExecutorState(estate);
+
+	qsort(results, n, sizeof(HnswFilterResult), CompareFilterResults);
+	return n;
+}
+
+/*
+ * Search the graph for rows in the bitmap
+ */
+static int
+GraphSearch(Relation heap, Relation index, TIDBitmap *tbm, Datum q, Snapshot snapshot, int k, HnswFilterResult * results)
+{
+	IndexScanDesc scan;
+	ScanKeyData orderby;
+	int			n = 0;
+
+	MemSet(&orderby, 0, sizeof(ScanKeyData));
+	orderby.sk_attno = 1;
+	orderby.sk_argument = q;
+
+	AddRootTids(heap, tbm);
+
+	scan = index_beginscan(heap, index, snapshot, 0, 1);
+	index_rescan(scan, NULL, 0, &orderby, 1);
+	HnswSetScanFilter(scan, tbm);
+
+	while (n < k && index_getnext(scan, ForwardScanDirection) != NULL)
+		results[n++].tid = scan->xs_ctup.t_self;
+
+	index_endscan(scan);
+
+	return n;
+}
+
+/*
+ * Find the nearest rows to a query among a set of heap tids
+ *
+ * The filter is usually built from another index, like a bitmap index scan
+ * does, and results are returned in order of distance. Rows not in the
+ * filter are walked through but not counted towards hnsw.ef_search, and
+ * filters with at most hnsw.filter_exact_limit rows are scanned exactly.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_filtered_search);
+Datum
+hnsw_filtered_search(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Datum		q = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(1)));
+	ArrayType  *filter = PG_GETARG_ARRAYTYPE_P(2);
+	int			k = PG_GETARG_INT32(3);
+	Oid			queryType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	Snapshot	snapshot = GetActiveSnapshot();
+	Relation	index;
+	Relation	heap;
+	TIDBitmap  *tbm;
+	int			ntids;
+	HnswFilterResult *results;
+	int			n;
+	Datum	   *elems;
+	AclResult	aclresult;
+
+	if (k < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("k must be greater than or equal to zero")));
+
+	index = index_open(relid, AccessShareLock);
+	if (index->rd_rel->relam != get_am_oid("hnsw", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+	if (!IsBinaryCoercible(queryType, index->rd_opcintype[0]))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("query type %s does not match index type %s",
+						format_type_be(queryType), format_type_be(index->rd_opcintype[0]))));
+
+	heap = heap_open(index->rd_index->indrelid, AccessShareLock);
+
+	aclresult = pg_class_aclcheck(RelationGetRelid(heap), GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(heap));
+
+	tbm = BuildFilterBitmap(filter, &ntids);
+	results = (HnswFilterResult *) palloc(sizeof(HnswFilterResult) * Max(Min(ntids, k), 1));
+
+	/* Partial indexes search the graph so only indexed rows are returned */
+	if (ntids <= hnsw_filter_exact_limit && RelationGetIndexPredicate(index) == NIL)
+	{
+		HnswFilterResult *all = (HnswFilterResult *) palloc(sizeof(HnswFilterResult) * Max(ntids, 1));
+
+		n = Min(ExactSearch(heap, index, tbm, q, snapshot, all), k);
+		memcpy(results, all, sizeof(HnswFilterResult) * n);
+		pfree(all);
+	}
+	else
+		n = GraphSearch(heap, index, tbm, q, snapshot, Min(ntids, k), results);
+
+	tbm_free(tbm);
+	heap_close(heap, AccessShareLock);
+	index_close(index, AccessShareLock);
+
+	elems = (Datum *) palloc(sizeof(Datum) * Max(n, 1));
+	for (int i = 0; i < n; i++)
+		elems[i] = PointerGetDatum(&results[i].tid);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, n, TIDOID, sizeof(ItemPointerData), false, 's'));
+}
@@ -9,6 +9,14 @@
 #include "utils/datum.h"
 #include "utils/memutils.h"
 
+/* Pending update to the neighbor tuple of an element */
+typedef struct HnswNeighborUpdate
+{
+	HnswElement element;
+	int			lc;
+	int			idx;
+}			HnswNeighborUpdate;
+
 /*
  * Get the insert page
  */
@@ -36,7 +44,7 @@ GetInsertPage(Relation index)
  * Check for a free offset
  */
 static bool
-HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size ntupSize, Buffer *nbuf, Page *npage, OffsetNumber *freeOffno, OffsetNumber *freeNeighborOffno, BlockNumber *newInsertPage)
+HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size ntupSize, Buffer *nbuf, Page *npage, OffsetNumber *freeOffno, OffsetNumber *freeNeighborOffno, BlockNumber *newInsertPage, uint8 *tupleVersion)
 {
 	OffsetNumber offno;
 	OffsetNumber maxoffno = PageGetMaxOffsetNumber(page);
@@ -80,6 +88,7 @@ HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size
 			{
 				*freeOffno = offno;
 				*freeNeighborOffno = neighborOffno;
+				*tupleVersion = etup->version;
 				return true;
 			}
 			else if (*nbuf != buf)
@@ -133,6 +142,7 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	Buffer		nbuf;
 	Page		npage;
 	OffsetNumber freeOffno = InvalidOffsetNumber;
+	uint8		tupleVersion = 0;
 	OffsetNumber freeNeighborOffno = InvalidOffsetNumber;
 	BlockNumber newInsertPage = InvalidBlockNumber;
 	char	   *base = NULL;
@@ -184,7 +194,7 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 		}
 
 		/* Next, try space from a deleted element */
-		if (HnswFreeOffset(index, buf, page, e, ntupSize, &nbuf, &npage, &freeOffno, &freeNeighborOffno, &newInsertPage))
+		if (HnswFreeOffset(index, buf, page, e, ntupSize, &nbuf, &npage, &freeOffno, &freeNeighborOffno, &newInsertPage, &tupleVersion))
 		{
 			if (nbuf != buf)
 			{
@@ -268,6 +278,11 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	{
 		e->offno = freeOffno;
 		e->neighborOffno = freeNeighborOffno;
+
+		/* Bump version so iterative scans can detect the replacement */
+		e->version = tupleVersion + 1;
+		etup->version = e->version;
+		ntup->version = e->version;
 	}
 	else
 	{
@@ -336,13 +351,104 @@ ConnectionExists(HnswElement e, HnswNeighborTuple ntup, int startIdx, int lm)
 	return false;
 }
 
+/*
+ * Compare neighbor updates by page
+ */
+static int
+CompareNeighborUpdates(const void *a, const void *b)
+{
+	BlockNumber pa = ((const HnswNeighborUpdate *) a)->element->neighborPage;
+	BlockNumber pb = ((const HnswNeighborUpdate *) b)->element->neighborPage;
+
+	if (pa < pb)
+		return -1;
+
+	if (pa > pb)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get the slot to set for a neighbor update, or -1 if none
+ */
+static int
+GetNeighborUpdateIndex(Page page, HnswElement e, HnswNeighborUpdate * update, int m, bool checkExisting)
+{
+	HnswElement neighborElement = update->element;
+	int			lm = HnswGetLayerM(m, update->lc);
+	int			idx = update->idx;
+	int			startIdx;
+	HnswNeighborTuple ntup;
+
+	/* Get tuple */
+	ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, neighborElement->neighborOffno));
+
+	/* Calculate index for update */
+	startIdx = (neighborElement->level - update->lc) * m;
+
+	/* Check for existing connection */
+	if (checkExisting && ConnectionExists(e, ntup, startIdx, lm))
+		idx = -1;
+	else if (idx == -2)
+	{
+		/* Find free offset if still exists */
+		/* TODO Retry updating connections if not */
+		for (int j = 0; j < lm; j++)
+		{
+			if (!ItemPointerIsValid(&ntup->indextids[startIdx + j]))
+			{
+				idx = startIdx + j;
+				break;
+			}
+		}
+	}
+	else
+		idx += startIdx;
+
+	/* Make robust to issues */
+	if (idx < 0 || idx >= ntup->count)
+		return -1;
+
+	return idx;
+}
+
 /*
  * Update neighbors
+ *
+ * Connections are selected for all neighbors first, without holding any
+ * buffer locks. Updates are then applied in page order, with one WAL record
+ * for up to MAX_GENERIC_XLOG_PAGES pages instead of one per neighbor. Pages
+ * are locked in ascending order so concurrent inserts cannot deadlock.
  */
 void
 HnswUpdateNeighborsOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, HnswElement e, int m, bool checkExisting, bool building)
 {
 	char	   *base = NULL;
+	HnswNeighborUpdate *updates;
+	int			maxUpdates = 0;
+	int			nupdates = 0;
+	int			start = 0;
+
+	/* Start reads for all neighbor tuples */
+	for (int lc = e->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswElement neighborElement = (HnswElement) HnswPtrAccess(base, neighbors->items[i].element);
+
+			PrefetchBuffer(index, MAIN_FORKNUM, neighborElement->neighborPage);
+		}
+
+		maxUpdates += neighbors->length;
+	}
+
+	if (maxUpdates == 0)
+		return;
+
+	updates = (HnswNeighborUpdate *) palloc(sizeof(HnswNeighborUpdate) * maxUpdates);
 
 	for (int lc = e->level; lc >= 0; lc--)
 	{
@@ -352,14 +458,8 @@ HnswUpdateNeighborsOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, Hns
 		for (int i = 0; i < neighbors->length; i++)
 		{
 			HnswCandidate *hc = &neighbors->items[i];
-			Buffer		buf;
-			Page		page;
-			GenericXLogState *state;
-			HnswNeighborTuple ntup;
 			int			idx = -1;
-			int			startIdx;
 			HnswElement neighborElement = (HnswElement)HnswPtrAccess(base, hc->element);
-			OffsetNumber offno = neighborElement->neighborOffno;
 
 			/* Get latest neighbors since they may have changed */
 			/* Do not lock yet since selecting neighbors can take time */
@@ -379,65 +479,86 @@ HnswUpdateNeighborsOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, Hns
 			if (idx == -1)
 				continue;
 
-			/* Register page */
-			buf = ReadBuffer(index, neighborElement->neighborPage);
-			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-			if (building)
-			{
-				state = NULL;
-				page = BufferGetPage(buf);
-			}
-			else
-			{
-				state = GenericXLogStart(index);
-				page = GenericXLogRegisterBuffer(state, buf, 0);
-			}
+			updates[nupdates].element = neighborElement;
+			updates[nupdates].lc = lc;
+			updates[nupdates].idx = idx;
+			nupdates++;
+		}
+	}
 
-			/* Get tuple */
-			ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, offno));
+	qsort(updates, nupdates, sizeof(HnswNeighborUpdate), CompareNeighborUpdates);
 
-			/* Calculate index for update */
-			startIdx = (neighborElement->level - lc) * m;
+	while (start < nupdates)
+	{
+		Buffer		bufs[MAX_GENERIC_XLOG_PAGES];
+		Page		pages[MAX_GENERIC_XLOG_PAGES];
+		int			nbufs = 0;
+		bool		updated = false;
+		GenericXLogState *state = building ? NULL : GenericXLogStart(index);
+		int			end;
+
+		/* Lock as many pages as fit in a single record */
+		for (end = start; end < nupdates; end++)
+		{
+			HnswElement neighborElement = updates[end].element;
+			BlockNumber blkno = neighborElement->neighborPage;
+			Page		page;
+			HnswNeighborTuple ntup;
+			int			idx;
 
-			/* Check for existing connection */
-			if (checkExisting && ConnectionExists(e, ntup, startIdx, lm))
-				idx = -1;
-			else if (idx == -2)
+			if (nbufs == 0 || BufferGetBlockNumber(bufs[nbufs - 1]) != blkno)
 			{
-				/* Find free offset if still exists */
-				/* TODO Retry updating connections if not */
-				for (int j = 0; j < lm; j++)
-				{
-					if (!ItemPointerIsValid(&ntup->indextids[startIdx + j]))
-					{
-						idx = startIdx + j;
-						break;
-					}
-				}
-			}
-			else
-				idx += startIdx;
+				if (nbufs == MAX_GENERIC_XLOG_PAGES)
+					break;
 
-			/* Make robust to issues */
-			if (idx >= 0 && idx < ntup->count)
-			{
-				ItemPointer indextid = &ntup->indextids[idx];
+				bufs[nbufs] = ReadBuffer(index, blkno);
+				LockBuffer(bufs[nbufs], BUFFER_LOCK_EXCLUSIVE);
+				pages[nbufs] = NULL;
+				nbufs++;
+			}
 
-				/* Update neighbor on the buffer */
-				ItemPointerSet(indextid, e->blkno, e->offno);
+			page = pages[nbufs - 1] != NULL ? pages[nbufs - 1] : BufferGetPage(bufs[nbufs - 1]);
+			idx = GetNeighborUpdateIndex(page, e, &updates[end], m, checkExisting);
+			if (idx == -1)
+				continue;
 
-				/* Commit */
+			/* Only register pages that change to avoid full page images */
+			if (pages[nbufs - 1] == NULL)
+			{
 				if (building)
-					MarkBufferDirty(buf);
+					pages[nbufs - 1] = BufferGetPage(bufs[nbufs - 1]);
 				else
-					GenericXLogFinish(state);
+					pages[nbufs - 1] = GenericXLogRegisterBuffer(state, bufs[nbufs - 1], 0);
 			}
-			else if (!building)
-				GenericXLogAbort(state);
 
-			UnlockReleaseBuffer(buf);
+			/* Update neighbor on the buffer */
+			page = pages[nbufs - 1];
+			ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, neighborElement->neighborOffno));
+			ItemPointerSet(&ntup->indextids[idx], e->blkno, e->offno);
+			updated = true;
 		}
+
+		/* Commit */
+		if (building)
+		{
+			for (int i = 0; i < nbufs; i++)
+			{
+				if (pages[i] != NULL)
+					MarkBufferDirty(bufs[i]);
+			}
+		}
+		else if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+
+		for (int i = 0; i < nbufs; i++)
+			UnlockReleaseBuffer(bufs[i]);
+
+		start = end;
 	}
+
+	pfree(updates);
 }
 
 /*
@@ -525,15 +646,17 @@ FindDuplicateOnDisk(Relation index, HnswElement element, bool building)
 
 /*
  * Update graph on disk
+ *
+ * Returns false if the element was a duplicate and the graph is unchanged
  */
-static void
+static bool
 UpdateGraphOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, HnswElement element, int m, int efConstruction, HnswElement entryPoint, bool building)
 {
 	BlockNumber newInsertPage = InvalidBlockNumber;
 
 	/* Look for duplicate */
 	if (FindDuplicateOnDisk(index, element, building))
-		return;
+		return false;
 
 	/* Add element */
 	AddElementOnDisk(index, element, m, GetInsertPage(index), &newInsertPage, building);
@@ -548,6 +671,8 @@ UpdateGraphOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, HnswElement
 	/* Update entry point if needed */
 	if (entryPoint == NULL || element->level > entryPoint->level)
 		HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, building);
+
+	return true;
 }
 
 /*
@@ -560,8 +685,9 @@ HnswInsertTupleOnDisk(Relation index, Datum value, Datum *values, const bool *is
 	HnswElement element;
 	int			m;
 	int			efConstruction = HnswGetEfConstruction(index);
-	FmgrInfo   *procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	FmgrInfo   *procinfo = HnswGetDistanceProcInfo(index);
 	Oid			collation = index->rd_indcollation[0];
+	const		HnswTypeInfo *typeInfo = HnswGetTypeInfo(index);
 	LOCKMODE	lockmode = ShareLock;
 	char	   *base = NULL;
 
@@ -594,10 +720,11 @@ HnswInsertTupleOnDisk(Relation index, Datum value, Datum *values, const bool *is
 	}
 
 	/* Find neighbors for element */
-	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, m, efConstruction, false);
+	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, typeInfo, m, efConstruction, false);
 
-	/* Update graph on disk */
-	UpdateGraphOnDisk(index, procinfo, collation, element, m, efConstruction, entryPoint, building);
+	/* Update graph on disk and cached graph */
+	if (UpdateGraphOnDisk(index, procinfo, collation, element, m, efConstruction, entryPoint, building))
+		HnswUpdateGraphCache(index, element, entryPoint == NULL || element->level > entryPoint->level);
 
 	/* Release lock */
 	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
@@ -633,6 +760,10 @@ HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_ti
 		value = HnswNormValue(typeInfo, collation, value);
 	}
 
+	/* Quantize if needed */
+	if (typeInfo->quantize != NULL)
+		value = DirectFunctionCall1(typeInfo->quantize, value);
+
 	HnswInsertTupleOnDisk(index, value, values, isnull, heap_tid, false);
 }
 
@@ -0,0 +1,365 @@
+/*
+ * Merge of graph segments for HNSW builds
+ *
+ * A merge build writes several graphs (segments) to consecutive blocks, each
+ * over part of the rows and with its own entry point. Here the segments are
+ * connected into one graph. For each element, every other segment is searched
+ * from its entry point like an insert, and the candidates found are combined
+ * with the element's own neighbors using the same heuristic. Since every
+ * element searches every other segment, edges in both directions are found
+ * without updating the neighbors of other elements.
+ *
+ * Each neighbor tuple is only written by the participant that claimed the
+ * block of its element, so participants only coordinate to claim blocks.
+ * Searches may see neighbor tuples that were already merged, which only adds
+ * candidates from other segments.
+ */
+#include "postgres.h"
+
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+
+typedef struct HnswMergeState
+{
+	Relation	index;
+	HnswMergeShared *mshared;
+
+	/* Support functions */
+	FmgrInfo   *procinfo;
+	const		HnswTypeInfo *typeInfo;
+	Oid			collation;
+
+	/* Variables */
+	HnswNeighborTuple ntup;
+
+	/* Memory */
+	MemoryContext blockCtx;
+	MemoryContext elementCtx;
+}			HnswMergeState;
+
+/*
+ * Find the segment of a block
+ */
+static int
+FindSegment(HnswMergeShared * mshared, BlockNumber blkno)
+{
+	for (int i = 0; i < mshared->segmentCount; i++)
+	{
+		if (blkno >= mshared->segments[i].startBlkno && blkno <= mshared->segments[i].endBlkno)
+			return i;
+	}
+
+	elog(ERROR, "hnsw block %u is not in a segment", blkno);
+	return -1;
+}
+
+/*
+ * Add candidates from a search of another segment
+ */
+static void
+SearchSegment(HnswMergeState * state, HnswElement element, HnswSegment * segment, List **candidates)
+{
+	char	   *base = NULL;
+	Relation	index = state->index;
+	int			m = state->mshared->m;
+	Datum		q = HnswGetValue(base, element);
+	HnswElement entryPoint = HnswInitElementFromBlock(segment->entryBlkno, segment->entryOffno);
+	List	   *ep;
+
+	entryPoint->level = segment->entryLevel;
+	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, state->procinfo, state->collation, true));
+
+	/* Greedy search to element level */
+	for (int lc = segment->entryLevel; lc >= element->level + 1; lc--)
+		ep = HnswSearchLayer(base, q, ep, 1, lc, index, state->procinfo, state->collation, state->typeInfo, m, true, NULL, NULL, NULL, true, NULL, NULL, NULL);
+
+	for (int lc = Min(element->level, segment->entryLevel); lc >= 0; lc--)
+	{
+		List	   *w = HnswSearchLayer(base, q, ep, state->mshared->efConstruction, lc, index, state->procinfo, state->collation, state->typeInfo, m, true, NULL, NULL, NULL, true, NULL, NULL, NULL);
+
+		candidates[lc] = list_concat(candidates[lc], list_copy(w));
+		ep = w;
+	}
+}
+
+/*
+ * Select neighbors from candidates, skipping duplicates and the element
+ */
+static void
+SelectMergedNeighbors(HnswMergeState * state, HnswElement element, List *candidates, int lc)
+{
+	char	   *base = NULL;
+	int			m = state->mshared->m;
+	int			lm = HnswGetLayerM(m, lc);
+	HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+	tidhash_hash *seen = tidhash_create(CurrentMemoryContext, list_length(candidates) + 1, NULL);
+	List	   *c = NIL;
+	List	   *selected;
+	ListCell   *lc2;
+	ItemPointerData tid;
+	bool		found;
+
+	ItemPointerSet(&tid, element->blkno, element->offno);
+	tidhash_insert(seen, tid, &found);
+
+	foreach(lc2, candidates)
+	{
+		HnswCandidate *hc = (HnswCandidate *) lfirst(lc2);
+		HnswElement hce = (HnswElement) HnswPtrAccess(base, hc->element);
+
+		ItemPointerSet(&tid, hce->blkno, hce->offno);
+		tidhash_insert(seen, tid, &found);
+		if (found || hce->heaptidsLength == 0)
+			continue;
+
+		c = lappend(c, hc);
+	}
+
+	selected = HnswSelectNeighbors(base, c, lm, lc, state->procinfo, state->collation, element);
+
+	neighbors->length = 0;
+	foreach(lc2, selected)
+		neighbors->items[neighbors->length++] = *((HnswCandidate *) lfirst(lc2));
+}
+
+/*
+ * Merge the neighbors of an element with the other segments
+ */
+static void
+MergeElement(HnswMergeState * state, HnswElement element, int segment)
+{
+	char	   *base = NULL;
+	Relation	index = state->index;
+	HnswMergeShared *mshared = state->mshared;
+	int			m = mshared->m;
+	Datum		q = HnswGetValue(base, element);
+	List	  **candidates = (List **) palloc0(sizeof(List *) * (element->level + 1));
+	HnswNeighborTuple ntup = state->ntup;
+	Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
+	Buffer		buf;
+	Page		page;
+
+	/* Start with own neighbors */
+	HnswLoadNeighbors(element, index, m);
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			/* Copy since neighbors are replaced after selection */
+			HnswCandidate *hc = (HnswCandidate *) palloc(sizeof(HnswCandidate));
+			HnswElement hce;
+
+			*hc = neighbors->items[i];
+			hce = (HnswElement) HnswPtrAccess(base, hc->element);
+			HnswLoadElement(hce, &hc->distance, &q, index, state->procinfo, state->collation, true, NULL);
+			candidates[lc] = lappend(candidates[lc], hc);
+		}
+	}
+
+	/* Search other segments */
+	for (int i = 0; i < mshared->segmentCount; i++)
+	{
+		if (i != segment)
+			SearchSegment(state, element, &mshared->segments[i], candidates);
+	}
+
+	for (int lc = element->level; lc >= 0; lc--)
+		SelectMergedNeighbors(state, element, candidates[lc], lc);
+
+	/* Write neighbors */
+	MemSet(ntup, 0, HNSW_TUPLE_ALLOC_SIZE);
+	HnswSetNeighborTuple(NULL, ntup, element, m);
+
+	buf = ReadBufferExtended(index, mshared->forkNum, element->neighborPage, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+
+	if (!page_index_tuple_overwrite(page, element->neighborOffno, (Item) ntup, ntupSize))
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Merge the elements on a block
+ */
+static void
+MergeBlock(HnswMergeState * state, BlockNumber blkno)
+{
+	Relation	index = state->index;
+	int			segment = FindSegment(state->mshared, blkno);
+	List	   *elements = NIL;
+	ListCell   *lc;
+	Buffer		buf;
+	Page		page;
+	OffsetNumber maxoffno;
+	MemoryContext oldCtx;
+
+	/* Can take a while, so ensure we can interrupt */
+	/* Needs to be called when no buffer locks are held */
+	CHECK_FOR_INTERRUPTS();
+
+	oldCtx = MemoryContextSwitchTo(state->blockCtx);
+
+	/* Load elements first since neighbor tuples can be on the same page */
+	buf = ReadBufferExtended(index, state->mshared->forkNum, blkno, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+		HnswElement element;
+
+		if (!HnswIsElementTuple(etup))
+			continue;
+
+		element = HnswInitElementFromBlock(blkno, offno);
+		HnswLoadElementFromTuple(element, etup, true, true);
+		elements = lappend(elements, element);
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	foreach(lc, elements)
+	{
+		MemoryContextSwitchTo(state->elementCtx);
+		MergeElement(state, (HnswElement) lfirst(lc), segment);
+		MemoryContextReset(state->elementCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(state->blockCtx);
+}
+
+/*
+ * Claim and merge blocks until none are left
+ */
+static void
+MergeParticipate(HnswMergeShared * mshared, Relation index)
+{
+	HnswMergeState state;
+	BlockNumber endBlkno = mshared->segments[mshared->segmentCount - 1].endBlkno;
+
+	state.index = index;
+	state.mshared = mshared;
+	state.procinfo = HnswGetDistanceProcInfo(index);
+	state.typeInfo = HnswGetTypeInfo(index);
+	state.collation = index->rd_indcollation[0];
+	state.ntup = (HnswNeighborTuple) palloc0(HNSW_TUPLE_ALLOC_SIZE);
+	state.blockCtx = AllocSetContextCreate(CurrentMemoryContext,
+										   "Hnsw merge block context",
+										   ALLOCSET_DEFAULT_SIZES);
+	state.elementCtx = AllocSetContextCreate(CurrentMemoryContext,
+											 "Hnsw merge element context",
+											 ALLOCSET_DEFAULT_SIZES);
+
+	for (;;)
+	{
+		BlockNumber startBlkno;
+
+		SpinLockAcquire(&mshared->mutex);
+		startBlkno = mshared->nextBlkno;
+		if (startBlkno <= endBlkno)
+			mshared->nextBlkno = startBlkno + HNSW_MERGE_CHUNK_SIZE;
+		SpinLockRelease(&mshared->mutex);
+
+		if (startBlkno > endBlkno)
+			break;
+
+		for (BlockNumber blkno = startBlkno; blkno < startBlkno + HNSW_MERGE_CHUNK_SIZE && blkno <= endBlkno; blkno++)
+			MergeBlock(&state, blkno);
+	}
+
+	MemoryContextDelete(state.blockCtx);
+	MemoryContextDelete(state.elementCtx);
+	pfree(state.ntup);
+}
+
+/*
+ * Perform work within a launched parallel process
+ */
+void
+HnswParallelMergeMain(const BgWorkerContext *bwc)
+{
+	HnswMergeShared *mshared = (HnswMergeShared *) bwc->bgshared;
+	Relation	index;
+
+	/* Open relation within worker */
+	index = index_open(mshared->indexrelid, NoLock);
+
+	MergeParticipate(mshared, index);
+
+	/* Close relation within worker */
+	index_close(index, NoLock);
+}
+
+/*
+ * Initialize shared state
+ */
+static void
+InitMergeShared(HnswMergeShared * mshared, Relation index, ForkNumber forkNum, HnswSegment * segments, int segmentCount, int m, int efConstruction)
+{
+	mshared->indexrelid = RelationGetRelid(index);
+	mshared->forkNum = forkNum;
+	mshared->m = m;
+	mshared->efConstruction = efConstruction;
+	mshared->segmentCount = segmentCount;
+	memcpy(mshared->segments, segments, sizeof(HnswSegment) * segmentCount);
+	SpinLockInit(&mshared->mutex);
+	mshared->nextBlkno = segments[0].startBlkno;
+}
+
+/*
+ * Connect graph segments into one graph
+ */
+void
+HnswMergeSegments(Relation index, ForkNumber forkNum, HnswSegment * segments, int segmentCount, int m, int efConstruction, int nworkers)
+{
+	HnswMergeShared local;
+	HnswMergeShared *mshared = &local;
+	int			nlaunched = 0;
+
+	Assert(segmentCount > 1 && segmentCount <= HNSW_MAX_SEGMENTS);
+
+	ereport(DEBUG1, (errmsg("merging %d hnsw graph segments", segmentCount)));
+
+	if (nworkers > 0)
+	{
+		mshared = (HnswMergeShared *) MemoryContextAllocZero(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), sizeof(HnswMergeShared));
+		InitMergeShared(mshared, index, forkNum, segments, segmentCount, m, efConstruction);
+
+		nlaunched = LaunchBackgroundWorkers(nworkers, mshared, HnswParallelMergeMain, NULL);
+
+		/* If no workers were successfully launched, back out (merge serially) */
+		if (nlaunched == 0)
+		{
+			pfree_ext(mshared);
+			mshared = &local;
+		}
+		else
+			ereport(DEBUG1, (errmsg("using %d parallel workers for merge", nlaunched)));
+	}
+
+	if (mshared == &local)
+		InitMergeShared(mshared, index, forkNum, segments, segmentCount, m, efConstruction);
+
+	/* Participate as a worker */
+	MergeParticipate(mshared, index);
+
+	if (nlaunched == 0)
+		return;
+
+	BgworkerListWaitFinish(&nlaunched);
+	pg_memory_barrier();
+
+	/* Shut down workers, which frees the shared state */
+	BgworkerListSyncQuit();
+}
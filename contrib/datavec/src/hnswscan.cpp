@@ -1,43 +1,273 @@
 #include "postgres.h"
 
+#include "access/heapam.h"
 #include "access/relscan.h"
+#include "catalog/index.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
+#include "executor/executor.h"
 #include "hnsw.h"
+#include "miscadmin.h"
+#include "parser/parse_coerce.h"
 #include "pgstat.h"
 #include "storage/buf/bufmgr.h"
 #include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
 #include "utils/memutils.h"
+#include "utils/snapmgr.h"
 
 /*
  * Algorithm 5 from paper
  */
 static List *
-GetScanItems(IndexScanDesc scan, Datum q)
+SearchLayers(IndexScanDesc scan, Datum q, HnswElement entryPoint, int m, const HnswGraphCache * cache)
 {
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 	Relation	index = scan->indexRelation;
 	FmgrInfo   *procinfo = so->procinfo;
 	Oid			collation = so->collation;
-	List	   *ep;
+	List	   *ep = NIL;
+	List	   *w;
+	char	   *base = NULL;
+
+	/* Walk the upper layers in memory if cached */
+	if (cache != NULL)
+	{
+		HnswElement element = HnswCacheSearchUpperLayers(cache, entryPoint, q, so->typeInfo, procinfo, collation);
+
+		if (element != NULL)
+			ep = list_make1(HnswEntryCandidate(base, element, q, index, procinfo, collation, false));
+	}
+
+	if (ep == NIL)
+	{
+		ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, procinfo, collation, false));
+
+		for (int lc = entryPoint->level; lc >= 1; lc--)
+		{
+			w = HnswSearchLayer(base, q, ep, 1, lc, index, procinfo, collation, so->typeInfo, m, false, NULL, NULL, NULL, true, NULL, cache, NULL);
+			ep = w;
+		}
+	}
+
+	/* Filtered scans count tuples to bound the search */
+	if (hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_OFF && !so->range)
+		return HnswSearchLayer(base, q, ep, hnsw_ef_search, 0, index, procinfo, collation, so->typeInfo, m, false, NULL, NULL, NULL, true, so->filter != NULL ? &so->tuples : NULL, cache, so->filter);
+
+	return HnswSearchLayer(base, q, ep, hnsw_ef_search, 0, index, procinfo, collation, so->typeInfo, m, false, NULL, &so->v, &so->discarded, true, &so->tuples, cache, so->filter);
+}
+
+/*
+ * Get items, using the graph cache if enabled
+ */
+static List *
+GetScanItems(IndexScanDesc scan, Datum q)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
 	List	   *w;
 	int			m;
 	HnswElement entryPoint;
-	char	   *base = NULL;
+	HnswGraphCache *cache;
 
 	/* Get m and entry point */
 	HnswGetMetaPageInfo(index, &m, &entryPoint);
 
+	so->q = q;
+	so->m = m;
+
 	if (entryPoint == NULL)
 		return NIL;
 
-	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, procinfo, collation, false));
+	cache = HnswPinGraphCache(index, m);
+
+	PG_TRY();
+	{
+		w = SearchLayers(scan, q, entryPoint, m, cache);
+	}
+	PG_CATCH();
+	{
+		HnswUnpinGraphCache(cache);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	HnswUnpinGraphCache(cache);
+
+	return w;
+}
+
+/*
+ * Resume layer 0 search with the nearest discarded candidates
+ */
+static List *
+ResumeScanItems(IndexScanDesc scan)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	List	   *ep = NIL;
+	char	   *base = NULL;
+	int			batchSize = hnsw_ef_search;
+
+	if (pairingheap_is_empty(so->discarded))
+		return NIL;
+
+	/* Get next batch of candidates */
+	for (int i = 0; i < batchSize; i++)
+	{
+		if (pairingheap_is_empty(so->discarded))
+			break;
 
-	for (int lc = entryPoint->level; lc >= 1; lc--)
+		ep = lappend(ep, ((HnswPairingHeapNode *) pairingheap_remove_first(so->discarded))->inner);
+	}
+
+	return HnswSearchLayer(base, so->q, ep, batchSize, 0, index, so->procinfo, so->collation, so->typeInfo, so->m, false, NULL, &so->v, &so->discarded, false, &so->tuples, NULL, so->filter);
+}
+
+/*
+ * Compare candidate distances, farthest first
+ */
+static int
+#if PG_VERSION_NUM >= 130000
+CompareRerankDistances(const ListCell *a, const ListCell *b)
+{
+	HnswCandidate *hca = (HnswCandidate *) lfirst(a);
+	HnswCandidate *hcb = (HnswCandidate *) lfirst(b);
+#else
+CompareRerankDistances(const void *a, const void *b)
+{
+	HnswCandidate *hca = (HnswCandidate *) lfirst(*(ListCell **) a);
+	HnswCandidate *hcb = (HnswCandidate *) lfirst(*(ListCell **) b);
+#endif
+
+	if (hca->distance < hcb->distance)
+		return 1;
+
+	if (hca->distance > hcb->distance)
+		return -1;
+
+	return ItemPointerCompare(&((HnswElement) HnswPtrPointer(hcb->element))->heaptids[0],
+							  &((HnswElement) HnswPtrPointer(hca->element))->heaptids[0]);
+}
+
+/*
+ * Get the full precision distance of a row
+ *
+ * The value is read from the heap and computed the same way as for inserts.
+ * Returns false if no version of the row is visible or its value is not
+ * indexed.
+ */
+static bool
+GetRerankDistance(IndexScanDesc scan, ItemPointer heaptid, double *distance)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Relation	heap = scan->heapRelation;
+	ExprContext *econtext;
+	HeapTupleData tuple;
+	Buffer		buf;
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+	bool		found = false;
+
+	/* Create executor state on first use */
+	if (so->slot == NULL)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(so->estate->es_query_cxt);
+
+		so->slot = MakeSingleTupleTableSlot(RelationGetDescr(heap));
+		GetPerTupleExprContext(so->estate)->ecxt_scantuple = so->slot;
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	econtext = GetPerTupleExprContext(so->estate);
+
+	/* Follow HOT chains to the visible version */
+	tuple.t_self = *heaptid;
+	if (!heap_hot_search(&tuple.t_self, heap, scan->xs_snapshot, NULL))
+		return false;
+
+	if (!heap_fetch(heap, scan->xs_snapshot, &tuple, &buf, false, NULL))
+		return false;
+
+	(void) ExecStoreTuple(&tuple, so->slot, InvalidBuffer, false);
+	FormIndexDatum(so->indexInfo, so->slot, so->estate, values, isnull);
+
+	if (!isnull[0])
 	{
-		w = HnswSearchLayer(base, q, ep, 1, lc, index, procinfo, collation, m, false, NULL);
-		ep = w;
+		Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+		/* Zero vectors are not indexed for cosine distance */
+		if (so->normprocinfo == NULL || HnswCheckNorm(so->normprocinfo, so->collation, value))
+		{
+			if (so->normprocinfo != NULL)
+				value = HnswNormValue(so->typeInfo, so->collation, value);
+
+			*distance = DatumGetFloat8(FunctionCall2Coll(so->rerankprocinfo, so->collation, so->rerankq, value));
+			found = true;
+		}
 	}
 
-	return HnswSearchLayer(base, q, ep, hnsw_ef_search, 0, index, procinfo, collation, m, false, NULL);
+	ExecClearTuple(so->slot);
+	ReleaseBuffer(buf);
+	ResetExprContext(econtext);
+
+	return found;
+}
+
+/*
+ * Rerank candidates with full precision distances
+ *
+ * Each heap tid becomes its own candidate, so rows sharing a quantized value
+ * are ordered correctly. Candidates are sorted farthest first like the
+ * results of a search.
+ */
+static List *
+RerankScanItems(IndexScanDesc scan, List *w)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	char	   *base = NULL;
+	List	   *reranked = NIL;
+	ListCell   *lc;
+
+	foreach(lc, w)
+	{
+		HnswCandidate *hc = (HnswCandidate *) lfirst(lc);
+		HnswElement element = (HnswElement) HnswPtrAccess(base, hc->element);
+
+		for (int i = 0; i < element->heaptidsLength; i++)
+		{
+			ItemPointer heaptid = &element->heaptids[i];
+			HnswElement e;
+			HnswCandidate *rc;
+			double		distance;
+
+			CHECK_FOR_INTERRUPTS();
+
+			if (so->filter != NULL && tidhash_lookup(so->filter, *heaptid) == NULL)
+				continue;
+
+			if (!GetRerankDistance(scan, heaptid, &distance))
+				continue;
+
+			e = (HnswElement) palloc0(sizeof(HnswElementData));
+			e->heaptids[0] = *heaptid;
+			e->heaptidsLength = 1;
+			e->level = element->level;
+			e->blkno = element->blkno;
+			e->offno = element->offno;
+
+			rc = (HnswCandidate *) palloc(sizeof(HnswCandidate));
+			HnswPtrStore(base, rc->element, e);
+			rc->distance = distance;
+			rc->closer = false;
+			reranked = lappend(reranked, rc);
+		}
+	}
+
+	list_sort(reranked, CompareRerankDistances);
+	return reranked;
 }
 
 /*
@@ -62,6 +292,13 @@ GetScanValue(IndexScanDesc scan)
 		/* Normalize if needed */
 		if (so->normprocinfo != NULL)
 			value = HnswNormValue(so->typeInfo, so->collation, value);
+
+		/* Keep the full precision value for reranking */
+		if (so->typeInfo->quantize != NULL)
+		{
+			so->rerankq = value;
+			value = DirectFunctionCall1(so->typeInfo->quantize, value);
+		}
 	}
 
 	return value;
@@ -81,15 +318,35 @@ hnswbeginscan_internal(Relation index, int nkeys, int norderbys)
 	so = (HnswScanOpaque) palloc(sizeof(HnswScanOpaqueData));
 	so->typeInfo = HnswGetTypeInfo(index);
 	so->first = true;
+	so->discarded = NULL;
+	so->tuples = 0;
+	so->previousDistance = -get_float8_infinity();
+	so->filter = NULL;
+	so->range = false;
+	so->radius = get_float8_infinity();
 	so->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 									   "Hnsw scan temporary context",
 									   ALLOCSET_DEFAULT_SIZES);
 
 	/* Set support functions */
-	so->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	so->procinfo = HnswGetDistanceProcInfo(index);
 	so->normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
 	so->collation = index->rd_indcollation[0];
 
+	/* Rerank quantized candidates with values from the heap */
+	so->rerank = so->typeInfo->quantize != NULL;
+	so->rerankq = PointerGetDatum(NULL);
+	so->rerankprocinfo = NULL;
+	so->indexInfo = NULL;
+	so->estate = NULL;
+	so->slot = NULL;
+	if (so->rerank)
+	{
+		so->rerankprocinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+		so->indexInfo = BuildIndexInfo(index);
+		so->estate = CreateExecutorState();
+	}
+
 	scan->opaque = so;
 
 	return scan;
@@ -104,6 +361,10 @@ hnswrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderby
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 
 	so->first = true;
+	so->discarded = NULL;
+	so->tuples = 0;
+	so->previousDistance = -get_float8_infinity();
+	so->rerankq = PointerGetDatum(NULL);
 	MemoryContextReset(so->tmpCtx);
 
 	if (keys && scan->numberOfKeys > 0)
@@ -111,6 +372,18 @@ hnswrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderby
 
 	if (orderbys && scan->numberOfOrderBys > 0)
 		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+
+	/* Get radius in distances of the support function */
+	so->range = false;
+	so->radius = get_float8_infinity();
+	for (int i = 0; i < scan->numberOfKeys; i++)
+	{
+		if (scan->keyData[i].sk_strategy == HNSW_RANGE_STRATEGY)
+		{
+			so->range = true;
+			so->radius = Min(so->radius, DatumGetFloat8(scan->keyData[i].sk_argument));
+		}
+	}
 }
 
 /*
@@ -144,6 +417,10 @@ hnswgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 		if (!IsMVCCSnapshot(scan->xs_snapshot))
 			elog(ERROR, "non-MVCC snapshots are not supported with hnsw");
 
+		/* Quantized distances cannot be compared to the radius */
+		if (so->range && so->rerank)
+			elog(ERROR, "range search is not supported for quantized hnsw indexes");
+
 		/* Get scan value */
 		value = GetScanValue(scan);
 
@@ -158,6 +435,9 @@ hnswgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 		/* Release shared lock */
 		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
+		if (so->rerank && DatumGetPointer(so->rerankq) != NULL)
+			so->w = RerankScanItems(scan, so->w);
+
 		so->first = false;
 
 #if defined(HNSW_MEMORY) && PG_VERSION_NUM >= 130000
@@ -165,15 +445,83 @@ hnswgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 #endif
 	}
 
-	while (list_length(so->w) > 0)
+	for (;;)
 	{
 		char	   *base = NULL;
-		HnswCandidate *hc = (HnswCandidate *)llast(so->w);
-		HnswElement element = (HnswElement)HnswPtrAccess(base, hc->element);
+		HnswCandidate *hc;
+		HnswElement element;
 		ItemPointer heaptid;
 
-		/* Move to next element if no valid heap TIDs */
-		if (element->heaptidsLength == 0)
+		if (list_length(so->w) == 0)
+		{
+			/*
+			 * Range scans keep expanding the graph until the closest
+			 * discarded candidate is outside the radius
+			 */
+			if (so->range)
+			{
+				HnswCandidate *next;
+
+				if (so->discarded == NULL || pairingheap_is_empty(so->discarded))
+					break;
+
+				next = ((HnswPairingHeapNode *) pairingheap_first(so->discarded))->inner;
+				if (next->distance > so->radius)
+					break;
+
+				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+				so->w = ResumeScanItems(scan);
+
+				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+				if (list_length(so->w) == 0)
+					break;
+
+				continue;
+			}
+
+			/* Empty index or iterative scans disabled */
+			if (so->discarded == NULL || hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_OFF)
+				break;
+
+			if (so->tuples >= hnsw_max_scan_tuples)
+			{
+				/* Stop expanding the graph and return remaining candidates */
+				if (pairingheap_is_empty(so->discarded))
+					break;
+
+				so->w = lappend(so->w, ((HnswPairingHeapNode *) pairingheap_remove_first(so->discarded))->inner);
+			}
+			else
+			{
+				/*
+				 * Neighbors read in this batch are protected by the lock, but
+				 * elements loaded in previous batches may have been deleted
+				 * and replaced, so neighbor tuples are checked against the
+				 * element version when loaded.
+				 */
+				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+				so->w = ResumeScanItems(scan);
+
+				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+				if (list_length(so->w) == 0)
+					break;
+			}
+
+			if (so->rerank && DatumGetPointer(so->rerankq) != NULL)
+				so->w = RerankScanItems(scan, so->w);
+
+			continue;
+		}
+
+		hc = (HnswCandidate *)llast(so->w);
+		element = (HnswElement)HnswPtrAccess(base, hc->element);
+
+		/* Move to next element if no valid heap TIDs or outside the radius */
+		if (element->heaptidsLength == 0 || hc->distance > so->radius)
 		{
 			so->w = list_delete_last(so->w);
 			continue;
@@ -181,6 +529,19 @@ hnswgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 
 		heaptid = &element->heaptids[--element->heaptidsLength];
 
+		/* Elements can have other heap tids that fail the filter */
+		if (so->filter != NULL && tidhash_lookup(so->filter, *heaptid) == NULL)
+			continue;
+
+		/* Skip candidates that would be returned out of order */
+		if (hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_STRICT && !so->range)
+		{
+			if (hc->distance < so->previousDistance)
+				continue;
+
+			so->previousDistance = hc->distance;
+		}
+
 		MemoryContextSwitchTo(oldCtx);
 
 		scan->xs_ctup.t_self = *heaptid;
@@ -192,6 +553,128 @@ hnswgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 	return false;
 }
 
+/*
+ * Restrict a scan to heap tids in a bitmap
+ *
+ * Only elements with a heap tid in the bitmap are returned or counted
+ * towards hnsw.ef_search, which keeps recall up for selective filters. All
+ * offsets of lossy pages are allowed, so the caller must recheck the filter
+ * for those. Must be called before the first tuple is fetched and applies to
+ * later rescans.
+ */
+void
+HnswSetScanFilter(IndexScanDesc scan, TIDBitmap *tbm)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	TBMIterator *iterator = tbm_get_handler(tbm)._begin_iterate(tbm);
+	TBMIterateResult *tbmres;
+
+	so->filter = tidhash_create(CurrentMemoryContext, 256, NULL);
+
+	while ((tbmres = tbm_iterate(iterator)) != NULL)
+	{
+		int			ntuples = tbmres->ntuples >= 0 ? tbmres->ntuples : MaxHeapTuplesPerPage;
+
+		for (int i = 0; i < ntuples; i++)
+		{
+			ItemPointerData tid;
+			bool		found;
+
+			ItemPointerSet(&tid, tbmres->blockno, tbmres->ntuples >= 0 ? tbmres->offsets[i] : i + FirstOffsetNumber);
+			tidhash_insert(so->filter, tid, &found);
+		}
+	}
+
+	tbm_end_iterate(iterator);
+}
+
+/*
+ * Find all rows within a distance of a query
+ *
+ * The radius is in units of the operator of the opclass. The graph is
+ * expanded from the closest candidates as long as they are within the
+ * radius, so the result is approximate like other searches. Rows updated in
+ * place since they were indexed may not match by ctid.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_range_search);
+Datum
+hnsw_range_search(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Datum		q = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(1)));
+	double		radius = PG_GETARG_FLOAT8(2);
+	Oid			queryType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	Snapshot	snapshot = GetActiveSnapshot();
+	Relation	index;
+	Relation	heap;
+	IndexScanDesc scan;
+	ScanKeyData key;
+	ScanKeyData orderby;
+	ItemPointer tids;
+	Datum	   *elems;
+	int			n = 0;
+	int			maxTids = 64;
+	AclResult	aclresult;
+
+	if (isnan(radius))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("radius must not be NaN")));
+
+	index = index_open(relid, AccessShareLock);
+	if (index->rd_rel->relam != get_am_oid("hnsw", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+	if (!IsBinaryCoercible(queryType, index->rd_opcintype[0]))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("query type %s does not match index type %s",
+						format_type_be(queryType), format_type_be(index->rd_opcintype[0]))));
+
+	heap = heap_open(index->rd_index->indrelid, AccessShareLock);
+
+	aclresult = pg_class_aclcheck(RelationGetRelid(heap), GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(heap));
+
+	MemSet(&key, 0, sizeof(ScanKeyData));
+	key.sk_attno = 1;
+	key.sk_strategy = HNSW_RANGE_STRATEGY;
+	key.sk_argument = Float8GetDatum(HnswRangeDistance(index, radius));
+
+	MemSet(&orderby, 0, sizeof(ScanKeyData));
+	orderby.sk_attno = 1;
+	orderby.sk_argument = q;
+
+	tids = (ItemPointer) palloc(sizeof(ItemPointerData) * maxTids);
+
+	scan = index_beginscan(heap, index, snapshot, 1, 1);
+	index_rescan(scan, &key, 1, &orderby, 1);
+
+	while (index_getnext(scan, ForwardScanDirection) != NULL)
+	{
+		if (n == maxTids)
+		{
+			maxTids *= 2;
+			tids = (ItemPointer) repalloc(tids, sizeof(ItemPointerData) * maxTids);
+		}
+
+		tids[n++] = scan->xs_ctup.t_self;
+	}
+
+	index_endscan(scan);
+	heap_close(heap, AccessShareLock);
+	index_close(index, AccessShareLock);
+
+	elems = (Datum *) palloc(sizeof(Datum) * Max(n, 1));
+	for (int i = 0; i < n; i++)
+		elems[i] = PointerGetDatum(&tids[i]);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, n, TIDOID, sizeof(ItemPointerData), false, 's'));
+}
+
 /*
  * End a scan and release resources
  */
@@ -202,6 +685,11 @@ hnswendscan_internal(IndexScanDesc scan)
 
 	MemoryContextDelete(so->tmpCtx);
 
+	if (so->slot != NULL)
+		ExecDropSingleTupleTableSlot(so->slot);
+	if (so->estate != NULL)
+		FreeExecutorState(so->estate);
+
 	pfree(so);
 	scan->opaque = NULL;
 }
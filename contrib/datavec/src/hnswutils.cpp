@@ -3,8 +3,11 @@
 #include <math.h>
 
 #include "access/generic_xlog.h"
+#include "access/reloptions.h"
+#include "bitvec.h"
 #include "catalog/pg_type.h"
 #include "fmgr.h"
+#include "halfvec.h"
 #include "hnsw.h"
 #include "lib/pairingheap.h"
 #include "sparsevec.h"
@@ -105,13 +108,6 @@ hash_offset(Size offset)
 #define SH_DEFINE
 #include "lib/simplehash.h"
 
-typedef union
-{
-	pointerhash_hash *pointers;
-	offsethash_hash *offsets;
-	tidhash_hash *tids;
-}			visited_hash;
-
 /*
  * Get the max number of connections in an upper layer for each element in the index
  */
@@ -140,6 +136,149 @@ HnswGetEfConstruction(Relation index)
 	return HNSW_DEFAULT_EF_CONSTRUCTION;
 }
 
+/*
+ * Get the graph cache mode for the index
+ */
+int
+HnswGetGraphCacheMode(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return HNSW_GRAPH_CACHE_OFF;
+
+	value = GET_STRING_RELOPTION(opts, graphCache);
+	if (value != NULL && strcmp(value, "upper") == 0)
+		return HNSW_GRAPH_CACHE_UPPER;
+
+	if (value != NULL && strcmp(value, "all") == 0)
+		return HNSW_GRAPH_CACHE_ALL;
+
+	return HNSW_GRAPH_CACHE_OFF;
+}
+
+/*
+ * Get the build method for the index
+ */
+int
+HnswGetBuildMethod(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return HNSW_BUILD_INSERT;
+
+	value = GET_STRING_RELOPTION(opts, buildMethod);
+	if (value != NULL && strcmp(value, "merge") == 0)
+		return HNSW_BUILD_MERGE;
+
+	return HNSW_BUILD_INSERT;
+}
+
+/*
+ * Get the vacuum repair mode for the index
+ */
+int
+HnswGetVacuumRepair(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return HNSW_VACUUM_REPAIR_FULL;
+
+	value = GET_STRING_RELOPTION(opts, vacuumRepair);
+	if (value != NULL && strcmp(value, "incremental") == 0)
+		return HNSW_VACUUM_REPAIR_INCREMENTAL;
+
+	return HNSW_VACUUM_REPAIR_FULL;
+}
+
+/*
+ * Get the quantizer for the index
+ */
+int
+HnswGetQuantizer(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return HNSW_QUANTIZER_NONE;
+
+	value = GET_STRING_RELOPTION(opts, quantizer);
+	if (value != NULL && strcmp(value, "binary") == 0)
+		return HNSW_QUANTIZER_BINARY;
+
+	return HNSW_QUANTIZER_NONE;
+}
+
+/*
+ * Get the page order for the index
+ */
+int
+HnswGetPageOrder(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return HNSW_PAGE_ORDER_INSERT;
+
+	value = GET_STRING_RELOPTION(opts, pageOrder);
+	if (value != NULL && strcmp(value, "bfs") == 0)
+		return HNSW_PAGE_ORDER_BFS;
+
+	return HNSW_PAGE_ORDER_INSERT;
+}
+
+/*
+ * Get the distance function used to navigate the graph
+ *
+ * With the binary quantizer, the graph stores bit vectors and is navigated
+ * with the Hamming distance instead of the distance of the opclass.
+ */
+FmgrInfo *
+HnswGetDistanceProcInfo(Relation index)
+{
+	FmgrInfo   *procinfo;
+
+	if (HnswGetQuantizer(index) != HNSW_QUANTIZER_BINARY)
+		return index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+
+	procinfo = (FmgrInfo *) palloc0(sizeof(FmgrInfo));
+	procinfo->fn_addr = hamming_distance;
+	procinfo->fn_oid = InvalidOid;
+	procinfo->fn_nargs = 2;
+	procinfo->fn_strict = true;
+	procinfo->fn_mcxt = CurrentMemoryContext;
+	return procinfo;
+}
+
+/*
+ * Convert a distance of the operator to a distance of the support function
+ *
+ * L2 distance is squared, and cosine distance is the negative inner product
+ * of normalized values minus one.
+ */
+double
+HnswRangeDistance(Relation index, double radius)
+{
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+
+	if (procinfo->fn_addr == vector_l2_squared_distance ||
+		procinfo->fn_addr == halfvec_l2_squared_distance ||
+		procinfo->fn_addr == sparsevec_l2_squared_distance)
+		return radius < 0 ? -1 : radius * radius;
+
+	if (HnswOptionalProcInfo(index, HNSW_NORM_PROC) != NULL)
+		return radius - 1;
+
+	return radius;
+}
+
 /*
  * Get proc
  */
@@ -252,6 +391,7 @@ HnswInitElement(char *base, ItemPointer heaptid, int m, double ml, int maxLevel,
 
 	element->level = level;
 	element->deleted = 0;
+	element->version = 0;
 
 	HnswInitNeighbors(base, element, m, allocator);
 
@@ -280,6 +420,7 @@ HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno)
 
 	element->blkno = blkno;
 	element->offno = offno;
+	element->version = 0;
 	HnswPtrStore(base, element->neighbors, (HnswNeighborArrayPtr *) NULL);
 	HnswPtrStore(base, element->value, (Pointer) NULL);
 	return element;
@@ -333,6 +474,38 @@ HnswGetEntryPoint(Relation index)
 	return entryPoint;
 }
 
+/*
+ * Get the search statistics
+ */
+void
+HnswGetSearchStats(Relation index, int *efSearch, double *rows, double *visited)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	/* Metapages of older indexes end before the statistics */
+	if (((PageHeader) page)->pd_lower >= ((char *) metap + sizeof(HnswMetaPageData)) - (char *) page)
+	{
+		*efSearch = metap->statsEfSearch;
+		*rows = metap->statsRows;
+		*visited = metap->statsVisited;
+	}
+	else
+	{
+		*efSearch = 0;
+		*rows = 0;
+		*visited = 0;
+	}
+
+	UnlockReleaseBuffer(buf);
+}
+
 /*
  * Update the metapage info
  */
@@ -404,6 +577,7 @@ HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element)
 	etup->type = HNSW_ELEMENT_TUPLE_TYPE;
 	etup->level = element->level;
 	etup->deleted = 0;
+	etup->version = element->version;
 	for (int i = 0; i < HNSW_HEAPTIDS; i++)
 	{
 		if (i < element->heaptidsLength)
@@ -423,6 +597,7 @@ HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m)
 	int			idx = 0;
 
 	ntup->type = HNSW_NEIGHBOR_TUPLE_TYPE;
+	ntup->version = e->version;
 
 	for (int lc = e->level; lc >= 0; lc--)
 	{
@@ -467,6 +642,14 @@ LoadNeighborsFromPage(HnswElement element, Relation index, Page page, int m)
 	if (ntup->count != neighborCount)
 		return;
 
+	/*
+	 * Ensure element has not been deleted and replaced since it was loaded
+	 * (possible with iterative scans, which do not hold the scan lock
+	 * between batches)
+	 */
+	if (ntup->version != element->version)
+		return;
+
 	for (int i = 0; i < neighborCount; i++)
 	{
 		HnswElement e;
@@ -519,6 +702,7 @@ HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHe
 {
 	element->level = etup->level;
 	element->deleted = etup->deleted;
+	element->version = etup->version;
 	element->neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
 	element->neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
 	element->heaptidsLength = 0;
@@ -579,6 +763,45 @@ HnswLoadElement(HnswElement element, float *distance, Datum *q, Relation index,
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Start reads for unvisited neighbors and the next candidate
+ *
+ * Reads are issued before any distance is computed, so they overlap instead
+ * of costing a random read per neighbor on a cold index. The neighbor tuple
+ * of the nearest remaining candidate is also prefetched, since it is likely
+ * the next one expanded.
+ */
+static void
+PrefetchNeighbors(char *base, Relation index, HnswCandidate * *unvisited, int n, pairingheap *C, const HnswGraphCache * cache)
+{
+	BlockNumber lastBlkno = InvalidBlockNumber;
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement e = (HnswElement) HnswPtrAccess(base, unvisited[i]->element);
+
+		/* Neighbors are often stored next to each other */
+		if (e->blkno != lastBlkno)
+		{
+			PrefetchBuffer(index, MAIN_FORKNUM, e->blkno);
+			lastBlkno = e->blkno;
+		}
+	}
+
+	/* Skip if the cache has the neighbors */
+	if (cache != NULL && cache->layer0)
+		return;
+
+	if (!pairingheap_is_empty(C))
+	{
+		HnswCandidate *next = ((HnswPairingHeapNode *) pairingheap_first(C))->inner;
+		HnswElement nextElement = (HnswElement) HnswPtrAccess(base, next->element);
+
+		if (HnswPtrIsNull(base, nextElement->neighbors))
+			PrefetchBuffer(index, MAIN_FORKNUM, nextElement->neighborPage);
+	}
+}
+
 /*
  * Get the distance for a candidate
  */
@@ -591,6 +814,99 @@ GetCandidateDistance(char *base, HnswCandidate * hc, Datum q, FmgrInfo *procinfo
 	return DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, value));
 }
 
+/*
+ * Get the distances for candidates at once
+ */
+static void
+GetCandidateDistances(char *base, HnswCandidate * *candidates, int n, Datum q, const HnswTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation, Datum *values, double *distances)
+{
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement hce = (HnswElement) HnswPtrAccess(base, candidates[i]->element);
+
+		values[i] = HnswGetValue(base, hce);
+	}
+
+	if (typeInfo->distanceBatch != NULL)
+		typeInfo->distanceBatch(procinfo, collation, q, values, n, distances);
+	else
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+	}
+}
+
+/*
+ * Load candidates from disk and get their distances at once
+ *
+ * Values are copied out under their buffer locks so the distance function
+ * is called once for the neighborhood. Elements are loaded before their
+ * distances are known, and the caller copies values it keeps.
+ */
+static void
+LoadCandidateDistances(char *base, HnswCandidate * *candidates, int n, Datum q, Relation index, const HnswTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation, Datum *values, double *distances, char **data, Size *dataSize)
+{
+	Buffer		buf = InvalidBuffer;
+	Size		used = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement e = (HnswElement) HnswPtrAccess(base, candidates[i]->element);
+		Page		page;
+		HnswElementTuple etup;
+		Size		valueSize;
+
+		/* Neighbors are often stored next to each other */
+		if (!BufferIsValid(buf) || BufferGetBlockNumber(buf) != e->blkno)
+		{
+			if (BufferIsValid(buf))
+				UnlockReleaseBuffer(buf);
+
+			buf = ReadBuffer(index, e->blkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+		}
+
+		page = BufferGetPage(buf);
+		etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, e->offno));
+
+		Assert(HnswIsElementTuple(etup));
+
+		HnswLoadElementFromTuple(e, etup, true, false);
+
+		valueSize = VARSIZE_ANY(&etup->data);
+		while (used + MAXALIGN(valueSize) > *dataSize)
+		{
+			*dataSize *= 2;
+			*data = (char *) repalloc(*data, *dataSize);
+		}
+		memcpy(*data + used, &etup->data, valueSize);
+
+		/* Store offset since data can move */
+		values[i] = (Datum) used;
+		used += MAXALIGN(valueSize);
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+
+	for (int i = 0; i < n; i++)
+		values[i] = PointerGetDatum(*data + values[i]);
+
+	/* Distances are zero without a value */
+	if (DatumGetPointer(q) == NULL)
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = 0;
+	}
+	else if (typeInfo->distanceBatch != NULL)
+		typeInfo->distanceBatch(procinfo, collation, q, values, n, distances);
+	else
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+	}
+}
+
 /*
  * Create a candidate for the entry point
  */
@@ -717,29 +1033,75 @@ CountElement(char *base, HnswElement skipElement, HnswCandidate * hc)
 	return e->heaptidsLength != 0;
 }
 
+/*
+ * Check if an element has a heap tid in the filter
+ */
+bool
+HnswElementMatchesFilter(HnswElement element, tidhash_hash * filter)
+{
+	for (int i = 0; i < element->heaptidsLength; i++)
+	{
+		if (tidhash_lookup(filter, element->heaptids[i]) != NULL)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Algorithm 2 from paper
+ *
+ * For iterative scans, the caller passes in the visited set and a heap for
+ * discarded candidates, which persist across calls so the search can be
+ * resumed from where it stopped. Scans can pass in a graph cache to load
+ * neighbors without reading neighbor tuples.
+ *
+ * With a filter, elements without a matching heap tid are still expanded but
+ * are not returned or counted towards ef, so the search walks through regions
+ * of the graph that fail the filter. The search stops once it has visited
+ * hnsw.max_scan_tuples tuples.
  */
 List *
-HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, FmgrInfo *procinfo, Oid collation, int m, bool inserting, HnswElement skipElement)
+HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, FmgrInfo *procinfo, Oid collation, const HnswTypeInfo * typeInfo, int m, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples, const HnswGraphCache * cache, tidhash_hash * filter)
 {
 	List	   *w = NIL;
 	pairingheap *C = pairingheap_allocate(CompareNearestCandidates, NULL);
 	pairingheap *W = pairingheap_allocate(CompareFurthestCandidates, NULL);
 	int			wlen = 0;
-	visited_hash v;
+	visited_hash vh;
 	ListCell   *lc2;
 	HnswNeighborArray *neighborhoodData = NULL;
 	Size		neighborhoodSize;
+	int			lm = HnswGetLayerM(m, lc);
+	HnswCandidate **unvisited = (HnswCandidate * *) palloc(sizeof(HnswCandidate *) * lm);
+	Datum	   *values = (Datum *) palloc(sizeof(Datum) * lm);
+	double	   *distances = (double *) palloc(sizeof(double) * lm);
+	Size		dataSize = BLCKSZ;
+	char	   *data = NULL;
+
+	/* Create visited set if not provided */
+	if (v == NULL)
+	{
+		v = &vh;
+		initVisited = true;
+	}
 
-	InitVisited(base, &v, index, ef, m);
+	if (initVisited)
+	{
+		InitVisited(base, v, index, ef, m);
+
+		if (discarded != NULL)
+			*discarded = pairingheap_allocate(CompareNearestCandidates, NULL);
+	}
 
 	/* Create local memory for neighborhood if needed */
 	if (index == NULL)
 	{
-		neighborhoodSize = HNSW_NEIGHBOR_ARRAY_SIZE(HnswGetLayerM(m, lc));
+		neighborhoodSize = HNSW_NEIGHBOR_ARRAY_SIZE(lm);
 		neighborhoodData = (HnswNeighborArray *)palloc(neighborhoodSize);
 	}
+	else
+		data = (char *) palloc(dataSize);
 
 	/* Add entry points to v, C, and W */
 	foreach(lc2, ep)
@@ -747,9 +1109,13 @@ HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, F
 		HnswCandidate *hc = (HnswCandidate *) lfirst(lc2);
 		bool		found;
 
-		AddToVisited(base, &v, hc, index, &found);
+		AddToVisited(base, v, hc, index, &found);
 
 		pairingheap_add(C, &(CreatePairingHeapNode(hc)->ph_node));
+
+		if (filter != NULL && !HnswElementMatchesFilter((HnswElement) HnswPtrAccess(base, hc->element), filter))
+			continue;
+
 		pairingheap_add(W, &(CreatePairingHeapNode(hc)->ph_node));
 
 		/*
@@ -764,17 +1130,30 @@ HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, F
 	while (!pairingheap_is_empty(C))
 	{
 		HnswNeighborArray *neighborhood;
+		int			nunvisited;
 		HnswCandidate *c = ((HnswPairingHeapNode *) pairingheap_remove_first(C))->inner;
-		HnswCandidate *f = ((HnswPairingHeapNode *) pairingheap_first(W))->inner;
+		HnswCandidate *f = NULL;
 		HnswElement cElement;
 
-		if (c->distance > f->distance)
+		/* W only holds matching elements, so it can be empty when filtering */
+		if (!pairingheap_is_empty(W))
+		{
+			f = ((HnswPairingHeapNode *) pairingheap_first(W))->inner;
+
+			if (c->distance > f->distance && (filter == NULL || wlen >= ef))
+				break;
+		}
+
+		if (filter != NULL && tuples != NULL && *tuples >= hnsw_max_scan_tuples)
 			break;
 
 		cElement = (HnswElement)HnswPtrAccess(base, c->element);
 
 		if (HnswPtrIsNull(base, cElement->neighbors))
-			HnswLoadNeighbors(cElement, index, m);
+		{
+			if (cache == NULL || !HnswCacheLoadNeighbors(cache, cElement, m))
+				HnswLoadNeighbors(cElement, index, m);
+		}
 
 		/* Get the neighborhood at layer lc */
 		neighborhood = HnswGetNeighbors(base, cElement, lc);
@@ -788,59 +1167,96 @@ HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, F
 			neighborhood = neighborhoodData;
 		}
 
+		/* Collect unvisited neighbors */
+		nunvisited = 0;
 		for (int i = 0; i < neighborhood->length; i++)
 		{
 			HnswCandidate *e = &neighborhood->items[i];
 			bool		visited;
 
-			AddToVisited(base, &v, e, index, &visited);
+			AddToVisited(base, v, e, index, &visited);
 
 			if (!visited)
+				unvisited[nunvisited++] = e;
+		}
+
+		/* Get distances for the whole neighborhood at once */
+		if (index == NULL)
+			GetCandidateDistances(base, unvisited, nunvisited, q, typeInfo, procinfo, collation, values, distances);
+		else
+		{
+			PrefetchNeighbors(base, index, unvisited, nunvisited, C, cache);
+			LoadCandidateDistances(base, unvisited, nunvisited, q, index, typeInfo, procinfo, collation, values, distances, &data, &dataSize);
+		}
+
+		for (int i = 0; i < nunvisited; i++)
+		{
+			HnswCandidate *e = unvisited[i];
+			float		eDistance = (float) distances[i];
+			HnswElement eElement = (HnswElement)HnswPtrAccess(base, e->element);
+			bool		alwaysAdd = wlen < ef;
+
+			f = pairingheap_is_empty(W) ? NULL : ((HnswPairingHeapNode *) pairingheap_first(W))->inner;
+
+			/* Discarded candidates must be fully loaded to be returned later */
+			if (index != NULL && inserting && (alwaysAdd || discarded != NULL || eDistance < f->distance))
+				HnswPtrStore(base, eElement->value, DatumGetPointer(datumCopy(values[i], false, -1)));
+
+			if (tuples != NULL)
+				(*tuples)++;
+
+			if (alwaysAdd || eDistance < f->distance)
 			{
-				float		eDistance;
-				HnswElement eElement = (HnswElement)HnswPtrAccess(base, e->element);
-				bool		alwaysAdd = wlen < ef;
+				HnswCandidate *ec;
 
-				f = ((HnswPairingHeapNode *) pairingheap_first(W))->inner;
+				Assert(!eElement->deleted);
 
-				if (index == NULL)
-					eDistance = GetCandidateDistance(base, e, q, procinfo, collation);
-				else
-					HnswLoadElement(eElement, &eDistance, &q, index, procinfo, collation, inserting, alwaysAdd ? NULL : &f->distance);
+				/* Make robust to issues */
+				if (eElement->level < lc)
+					continue;
 
-				if (eDistance < f->distance || alwaysAdd)
-				{
-					HnswCandidate *ec;
+				/* Copy e */
+				ec = (HnswCandidate *)palloc(sizeof(HnswCandidate));
+				HnswPtrStore(base, ec->element, eElement);
+				ec->distance = eDistance;
 
-					Assert(!eElement->deleted);
+				pairingheap_add(C, &(CreatePairingHeapNode(ec)->ph_node));
 
-					/* Make robust to issues */
-					if (eElement->level < lc)
-						continue;
+				/* Expand but do not return elements that fail the filter */
+				if (filter != NULL && !HnswElementMatchesFilter(eElement, filter))
+					continue;
 
-					/* Copy e */
-					ec = (HnswCandidate *)palloc(sizeof(HnswCandidate));
-					HnswPtrStore(base, ec->element, eElement);
-					ec->distance = eDistance;
+				pairingheap_add(W, &(CreatePairingHeapNode(ec)->ph_node));
 
-					pairingheap_add(C, &(CreatePairingHeapNode(ec)->ph_node));
-					pairingheap_add(W, &(CreatePairingHeapNode(ec)->ph_node));
+				/*
+				 * Do not count elements being deleted towards ef when
+				 * vacuuming. It would be ideal to do this for inserts as
+				 * well, but this could affect insert performance.
+				 */
+				if (CountElement(base, skipElement, e))
+				{
+					wlen++;
 
-					/*
-					 * Do not count elements being deleted towards ef when
-					 * vacuuming. It would be ideal to do this for inserts as
-					 * well, but this could affect insert performance.
-					 */
-					if (CountElement(base, skipElement, e))
+					/* No need to decrement wlen */
+					if (wlen > ef)
 					{
-						wlen++;
+						pairingheap_node *d = pairingheap_remove_first(W);
 
-						/* No need to decrement wlen */
-						if (wlen > ef)
-							pairingheap_remove_first(W);
+						/* Keep for iterative scans */
+						if (discarded != NULL)
+							pairingheap_add(*discarded, d);
 					}
 				}
 			}
+			else if (discarded != NULL)
+			{
+				HnswCandidate *ec = (HnswCandidate *)palloc(sizeof(HnswCandidate));
+
+				HnswPtrStore(base, ec->element, eElement);
+				ec->distance = eDistance;
+
+				pairingheap_add(*discarded, &(CreatePairingHeapNode(ec)->ph_node));
+			}
 		}
 	}
 
@@ -852,6 +1268,15 @@ HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, F
 		w = lappend(w, hc);
 	}
 
+	/* Callers can search many times in the same memory context */
+	pfree(unvisited);
+	pfree(values);
+	pfree(distances);
+	if (data != NULL)
+		pfree(data);
+	if (neighborhoodData != NULL)
+		pfree(neighborhoodData);
+
 	return w;
 }
 
@@ -1058,6 +1483,15 @@ SelectNeighbors(char *base, List *c, int lm, int lc, FmgrInfo *procinfo, Oid col
 	return r;
 }
 
+/*
+ * Select neighbors for an element from candidates in any order
+ */
+List *
+HnswSelectNeighbors(char *base, List *c, int lm, int lc, FmgrInfo *procinfo, Oid collation, HnswElement element)
+{
+	return SelectNeighbors(base, c, lm, lc, procinfo, collation, element, NULL, NULL, true);
+}
+
 /*
  * Add connections
  */
@@ -1204,7 +1638,7 @@ PrecomputeHash(char *base, HnswElement element)
  * Algorithm 1 from paper
  */
 void
-HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, FmgrInfo *procinfo, Oid collation, int m, int efConstruction, bool existing)
+HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, FmgrInfo *procinfo, Oid collation, const HnswTypeInfo * typeInfo, int m, int efConstruction, bool existing)
 {
 	List	   *ep;
 	List	   *w;
@@ -1230,7 +1664,7 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 	/* 1st phase: greedy search to insert level */
 	for (int lc = entryLevel; lc >= level + 1; lc--)
 	{
-		w = HnswSearchLayer(base, q, ep, 1, lc, index, procinfo, collation, m, true, skipElement);
+		w = HnswSearchLayer(base, q, ep, 1, lc, index, procinfo, collation, typeInfo, m, true, skipElement, NULL, NULL, true, NULL, NULL, NULL);
 		ep = w;
 	}
 
@@ -1248,7 +1682,7 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 		List	   *neighbors;
 		List	   *lw;
 
-		w = HnswSearchLayer(base, q, ep, efConstruction, lc, index, procinfo, collation, m, true, skipElement);
+		w = HnswSearchLayer(base, q, ep, efConstruction, lc, index, procinfo, collation, typeInfo, m, true, skipElement, NULL, NULL, true, NULL, NULL, NULL);
 
 		/* Elements being deleted or skipped can help with search */
 		/* but should be removed before selecting neighbors */
@@ -1298,13 +1732,34 @@ HnswGetTypeInfo(Relation index)
 		static const HnswTypeInfo typeInfo = {
 			.maxDimensions = HNSW_MAX_DIM,
 			.normalize = l2_normalize,
-			.checkValue = NULL
+			.checkValue = NULL,
+			.distanceBatch = VectorDistanceBatch,
+			.quantize = NULL
 		};
 
+		/* Each dimension takes a single bit in the graph */
+		static const HnswTypeInfo binaryTypeInfo = {
+			.maxDimensions = VECTOR_MAX_DIM,
+			.normalize = l2_normalize,
+			.checkValue = NULL,
+			.distanceBatch = BitDistanceBatch,
+			.quantize = binary_quantize
+		};
+
+		if (HnswGetQuantizer(index) == HNSW_QUANTIZER_BINARY)
+			return (&binaryTypeInfo);
+
 		return (&typeInfo);
 	}
 	else
+	{
+		if (HnswGetQuantizer(index) == HNSW_QUANTIZER_BINARY)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("binary quantizer is only supported for vector")));
+
 		return (const HnswTypeInfo *) DatumGetPointer(OidFunctionCall0Coll(procinfo->fn_oid, InvalidOid));
+	}
 }
 
 PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_halfvec_support);
@@ -1314,7 +1769,9 @@ hnsw_halfvec_support(PG_FUNCTION_ARGS)
 	static const HnswTypeInfo typeInfo = {
 		.maxDimensions = HNSW_MAX_DIM * 2,
 		.normalize = halfvec_l2_normalize,
-		.checkValue = NULL
+		.checkValue = NULL,
+		.distanceBatch = HalfvecDistanceBatch,
+		.quantize = NULL
 	};
 
 	PG_RETURN_POINTER(&typeInfo);
@@ -1327,7 +1784,9 @@ hnsw_bit_support(PG_FUNCTION_ARGS)
 	static const HnswTypeInfo typeInfo = {
 		.maxDimensions = HNSW_MAX_DIM * 32,
 		.normalize = NULL,
-		.checkValue = NULL
+		.checkValue = NULL,
+		.distanceBatch = BitDistanceBatch,
+		.quantize = NULL
 	};
 
 	PG_RETURN_POINTER(&typeInfo);
@@ -1340,7 +1799,9 @@ hnsw_sparsevec_support(PG_FUNCTION_ARGS)
 	static const HnswTypeInfo typeInfo = {
 		.maxDimensions = SPARSEVEC_MAX_DIM,
 		.normalize = sparsevec_l2_normalize,
-		.checkValue = SparsevecCheckValue
+		.checkValue = SparsevecCheckValue,
+		.distanceBatch = NULL,
+		.quantize = NULL
 	};
 
 	PG_RETURN_POINTER(&typeInfo);
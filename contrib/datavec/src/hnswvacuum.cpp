@@ -5,10 +5,13 @@
 #include "access/generic_xlog.h"
 #include "commands/vacuum.h"
 #include "hnsw.h"
+#include "postmaster/bgworker.h"
 #include "storage/buf/bufmgr.h"
 #include "storage/lmgr.h"
 #include "utils/memutils.h"
 
+int			hnsw_vacuum_workers;
+
 /*
  * Check if deleted list contains an index TID
  */
@@ -178,35 +181,21 @@ NeedsUpdated(HnswVacuumState * vacuumstate, HnswElement element)
 }
 
 /*
- * Repair graph for a single element
+ * Write the neighbor tuple of an element
  */
 static void
-RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswElement entryPoint)
+WriteNeighborTuple(HnswVacuumState * vacuumstate, HnswElement element)
 {
 	Relation	index = vacuumstate->index;
 	Buffer		buf;
 	Page		page;
 	GenericXLogState *state;
 	int			m = vacuumstate->m;
-	int			efConstruction = vacuumstate->efConstruction;
-	FmgrInfo   *procinfo = vacuumstate->procinfo;
-	Oid			collation = vacuumstate->collation;
 	BufferAccessStrategy bas = vacuumstate->bas;
 	HnswNeighborTuple ntup = vacuumstate->ntup;
 	Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
 	char	   *base = NULL;
 
-	/* Skip if element is entry point */
-	if (entryPoint != NULL && element->blkno == entryPoint->blkno && element->offno == entryPoint->offno)
-		return;
-
-	/* Init fields */
-	HnswInitNeighbors(base, element, m, NULL);
-	element->heaptidsLength = 0;
-
-	/* Find neighbors for element, skipping itself */
-	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, m, efConstruction, true);
-
 	/* Zero memory for each element */
 	MemSet(ntup, 0, HNSW_TUPLE_ALLOC_SIZE);
 
@@ -227,9 +216,149 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 	/* Commit */
 	GenericXLogFinish(state);
 	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Repair graph for a single element
+ */
+static void
+RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswElement entryPoint)
+{
+	Relation	index = vacuumstate->index;
+	int			m = vacuumstate->m;
+	int			efConstruction = vacuumstate->efConstruction;
+	FmgrInfo   *procinfo = vacuumstate->procinfo;
+	Oid			collation = vacuumstate->collation;
+	char	   *base = NULL;
+
+	/* Skip if element is entry point */
+	if (entryPoint != NULL && element->blkno == entryPoint->blkno && element->offno == entryPoint->offno)
+		return;
+
+	/* Init fields */
+	HnswInitNeighbors(base, element, m, NULL);
+	element->heaptidsLength = 0;
+
+	/* Find neighbors for element, skipping itself */
+	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, vacuumstate->typeInfo, m, efConstruction, true);
+
+	/* Update neighbor tuple */
+	WriteNeighborTuple(vacuumstate, element);
 
 	/* Update neighbors */
 	HnswUpdateNeighborsOnDisk(index, procinfo, collation, element, m, true, false);
+
+	vacuumstate->searchRepairs++;
+}
+
+/*
+ * Add a candidate for a local repair if not seen
+ */
+static void
+AddLocalCandidate(HnswVacuumState * vacuumstate, tidhash_hash * seen, List **c, HnswCandidate * hc, Datum q)
+{
+	HnswElement hce = (HnswElement) HnswPtrAccess((char *) NULL, hc->element);
+	HnswCandidate *copy;
+	ItemPointerData indextid;
+	bool		found;
+
+	ItemPointerSet(&indextid, hce->blkno, hce->offno);
+	if (DeletedContains(vacuumstate->deleted, &indextid))
+		return;
+
+	tidhash_insert(seen, indextid, &found);
+	if (found)
+		return;
+
+	/* Copy since neighbors are replaced after selection */
+	copy = (HnswCandidate *) palloc(sizeof(HnswCandidate));
+	HnswPtrStore((char *) NULL, copy->element, hce);
+	HnswLoadElement(hce, &copy->distance, &q, vacuumstate->index, vacuumstate->procinfo, vacuumstate->collation, true, NULL);
+
+	/* Skip elements deleted since the first pass */
+	if (hce->heaptidsLength == 0 || hce->deleted)
+		return;
+
+	*c = lappend(*c, copy);
+}
+
+/*
+ * Repair graph for a single element from the neighbors of its deleted
+ * neighbors, without searching the graph or updating other elements
+ *
+ * Returns false if the bottom layer could not be filled, in which case
+ * nothing is written and the element needs a full repair
+ */
+static bool
+RepairGraphElementLocal(HnswVacuumState * vacuumstate, HnswElement element, HnswElement entryPoint)
+{
+	Relation	index = vacuumstate->index;
+	int			m = vacuumstate->m;
+	char	   *base = NULL;
+	Datum		q = HnswGetValue(base, element);
+
+	/* Skip if element is entry point */
+	if (entryPoint != NULL && element->blkno == entryPoint->blkno && element->offno == entryPoint->offno)
+		return true;
+
+	HnswLoadNeighbors(element, index, m);
+
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+		int			lm = HnswGetLayerM(m, lc);
+		tidhash_hash *seen = tidhash_create(CurrentMemoryContext, 256, NULL);
+		List	   *c = NIL;
+		List	   *selected;
+		ListCell   *lc2;
+		ItemPointerData indextid;
+		bool		found;
+
+		ItemPointerSet(&indextid, element->blkno, element->offno);
+		tidhash_insert(seen, indextid, &found);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswCandidate *hc = &neighbors->items[i];
+			HnswElement hce = (HnswElement) HnswPtrAccess(base, hc->element);
+
+			ItemPointerSet(&indextid, hce->blkno, hce->offno);
+
+			if (DeletedContains(vacuumstate->deleted, &indextid))
+			{
+				HnswNeighborArray *dneighbors;
+
+				/* Use the neighbors of the deleted element instead */
+				HnswLoadElement(hce, NULL, NULL, index, vacuumstate->procinfo, vacuumstate->collation, false, NULL);
+				if (hce->level < lc)
+					continue;
+
+				HnswLoadNeighbors(hce, index, m);
+				dneighbors = HnswGetNeighbors(base, hce, lc);
+
+				for (int j = 0; j < dneighbors->length; j++)
+					AddLocalCandidate(vacuumstate, seen, &c, &dneighbors->items[j], q);
+			}
+			else
+				AddLocalCandidate(vacuumstate, seen, &c, hc, q);
+		}
+
+		selected = HnswSelectNeighbors(base, c, lm, lc, vacuumstate->procinfo, vacuumstate->collation, element);
+
+		/* Fall back to a search if the bottom layer is not full */
+		if (lc == 0 && list_length(selected) < lm)
+			return false;
+
+		neighbors->length = 0;
+		foreach(lc2, selected)
+			neighbors->items[neighbors->length++] = *((HnswCandidate *) lfirst(lc2));
+	}
+
+	WriteNeighborTuple(vacuumstate, element);
+
+	vacuumstate->localRepairs++;
+
+	return true;
 }
 
 /*
@@ -316,118 +445,277 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 }
 
 /*
- * Repair graph for all elements
+ * Repair graph for the elements on a block
  */
 static void
-RepairGraph(HnswVacuumState * vacuumstate)
+RepairBlock(HnswVacuumState * vacuumstate, BlockNumber blkno)
 {
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	Buffer		buf;
+	Page		page;
+	OffsetNumber offno;
+	OffsetNumber maxoffno;
+	List	   *elements = NIL;
+	ListCell   *lc2;
+	MemoryContext oldCtx;
 
-	/*
-	 * Wait for inserts to complete. Inserts before this point may have
-	 * neighbors about to be deleted. Inserts after this point will not.
-	 */
-	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
-	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	vacuum_delay_point();
 
-	/* Repair entry point first */
-	RepairGraphEntryPoint(vacuumstate);
+	oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
 
-	while (BlockNumberIsValid(blkno))
-	{
-		Buffer		buf;
-		Page		page;
-		OffsetNumber offno;
-		OffsetNumber maxoffno;
-		List	   *elements = NIL;
-		ListCell   *lc2;
-		MemoryContext oldCtx;
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoffno = PageGetMaxOffsetNumber(page);
 
-		vacuum_delay_point();
+	/* Load items into memory to minimize locking */
+	for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+		HnswElement element;
 
-		oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
+		/* Skip neighbor tuples */
+		if (!HnswIsElementTuple(etup))
+			continue;
 
-		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
-		LockBuffer(buf, BUFFER_LOCK_SHARE);
-		page = BufferGetPage(buf);
-		maxoffno = PageGetMaxOffsetNumber(page);
+		/* Skip updating neighbors if being deleted */
+		if (!ItemPointerIsValid(&etup->heaptids[0]))
+			continue;
 
-		/* Load items into memory to minimize locking */
-		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
-		{
-			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
-			HnswElement element;
+		/* Create an element */
+		element = HnswInitElementFromBlock(blkno, offno);
+		HnswLoadElementFromTuple(element, etup, false, true);
 
-			/* Skip neighbor tuples */
-			if (!HnswIsElementTuple(etup))
-				continue;
+		elements = lappend(elements, element);
+	}
 
-			/* Skip updating neighbors if being deleted */
-			if (!ItemPointerIsValid(&etup->heaptids[0]))
-				continue;
+	UnlockReleaseBuffer(buf);
 
-			/* Create an element */
-			element = HnswInitElementFromBlock(blkno, offno);
-			HnswLoadElementFromTuple(element, etup, false, true);
+	/* Update neighbor pages */
+	foreach(lc2, elements)
+	{
+		HnswElement element = (HnswElement) lfirst(lc2);
+		HnswElement entryPoint;
+		LOCKMODE	lockmode = ShareLock;
 
-			elements = lappend(elements, element);
-		}
+		/* Check if any neighbors point to deleted values */
+		if (!NeedsUpdated(vacuumstate, element))
+			continue;
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
+		/* Get a shared lock */
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
 
-		UnlockReleaseBuffer(buf);
+		/* Refresh entry point for each element */
+		entryPoint = HnswGetEntryPoint(index);
 
-		/* Update neighbor pages */
-		foreach(lc2, elements)
+		/* Prevent concurrent inserts when likely updating entry point */
+		if (entryPoint == NULL || element->level > entryPoint->level)
 		{
-			HnswElement element = (HnswElement) lfirst(lc2);
-			HnswElement entryPoint;
-			LOCKMODE	lockmode = ShareLock;
-
-			/* Check if any neighbors point to deleted values */
-			if (!NeedsUpdated(vacuumstate, element))
-				continue;
+			/* Release shared lock */
+			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
 
-			/* Get a shared lock */
+			/* Get exclusive lock */
+			lockmode = ExclusiveLock;
 			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
 
-			/* Refresh entry point for each element */
+			/* Get latest entry point after lock is acquired */
 			entryPoint = HnswGetEntryPoint(index);
+		}
 
-			/* Prevent concurrent inserts when likely updating entry point */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-			{
-				/* Release shared lock */
-				UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		/* Repair connections, locally if possible */
+		if (vacuumstate->repair != HNSW_VACUUM_REPAIR_INCREMENTAL || lockmode != ShareLock ||
+			!RepairGraphElementLocal(vacuumstate, element, entryPoint))
+			RepairGraphElement(vacuumstate, element, entryPoint);
 
-				/* Get exclusive lock */
-				lockmode = ExclusiveLock;
-				LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		/*
+		 * Update metapage if needed. Should only happen if entry point was
+		 * replaced and highest point was outdated.
+		 */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+			HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
 
-				/* Get latest entry point after lock is acquired */
-				entryPoint = HnswGetEntryPoint(index);
-			}
+		/* Release lock */
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	}
 
-			/* Repair connections */
-			RepairGraphElement(vacuumstate, element, entryPoint);
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(vacuumstate->tmpCtx);
+}
 
-			/*
-			 * Update metapage if needed. Should only happen if entry point
-			 * was replaced and highest point was outdated.
-			 */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-				HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+/*
+ * Claim and repair blocks until none are left
+ *
+ * Participants repair elements like concurrent inserts, so the same locking
+ * applies
+ */
+static void
+RepairParticipate(HnswVacuumShared * vshared, HnswVacuumState * vacuumstate)
+{
+	for (;;)
+	{
+		BlockNumber startBlkno;
 
-			/* Release lock */
-			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		SpinLockAcquire(&vshared->mutex);
+		startBlkno = vshared->nextBlkno;
+		if (startBlkno < vshared->endBlkno)
+			vshared->nextBlkno = startBlkno + HNSW_VACUUM_CHUNK_SIZE;
+		SpinLockRelease(&vshared->mutex);
+
+		if (startBlkno >= vshared->endBlkno)
+			break;
+
+		for (BlockNumber blkno = startBlkno; blkno < startBlkno + HNSW_VACUUM_CHUNK_SIZE && blkno < vshared->endBlkno; blkno++)
+			RepairBlock(vacuumstate, blkno);
+	}
+
+	/* Record statistics */
+	SpinLockAcquire(&vshared->mutex);
+	vshared->localRepairs += vacuumstate->localRepairs;
+	vshared->searchRepairs += vacuumstate->searchRepairs;
+	SpinLockRelease(&vshared->mutex);
+}
+
+/*
+ * Initialize the state needed to repair the graph
+ */
+static void
+InitRepairState(HnswVacuumState * vacuumstate, Relation index)
+{
+	vacuumstate->index = index;
+	vacuumstate->efConstruction = HnswGetEfConstruction(index);
+	vacuumstate->repair = HnswGetVacuumRepair(index);
+	vacuumstate->bas = GetAccessStrategy(BAS_BULKREAD);
+	vacuumstate->procinfo = HnswGetDistanceProcInfo(index);
+	vacuumstate->typeInfo = HnswGetTypeInfo(index);
+	vacuumstate->collation = index->rd_indcollation[0];
+	vacuumstate->ntup = (HnswNeighborTuple)palloc0(HNSW_TUPLE_ALLOC_SIZE);
+	vacuumstate->localRepairs = 0;
+	vacuumstate->searchRepairs = 0;
+	vacuumstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												"Hnsw vacuum temporary context",
+												ALLOCSET_DEFAULT_SIZES);
+
+	/* Get m from metapage */
+	HnswGetMetaPageInfo(index, &vacuumstate->m, NULL);
+}
+
+/*
+ * Free the state needed to repair the graph
+ */
+static void
+FreeRepairState(HnswVacuumState * vacuumstate)
+{
+	FreeAccessStrategy(vacuumstate->bas);
+	pfree(vacuumstate->ntup);
+	MemoryContextDelete(vacuumstate->tmpCtx);
+}
+
+/*
+ * Perform work within a launched parallel process
+ */
+void
+HnswParallelVacuumMain(const BgWorkerContext *bwc)
+{
+	HnswVacuumShared *vshared = (HnswVacuumShared *) bwc->bgshared;
+	HnswVacuumState vacuumstate;
+	Relation	index;
+
+	/* Open relation within worker */
+	index = index_open(vshared->indexrelid, NoLock);
+
+	InitRepairState(&vacuumstate, index);
+	vacuumstate.deleted = vshared->deleted;
+
+	RepairParticipate(vshared, &vacuumstate);
+
+	FreeRepairState(&vacuumstate);
+
+	/* Close relation within worker */
+	index_close(index, NoLock);
+}
+
+/*
+ * Initialize shared state
+ */
+static void
+InitVacuumShared(HnswVacuumShared * vshared, HnswVacuumState * vacuumstate, BlockNumber endBlkno)
+{
+	vshared->indexrelid = RelationGetRelid(vacuumstate->index);
+	vshared->deleted = vacuumstate->deleted;
+	vshared->endBlkno = endBlkno;
+	SpinLockInit(&vshared->mutex);
+	vshared->nextBlkno = HNSW_HEAD_BLKNO;
+	vshared->localRepairs = 0;
+	vshared->searchRepairs = 0;
+}
+
+/*
+ * Repair graph for all elements
+ */
+static void
+RepairGraph(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	HnswVacuumShared local;
+	HnswVacuumShared *vshared = &local;
+	BlockNumber endBlkno;
+	int			nworkers = 0;
+
+	/*
+	 * Wait for inserts to complete. Inserts before this point may have
+	 * neighbors about to be deleted. Inserts after this point will not.
+	 */
+	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+
+	/* Repair entry point first */
+	RepairGraphEntryPoint(vacuumstate);
+
+	/* Pages added after this point only have elements inserted after the wait */
+	endBlkno = RelationGetNumberOfBlocks(index);
+
+	/* Nothing to repair if no elements were deleted */
+	if (vacuumstate->deleted->members == 0 && vacuumstate->repair == HNSW_VACUUM_REPAIR_INCREMENTAL)
+		endBlkno = HNSW_HEAD_BLKNO;
+
+	if (hnsw_vacuum_workers > 0 && endBlkno > HNSW_HEAD_BLKNO + HNSW_VACUUM_CHUNK_SIZE)
+	{
+		int			request = (int) Min((BlockNumber) hnsw_vacuum_workers, (endBlkno - HNSW_HEAD_BLKNO - 1) / HNSW_VACUUM_CHUNK_SIZE);
+
+		vshared = (HnswVacuumShared *) MemoryContextAllocZero(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), sizeof(HnswVacuumShared));
+		InitVacuumShared(vshared, vacuumstate, endBlkno);
+
+		nworkers = LaunchBackgroundWorkers(request, vshared, HnswParallelVacuumMain, NULL);
+
+		/* If no workers were successfully launched, back out (repair serially) */
+		if (nworkers == 0)
+		{
+			pfree_ext(vshared);
+			vshared = &local;
 		}
+	}
+
+	if (vshared == &local)
+		InitVacuumShared(vshared, vacuumstate, endBlkno);
+
+	/* Participate as a worker */
+	RepairParticipate(vshared, vacuumstate);
 
-		/* Reset memory context */
-		MemoryContextSwitchTo(oldCtx);
-		MemoryContextReset(vacuumstate->tmpCtx);
+	if (nworkers > 0)
+	{
+		BgworkerListWaitFinish(&nworkers);
+		pg_memory_barrier();
 	}
+
+	ereport(DEBUG1,
+			(errmsg("hnsw vacuum repaired " INT64_FORMAT " elements locally and " INT64_FORMAT " with searches",
+					vshared->localRepairs, vshared->searchRepairs)));
+
+	/* Shut down workers, which frees the shared state */
+	if (nworkers > 0)
+		BgworkerListSyncQuit();
 }
 
 /*
@@ -456,6 +744,10 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 		GenericXLogState *state;
 		OffsetNumber offno;
 		OffsetNumber maxoffno;
+		Buffer		nbufs[MAX_GENERIC_XLOG_PAGES - 1];
+		Page		npages[MAX_GENERIC_XLOG_PAGES - 1];
+		int			nnbufs = 0;
+		bool		updated = false;
 
 		vacuum_delay_point();
 
@@ -473,13 +765,15 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 		page = GenericXLogRegisterBuffer(state, buf, 0);
 		maxoffno = PageGetMaxOffsetNumber(page);
 
-		/* Update element and neighbors together */
+		/*
+		 * Update elements and neighbors together, with one WAL record for all
+		 * elements on the page unless their neighbors are on too many pages
+		 */
 		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 		{
 			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
 			HnswNeighborTuple ntup;
-			Buffer		nbuf;
-			Page		npage;
+			Page		npage = NULL;
 			BlockNumber neighborPage;
 			OffsetNumber neighborOffno;
 
@@ -506,15 +800,40 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
 
 			if (neighborPage == blkno)
-			{
-				nbuf = buf;
 				npage = page;
-			}
 			else
 			{
-				nbuf = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, bas);
-				LockBuffer(nbuf, BUFFER_LOCK_EXCLUSIVE);
-				npage = GenericXLogRegisterBuffer(state, nbuf, 0);
+				for (int i = 0; i < nnbufs; i++)
+				{
+					if (BufferGetBlockNumber(nbufs[i]) == neighborPage)
+					{
+						npage = npages[i];
+						break;
+					}
+				}
+			}
+
+			if (npage == NULL)
+			{
+				/* Commit if the record cannot hold another page */
+				if (nnbufs == MAX_GENERIC_XLOG_PAGES - 1)
+				{
+					GenericXLogFinish(state);
+					for (int i = 0; i < nnbufs; i++)
+						UnlockReleaseBuffer(nbufs[i]);
+					nnbufs = 0;
+
+					/* Prepare new xlog */
+					state = GenericXLogStart(index);
+					page = GenericXLogRegisterBuffer(state, buf, 0);
+					etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+				}
+
+				nbufs[nnbufs] = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, bas);
+				LockBuffer(nbufs[nnbufs], BUFFER_LOCK_EXCLUSIVE);
+				npages[nnbufs] = GenericXLogRegisterBuffer(state, nbufs[nnbufs], 0);
+				npage = npages[nnbufs];
+				nnbufs++;
 			}
 
 			ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, neighborOffno));
@@ -531,24 +850,23 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			 * We modified the tuples in place, no need to call
 			 * page_index_tuple_overwrite
 			 */
-
-			/* Commit */
-			GenericXLogFinish(state);
-			if (nbuf != buf)
-				UnlockReleaseBuffer(nbuf);
+			updated = true;
 
 			/* Set to first free page */
 			if (!BlockNumberIsValid(insertPage))
 				insertPage = blkno;
-
-			/* Prepare new xlog */
-			state = GenericXLogStart(index);
-			page = GenericXLogRegisterBuffer(state, buf, 0);
 		}
 
 		blkno = HnswPageGetOpaque(page)->nextblkno;
 
-		GenericXLogAbort(state);
+		/* Commit */
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+
+		for (int i = 0; i < nnbufs; i++)
+			UnlockReleaseBuffer(nbufs[i]);
 		UnlockReleaseBuffer(buf);
 	}
 
@@ -562,31 +880,31 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 static void
 InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
 {
-	Relation	index = info->index;
-
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
-	vacuumstate->index = index;
+	InitRepairState(vacuumstate, info->index);
 	vacuumstate->stats = stats;
 	vacuumstate->callback = callback;
 	vacuumstate->callback_state = callback_state;
-	vacuumstate->efConstruction = HnswGetEfConstruction(index);
-	vacuumstate->bas = GetAccessStrategy(BAS_BULKREAD);
-	vacuumstate->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
-	vacuumstate->collation = index->rd_indcollation[0];
-	vacuumstate->ntup = (HnswNeighborTuple)palloc0(HNSW_TUPLE_ALLOC_SIZE);
-	vacuumstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
-												"Hnsw vacuum temporary context",
-												ALLOCSET_DEFAULT_SIZES);
-
-	/* Get m from metapage */
-	HnswGetMetaPageInfo(index, &vacuumstate->m, NULL);
 
 	/* Create hash table */
 	vacuumstate->deleted = tidhash_create(CurrentMemoryContext, 256, NULL);
 }
 
+/*
+ * Invalidate the cached graph after a pass changes it
+ */
+static void
+InvalidateGraphCache(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+
+	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	HnswInvalidateGraphCache(index);
+	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+}
+
 /*
  * Free resources
  */
@@ -594,9 +912,7 @@ static void
 FreeVacuumState(HnswVacuumState * vacuumstate)
 {
 	tidhash_destroy(vacuumstate->deleted);
-	FreeAccessStrategy(vacuumstate->bas);
-	pfree(vacuumstate->ntup);
-	MemoryContextDelete(vacuumstate->tmpCtx);
+	FreeRepairState(vacuumstate);
 }
 
 /*
@@ -615,15 +931,162 @@ hnswbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 
 	/* Pass 2: Repair graph */
 	RepairGraph(&vacuumstate);
+	InvalidateGraphCache(&vacuumstate);
 
 	/* Pass 3: Mark as deleted */
 	MarkDeleted(&vacuumstate);
+	InvalidateGraphCache(&vacuumstate);
 
 	FreeVacuumState(&vacuumstate);
 
 	return vacuumstate.stats;
 }
 
+/*
+ * Copy the value of an element on a random page to use as a query
+ */
+static Datum
+SampleElementValue(Relation index, BlockNumber nblocks, BufferAccessStrategy bas)
+{
+	BlockNumber blkno = HNSW_HEAD_BLKNO + (BlockNumber) (RandomDouble() * (nblocks - HNSW_HEAD_BLKNO));
+	Buffer		buf;
+	Page		page;
+	OffsetNumber maxoffno;
+	Datum		value = (Datum) 0;
+
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+		/* Skip neighbor tuples and elements being deleted */
+		if (!HnswIsElementTuple(etup) || etup->deleted || !ItemPointerIsValid(&etup->heaptids[0]))
+			continue;
+
+		value = PointerGetDatum(palloc(VARSIZE_ANY(&etup->data)));
+		memcpy(DatumGetPointer(value), &etup->data, VARSIZE_ANY(&etup->data));
+		break;
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return value;
+}
+
+/*
+ * Measure searches for the planner
+ *
+ * Searches for the values of random elements with the default ef_search and
+ * stores the average number of elements visited on the metapage, which the
+ * planner scales to the ef_search of the query. Stored values are already
+ * normalized or quantized, so they are searched as is. Searches are only
+ * repeated when the number of rows has changed materially.
+ */
+void
+HnswUpdateSearchStats(Relation index, double rows)
+{
+	char	   *base = NULL;
+	const		HnswTypeInfo *typeInfo = HnswGetTypeInfo(index);
+	FmgrInfo   *procinfo = HnswGetDistanceProcInfo(index);
+	Oid			collation = index->rd_indcollation[0];
+	BlockNumber nblocks;
+	BufferAccessStrategy bas;
+	MemoryContext tmpCtx;
+	MemoryContext oldCtx;
+	int64		tuples = 0;
+	int			searches = 0;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	HnswMetaPage metap;
+	int			oldEfSearch;
+	double		oldRows;
+	double		oldVisited;
+	int			efSearch;
+	float		visited;
+
+	HnswGetSearchStats(index, &oldEfSearch, &oldRows, &oldVisited);
+	if (oldEfSearch > 0 && fabs(rows - oldRows) <= oldRows * HNSW_STATS_CHANGE)
+		return;
+
+	nblocks = RelationGetNumberOfBlocks(index);
+	bas = GetAccessStrategy(BAS_BULKREAD);
+	tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+								   "Hnsw stats temporary context",
+								   ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+	for (int i = 0; i < HNSW_STATS_SAMPLES && nblocks > HNSW_HEAD_BLKNO; i++)
+	{
+		Datum		q;
+		int			m;
+		HnswElement entryPoint;
+		List	   *ep;
+
+		vacuum_delay_point();
+
+		q = SampleElementValue(index, nblocks, bas);
+		if (q == (Datum) 0)
+			continue;
+
+		/* Same lock as scans */
+		LockPage(index, HNSW_SCAN_LOCK, ShareLock);
+
+		HnswGetMetaPageInfo(index, &m, &entryPoint);
+		if (entryPoint == NULL)
+		{
+			UnlockPage(index, HNSW_SCAN_LOCK, ShareLock);
+			break;
+		}
+
+		/* Count the entry point and elements visited in every layer */
+		ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, procinfo, collation, false));
+		tuples++;
+
+		for (int lc = entryPoint->level; lc >= 1; lc--)
+			ep = HnswSearchLayer(base, q, ep, 1, lc, index, procinfo, collation, typeInfo, m, false, NULL, NULL, NULL, true, &tuples, NULL, NULL);
+
+		HnswSearchLayer(base, q, ep, HNSW_DEFAULT_EF_SEARCH, 0, index, procinfo, collation, typeInfo, m, false, NULL, NULL, NULL, true, &tuples, NULL, NULL);
+
+		UnlockPage(index, HNSW_SCAN_LOCK, ShareLock);
+
+		searches++;
+		MemoryContextReset(tmpCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(tmpCtx);
+	FreeAccessStrategy(bas);
+
+	efSearch = searches > 0 ? HNSW_DEFAULT_EF_SEARCH : 0;
+	visited = searches > 0 ? (float) tuples / searches : 0;
+
+	/* Skip WAL when nothing changed, such as for empty indexes */
+	if (efSearch == oldEfSearch && (float) rows == (float) oldRows && visited == (float) oldVisited)
+		return;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = HnswPageGetMeta(page);
+
+	metap->statsEfSearch = efSearch;
+	metap->statsRows = (float) rows;
+	metap->statsVisited = visited;
+
+	/* Extend metapages of older indexes */
+	((PageHeader) page)->pd_lower =
+		((char *) metap + sizeof(HnswMetaPageData)) - (char *) page;
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
 /*
  * Clean up after a VACUUM operation
  */
@@ -632,6 +1095,9 @@ hnswvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 {
 	Relation	rel = info->index;
 
+	/* Also called by ANALYZE */
+	HnswUpdateSearchStats(rel, info->num_heap_tuples);
+
 	if (info->analyze_only)
 		return stats;
 
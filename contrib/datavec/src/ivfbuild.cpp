@@ -2,16 +2,24 @@
 
 #include <float.h>
 
+#include "access/reloptions.h"
 #include "access/tableam.h"
 #include "access/xact.h"
 #include "bitvec.h"
 #include "catalog/index.h"
+#include "catalog/namespace.h"
+#include "commands/defrem.h"
+#include "executor/spi.h"
+#include "commands/vacuum.h"
 #include "halfvec.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
 #include "storage/buf/bufmgr.h"
 #include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/syscache.h"
 #include "vector.h"
 #include "postmaster/bgworker.h"
 
@@ -37,6 +45,116 @@
 #define PARALLEL_KEY_IVFFLAT_CENTERS	UINT64CONST(0xA000000000000003)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000004)
 
+/*
+ * Add sample
+ */
+static void
+AddSample(Datum *values, IvfflatBuildState * buildstate)
+{
+	VectorArray samples = buildstate->samples;
+	int			targsamples = samples->maxlen;
+
+	/* Detoast once for all calls */
+	Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+	/*
+	 * Normalize with KMEANS_NORM_PROC since spherical distance function
+	 * expects unit vectors
+	 */
+	if (buildstate->kmeansnormprocinfo != NULL)
+	{
+		if (!IvfflatCheckNorm(buildstate->kmeansnormprocinfo, buildstate->collation, value))
+			return;
+	}
+
+	/* Keep samples in the form stored in lists for quantizer training */
+	if (buildstate->normprocinfo != NULL)
+		value = IvfflatNormValue(buildstate->typeInfo, buildstate->collation, value);
+
+	if (samples->length < targsamples)
+	{
+		VectorArraySet(samples, samples->length, DatumGetPointer(value));
+		samples->length++;
+	}
+	else
+	{
+		if (buildstate->rowstoskip < 0)
+			buildstate->rowstoskip = anl_get_next_S(buildstate->samplerows, targsamples, &buildstate->rstate);
+
+		if (buildstate->rowstoskip <= 0)
+		{
+			int			k = (int) (targsamples * anl_random_fract());
+
+			Assert(k >= 0 && k < targsamples);
+			VectorArraySet(samples, k, DatumGetPointer(value));
+		}
+
+		buildstate->rowstoskip -= 1;
+	}
+
+	buildstate->samplerows += 1;
+}
+
+/*
+ * Callback for sampling
+ */
+static void
+SampleCallback(Relation index, CALLBACK_ITEM_POINTER, Datum *values,
+			   const bool *isnull, bool tupleIsAlive, void *state)
+{
+	IvfflatBuildState *buildstate = (IvfflatBuildState *) state;
+	MemoryContext oldCtx;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	/* Use memory context since detoast can allocate */
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+	/* Add sample */
+	AddSample(values, buildstate);
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+}
+
+/*
+ * Sample rows with reservoir sampling
+ *
+ * There is no block range scan for index builds, so a full scan is used
+ */
+static void
+SampleRows(IvfflatBuildState * buildstate)
+{
+	buildstate->rstate = anl_init_selection_state(buildstate->samples->maxlen);
+	buildstate->rowstoskip = -1;
+	buildstate->samplerows = 0;
+
+	tableam_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
+							 true, SampleCallback, (void *) buildstate, NULL);
+}
+
+/*
+ * Normalize samples for spherical k-means
+ *
+ * Only needed when values are not already normalized for storage
+ */
+static void
+NormSamples(IvfflatBuildState * buildstate)
+{
+	VectorArray samples = buildstate->samples;
+
+	for (int i = 0; i < samples->length; i++)
+	{
+		Datum		value = IvfflatNormValue(buildstate->typeInfo, buildstate->collation, PointerGetDatum(VectorArrayGet(samples, i)));
+
+		VectorArraySet(samples, i, DatumGetPointer(value));
+		pfree(DatumGetPointer(value));
+	}
+}
+
 /*
  * Add tuple to sort
  */
@@ -87,6 +205,18 @@ AddTupleToSort(Relation index, ItemPointer tid, Datum *values, IvfflatBuildState
 	slot->tts_isnull[1] = false;
 	slot->tts_values[2] = value;
 	slot->tts_isnull[2] = false;
+
+	/* Store codes instead of the value when quantized */
+	if (buildstate->quantizer != NULL)
+	{
+		Size		size = IvfflatQuantizedSize(buildstate->quantizer);
+		bytea	   *codes = (bytea *) palloc(VARHDRSZ + size);
+
+		SET_VARSIZE(codes, VARHDRSZ + size);
+		IvfflatValueToFloat(buildstate->typeInfo, value, buildstate->dimensions, buildstate->quantvector);
+		IvfflatQuantize(buildstate->quantizer, buildstate->quantvector, (uint8 *) VARDATA(codes));
+		slot->tts_values[2] = PointerGetDatum(codes);
+	}
 	ExecStoreVirtualTuple(slot);
 
 	/*
@@ -133,7 +263,7 @@ BuildCallback(Relation index, CALLBACK_ITEM_POINTER, Datum *values,
  * Get index tuple from sort state
  */
 static inline void
-GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list)
+GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list, IvfflatQuantizer quantizer)
 {
 	Datum		value;
 	bool		isnull;
@@ -144,7 +274,10 @@ GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot,
 		value = heap_slot_getattr(slot, 3, &isnull);
 
 		/* Form the index tuple */
-		*itup = index_form_tuple(tupdesc, &value, &isnull);
+		if (quantizer != NULL)
+			*itup = IvfflatFormQuantizedTuple(quantizer, (uint8 *) VARDATA_ANY(DatumGetPointer(value)));
+		else
+			*itup = index_form_tuple(tupdesc, &value, &isnull);
 		(*itup)->t_tid = *((ItemPointer) DatumGetPointer(heap_slot_getattr(slot, 2, &isnull)));
 	}
 	else
@@ -164,7 +297,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 	TupleTableSlot *slot = MakeSingleTupleTableSlot(buildstate->tupdesc);
 	TupleDesc	tupdesc = RelationGetDescr(index);
 
-	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list, buildstate->quantizer);
 
 	for (int i = 0; i < buildstate->centers->length; i++)
 	{
@@ -200,7 +333,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 			UpdateProgress(PROGRESS_CREATEIDX_TUPLES_DONE, ++inserted);
 
-			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list, buildstate->quantizer);
 		}
 
 		insertPage = BufferGetBlockNumber(buf);
@@ -212,18 +345,239 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 	}
 }
 
+/*
+ * Add a center from floats
+ */
+static void
+AddCenter(IvfflatBuildState * buildstate, VectorArray centers, float *x)
+{
+	Pointer		center = VectorArrayGet(centers, centers->length);
+
+	buildstate->typeInfo->updateCenter(center, centers->dim, x);
+
+	/* Normalize for spherical k-means */
+	if (buildstate->kmeansnormprocinfo != NULL)
+	{
+		Datum		value = IvfflatNormValue(buildstate->typeInfo, buildstate->collation, PointerGetDatum(center));
+
+		if (VARSIZE_ANY(DatumGetPointer(value)) > centers->itemsize)
+			elog(ERROR, "safety check failed");
+
+		memcpy(center, DatumGetPointer(value), VARSIZE_ANY(DatumGetPointer(value)));
+	}
+
+	if (buildstate->normprocinfo != NULL && !IvfflatCheckNorm(buildstate->normprocinfo, buildstate->collation, PointerGetDatum(center)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("centroids_from contains a zero vector")));
+
+	centers->length++;
+}
+
+/*
+ * Load centers from an ivfflat index
+ */
+static VectorArray
+LoadIndexCenters(IvfflatBuildState * buildstate, Relation rel)
+{
+	const IvfflatTypeInfo *typeInfo;
+	VectorArray src;
+	VectorArray centers;
+	float	   *x;
+
+	if (rel->rd_rel->relam != get_am_oid("ivfflat", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("centroids_from index \"%s\" is not an ivfflat index", RelationGetRelationName(rel))));
+
+	IvfflatCheckTablePrivilege(rel);
+
+	typeInfo = IvfflatGetTypeInfo(rel);
+	src = IvfflatReadCenters(rel);
+	if (src->dim != buildstate->dimensions)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("centroids_from has %d dimensions, expected %d", src->dim, buildstate->dimensions)));
+
+	centers = VectorArrayInit(src->length, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
+	x = (float *) palloc(sizeof(float) * buildstate->dimensions);
+
+	/* Go through floats so centers can be used by other types */
+	for (int i = 0; i < src->length; i++)
+	{
+		for (int k = 0; k < buildstate->dimensions; k++)
+			x[k] = 0;
+
+		typeInfo->sumCenter(VectorArrayGet(src, i), x);
+		AddCenter(buildstate, centers, x);
+	}
+
+	pfree(x);
+	VectorArrayFree(src);
+
+	return centers;
+}
+
+/*
+ * Load centers from the first vector column of a table
+ */
+static VectorArray
+LoadTableCenters(IvfflatBuildState * buildstate, Relation rel)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Form_pg_attribute attr = NULL;
+	StringInfoData query;
+	MemoryContext oldCtx = CurrentMemoryContext;
+	MemoryContext spiCtx;
+	VectorArray centers;
+
+	for (int i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute a = TupleDescAttr(tupdesc, i);
+
+		if (!a->attisdropped && strcmp(get_typename(a->atttypid), "vector") == 0)
+		{
+			attr = a;
+			break;
+		}
+	}
+
+	if (attr == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("centroids_from table \"%s\" has no vector column", RelationGetRelationName(rel))));
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "SELECT %s FROM %s", quote_identifier(NameStr(attr->attname)),
+					 quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)), RelationGetRelationName(rel)));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	if (SPI_execute(query.data, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed");
+
+	if (SPI_processed > IVFFLAT_MAX_LISTS)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("centroids_from has more than %d centers", IVFFLAT_MAX_LISTS)));
+
+	/* Allocate outside of SPI memory */
+	spiCtx = MemoryContextSwitchTo(oldCtx);
+	centers = VectorArrayInit((int) SPI_processed, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
+	MemoryContextSwitchTo(spiCtx);
+
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		bool		isnull;
+		Datum		value = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull);
+		Vector	   *vec;
+
+		if (isnull)
+			continue;
+
+		vec = DatumGetVector(value);
+		if (vec->dim != buildstate->dimensions)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_EXCEPTION),
+					 errmsg("centroids_from has %d dimensions, expected %d", vec->dim, buildstate->dimensions)));
+
+		AddCenter(buildstate, centers, vec->x);
+	}
+
+	SPI_finish();
+	pfree(query.data);
+
+	return centers;
+}
+
+/*
+ * Check if lists was set for the index
+ */
+static bool
+ListsIsSet(Relation index)
+{
+	HeapTuple	tuple;
+	Datum		datum;
+	bool		isnull;
+	bool		found = false;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(RelationGetRelid(index)));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for relation %u", RelationGetRelid(index));
+
+	datum = SysCacheGetAttr(RELOID, tuple, Anum_pg_class_reloptions, &isnull);
+	if (!isnull)
+	{
+		ListCell   *lc;
+
+		foreach(lc, untransformRelOptions(datum))
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "lists") == 0)
+				found = true;
+		}
+	}
+
+	ReleaseSysCache(tuple);
+
+	return found;
+}
+
+/*
+ * Load centers from another index or table instead of training
+ */
+static VectorArray
+LoadCenters(IvfflatBuildState * buildstate, const char *name)
+{
+	RangeVar   *rv = makeRangeVarFromNameList(stringToQualifiedNameList(name));
+	Oid			relid = RangeVarGetRelid(rv, AccessShareLock, false);
+	Relation	rel;
+	VectorArray centers = NULL;
+
+	if (relid == RelationGetRelid(buildstate->index))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("centroids_from cannot reference the index being built")));
+
+	rel = relation_open(relid, NoLock);
+
+	if (rel->rd_rel->relkind == RELKIND_INDEX)
+		centers = LoadIndexCenters(buildstate, rel);
+	else if (rel->rd_rel->relkind == RELKIND_RELATION)
+		centers = LoadTableCenters(buildstate, rel);
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("centroids_from must be an ivfflat index or a table")));
+
+	relation_close(rel, AccessShareLock);
+
+	if (centers->length == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("centroids_from has no centers")));
+
+	return centers;
+}
+
 /*
  * Initialize the build state
  */
 static void
-InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, IndexInfo *indexInfo)
+InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, IndexInfo *indexInfo, IvfflatShared * ivfshared)
 {
+	int			quantizer;
+	char	   *centroidsFrom;
+
 	buildstate->heap = heap;
 	buildstate->index = index;
 	buildstate->indexInfo = indexInfo;
 	buildstate->typeInfo = IvfflatGetTypeInfo(index);
 
 	buildstate->lists = IvfflatGetLists(index);
+	buildstate->kmeans = IvfflatGetKmeans(index);
 	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
 
 	/* Disallow varbit since require fixed dimensions */
@@ -240,6 +594,11 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 	buildstate->reltuples = 0;
 	buildstate->indtuples = 0;
 
+	/* Calculate parallel workers */
+	buildstate->parallelWorkers = 0;
+	if (heap != NULL)
+		buildstate->parallelWorkers = PlanCreateIndexWorkers(heap, indexInfo);
+
 	/* Get support functions */
 	buildstate->procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
 	buildstate->normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC);
@@ -250,15 +609,61 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 	if (buildstate->kmeansnormprocinfo != NULL && buildstate->dimensions == 1)
 		elog(ERROR, "dimensions must be greater than one for this opclass");
 
+	/* Set up quantizer */
+	buildstate->quantizer = NULL;
+	buildstate->quantvector = NULL;
+	quantizer = IvfflatGetQuantizerType(index);
+	if (quantizer != IVFFLAT_QUANTIZER_NONE)
+	{
+		int			pqM = 0;
+
+		if (IvfflatGetQuantizerMetric(buildstate->procinfo) < 0)
+			elog(ERROR, "quantizer not supported for this opclass");
+
+		if (quantizer == IVFFLAT_QUANTIZER_PQ)
+		{
+			pqM = IvfflatGetPqM(index, buildstate->dimensions);
+			if (pqM > buildstate->dimensions || buildstate->dimensions % pqM != 0)
+				elog(ERROR, "dimensions must be divisible by pq_m");
+		}
+
+		buildstate->quantizer = IvfflatQuantizerInit(quantizer, buildstate->dimensions, pqM);
+		buildstate->quantvector = (float *) palloc(sizeof(float) * buildstate->dimensions);
+	}
+
 	/* Create tuple description for sorting */
 	buildstate->tupdesc = CreateTemplateTupleDesc(3, false);
 	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 1, "list", INT4OID, -1, 0);
 	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
-	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 3, "vector", RelationGetDescr(index)->attrs[0].atttypid, -1, 0);
+	if (buildstate->quantizer != NULL)
+		TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 3, "codes", BYTEAOID, -1, 0);
+	else
+		TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 3, "vector", RelationGetDescr(index)->attrs[0].atttypid, -1, 0);
 
 	buildstate->slot = MakeSingleTupleTableSlot(buildstate->tupdesc);
 
-	buildstate->centers = VectorArrayInit(buildstate->lists, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
+	centroidsFrom = IvfflatGetCentroidsFrom(index);
+	if (ivfshared != NULL)
+	{
+		/* Workers use the centers of the leader */
+		buildstate->lists = ivfshared->lists;
+		buildstate->centers = VectorArrayInit(buildstate->lists, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
+		memcpy(buildstate->centers->items, ivfshared->ivfcenters, buildstate->centers->itemsize * buildstate->lists);
+		buildstate->centers->length = buildstate->lists;
+	}
+	else if (centroidsFrom != NULL)
+	{
+		/* The number of lists comes from centroids_from */
+		buildstate->centers = LoadCenters(buildstate, centroidsFrom);
+		if (buildstate->centers->length != buildstate->lists && ListsIsSet(index))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("lists is %d, but centroids_from has %d centers", buildstate->lists, buildstate->centers->length),
+					 errhint("Omit lists when using centroids_from.")));
+		buildstate->lists = buildstate->centers->length;
+	}
+	else
+		buildstate->centers = VectorArrayInit(buildstate->lists, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
 	buildstate->listInfo = (ListInfo *)palloc(sizeof(ListInfo) * buildstate->lists);
 
 	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
@@ -282,6 +687,12 @@ FreeBuildState(IvfflatBuildState * buildstate)
 	VectorArrayFree(buildstate->centers);
 	pfree(buildstate->listInfo);
 
+	if (buildstate->quantizer != NULL)
+	{
+		pfree(buildstate->quantizer);
+		pfree(buildstate->quantvector);
+	}
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 	pfree(buildstate->listSums);
 	pfree(buildstate->listCounts);
@@ -298,6 +709,13 @@ ComputeCenters(IvfflatBuildState * buildstate)
 {
 	int			numSamples;
 
+	/* Centers loaded from centroids_from */
+	bool		loaded = buildstate->centers->length > 0;
+
+	/* Samples are only needed to train the quantizer */
+	if (loaded && buildstate->quantizer == NULL)
+		return;
+
 	/* Target 50 samples per list, with at least 10000 samples */
 	/* The number of samples has a large effect on index build time */
 	numSamples = buildstate->lists * 50;
@@ -308,12 +726,21 @@ ComputeCenters(IvfflatBuildState * buildstate)
 	if (buildstate->heap == NULL)
 		numSamples = 1;
 
+	/* Keep the reservoir within maintenance_work_mem for mini-batch */
+	if (buildstate->kmeans == IVFFLAT_KMEANS_MINIBATCH)
+	{
+		int			maxSamples = IvfflatMiniBatchMaxSamples(buildstate->lists, buildstate->dimensions, buildstate->centers->itemsize);
+
+		if (numSamples > maxSamples)
+			numSamples = Max(maxSamples, 1);
+	}
+
 	/* Sample rows */
-	/* TODO Ensure within maintenance_work_mem */
 	buildstate->samples = VectorArrayInit(numSamples, buildstate->dimensions, buildstate->centers->itemsize);
 	if (buildstate->heap != NULL)
 	{
-		if (buildstate->samples->length < buildstate->lists)
+		SampleRows(buildstate);
+		if (buildstate->samples->length < buildstate->lists && !loaded)
 		{
 			ereport(NOTICE,
 					(errmsg("ivfflat index created with little data"),
@@ -322,8 +749,19 @@ ComputeCenters(IvfflatBuildState * buildstate)
 		}
 	}
 
-	/* Calculate centers */
-	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo));
+	/* Train quantizer on values in the form stored in lists */
+	if (buildstate->quantizer != NULL)
+		IvfflatBench("quantizer training", IvfflatTrainQuantizer(buildstate->samples, buildstate->typeInfo, buildstate->quantizer));
+
+	if (!loaded)
+	{
+		/* Inner product stores values as is but uses spherical k-means */
+		if (buildstate->kmeansnormprocinfo != NULL && buildstate->normprocinfo == NULL)
+			NormSamples(buildstate);
+
+		/* Calculate centers */
+		IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo, buildstate->kmeans, buildstate->parallelWorkers));
+	}
 
 	/* Free samples before we allocate more memory */
 	VectorArrayFree(buildstate->samples);
@@ -333,7 +771,7 @@ ComputeCenters(IvfflatBuildState * buildstate)
  * Create the metapage
  */
 static void
-CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
+CreateMetaPage(Relation index, int dimensions, int lists, IvfflatQuantizer quantizer, ForkNumber forkNum)
 {
 	Buffer		buf;
 	Page		page;
@@ -349,6 +787,13 @@ CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
 	metap->version = IVFFLAT_VERSION;
 	metap->dimensions = dimensions;
 	metap->lists = lists;
+	metap->quantizer = quantizer != NULL ? quantizer->quantizer : IVFFLAT_QUANTIZER_NONE;
+	metap->pqM = quantizer != NULL ? quantizer->pqM : 0;
+	metap->codebookPage = InvalidBlockNumber;
+	metap->sq8Min = quantizer != NULL ? quantizer->sq8Min : 0;
+	metap->sq8Scale = quantizer != NULL ? quantizer->sq8Scale : 0;
+	metap->freePage = InvalidBlockNumber;
+	metap->replacedXid = InvalidTransactionId;
 	((PageHeader) page)->pd_lower =
 		((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page;
 
@@ -480,7 +925,7 @@ ParallelHeapScan(IvfflatBuildState * buildstate)
  * Perform a worker's portion of a parallel sort
  */
 static void
-IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, Vector *ivfcenters)
+IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared)
 {
 	SortCoordinate coordinate;
 	IvfflatBuildState buildstate;
@@ -505,9 +950,9 @@ IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, V
 	/* Join parallel scan */
 	indexInfo = BuildIndexInfo(ivfspool->index);
 	indexInfo->ii_Concurrent = false;
-	InitBuildState(&buildstate, ivfspool->heap, ivfspool->index, indexInfo);
-	memcpy(buildstate.centers->items, ivfcenters, VECTOR_SIZE(buildstate.centers->dim) * buildstate.centers->maxlen);
-	buildstate.centers->length = buildstate.centers->maxlen;
+	InitBuildState(&buildstate, ivfspool->heap, ivfspool->index, indexInfo, ivfshared);
+	if (buildstate.quantizer != NULL)
+		IvfflatQuantizerCopy(buildstate.quantizer, ivfshared->quantizer);
 	ivfspool->sortstate = tuplesort_begin_heap(buildstate.tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, sortmem, false, 0, 0, 1, coordinate);
 	buildstate.sortstate = ivfspool->sortstate;
 
@@ -556,7 +1001,7 @@ IvfflatParallelBuildMain(const BgWorkerContext *bwc)
 	ivfspool->heap = heapRel;
 	ivfspool->index = indexRel;
 
-	IvfflatParallelScanAndSort(ivfspool, ivfshared, ivfshared->ivfcenters);
+	IvfflatParallelScanAndSort(ivfspool, ivfshared);
 
 	/* Close relations within worker */
 	index_close(indexRel, NoLock);
@@ -611,10 +1056,22 @@ IvfflatParallelInitshared(IvfflatBuildState * buildstate, int workmem, int scant
 	tuplesort_initialize_shared(sharedsort, scantuplesortstates);
 	ivfshared->sharedsort = sharedsort;
 
-	estcenters = VECTOR_SIZE(buildstate->dimensions) * buildstate->lists;
+	/* Items keep their aligned size so workers copy them as is */
+	estcenters = buildstate->centers->itemsize * buildstate->lists;
 	ivfcenters = (char *)MemoryContextAllocZero(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), estcenters);
 	memcpy(ivfcenters, buildstate->centers->items, estcenters);
 	ivfshared->ivfcenters = (Vector*)ivfcenters;
+	ivfshared->lists = buildstate->lists;
+
+	ivfshared->quantizer = NULL;
+	if (buildstate->quantizer != NULL)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE));
+
+		ivfshared->quantizer = IvfflatQuantizerInit(buildstate->quantizer->quantizer, buildstate->dimensions, buildstate->quantizer->pqM);
+		MemoryContextSwitchTo(oldCtx);
+		IvfflatQuantizerCopy(ivfshared->quantizer, buildstate->quantizer);
+	}
 
 	return ivfshared;
 }
@@ -688,7 +1145,7 @@ static void
 AssignTuples(IvfflatBuildState * buildstate)
 {
 	SortCoordinate coordinate = NULL;
-	int parallel_workers = 0;
+	int parallel_workers = buildstate->parallelWorkers;
 	IndexInfo *indexInfo = buildstate->indexInfo;
 	UtilityDesc *desc = &indexInfo->ii_desc;
 	int workmem;
@@ -702,10 +1159,6 @@ AssignTuples(IvfflatBuildState * buildstate)
 	workmem = (desc->query_mem[0] > 0) ? (desc->query_mem[0] - SIMPLE_THRESHOLD) :
 				u_sess->attr.attr_memory.maintenance_work_mem;
 
-	/* Calculate parallel workers */
-	if (buildstate->heap != NULL)
-		parallel_workers = PlanCreateIndexWorkers(buildstate->heap, indexInfo);
-
 	/* Attempt to launch parallel worker scan when required */
 	if (parallel_workers > 0) {
 		Assert(!indexInfo->ii_Concurrent);
@@ -766,13 +1219,15 @@ static void
 BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 		   IvfflatBuildState * buildstate, ForkNumber forkNum)
 {
-	InitBuildState(buildstate, heap, index, indexInfo);
+	InitBuildState(buildstate, heap, index, indexInfo, NULL);
 
 	ComputeCenters(buildstate);
 
 	/* Create pages */
-	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, forkNum);
+	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, buildstate->quantizer, forkNum);
 	CreateListPages(index, buildstate->centers, buildstate->dimensions, buildstate->lists, forkNum, &buildstate->listInfo);
+	if (buildstate->quantizer != NULL && buildstate->quantizer->quantizer == IVFFLAT_QUANTIZER_PQ)
+		IvfflatWriteCodebook(index, buildstate->quantizer, forkNum);
 	CreateEntryPages(buildstate, forkNum);
 
 	/* Write WAL for initialization fork since GenericXLog functions do not */
@@ -0,0 +1,476 @@
+#include "postgres.h"
+
+#include <pthread.h>
+
+#include "ivfflat.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Cached centers for an index
+ *
+ * Caches live in instance memory so every session can use them, and are
+ * keyed by relfilenode so rewrites of the index get a new cache
+ */
+typedef struct IvfflatCenterCacheSlot
+{
+	bool		used;
+	bool		building;
+	bool		failed;
+	int			failedCacheSize;
+	RelFileNode node;
+	uint64		changeCount;	/* incremented each time lists change */
+	uint64		lastUsed;
+	IvfflatCenterCache *cache;
+}			IvfflatCenterCacheSlot;
+
+int			ivfflat_center_cache_size;
+
+static IvfflatCenterCacheSlot centerCacheSlots[IVFFLAT_MAX_CENTER_CACHES];
+static Size centerCacheUsed = 0;
+static uint64 centerCacheClock = 0;
+static pthread_mutex_t centerCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Free a cache (lock must be held)
+ */
+static void
+FreeCenterCache(IvfflatCenterCache * cache)
+{
+	centerCacheUsed -= cache->size;
+	pfree(cache);
+}
+
+/*
+ * Drop the cache of a slot (lock must be held)
+ */
+static void
+DropCenterCache(IvfflatCenterCacheSlot * slot)
+{
+	if (slot->cache == NULL)
+		return;
+
+	/* Pinned caches are freed when unpinned */
+	slot->cache->invalid = true;
+	if (slot->cache->refcount == 0)
+		FreeCenterCache(slot->cache);
+
+	slot->cache = NULL;
+}
+
+/*
+ * Evict the least recently used cache that is not in use (lock must be held)
+ */
+static bool
+EvictCenterCache(void)
+{
+	IvfflatCenterCacheSlot *victim = NULL;
+
+	for (int i = 0; i < IVFFLAT_MAX_CENTER_CACHES; i++)
+	{
+		IvfflatCenterCacheSlot *slot = &centerCacheSlots[i];
+
+		if (!slot->used || slot->building)
+			continue;
+
+		if (slot->cache != NULL && slot->cache->refcount > 0)
+			continue;
+
+		if (victim == NULL || slot->lastUsed < victim->lastUsed)
+			victim = slot;
+	}
+
+	if (victim == NULL)
+		return false;
+
+	DropCenterCache(victim);
+	victim->used = false;
+	return true;
+}
+
+/*
+ * Find the slot for an index (lock must be held)
+ */
+static IvfflatCenterCacheSlot *
+FindCenterCacheSlot(RelFileNode node)
+{
+	for (int i = 0; i < IVFFLAT_MAX_CENTER_CACHES; i++)
+	{
+		IvfflatCenterCacheSlot *slot = &centerCacheSlots[i];
+
+		if (slot->used && RelFileNodeEquals(slot->node, node))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a slot for an index (lock must be held)
+ */
+static IvfflatCenterCacheSlot *
+AddCenterCacheSlot(RelFileNode node)
+{
+	for (;;)
+	{
+		for (int i = 0; i < IVFFLAT_MAX_CENTER_CACHES; i++)
+		{
+			IvfflatCenterCacheSlot *slot = &centerCacheSlots[i];
+
+			if (slot->used)
+				continue;
+
+			MemSet(slot, 0, sizeof(IvfflatCenterCacheSlot));
+			slot->used = true;
+			slot->node = node;
+			return slot;
+		}
+
+		if (!EvictCenterCache())
+			return NULL;
+	}
+}
+
+/*
+ * Reserve memory for a cache
+ */
+static bool
+ReserveCenterCache(Size size)
+{
+	Size		maxSize = (Size) ivfflat_center_cache_size * 1024;
+	bool		reserved = false;
+
+	pthread_mutex_lock(&centerCacheLock);
+
+	/* Make room by evicting caches that are not in use */
+	while (centerCacheUsed + size > maxSize)
+	{
+		if (!EvictCenterCache())
+			break;
+	}
+
+	if (centerCacheUsed + size <= maxSize)
+	{
+		centerCacheUsed += size;
+		reserved = true;
+	}
+
+	pthread_mutex_unlock(&centerCacheLock);
+
+	return reserved;
+}
+
+/*
+ * Release memory reserved for a cache
+ */
+static void
+ReleaseCenterCache(Size size)
+{
+	pthread_mutex_lock(&centerCacheLock);
+	centerCacheUsed -= size;
+	pthread_mutex_unlock(&centerCacheLock);
+}
+
+/*
+ * Copy the centers from the list pages
+ *
+ * Lists are collected in physical order, which is the order a scan of the
+ * list pages visits them. The first list page is share locked for the
+ * whole read so rebalancing cannot change the lists in between.
+ */
+static IvfflatCenterCache *
+BuildCenterCache(Relation index)
+{
+	MemoryContext tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												 "Ivfflat center cache build context",
+												 ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+	BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
+	int			listCount = 0;
+	int			maxLists;
+	Size		maxValuesSize = BLCKSZ;
+	Size		valuesSize = 0;
+	ItemPointerData *tids;
+	BlockNumber *startPages;
+	Size	   *valueOffsets;
+	char	   *values = (char *) palloc(maxValuesSize);
+	Buffer		headBuf;
+	uint32		generation;
+	IvfflatCenterCache *cache;
+	Size		size;
+	char	   *ptr;
+
+	IvfflatGetMetaPageInfo(index, &maxLists, NULL);
+	tids = (ItemPointerData *) palloc(sizeof(ItemPointerData) * maxLists);
+	startPages = (BlockNumber *) palloc(sizeof(BlockNumber) * maxLists);
+	valueOffsets = (Size *) palloc(sizeof(Size) * maxLists);
+
+	headBuf = ReadBuffer(index, IVFFLAT_HEAD_BLKNO);
+	LockBuffer(headBuf, BUFFER_LOCK_SHARE);
+	generation = IvfflatGetListGeneration(index);
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf = headBuf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		if (blkno != IVFFLAT_HEAD_BLKNO)
+		{
+			buf = ReadBuffer(index, blkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+		}
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offno));
+			Size		valueSize = VARSIZE_ANY(&list->center);
+
+			/* Lists may have been added since the metapage was read */
+			if (listCount == maxLists)
+			{
+				maxLists *= 2;
+				tids = (ItemPointerData *) repalloc(tids, sizeof(ItemPointerData) * maxLists);
+				startPages = (BlockNumber *) repalloc(startPages, sizeof(BlockNumber) * maxLists);
+				valueOffsets = (Size *) repalloc(valueOffsets, sizeof(Size) * maxLists);
+			}
+
+			while (valuesSize + MAXALIGN(valueSize) > maxValuesSize)
+			{
+				maxValuesSize *= 2;
+				values = (char *) repalloc_huge(values, maxValuesSize);
+			}
+
+			ItemPointerSet(&tids[listCount], blkno, offno);
+			startPages[listCount] = list->startPage;
+			memcpy(values + valuesSize, &list->center, valueSize);
+			valueOffsets[listCount] = valuesSize;
+			valuesSize += MAXALIGN(valueSize);
+			listCount++;
+		}
+
+		blkno = IvfflatPageGetOpaque(page)->nextblkno;
+
+		if (buf != headBuf)
+			UnlockReleaseBuffer(buf);
+	}
+
+	UnlockReleaseBuffer(headBuf);
+
+	/* Copy to a single chunk */
+	size = MAXALIGN(sizeof(IvfflatCenterCache));
+	size += MAXALIGN(sizeof(ItemPointerData) * listCount);
+	size += MAXALIGN(sizeof(BlockNumber) * listCount);
+	size += MAXALIGN(sizeof(Datum) * listCount);
+	size += MAXALIGN(valuesSize);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	cache = NULL;
+	if (ReserveCenterCache(size))
+	{
+		ptr = (char *) MemoryContextAllocExtended(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), size, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+
+		if (ptr == NULL)
+			ReleaseCenterCache(size);
+		else
+		{
+			char	   *cacheValues;
+
+			cache = (IvfflatCenterCache *) ptr;
+			ptr += MAXALIGN(sizeof(IvfflatCenterCache));
+
+			cache->size = size;
+			cache->refcount = 0;
+			cache->invalid = false;
+			cache->generation = generation;
+			cache->listCount = listCount;
+
+			cache->tids = (ItemPointerData *) ptr;
+			memcpy(ptr, tids, sizeof(ItemPointerData) * listCount);
+			ptr += MAXALIGN(sizeof(ItemPointerData) * listCount);
+
+			cache->startPages = (BlockNumber *) ptr;
+			memcpy(ptr, startPages, sizeof(BlockNumber) * listCount);
+			ptr += MAXALIGN(sizeof(BlockNumber) * listCount);
+
+			cache->centers = (Datum *) ptr;
+			ptr += MAXALIGN(sizeof(Datum) * listCount);
+
+			cacheValues = ptr;
+			memcpy(cacheValues, values, valuesSize);
+
+			for (int i = 0; i < listCount; i++)
+				cache->centers[i] = PointerGetDatum(cacheValues + valueOffsets[i]);
+		}
+	}
+
+	MemoryContextDelete(tmpCtx);
+
+	return cache;
+}
+
+/*
+ * Get the cached centers for an index, building them if needed
+ *
+ * Returns NULL if caching is disabled or the cache is not available. The
+ * cache must be unpinned after use. Caches are checked against the list
+ * generation on the metapage, since WAL redo on standbys and in recovery
+ * swaps lists without invalidating caches.
+ */
+IvfflatCenterCache *
+IvfflatPinCenterCache(Relation index)
+{
+	IvfflatCenterCacheSlot *slot;
+	IvfflatCenterCache *cache;
+	uint64		changeCount;
+	uint32		generation;
+
+	if (ivfflat_center_cache_size == 0)
+		return NULL;
+
+	generation = IvfflatGetListGeneration(index);
+
+	pthread_mutex_lock(&centerCacheLock);
+
+	slot = FindCenterCacheSlot(index->rd_node);
+
+	/* Lists were swapped since the cache was built */
+	if (slot != NULL && slot->cache != NULL && slot->cache->generation != generation)
+	{
+		slot->changeCount++;
+		DropCenterCache(slot);
+	}
+
+	if (slot != NULL && slot->cache != NULL)
+	{
+		cache = slot->cache;
+		cache->refcount++;
+		slot->lastUsed = ++centerCacheClock;
+		pthread_mutex_unlock(&centerCacheLock);
+		return cache;
+	}
+
+	/* Another session is building or the centers did not fit */
+	if (slot != NULL && (slot->building || (slot->failed && slot->failedCacheSize == ivfflat_center_cache_size)))
+	{
+		pthread_mutex_unlock(&centerCacheLock);
+		return NULL;
+	}
+
+	if (slot == NULL)
+		slot = AddCenterCacheSlot(index->rd_node);
+	else
+		DropCenterCache(slot);
+
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock(&centerCacheLock);
+		return NULL;
+	}
+
+	slot->building = true;
+	slot->lastUsed = ++centerCacheClock;
+	changeCount = slot->changeCount;
+
+	pthread_mutex_unlock(&centerCacheLock);
+
+	PG_TRY();
+	{
+		cache = BuildCenterCache(index);
+	}
+	PG_CATCH();
+	{
+		pthread_mutex_lock(&centerCacheLock);
+		slot->building = false;
+		pthread_mutex_unlock(&centerCacheLock);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pthread_mutex_lock(&centerCacheLock);
+
+	slot->building = false;
+
+	if (cache == NULL)
+	{
+		slot->failed = true;
+		slot->failedCacheSize = ivfflat_center_cache_size;
+		ereport(DEBUG1, (errmsg("ivfflat center cache does not fit in ivfflat.center_cache_size")));
+	}
+	else if (slot->changeCount != changeCount)
+	{
+		/* Lists changed during build */
+		FreeCenterCache(cache);
+		cache = NULL;
+	}
+	else
+	{
+		slot->failed = false;
+		slot->cache = cache;
+		cache->refcount++;
+	}
+
+	pthread_mutex_unlock(&centerCacheLock);
+
+	return cache;
+}
+
+/*
+ * Release a cache after use
+ */
+void
+IvfflatUnpinCenterCache(IvfflatCenterCache * cache)
+{
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_lock(&centerCacheLock);
+
+	cache->refcount--;
+	if (cache->refcount == 0 && cache->invalid)
+		FreeCenterCache(cache);
+
+	pthread_mutex_unlock(&centerCacheLock);
+}
+
+/*
+ * Invalidate the cache for an index
+ *
+ * Called after the lists change on disk
+ */
+void
+IvfflatInvalidateCenterCache(Relation index)
+{
+	IvfflatCenterCacheSlot *slot;
+
+	pthread_mutex_lock(&centerCacheLock);
+
+	slot = FindCenterCacheSlot(index->rd_node);
+	if (slot != NULL)
+	{
+		slot->changeCount++;
+		slot->failed = false;
+		DropCenterCache(slot);
+	}
+
+	pthread_mutex_unlock(&centerCacheLock);
+}
+
+/*
+ * Calculate the distance from a value to every center
+ */
+void
+IvfflatCenterCacheDistances(const IvfflatCenterCache * cache, const IvfflatTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation, Datum value, double *distances)
+{
+	if (typeInfo->distanceBatch != NULL)
+		typeInfo->distanceBatch(procinfo, collation, value, cache->centers, cache->listCount, distances);
+	else
+	{
+		for (int i = 0; i < cache->listCount; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, cache->centers[i], value));
+	}
+}
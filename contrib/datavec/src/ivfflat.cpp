@@ -1,11 +1,16 @@
 #include "postgres.h"
 
 #include <float.h>
+#include <math.h>
 
 #include "access/amapi.h"
 #include "access/reloptions.h"
+#include "commands/defrem.h"
 #include "commands/vacuum.h"
+#include "funcapi.h"
 #include "ivfflat.h"
+#include "optimizer/cost.h"
+#include "optimizer/predtest.h"
 #include "utils/guc.h"
 #include "utils/selfuncs.h"
 #include "utils/spccache.h"
@@ -15,8 +20,42 @@
 #endif
 
 int			ivfflat_probes;
+int			ivfflat_rerank_candidates;
+int			ivfflat_scan_workers;
 static relopt_kind ivfflat_relopt_kind;
 
+/*
+ * Validate the quantizer reloption
+ */
+static void
+IvfflatValidateQuantizer(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "none") != 0 && strcmp(value, "pq") != 0 && strcmp(value, "sq8") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for quantizer: \"%s\"", value),
+				 errdetail("Valid values are \"none\", \"pq\", and \"sq8\".")));
+}
+
+/*
+ * Validate the kmeans reloption
+ */
+static void
+IvfflatValidateKmeans(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "elkan") != 0 && strcmp(value, "minibatch") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for kmeans: \"%s\"", value),
+				 errdetail("Valid values are \"elkan\" and \"minibatch\".")));
+}
+
 /*
  * Initialize index options and variables
  */
@@ -28,6 +67,24 @@ IvfflatInit(void)
 					  IVFFLAT_DEFAULT_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS
 #if PG_VERSION_NUM >= 130000
 					  ,AccessExclusiveLock
+#endif
+		);
+	add_string_reloption(ivfflat_relopt_kind, "quantizer", "Quantizer for list entries",
+						 "none", IvfflatValidateQuantizer);
+	add_int_reloption(ivfflat_relopt_kind, "pq_m", "Number of product quantization subquantizers",
+					  IVFFLAT_DEFAULT_PQ_M, IVFFLAT_MIN_PQ_M, IVFFLAT_MAX_PQ_M
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+	add_string_reloption(ivfflat_relopt_kind, "kmeans", "K-means algorithm for building lists",
+						 "elkan", IvfflatValidateKmeans);
+	add_string_reloption(ivfflat_relopt_kind, "centroids_from", "Index or table to copy centers and the number of lists from instead of training",
+						 NULL, NULL);
+	add_real_reloption(ivfflat_relopt_kind, "rebalance_ratio", "List size ratio to the average for rebalancing during vacuum",
+					   IVFFLAT_DEFAULT_REBALANCE_RATIO, IVFFLAT_MIN_REBALANCE_RATIO, IVFFLAT_MAX_REBALANCE_RATIO
+#if PG_VERSION_NUM >= 130000
+					   ,AccessExclusiveLock
 #endif
 		);
 
@@ -35,9 +92,47 @@ IvfflatInit(void)
 							"Valid range is 1..lists.", &ivfflat_probes,
 							IVFFLAT_DEFAULT_PROBES, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("ivfflat.rerank_candidates", "Sets the number of candidates to rerank for quantized indexes",
+							"Zero disables reranking.", &ivfflat_rerank_candidates,
+							IVFFLAT_DEFAULT_RERANK_CANDIDATES, 0, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("ivfflat.scan_workers", "Sets the number of background workers for scanning lists",
+							"Zero scans lists serially.", &ivfflat_scan_workers,
+							0, 0, IVFFLAT_MAX_SCAN_WORKERS, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("ivfflat.center_cache_size", "Sets the max memory for cached centers",
+							"Zero disables center caches.", &ivfflat_center_cache_size,
+							IVFFLAT_DEFAULT_CENTER_CACHE_SIZE, 0, INT_MAX, PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("ivfflat");
 }
 
+/*
+ * Get the fraction of rows that pass the filters of a scan
+ */
+static Selectivity
+IvfflatFilterSelectivity(PlannerInfo *root, IndexOptInfo *indexinfo)
+{
+	List	   *clauses = NIL;
+	ListCell   *lc;
+
+	foreach(lc, indexinfo->rel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		/* Skip filters that every row of a partial index passes */
+		if (indexinfo->indpred != NIL && predicate_implied_by(list_make1(rinfo->clause), indexinfo->indpred))
+			continue;
+
+		clauses = lappend(clauses, rinfo);
+	}
+
+	if (clauses == NIL)
+		return 1.0;
+
+	return clauselist_selectivity(root, clauses, indexinfo->rel->relid, JOIN_INNER, NULL, false);
+}
+
 /*
  * Estimate the cost of an index scan
  */
@@ -50,6 +145,8 @@ ivfflatcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_cou
 	int			lists;
 	double		ratio;
 	double		spc_seq_page_cost;
+	double		statsTuples;
+	double		statsListTuples;
 	Relation	index;
 
 	/* Never use index without order */
@@ -66,10 +163,29 @@ ivfflatcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_cou
 
 	index = index_open(path->indexinfo->indexoid, NoLock);
 	IvfflatGetMetaPageInfo(index, &lists, NULL);
+	IvfflatGetListStats(index, &statsTuples, &statsListTuples);
 	index_close(index, NoLock);
 
 	/* Get the ratio of lists that we need to visit */
 	ratio = ((double) ivfflat_probes) / lists;
+
+	/* Probed lists are larger than average when list sizes are skewed */
+	if (statsTuples > 0 && ratio < 1.0)
+		ratio = ivfflat_probes * statsListTuples / statsTuples;
+
+	/*
+	 * With a limit and filters that remove most rows, more lists are needed
+	 * to find enough rows. The limit only applies to this scan without joins.
+	 */
+	if (root->limit_tuples > 0 && bms_membership(root->all_baserels) == BMS_SINGLETON && path->indexinfo->tuples > 0)
+	{
+		Selectivity selectivity = IvfflatFilterSelectivity(root, path->indexinfo);
+		double		needed = root->limit_tuples / Max(selectivity, 1e-10) / path->indexinfo->tuples;
+
+		if (needed > ratio)
+			ratio = needed;
+	}
+
 	if (ratio > 1.0)
 		ratio = 1.0;
 
@@ -83,7 +199,13 @@ ivfflatcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_cou
 	genericcostestimate(root, path, loop_count, costs.numIndexTuples, &costs.indexStartupCost,
 			&costs.indexTotalCost, &costs.indexSelectivity, &costs.indexCorrelation);
 
-	get_tablespace_page_costs(path->indexinfo->reltablespace, NULL, &spc_seq_page_cost);
+	/* Pages visited by the generic cost estimator, which it does not return */
+	if (path->indexinfo->pages > 1 && path->indexinfo->tuples > 1)
+		costs.numIndexPages = ceil(costs.numIndexTuples * path->indexinfo->pages / path->indexinfo->tuples);
+	else
+		costs.numIndexPages = 1.0;
+
+	get_tablespace_page_costs(path->indexinfo->reltablespace, &costs.spc_random_page_cost, &spc_seq_page_cost);
 
 	/* Adjust cost if needed since TOAST not included in seq scan cost */
 	if (costs.numIndexPages > path->indexinfo->rel->pages && ratio < 0.5)
@@ -122,6 +244,11 @@ ivfflatoptions_internal(Datum reloptions, bool validate)
 {
 	static const relopt_parse_elt tab[] = {
 		{"lists", RELOPT_TYPE_INT, offsetof(IvfflatOptions, lists)},
+		{"quantizer", RELOPT_TYPE_STRING, offsetof(IvfflatOptions, quantizer)},
+		{"pq_m", RELOPT_TYPE_INT, offsetof(IvfflatOptions, pqM)},
+		{"kmeans", RELOPT_TYPE_STRING, offsetof(IvfflatOptions, kmeans)},
+		{"centroids_from", RELOPT_TYPE_STRING, offsetof(IvfflatOptions, centroidsFrom)},
+		{"rebalance_ratio", RELOPT_TYPE_REAL, offsetof(IvfflatOptions, rebalanceRatio)},
 		{"parallel_workers", RELOPT_TYPE_INT, offsetof(StdRdOptions, parallel_workers)}
 	};
 
@@ -369,3 +496,69 @@ ivfflatendscan(PG_FUNCTION_ARGS)
 
 	PG_RETURN_VOID();
 }
+
+/*
+ * Get the centers of an ivfflat index
+ *
+ * Centers are returned as vectors so they can be stored in a table and
+ * used with centroids_from for any type
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(ivfflat_centers);
+Datum
+ivfflat_centers(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	VectorArray centers;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid			relid = PG_GETARG_OID(0);
+		MemoryContext oldCtx;
+		Relation	index;
+		VectorArray vectors;
+		const		IvfflatTypeInfo *typeInfo;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		index = index_open(relid, AccessShareLock);
+		if (index->rd_rel->relam != get_am_oid("ivfflat", false))
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+		IvfflatCheckTablePrivilege(index);
+
+		typeInfo = IvfflatGetTypeInfo(index);
+		centers = IvfflatReadCenters(index);
+		if (centers->dim > VECTOR_MAX_DIM)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("centers cannot have more than %d dimensions", VECTOR_MAX_DIM)));
+
+		/* Convert centers to vectors */
+		vectors = VectorArrayInit(centers->length, centers->dim, VECTOR_SIZE(centers->dim));
+		for (int i = 0; i < centers->length; i++)
+		{
+			Vector	   *vec = InitVector(centers->dim);
+
+			typeInfo->sumCenter(VectorArrayGet(centers, i), vec->x);
+			VectorArraySet(vectors, vectors->length++, (Pointer) vec);
+			pfree(vec);
+		}
+		funcctx->user_fctx = vectors;
+
+		VectorArrayFree(centers);
+		index_close(index, AccessShareLock);
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	centers = (VectorArray) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < (uint64) centers->length)
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(VectorArrayGet(centers, funcctx->call_cntr)));
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -39,11 +39,59 @@
 #define IVFFLAT_METAPAGE_BLKNO	0
 #define IVFFLAT_HEAD_BLKNO		1	/* first list page */
 
+/* Scan key strategy for range searches, which the planner never uses */
+#define IVFFLAT_RANGE_STRATEGY	1
+
 /* IVFFlat parameters */
 #define IVFFLAT_DEFAULT_LISTS	100
 #define IVFFLAT_MIN_LISTS		1
 #define IVFFLAT_MAX_LISTS		32768
 #define IVFFLAT_DEFAULT_PROBES	1
+#define IVFFLAT_DEFAULT_RERANK_CANDIDATES	100
+#define IVFFLAT_MAX_SCAN_WORKERS	32
+#define IVFFLAT_DEFAULT_CENTER_CACHE_SIZE	(256 * 1024)	/* kB */
+#define IVFFLAT_MAX_CENTER_CACHES	64
+#define IVFFLAT_DEFAULT_REBALANCE_RATIO	0
+#define IVFFLAT_MIN_REBALANCE_RATIO	0
+#define IVFFLAT_MAX_REBALANCE_RATIO	1000
+
+/* Quantizers */
+#define IVFFLAT_QUANTIZER_NONE	0
+#define IVFFLAT_QUANTIZER_PQ	1
+#define IVFFLAT_QUANTIZER_SQ8	2
+
+/* Product quantization parameters */
+#define IVFFLAT_PQ_CODEWORDS	256		/* one byte per code */
+#define IVFFLAT_PQ_ITERATIONS	25
+#define IVFFLAT_DEFAULT_PQ_M	0		/* dimensions / 4, rounded down to a divisor */
+#define IVFFLAT_MIN_PQ_M		0
+#define IVFFLAT_MAX_PQ_M		(IVFFLAT_MAX_DIM * 2)
+
+/* Scalar quantization parameters */
+#define IVFFLAT_SQ8_LEVELS		255
+
+/* K-means algorithms */
+#define IVFFLAT_KMEANS_ELKAN		0
+#define IVFFLAT_KMEANS_MINIBATCH	1
+
+/* K-means parameters */
+#define IVFFLAT_KMEANS_DISTANCE_BATCH	1024	/* values per batched distance call */
+#define IVFFLAT_KMEANS_CHUNK_SIZE	256		/* items claimed at a time by a participant */
+#define IVFFLAT_KMEANS_PARALLEL_MIN_COST	(1 << 24)	/* approximate float operations */
+#define IVFFLAT_MINIBATCH_MIN_SIZE	1024
+#define IVFFLAT_MINIBATCH_ITERATIONS	50
+
+/* K-means tasks for participants */
+#define IVFFLAT_KMEANS_TASK_ELKAN_ASSIGN	0
+#define IVFFLAT_KMEANS_TASK_UPDATE	1
+#define IVFFLAT_KMEANS_TASK_MINIBATCH_ASSIGN	2
+
+/* Initial number of scan items when the scan is not bounded */
+#define IVFFLAT_SCAN_ITEMS_INITIAL	1024
+
+/* Quantizer metrics */
+#define IVFFLAT_METRIC_L2	0
+#define IVFFLAT_METRIC_IP	1
 
 /* Build phases */
 /* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
@@ -52,6 +100,11 @@
 #define PROGRESS_IVFFLAT_PHASE_LOAD		4
 
 #define IVFFLAT_LIST_SIZE(size)	(offsetof(IvfflatListData, center) + size)
+#define IVFFLAT_QUANTIZED_TUPLE_SIZE(size)	MAXALIGN(MAXALIGN(sizeof(IndexTupleData)) + (size))
+#define IVFFLAT_SQ8_SIZE(dim)		(offsetof(IvfflatSq8CodesData, x) + (dim))
+#define IVFFLAT_CODEBOOK_CHUNK_SIZE	(MAXALIGN_DOWN(BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData)) - sizeof(ItemIdData)) / sizeof(float))
+
+#define IvfflatQuantizedTupleCodes(itup)	((uint8 *) (itup) + MAXALIGN(sizeof(IndexTupleData)))
 
 #define IvfflatPageGetOpaque(page)	((IvfflatPageOpaque) PageGetSpecialPointer(page))
 #define IvfflatPageGetMeta(page)	((IvfflatMetaPageData *) PageGetContents(page))
@@ -81,6 +134,9 @@
 
 /* Variables */
 extern int	ivfflat_probes;
+extern int	ivfflat_rerank_candidates;
+extern int	ivfflat_scan_workers;
+extern int	ivfflat_center_cache_size;
 
 typedef struct VectorArrayData
 {
@@ -104,8 +160,44 @@ typedef struct IvfflatOptions
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			lists;			/* number of lists */
+	int			quantizer;		/* quantizer name (string offset) */
+	int			pqM;			/* number of subquantizers */
+	int			kmeans;			/* k-means algorithm (string offset) */
+	int			centroidsFrom;	/* relation to copy centers from (string offset) */
+	double		rebalanceRatio; /* list size ratio for rebalancing in vacuum */
 }			IvfflatOptions;
 
+/*
+ * Quantizer used for list entries
+ *
+ * Allocated as a single chunk so it can be cached in rd_amcache
+ */
+typedef struct IvfflatQuantizerData
+{
+	int			quantizer;
+	int			dimensions;
+
+	/* Product quantization */
+	int			pqM;			/* number of subquantizers */
+	int			pqDsub;			/* dimensions per subquantizer */
+	float	   *codebook;		/* pqM * IVFFLAT_PQ_CODEWORDS * pqDsub */
+
+	/* Scalar quantization */
+	float		sq8Min;
+	float		sq8Scale;
+}			IvfflatQuantizerData;
+
+typedef IvfflatQuantizerData * IvfflatQuantizer;
+
+/* Scalar quantization codes */
+typedef struct IvfflatSq8CodesData
+{
+	uint32		sum;			/* sum of codes for inner product */
+	uint8		x[FLEXIBLE_ARRAY_MEMBER];
+}			IvfflatSq8CodesData;
+
+typedef IvfflatSq8CodesData * IvfflatSq8Codes;
+
 typedef struct IvfflatSpool
 {
 	Tuplesortstate *sortstate;
@@ -130,6 +222,8 @@ typedef struct IvfflatShared
 
 	Sharedsort  *sharedsort;
 	Vector      *ivfcenters;
+	int			lists;			/* number of centers in ivfcenters */
+	IvfflatQuantizer quantizer;
 	int         workmem;
 
 #ifdef IVFFLAT_KMEANS_DEBUG
@@ -154,8 +248,27 @@ typedef struct IvfflatTypeInfo
 	Size		(*itemSize) (int dimensions);
 	void		(*updateCenter) (Pointer v, int dimensions, float *x);
 	void		(*sumCenter) (Pointer v, float *x);
+	void		(*distanceBatch) (FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances);
 }			IvfflatTypeInfo;
 
+/*
+ * Centers of an index in list page order
+ *
+ * Each center is a copy of the value on the list page, along with the tid
+ * of its list tuple and the first page of its list.
+ */
+typedef struct IvfflatCenterCache
+{
+	Size		size;
+	int			refcount;
+	bool		invalid;
+	uint32		generation;		/* list generation of the metapage */
+	int			listCount;
+	ItemPointerData *tids;
+	BlockNumber *startPages;
+	Datum	   *centers;
+}			IvfflatCenterCache;
+
 typedef struct IvfflatBuildState
 {
 	/* Info */
@@ -167,6 +280,9 @@ typedef struct IvfflatBuildState
 	/* Settings */
 	int			dimensions;
 	int			lists;
+	int			kmeans;
+	int			parallelWorkers;
+	IvfflatQuantizer quantizer;
 
 	/* Statistics */
 	double		indtuples;
@@ -182,6 +298,7 @@ typedef struct IvfflatBuildState
 	VectorArray samples;
 	VectorArray centers;
 	ListInfo   *listInfo;
+	float	   *quantvector;
 
 #ifdef IVFFLAT_KMEANS_DEBUG
 	double		inertia;
@@ -190,9 +307,9 @@ typedef struct IvfflatBuildState
 #endif
 
 	/* Sampling */
-	BlockSamplerData bs;
-	ReservoirStateData rstate;
-	int			rowstoskip;
+	double		rstate;			/* reservoir state for anl_get_next_S */
+	double		rowstoskip;
+	double		samplerows;
 
 	/* Sorting */
 	Tuplesortstate *sortstate;
@@ -213,6 +330,21 @@ typedef struct IvfflatMetaPageData
 	uint32		version;
 	uint16		dimensions;
 	uint16		lists;
+	uint16		quantizer;
+	uint16		pqM;
+	BlockNumber codebookPage;
+	float		sq8Min;
+	float		sq8Scale;
+
+	/* List statistics from the last vacuum or analyze, zero if none */
+	float		statsTuples;	/* tuples in all lists */
+	float		statsListTuples;	/* list size weighted by list size */
+
+	uint32		listGeneration; /* incremented each time lists are swapped */
+
+	/* Pages of lists replaced by rebalancing */
+	BlockNumber freePage;		/* first page that can be reused */
+	TransactionId replacedXid;	/* next xid when lists were last swapped */
 }			IvfflatMetaPageData;
 
 typedef IvfflatMetaPageData * IvfflatMetaPage;
@@ -242,14 +374,37 @@ typedef struct IvfflatScanList
 	double		distance;
 }			IvfflatScanList;
 
+typedef struct IvfflatScanItem
+{
+	ItemPointerData tid;
+	double		distance;
+}			IvfflatScanItem;
+
 typedef struct IvfflatScanOpaqueData
 {
 	const		IvfflatTypeInfo *typeInfo;
 	int			probes;
 	int			dimensions;
 	bool		first;
-
-	/* Sorting */
+	Datum		value;
+	bool		valueAllocated;
+
+	/* Items */
+	IvfflatScanItem *items;
+	int			itemsLength;
+	int			itemsIndex;
+	int			maxItems;
+	bool		bounded;
+	double		tuples;
+	double		matched;
+	IvfflatScanItem lastItem;
+	bool		hasLastItem;
+
+	/* Range searches */
+	bool		range;
+	double		radius;
+
+	/* Sorting when items do not fit in memory */
 	Tuplesortstate *sortstate;
 	TupleDesc	tupdesc;
 	TupleTableSlot *slot;
@@ -261,13 +416,121 @@ typedef struct IvfflatScanOpaqueData
 	Oid			collation;
 	Datum		(*distfunc) (FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2);
 
+	/* Quantization */
+	int			quantizer;
+	int			metric;
+	int			pqM;
+	float	   *pqTable;
+	float		sq8Min;
+	float		sq8Scale;
+	uint32		sq8QuerySum;
+	uint8	   *sq8Query;
+
+	/* Batched distances */
+	Datum	   *batchValues;
+	double	   *batchDistances;
+
+	/* Reranking */
+	IvfflatScanItem *rerank;
+	int			rerankLength;
+	int			rerankIndex;
+
 	/* Lists */
+	int			listCount;
 	pairingheap *listQueue;
 	IvfflatScanList lists[FLEXIBLE_ARRAY_MEMBER];	/* must come last */
 }			IvfflatScanOpaqueData;
 
 typedef IvfflatScanOpaqueData * IvfflatScanOpaque;
 
+typedef struct IvfflatScanShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	int			dimensions;
+	int			listCount;
+	BlockNumber *startPages;
+	char	   *value;
+	int			maxItems;
+	IvfflatScanItem lastItem;
+	bool		hasLastItem;
+
+	/* Quantization */
+	int			quantizer;
+	int			metric;
+	int			pqM;
+	float	   *pqTable;
+	float		sq8Min;
+	float		sq8Scale;
+	uint32		sq8QuerySum;
+	uint8	   *sq8Query;
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	int			nparticipants;
+	int			nextList;
+	double		tuples;
+	double		matched;
+	IvfflatScanItem *items;		/* maxItems per participant */
+	int		   *itemsLength;
+}			IvfflatScanShared;
+
+/*
+ * K-means state
+ *
+ * Workers run as threads of the same process, so they read the leader's
+ * arrays directly and write only to the items they claim
+ */
+typedef struct IvfflatKmeansStateData
+{
+	const		IvfflatTypeInfo *typeInfo;
+	VectorArray samples;
+	VectorArray centers;
+	Datum	   *centerValues;
+	int			numCenters;
+	bool		normalize;
+	int			nworkers;
+
+	/* Elkan */
+	int			iteration;
+	int		   *closestCenters;
+	float	   *lowerBound;
+	float	   *upperBound;
+	float	   *s;
+	float	   *halfcdist;
+	float	   *newcdist;
+
+	/* Update */
+	VectorArray newCenters;
+	float	   *agg;
+	int		   *centerCounts;
+
+	/* Mini-batch */
+	int			batchStart;
+	int		   *batchCenters;
+}			IvfflatKmeansStateData;
+
+typedef IvfflatKmeansStateData * IvfflatKmeansState;
+
+typedef struct IvfflatKmeansShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	int			task;
+	int64		count;
+	int64		chunk;
+	IvfflatKmeansState state;
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	int64		next;
+	int64		changes;
+}			IvfflatKmeansShared;
+
 #define VECTOR_ARRAY_SIZE(_length, _size) (sizeof(VectorArrayData) + (_length) * MAXALIGN(_size))
 
 /* Use functions instead of macros to avoid double evaluation */
@@ -284,15 +547,61 @@ VectorArraySet(VectorArray arr, int offset, Pointer val)
 	memcpy(VectorArrayGet(arr, offset), val, VARSIZE_ANY(val));
 }
 
+/*
+ * Approximate distance from a product quantization code
+ */
+static inline double
+IvfflatPqDistance(const float *table, int m, const uint8 *codes)
+{
+	float		distance = 0.0;
+
+	for (int j = 0; j < m; j++)
+		distance += table[j * IVFFLAT_PQ_CODEWORDS + codes[j]];
+
+	return (double) distance;
+}
+
 /* Methods */
 VectorArray VectorArrayInit(int maxlen, int dimensions, Size itemsize);
 void		VectorArrayFree(VectorArray arr);
-void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo);
+void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int kmeans, int nworkers);
+int			IvfflatMiniBatchMaxSamples(int numCenters, int dimensions, Size itemsize);
 FmgrInfo   *IvfflatOptionalProcInfo(Relation index, uint16 procnum);
+double		IvfflatRangeDistance(Relation index, double radius);
 Datum		IvfflatNormValue(const IvfflatTypeInfo * typeInfo, Oid collation, Datum value);
 bool		IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
 int			IvfflatGetLists(Relation index);
+int			IvfflatGetQuantizerType(Relation index);
+int			IvfflatGetKmeans(Relation index);
+char	   *IvfflatGetCentroidsFrom(Relation index);
+double		IvfflatGetRebalanceRatio(Relation index);
+VectorArray IvfflatReadCenters(Relation index);
+int			IvfflatGetPqM(Relation index, int dimensions);
+int			IvfflatGetQuantizerMetric(FmgrInfo *procinfo);
+IvfflatQuantizer IvfflatQuantizerInit(int quantizer, int dimensions, int pqM);
+void		IvfflatQuantizerCopy(IvfflatQuantizer dst, const IvfflatQuantizerData * src);
+const		IvfflatQuantizerData *IvfflatGetQuantizer(Relation index);
+void		IvfflatTrainQuantizer(VectorArray samples, const IvfflatTypeInfo * typeInfo, IvfflatQuantizer quantizer);
+void		IvfflatPqTrain(VectorArray samples, const IvfflatTypeInfo * typeInfo, IvfflatQuantizer quantizer);
+void		IvfflatPqTrainFloats(const float *x, int numSamples, IvfflatQuantizer quantizer);
+Size		IvfflatQuantizedSize(const IvfflatQuantizerData * quantizer);
+void		IvfflatQuantize(const IvfflatQuantizerData * quantizer, const float *x, uint8 *codes);
+void		IvfflatPqComputeTable(const IvfflatQuantizerData * quantizer, int metric, const float *x, float *table);
+IndexTuple	IvfflatFormQuantizedTuple(const IvfflatQuantizerData * quantizer, const uint8 *codes);
+void		IvfflatValueToFloat(const IvfflatTypeInfo * typeInfo, Datum value, int dimensions, float *x);
+void		IvfflatWriteCodebook(Relation index, IvfflatQuantizer quantizer, ForkNumber forkNum);
 void		IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions);
+IvfflatCenterCache *IvfflatPinCenterCache(Relation index);
+void		IvfflatUnpinCenterCache(IvfflatCenterCache * cache);
+void		IvfflatInvalidateCenterCache(Relation index);
+int			IvfflatRebalance(Relation index, double ratio);
+void		IvfflatReclaimPages(Relation index);
+void		IvfflatUpdateListStats(Relation index);
+void		IvfflatGetListStats(Relation index, double *tuples, double *listTuples);
+uint32		IvfflatGetListGeneration(Relation index);
+void		IvfflatExtendMetaPage(Page page);
+void		IvfflatCheckTablePrivilege(Relation index);
+void		IvfflatCenterCacheDistances(const IvfflatCenterCache * cache, const IvfflatTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation, Datum value, double *distances);
 void		IvfflatUpdateList(Relation index, ListInfo listInfo, BlockNumber insertPage, BlockNumber originalInsertPage, BlockNumber startPage, ForkNumber forkNum);
 void		IvfflatCommitBuffer(Buffer buf, GenericXLogState *state);
 void		IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, ForkNumber forkNum);
@@ -300,6 +609,8 @@ Buffer		IvfflatNewBuffer(Relation index, ForkNumber forkNum);
 void		IvfflatInitPage(Buffer buf, Page page);
 void		IvfflatInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state);
 PGDLLEXPORT void IvfflatParallelBuildMain(const BgWorkerContext *bwc);
+PGDLLEXPORT void IvfflatParallelScanMain(const BgWorkerContext *bwc);
+PGDLLEXPORT void IvfflatParallelKmeansMain(const BgWorkerContext *bwc);
 void		IvfflatInit(void);
 const		IvfflatTypeInfo *IvfflatGetTypeInfo(Relation index);
 
@@ -319,6 +630,9 @@ extern "C" {
 	Datum ivfflatendscan(PG_FUNCTION_ARGS);
 	Datum ivfflat_halfvec_support(PG_FUNCTION_ARGS);
 	Datum ivfflat_bit_support(PG_FUNCTION_ARGS);
+	Datum ivfflat_rebalance(PG_FUNCTION_ARGS);
+	Datum ivfflat_list_stats(PG_FUNCTION_ARGS);
+	Datum ivfflat_range_search(PG_FUNCTION_ARGS);
 }
 
 /* Index access methods */
@@ -18,6 +18,7 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
 	FmgrInfo   *procinfo;
 	Oid			collation;
+	IvfflatCenterCache *cache;
 
 	/* Avoid compiler warning */
 	listInfo->blkno = nextblkno;
@@ -26,6 +27,40 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 	procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
 	collation = index->rd_indcollation[0];
 
+	/* Use cached centers to only read the page of the closest list */
+	cache = IvfflatPinCenterCache(index);
+	if (cache != NULL)
+	{
+		double	   *distances = (double *) palloc(sizeof(double) * cache->listCount);
+		int			closest = 0;
+		Buffer		cbuf;
+		Page		cpage;
+		IvfflatList list;
+
+		IvfflatCenterCacheDistances(cache, IvfflatGetTypeInfo(index), procinfo, collation, PointerGetDatum(PG_DETOAST_DATUM(values[0])), distances);
+
+		for (int i = 1; i < cache->listCount; i++)
+		{
+			if (distances[i] < distances[closest])
+				closest = i;
+		}
+
+		listInfo->blkno = ItemPointerGetBlockNumber(&cache->tids[closest]);
+		listInfo->offno = ItemPointerGetOffsetNumber(&cache->tids[closest]);
+
+		IvfflatUnpinCenterCache(cache);
+		pfree(distances);
+
+		/* Insert page changes as lists grow */
+		cbuf = ReadBuffer(index, listInfo->blkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, listInfo->offno));
+		*insertPage = list->insertPage;
+		UnlockReleaseBuffer(cbuf);
+		return;
+	}
+
 	/* Search all list pages */
 	while (BlockNumberIsValid(nextblkno))
 	{
@@ -68,6 +103,7 @@ static void
 InsertTuple(Relation index, Datum *values, const bool *isnull, ItemPointer heap_tid, Relation heapRel)
 {
 	const		IvfflatTypeInfo *typeInfo = IvfflatGetTypeInfo(index);
+	const		IvfflatQuantizerData *quantizer;
 	IndexTuple	itup;
 	Datum		value;
 	FmgrInfo   *normprocinfo;
@@ -103,7 +139,18 @@ InsertTuple(Relation index, Datum *values, const bool *isnull, ItemPointer heap_
 	originalInsertPage = insertPage;
 
 	/* Form tuple */
-	itup = index_form_tuple(RelationGetDescr(index), &value, isnull);
+	quantizer = IvfflatGetQuantizer(index);
+	if (quantizer->quantizer != IVFFLAT_QUANTIZER_NONE)
+	{
+		float	   *x = (float *) palloc(sizeof(float) * quantizer->dimensions);
+		uint8	   *codes = (uint8 *) palloc(IvfflatQuantizedSize(quantizer));
+
+		IvfflatValueToFloat(typeInfo, value, quantizer->dimensions, x);
+		IvfflatQuantize(quantizer, x, codes);
+		itup = IvfflatFormQuantizedTuple(quantizer, codes);
+	}
+	else
+		itup = index_form_tuple(RelationGetDescr(index), &value, isnull);
 	itup->t_tid = *heap_tid;
 
 	/* Get tuple size */
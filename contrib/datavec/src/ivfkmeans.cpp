@@ -13,18 +13,35 @@
 #include "utils/memutils.h"
 #include "vector.h"
 
+/*
+ * Get the distances from q to many values
+ */
+static void
+KmeansDistances(const IvfflatTypeInfo * typeInfo, FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances)
+{
+	if (typeInfo->distanceBatch != NULL)
+		typeInfo->distanceBatch(procinfo, collation, q, values, n, distances);
+	else
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+	}
+}
+
 /*
  * Initialize with kmeans++
  *
  * https://theory.stanford.edu/~sergei/papers/kMeansPP-soda.pdf
  */
 static void
-InitCenters(Relation index, VectorArray samples, VectorArray centers, float *lowerBound)
+InitCenters(Relation index, VectorArray samples, VectorArray centers, float *lowerBound, const IvfflatTypeInfo * typeInfo)
 {
 	FmgrInfo   *procinfo;
 	Oid			collation;
 	int64		j;
-	float	   *weight = (float *)palloc(samples->length * sizeof(float));
+	float	   *weight = (float *) palloc(samples->length * sizeof(float));
+	Datum	   *values = (Datum *) palloc(IVFFLAT_KMEANS_DISTANCE_BATCH * sizeof(Datum));
+	double	   *distances = (double *) palloc(IVFFLAT_KMEANS_DISTANCE_BATCH * sizeof(double));
 	int			numCenters = centers->maxlen;
 	int			numSamples = samples->length;
 
@@ -40,6 +57,7 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 
 	for (int i = 0; i < numCenters; i++)
 	{
+		Datum		center = PointerGetDatum(VectorArrayGet(centers, i));
 		double		sum;
 		double		choice;
 
@@ -47,25 +65,33 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 
 		sum = 0.0;
 
-		for (j = 0; j < numSamples; j++)
+		/* Only need to compute distance for new center */
+		/* TODO Use triangle inequality to reduce distance calculations */
+		for (j = 0; j < numSamples; j += IVFFLAT_KMEANS_DISTANCE_BATCH)
 		{
-			Datum		vec = PointerGetDatum(VectorArrayGet(samples, j));
-			double		distance;
+			int			n = Min(IVFFLAT_KMEANS_DISTANCE_BATCH, numSamples - j);
+
+			for (int k = 0; k < n; k++)
+				values[k] = PointerGetDatum(VectorArrayGet(samples, j + k));
 
-			/* Only need to compute distance for new center */
-			/* TODO Use triangle inequality to reduce distance calculations */
-			distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, i))));
+			KmeansDistances(typeInfo, procinfo, collation, center, values, n, distances);
 
-			/* Set lower bound */
-			lowerBound[j * numCenters + i] = distance;
+			for (int k = 0; k < n; k++)
+			{
+				double		distance = distances[k];
+
+				/* Set lower bound */
+				if (lowerBound != NULL)
+					lowerBound[(j + k) * numCenters + i] = distance;
 
-			/* Use distance squared for weighted probability distribution */
-			distance *= distance;
+				/* Use distance squared for weighted probability distribution */
+				distance *= distance;
 
-			if (distance < weight[j])
-				weight[j] = distance;
+				if (distance < weight[j + k])
+					weight[j + k] = distance;
 
-			sum += weight[j];
+				sum += weight[j + k];
+			}
 		}
 
 		/* Only compute lower bound on last iteration */
@@ -86,6 +112,23 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 	}
 
 	pfree(weight);
+	pfree(values);
+	pfree(distances);
+}
+
+/*
+ * Norm a center in place
+ */
+static void
+NormCenter(const IvfflatTypeInfo * typeInfo, Oid collation, Pointer center, Size itemsize)
+{
+	Datum		newCenter = IvfflatNormValue(typeInfo, collation, PointerGetDatum(center));
+	Size		size = VARSIZE_ANY(DatumGetPointer(newCenter));
+
+	if (size > itemsize)
+		elog(ERROR, "safety check failed");
+
+	memcpy(center, DatumGetPointer(newCenter), size);
 }
 
 /*
@@ -101,14 +144,7 @@ NormCenters(const IvfflatTypeInfo * typeInfo, Oid collation, VectorArray centers
 
 	for (int j = 0; j < centers->length; j++)
 	{
-		Datum		center = PointerGetDatum(VectorArrayGet(centers, j));
-		Datum		newCenter = IvfflatNormValue(typeInfo, collation, center);
-		Size		size = VARSIZE_ANY(DatumGetPointer(newCenter));
-
-		if (size > centers->itemsize)
-			elog(ERROR, "safety check failed");
-
-		memcpy(DatumGetPointer(center), DatumGetPointer(newCenter), size);
+		NormCenter(typeInfo, collation, VectorArrayGet(centers, j), centers->itemsize);
 		MemoryContextReset(normCtx);
 	}
 
@@ -162,93 +198,412 @@ ShowMemoryUsage(MemoryContext context, Size estimatedSize)
 #endif
 
 /*
- * Sum centers
+ * Ensure the memory required for k-means fits in maintenance_work_mem
  */
 static void
-SumCenters(VectorArray samples, float *agg, int *closestCenters, const IvfflatTypeInfo * typeInfo)
+CheckKmeansMemory(Size totalSize)
 {
-	for (int j = 0; j < samples->length; j++)
-	{
-		float	   *x = agg + ((int64) closestCenters[j] * samples->dim);
-
-		typeInfo->sumCenter(VectorArrayGet(samples, j), x);
-	}
+	/* Add one to error message to ceil */
+	if (totalSize > (Size) u_sess->attr.attr_memory.maintenance_work_mem * 1024L)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("memory required is %zu MB, maintenance_work_mem is %d MB",
+						totalSize / (1024 * 1024) + 1, u_sess->attr.attr_memory.maintenance_work_mem / 1024),
+				 errhint("Increase maintenance_work_mem or use kmeans = 'minibatch'.")));
 }
 
 /*
- * Update centers
+ * Run Elkan steps 2 and 3 for a range of samples
+ *
+ * Steps 5 and 6 of the previous iteration are deferred to here so they
+ * are split across participants as well
  */
-static void
-UpdateCenters(float *agg, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+static int64
+ElkanAssign(IvfflatKmeansState state, FmgrInfo *procinfo, Oid collation, int64 start, int64 end)
 {
-	for (int j = 0; j < centers->length; j++)
+	VectorArray samples = state->samples;
+	int64		numCenters = state->numCenters;
+	int		   *closestCenters = state->closestCenters;
+	float	   *upperBound = state->upperBound;
+	float	   *halfcdist = state->halfcdist;
+	float	   *s = state->s;
+	bool		rjreset = state->iteration != 0;
+	int64		changes = 0;
+
+	for (int64 j = start; j < end; j++)
 	{
-		float	   *x = agg + ((int64) j * centers->dim);
+		float	   *lowerBound = state->lowerBound + j * numCenters;
+		bool		rj;
+
+		if (state->iteration == 0)
+		{
+			float		minDistance = FLT_MAX;
+			int			closestCenter = 0;
 
-		typeInfo->updateCenter(VectorArrayGet(centers, j), centers->dim, x);
+			/* Assign x to its closest initial center c(x) = argmin d(x,c) */
+			for (int64 k = 0; k < numCenters; k++)
+			{
+				/* TODO Use Lemma 1 in k-means++ initialization */
+				float		distance = lowerBound[k];
+
+				if (distance < minDistance)
+				{
+					minDistance = distance;
+					closestCenter = k;
+				}
+			}
+
+			upperBound[j] = minDistance;
+			closestCenters[j] = closestCenter;
+		}
+		else
+		{
+			/* Step 5 */
+			for (int64 k = 0; k < numCenters; k++)
+			{
+				float		distance = lowerBound[k] - state->newcdist[k];
+
+				if (distance < 0)
+					distance = 0;
+
+				lowerBound[k] = distance;
+			}
+
+			/* Step 6 */
+			upperBound[j] += state->newcdist[closestCenters[j]];
+		}
+
+		/* Step 2: Identify all points x such that u(x) <= s(c(x)) */
+		if (upperBound[j] <= s[closestCenters[j]])
+			continue;
+
+		rj = rjreset;
+
+		for (int64 k = 0; k < numCenters; k++)
+		{
+			Datum		vec;
+			float		dxcx;
+
+			/* Step 3: For all remaining points x and centers c */
+			if (k == closestCenters[j])
+				continue;
+
+			if (upperBound[j] <= lowerBound[k])
+				continue;
+
+			if (upperBound[j] <= halfcdist[closestCenters[j] * numCenters + k])
+				continue;
+
+			vec = PointerGetDatum(VectorArrayGet(samples, j));
+
+			/* Step 3a */
+			if (rj)
+			{
+				dxcx = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, state->centerValues[closestCenters[j]]));
+
+				/* d(x,c(x)) computed, which is a form of d(x,c) */
+				lowerBound[closestCenters[j]] = dxcx;
+				upperBound[j] = dxcx;
+
+				rj = false;
+			}
+			else
+				dxcx = upperBound[j];
+
+			/* Step 3b */
+			if (dxcx > lowerBound[k] || dxcx > halfcdist[closestCenters[j] * numCenters + k])
+			{
+				float		dxc = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, state->centerValues[k]));
+
+				/* d(x,c) calculated */
+				lowerBound[k] = dxc;
+
+				if (dxc < dxcx)
+				{
+					closestCenters[j] = k;
+
+					/* c(x) changed */
+					upperBound[j] = dxc;
+
+					changes++;
+				}
+			}
+		}
 	}
+
+	return changes;
 }
 
 /*
- * Compute new centers
+ * Compute new centers for a range of centers
+ *
+ * Each center sums its samples in order, so the result does not depend on
+ * how centers are split across participants. Empty centers are left for
+ * the leader.
  */
 static void
-ComputeNewCenters(VectorArray samples, float *agg, VectorArray newCenters, int *centerCounts, int *closestCenters, FmgrInfo *normprocinfo, Oid collation, const IvfflatTypeInfo * typeInfo)
+UpdateCenters(IvfflatKmeansState state, Oid collation, int64 start, int64 end)
 {
+	const IvfflatTypeInfo *typeInfo = state->typeInfo;
+	VectorArray samples = state->samples;
+	VectorArray newCenters = state->newCenters;
 	int			dimensions = newCenters->dim;
-	int			numCenters = newCenters->length;
-	int			numSamples = samples->length;
 
 	/* Reset sum and count */
-	for (int j = 0; j < numCenters; j++)
+	for (int64 j = start; j < end; j++)
 	{
-		float	   *x = agg + ((int64) j * dimensions);
+		float	   *x = state->agg + j * dimensions;
 
 		for (int k = 0; k < dimensions; k++)
 			x[k] = 0.0;
 
-		centerCounts[j] = 0;
+		state->centerCounts[j] = 0;
 	}
 
-	/* Increment sum of closest center */
-	SumCenters(samples, agg, closestCenters, typeInfo);
+	/* Increment sum and count of closest center */
+	for (int j = 0; j < samples->length; j++)
+	{
+		int			closestCenter = state->closestCenters[j];
+
+		if (closestCenter < start || closestCenter >= end)
+			continue;
 
-	/* Increment count of closest center */
-	for (int j = 0; j < numSamples; j++)
-		centerCounts[closestCenters[j]] += 1;
+		typeInfo->sumCenter(VectorArrayGet(samples, j), state->agg + ((int64) closestCenter * dimensions));
+		state->centerCounts[closestCenter] += 1;
+	}
 
 	/* Divide sum by count */
-	for (int j = 0; j < numCenters; j++)
+	for (int64 j = start; j < end; j++)
 	{
-		float	   *x = agg + ((int64) j * dimensions);
+		float	   *x = state->agg + j * dimensions;
+
+		if (state->centerCounts[j] == 0)
+			continue;
 
-		if (centerCounts[j] > 0)
+		/* Double avoids overflow, but requires more memory */
+		/* TODO Update bounds */
+		for (int k = 0; k < dimensions; k++)
 		{
-			/* Double avoids overflow, but requires more memory */
-			/* TODO Update bounds */
-			for (int k = 0; k < dimensions; k++)
+			if (isinf(x[k]))
+				x[k] = x[k] > 0 ? FLT_MAX : -FLT_MAX;
+		}
+
+		for (int k = 0; k < dimensions; k++)
+			x[k] /= state->centerCounts[j];
+
+		/* Set new center */
+		typeInfo->updateCenter(VectorArrayGet(newCenters, j), dimensions, x);
+
+		/* Normalize if needed */
+		if (state->normalize)
+			NormCenter(typeInfo, collation, VectorArrayGet(newCenters, j), newCenters->itemsize);
+	}
+}
+
+/*
+ * Reseed empty centers
+ */
+static void
+ReseedCenters(IvfflatKmeansState state, Oid collation)
+{
+	VectorArray newCenters = state->newCenters;
+	int			dimensions = newCenters->dim;
+
+	for (int j = 0; j < newCenters->length; j++)
+	{
+		float	   *x = state->agg + ((int64) j * dimensions);
+
+		if (state->centerCounts[j] > 0)
+			continue;
+
+		/* TODO Handle empty centers properly */
+		for (int k = 0; k < dimensions; k++)
+			x[k] = RandomDouble();
+
+		state->typeInfo->updateCenter(VectorArrayGet(newCenters, j), dimensions, x);
+
+		if (state->normalize)
+			NormCenter(state->typeInfo, collation, VectorArrayGet(newCenters, j), newCenters->itemsize);
+	}
+}
+
+/*
+ * Assign a range of samples in the current batch to their closest centers
+ */
+static void
+MiniBatchAssign(IvfflatKmeansState state, FmgrInfo *procinfo, Oid collation, double *distances, int64 start, int64 end)
+{
+	for (int64 i = start; i < end; i++)
+	{
+		Datum		value = PointerGetDatum(VectorArrayGet(state->samples, state->batchStart + i));
+		double		minDistance = DBL_MAX;
+		int			closestCenter = 0;
+
+		KmeansDistances(state->typeInfo, procinfo, collation, value, state->centerValues, state->numCenters, distances);
+
+		for (int k = 0; k < state->numCenters; k++)
+		{
+			if (distances[k] < minDistance)
 			{
-				if (isinf(x[k]))
-					x[k] = x[k] > 0 ? FLT_MAX : -FLT_MAX;
+				minDistance = distances[k];
+				closestCenter = k;
 			}
+		}
 
-			for (int k = 0; k < dimensions; k++)
-				x[k] /= centerCounts[j];
+		state->batchCenters[i] = closestCenter;
+	}
+}
+
+/*
+ * Claim and process items until none are left
+ */
+static void
+KmeansParticipate(IvfflatKmeansShared * kmshared, Relation index)
+{
+	IvfflatKmeansState state = kmshared->state;
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	double	   *distances = NULL;
+	int64		changes = 0;
+	MemoryContext tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												 "Ivfflat kmeans participant context",
+												 ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx;
+
+	if (kmshared->task == IVFFLAT_KMEANS_TASK_MINIBATCH_ASSIGN)
+		distances = (double *) palloc(sizeof(double) * state->numCenters);
+
+	oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+	for (;;)
+	{
+		int64		start;
+		int64		end;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		SpinLockAcquire(&kmshared->mutex);
+		start = kmshared->next;
+		end = Min(start + kmshared->chunk, kmshared->count);
+		kmshared->next = end;
+		SpinLockRelease(&kmshared->mutex);
+
+		if (start >= end)
+			break;
+
+		switch (kmshared->task)
+		{
+			case IVFFLAT_KMEANS_TASK_ELKAN_ASSIGN:
+				changes += ElkanAssign(state, procinfo, collation, start, end);
+				break;
+			case IVFFLAT_KMEANS_TASK_UPDATE:
+				UpdateCenters(state, collation, start, end);
+				break;
+			case IVFFLAT_KMEANS_TASK_MINIBATCH_ASSIGN:
+				MiniBatchAssign(state, procinfo, collation, distances, start, end);
+				break;
+			default:
+				elog(ERROR, "unknown k-means task");
 		}
-		else
+
+		MemoryContextReset(tmpCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(tmpCtx);
+
+	if (distances != NULL)
+		pfree(distances);
+
+	SpinLockAcquire(&kmshared->mutex);
+	kmshared->changes += changes;
+	SpinLockRelease(&kmshared->mutex);
+}
+
+/*
+ * Perform work within a launched parallel process
+ */
+void
+IvfflatParallelKmeansMain(const BgWorkerContext *bwc)
+{
+	IvfflatKmeansShared *kmshared = (IvfflatKmeansShared *) bwc->bgshared;
+	Relation	index;
+
+	/* Open relation within worker */
+	index = index_open(kmshared->indexrelid, NoLock);
+
+	KmeansParticipate(kmshared, index);
+
+	/* Close relation within worker */
+	index_close(index, NoLock);
+}
+
+/*
+ * Initialize shared state for a task
+ */
+static void
+KmeansInitShared(IvfflatKmeansShared * kmshared, IvfflatKmeansState state, Relation index, int task, int64 count, int64 chunk)
+{
+	kmshared->indexrelid = RelationGetRelid(index);
+	kmshared->task = task;
+	kmshared->count = count;
+	kmshared->chunk = chunk;
+	kmshared->state = state;
+	SpinLockInit(&kmshared->mutex);
+	kmshared->next = 0;
+	kmshared->changes = 0;
+}
+
+/*
+ * Run a task over count items, with background workers when the work is
+ * large enough to pay for launching them
+ *
+ * Returns the number of changed assignments
+ */
+static int64
+KmeansRun(IvfflatKmeansState state, Relation index, int task, int64 count, int64 chunk, double cost)
+{
+	IvfflatKmeansShared local;
+	IvfflatKmeansShared *kmshared = &local;
+	int			nworkers = 0;
+	int64		changes;
+
+	if (state->nworkers > 0 && count > chunk && cost >= IVFFLAT_KMEANS_PARALLEL_MIN_COST)
+	{
+		int			request = (int) Min((int64) state->nworkers, (count - 1) / chunk);
+
+		kmshared = (IvfflatKmeansShared *) MemoryContextAllocZero(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), sizeof(IvfflatKmeansShared));
+		KmeansInitShared(kmshared, state, index, task, count, chunk);
+
+		nworkers = LaunchBackgroundWorkers(request, kmshared, IvfflatParallelKmeansMain, NULL);
+
+		/* If no workers were successfully launched, back out (run serially) */
+		if (nworkers == 0)
 		{
-			/* TODO Handle empty centers properly */
-			for (int k = 0; k < dimensions; k++)
-				x[k] = RandomDouble();
+			pfree_ext(kmshared);
+			kmshared = &local;
 		}
 	}
 
-	/* Set new centers */
-	UpdateCenters(agg, newCenters, typeInfo);
+	if (kmshared == &local)
+		KmeansInitShared(kmshared, state, index, task, count, chunk);
 
-	/* Normalize if needed */
-	if (normprocinfo != NULL)
-		NormCenters(typeInfo, collation, newCenters);
+	/* Participate as a worker */
+	KmeansParticipate(kmshared, index);
+
+	if (nworkers == 0)
+		return kmshared->changes;
+
+	BgworkerListWaitFinish(&nworkers);
+	pg_memory_barrier();
+
+	changes = kmshared->changes;
+
+	/* Shut down workers, which frees the shared state */
+	BgworkerListSyncQuit();
+
+	return changes;
 }
 
 /*
@@ -260,7 +615,7 @@ ComputeNewCenters(VectorArray samples, float *agg, VectorArray newCenters, int *
  * https://www.aaai.org/Papers/ICML/2003/ICML03-022.pdf
  */
 static void
-ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int nworkers)
 {
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
@@ -268,15 +623,8 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 	int			dimensions = centers->dim;
 	int			numCenters = centers->maxlen;
 	int			numSamples = samples->length;
-	VectorArray newCenters;
-	float	   *agg;
-	int		   *centerCounts;
-	int		   *closestCenters;
-	float	   *lowerBound;
-	float	   *upperBound;
-	float	   *s;
-	float	   *halfcdist;
-	float	   *newcdist;
+	IvfflatKmeansStateData state;
+	double	   *distances;
 
 	/* Calculate allocation sizes */
 	Size		samplesSize = VECTOR_ARRAY_SIZE(samples->maxlen, samples->itemsize);
@@ -290,17 +638,14 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 	Size		sSize = sizeof(float) * numCenters;
 	Size		halfcdistSize = sizeof(float) * numCenters * numCenters;
 	Size		newcdistSize = sizeof(float) * numCenters;
+	Size		centerValuesSize = sizeof(Datum) * numCenters;
+	Size		distancesSize = sizeof(double) * numCenters;
 
 	/* Calculate total size */
-	Size		totalSize = samplesSize + centersSize + newCentersSize + aggSize + centerCountsSize + closestCentersSize + lowerBoundSize + upperBoundSize + sSize + halfcdistSize + newcdistSize;
+	Size		totalSize = samplesSize + centersSize + newCentersSize + aggSize + centerCountsSize + closestCentersSize + lowerBoundSize + upperBoundSize + sSize + halfcdistSize + newcdistSize + centerValuesSize + distancesSize;
 
 	/* Check memory requirements */
-	/* Add one to error message to ceil */
-	if (totalSize > (Size) u_sess->attr.attr_memory.maintenance_work_mem * 1024L)
-		ereport(ERROR,
-				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
-				 errmsg("memory required is %zu MB, maintenance_work_mem is %d MB",
-						totalSize / (1024 * 1024) + 1, u_sess->attr.attr_memory.maintenance_work_mem / 1024)));
+	CheckKmeansMemory(totalSize);
 
 	/* Ensure indexing does not overflow */
 	if (numCenters * numCenters > INT_MAX)
@@ -313,69 +658,59 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 
 	/* Allocate space */
 	/* Use float instead of double to save memory */
-	agg = (float *)palloc(aggSize);
-	centerCounts = (int *)palloc(centerCountsSize);
-	closestCenters = (int *)palloc(closestCentersSize);
-	lowerBound = (float *)palloc_extended(lowerBoundSize, MCXT_ALLOC_HUGE);
-	upperBound = (float *)palloc(upperBoundSize);
-	s = (float *)palloc(sSize);
-	halfcdist = (float *)palloc_extended(halfcdistSize, MCXT_ALLOC_HUGE);
-	newcdist = (float *)palloc(newcdistSize);
+	MemSet(&state, 0, sizeof(state));
+	state.typeInfo = typeInfo;
+	state.samples = samples;
+	state.centers = centers;
+	state.numCenters = numCenters;
+	state.normalize = normprocinfo != NULL;
+	state.nworkers = nworkers;
+	state.agg = (float *) palloc(aggSize);
+	state.centerCounts = (int *) palloc(centerCountsSize);
+	state.closestCenters = (int *) palloc(closestCentersSize);
+	state.lowerBound = (float *) palloc_extended(lowerBoundSize, MCXT_ALLOC_HUGE);
+	state.upperBound = (float *) palloc(upperBoundSize);
+	state.s = (float *) palloc(sSize);
+	state.halfcdist = (float *) palloc_extended(halfcdistSize, MCXT_ALLOC_HUGE);
+	state.newcdist = (float *) palloc(newcdistSize);
+	state.centerValues = (Datum *) palloc(centerValuesSize);
+	distances = (double *) palloc(distancesSize);
 
 	/* Initialize new centers */
-	newCenters = VectorArrayInit(numCenters, dimensions, centers->itemsize);
-	newCenters->length = numCenters;
+	state.newCenters = VectorArrayInit(numCenters, dimensions, centers->itemsize);
+	state.newCenters->length = numCenters;
+
+	for (int j = 0; j < numCenters; j++)
+		state.centerValues[j] = PointerGetDatum(VectorArrayGet(centers, j));
 
 #ifdef IVFFLAT_MEMORY
-	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext));
+	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext), totalSize);
 #endif
 
 	/* Pick initial centers */
-	InitCenters(index, samples, centers, lowerBound);
-
-	/* Assign each x to its closest initial center c(x) = argmin d(x,c) */
-	for (int64 j = 0; j < numSamples; j++)
-	{
-		float		minDistance = FLT_MAX;
-		int			closestCenter = 0;
-
-		/* Find closest center */
-		for (int64 k = 0; k < numCenters; k++)
-		{
-			/* TODO Use Lemma 1 in k-means++ initialization */
-			float		distance = lowerBound[j * numCenters + k];
-
-			if (distance < minDistance)
-			{
-				minDistance = distance;
-				closestCenter = k;
-			}
-		}
-
-		upperBound[j] = minDistance;
-		closestCenters[j] = closestCenter;
-	}
+	InitCenters(index, samples, centers, state.lowerBound, typeInfo);
 
 	/* Give 500 iterations to converge */
 	for (int iteration = 0; iteration < 500; iteration++)
 	{
-		int			changes = 0;
-		bool		rjreset;
+		int64		changes;
 
 		/* Can take a while, so ensure we can interrupt */
 		CHECK_FOR_INTERRUPTS();
 
 		/* Step 1: For all centers, compute distance */
-		for (int64 j = 0; j < numCenters; j++)
+		for (int64 j = 0; j < numCenters - 1; j++)
 		{
-			Datum		vec = PointerGetDatum(VectorArrayGet(centers, j));
+			int			n = numCenters - j - 1;
+
+			KmeansDistances(typeInfo, procinfo, collation, state.centerValues[j], &state.centerValues[j + 1], n, distances);
 
 			for (int64 k = j + 1; k < numCenters; k++)
 			{
-				float		distance = 0.5 * DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
+				float		distance = 0.5 * distances[k - j - 1];
 
-				halfcdist[j * numCenters + k] = distance;
-				halfcdist[k * numCenters + j] = distance;
+				state.halfcdist[j * numCenters + k] = distance;
+				state.halfcdist[k * numCenters + j] = distance;
 			}
 		}
 
@@ -391,110 +726,236 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 				if (j == k)
 					continue;
 
-				distance = halfcdist[j * numCenters + k];
+				distance = state.halfcdist[j * numCenters + k];
 				if (distance < minDistance)
 					minDistance = distance;
 			}
 
-			s[j] = minDistance;
+			state.s[j] = minDistance;
 		}
 
-		rjreset = iteration != 0;
+		/* Steps 2 and 3, assigning initial centers on the first iteration */
+		state.iteration = iteration;
+		changes = KmeansRun(&state, index, IVFFLAT_KMEANS_TASK_ELKAN_ASSIGN, numSamples,
+							IVFFLAT_KMEANS_CHUNK_SIZE, (double) numSamples * numCenters * dimensions);
 
-		for (int64 j = 0; j < numSamples; j++)
-		{
-			bool		rj;
+		/* Step 4: For each center c, let m(c) be mean of all points assigned */
+		KmeansRun(&state, index, IVFFLAT_KMEANS_TASK_UPDATE, numCenters,
+				  Max(numCenters / (4 * (nworkers + 1)), 1), (double) numSamples * dimensions);
+		ReseedCenters(&state, collation);
 
-			/* Step 2: Identify all points x such that u(x) <= s(c(x)) */
-			if (upperBound[j] <= s[closestCenters[j]])
-				continue;
+		/* Step 5 */
+		/* Bounds are updated at the start of the next assignment */
+		for (int j = 0; j < numCenters; j++)
+			state.newcdist[j] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, state.centerValues[j], PointerGetDatum(VectorArrayGet(state.newCenters, j))));
 
-			rj = rjreset;
+		/* Step 7 */
+		for (int j = 0; j < numCenters; j++)
+			VectorArraySet(centers, j, VectorArrayGet(state.newCenters, j));
 
-			for (int64 k = 0; k < numCenters; k++)
-			{
-				Datum		vec;
-				float		dxcx;
+		if (changes == 0 && iteration != 0)
+			break;
+	}
+}
 
-				/* Step 3: For all remaining points x and centers c */
-				if (k == closestCenters[j])
-					continue;
+/*
+ * Get the batch size for mini-batch k-means
+ */
+static int
+MiniBatchSize(int numSamples, int numCenters)
+{
+	int64		batchSize = Max((int64) numCenters * 4, IVFFLAT_MINIBATCH_MIN_SIZE);
 
-				if (upperBound[j] <= lowerBound[j * numCenters + k])
-					continue;
+	return (int) Min(batchSize, (int64) numSamples);
+}
 
-				if (upperBound[j] <= halfcdist[closestCenters[j] * numCenters + k])
-					continue;
+/*
+ * Get the memory required for mini-batch k-means, excluding samples
+ */
+static Size
+MiniBatchFixedSize(int numCenters, int dimensions, Size itemsize)
+{
+	Size		batchSize = MiniBatchSize(INT_MAX, numCenters);
+	Size		size = 0;
+
+	size += VECTOR_ARRAY_SIZE(numCenters, itemsize);	/* centers */
+	size += sizeof(float) * (int64) numCenters * dimensions;	/* agg */
+	size += sizeof(int) * numCenters;	/* centerCounts */
+	size += sizeof(bool) * numCenters;	/* moved */
+	size += sizeof(Datum) * numCenters;	/* centerValues */
+	size += sizeof(int) * batchSize;	/* batchCenters */
+	size += sizeof(float) * batchSize;	/* kmeans++ weights */
+
+	return size;
+}
 
-				vec = PointerGetDatum(VectorArrayGet(samples, j));
+/*
+ * Get the number of samples that fit in maintenance_work_mem for
+ * mini-batch k-means
+ */
+int
+IvfflatMiniBatchMaxSamples(int numCenters, int dimensions, Size itemsize)
+{
+	Size		maxSize = (Size) u_sess->attr.attr_memory.maintenance_work_mem * 1024L;
+	Size		fixedSize = MiniBatchFixedSize(numCenters, dimensions, itemsize) + sizeof(VectorArrayData);
 
-				/* Step 3a */
-				if (rj)
-				{
-					dxcx = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, closestCenters[j]))));
+	if (fixedSize >= maxSize)
+		return 0;
 
-					/* d(x,c(x)) computed, which is a form of d(x,c) */
-					lowerBound[j * numCenters + closestCenters[j]] = dxcx;
-					upperBound[j] = dxcx;
+	return (int) Min((maxSize - fixedSize) / MAXALIGN(itemsize), (Size) INT_MAX);
+}
 
-					rj = false;
-				}
-				else
-					dxcx = upperBound[j];
+/*
+ * Shuffle samples so consecutive batches are random subsets
+ */
+static void
+ShuffleSamples(VectorArray samples)
+{
+	char	   *tmp = (char *) palloc(samples->itemsize);
 
-				/* Step 3b */
-				if (dxcx > lowerBound[j * numCenters + k] || dxcx > halfcdist[closestCenters[j] * numCenters + k])
-				{
-					float		dxc = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
+	for (int i = samples->length - 1; i > 0; i--)
+	{
+		int			j = RandomInt() % (i + 1);
 
-					/* d(x,c) calculated */
-					lowerBound[j * numCenters + k] = dxc;
+		if (j == i)
+			continue;
 
-					if (dxc < dxcx)
-					{
-						closestCenters[j] = k;
+		memcpy(tmp, VectorArrayGet(samples, i), samples->itemsize);
+		memcpy(VectorArrayGet(samples, i), VectorArrayGet(samples, j), samples->itemsize);
+		memcpy(VectorArrayGet(samples, j), tmp, samples->itemsize);
+	}
 
-						/* c(x) changed */
-						upperBound[j] = dxc;
+	pfree(tmp);
+}
 
-						changes++;
-					}
-				}
-			}
-		}
+/*
+ * Use mini-batch k-means for large sample sets. This needs no per-sample
+ * bounds, so memory is dominated by the samples themselves.
+ *
+ * https://www.eecs.tufts.edu/~dsculley/papers/fastkmeans.pdf
+ */
+static void
+MiniBatchKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int nworkers)
+{
+	FmgrInfo   *normprocinfo;
+	Oid			collation;
+	int			dimensions = centers->dim;
+	int			numCenters = centers->maxlen;
+	int			numSamples = samples->length;
+	int			batchSize = MiniBatchSize(numSamples, numCenters);
+	int			iterations;
+	IvfflatKmeansStateData state;
+	VectorArrayData initSamples;
+	float	   *agg;
+	int		   *centerCounts;
+	bool	   *moved;
+	float	   *x;
+	MemoryContext normCtx;
 
-		/* Step 4: For each center c, let m(c) be mean of all points assigned */
-		ComputeNewCenters(samples, agg, newCenters, centerCounts, closestCenters, normprocinfo, collation, typeInfo);
+	/* Calculate total size */
+	Size		totalSize = VECTOR_ARRAY_SIZE(samples->maxlen, samples->itemsize) + MiniBatchFixedSize(numCenters, dimensions, centers->itemsize);
 
-		/* Step 5 */
-		for (int j = 0; j < numCenters; j++)
-			newcdist[j] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, PointerGetDatum(VectorArrayGet(centers, j)), PointerGetDatum(VectorArrayGet(newCenters, j))));
+	/* Check memory requirements */
+	CheckKmeansMemory(totalSize);
+
+	/* Set support functions */
+	normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	collation = index->rd_indcollation[0];
+
+	/* Pick initial centers from the first batch */
+	ShuffleSamples(samples);
+	initSamples = *samples;
+	initSamples.length = batchSize;
+	InitCenters(index, &initSamples, centers, NULL, typeInfo);
+
+	/* Allocate space */
+	MemSet(&state, 0, sizeof(state));
+	state.typeInfo = typeInfo;
+	state.samples = samples;
+	state.centers = centers;
+	state.numCenters = numCenters;
+	state.normalize = normprocinfo != NULL;
+	state.nworkers = nworkers;
+	state.centerValues = (Datum *) palloc(sizeof(Datum) * numCenters);
+	state.batchCenters = (int *) palloc(sizeof(int) * batchSize);
+	agg = (float *) palloc0(sizeof(float) * (int64) numCenters * dimensions);
+	centerCounts = (int *) palloc0(sizeof(int) * numCenters);
+	moved = (bool *) palloc(sizeof(bool) * numCenters);
+	x = (float *) palloc(sizeof(float) * dimensions);
+
+	/* Running means start at the initial centers */
+	for (int j = 0; j < numCenters; j++)
+	{
+		state.centerValues[j] = PointerGetDatum(VectorArrayGet(centers, j));
+		typeInfo->sumCenter(VectorArrayGet(centers, j), agg + ((int64) j * dimensions));
+	}
+
+	normCtx = AllocSetContextCreate(CurrentMemoryContext,
+									"Ivfflat norm temporary context",
+									ALLOCSET_DEFAULT_SIZES);
+
+	/* Run at least one pass over the samples */
+	iterations = Max(IVFFLAT_MINIBATCH_ITERATIONS, (numSamples + batchSize - 1) / batchSize);
+
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		/* Wrap around to the start of the samples */
+		if (state.batchStart + batchSize > numSamples)
+			state.batchStart = 0;
+
+		/* Assign each sample in the batch to its closest center */
+		KmeansRun(&state, index, IVFFLAT_KMEANS_TASK_MINIBATCH_ASSIGN, batchSize,
+				  IVFFLAT_KMEANS_CHUNK_SIZE / 4, (double) batchSize * numCenters * dimensions);
 
-		for (int64 j = 0; j < numSamples; j++)
+		/* Move each center toward its samples with a per-center learning rate */
+		MemSet(moved, 0, sizeof(bool) * numCenters);
+		for (int i = 0; i < batchSize; i++)
 		{
-			for (int64 k = 0; k < numCenters; k++)
-			{
-				float		distance = lowerBound[j * numCenters + k] - newcdist[k];
+			int			closestCenter = state.batchCenters[i];
+			float	   *mean = agg + ((int64) closestCenter * dimensions);
+			float		eta;
 
-				if (distance < 0)
-					distance = 0;
+			for (int k = 0; k < dimensions; k++)
+				x[k] = 0.0;
 
-				lowerBound[j * numCenters + k] = distance;
-			}
-		}
+			typeInfo->sumCenter(VectorArrayGet(samples, state.batchStart + i), x);
 
-		/* Step 6 */
-		/* We reset r(x) before Step 3 in the next iteration */
-		for (int j = 0; j < numSamples; j++)
-			upperBound[j] += newcdist[closestCenters[j]];
+			centerCounts[closestCenter] += 1;
+			eta = 1.0 / centerCounts[closestCenter];
 
-		/* Step 7 */
+			for (int k = 0; k < dimensions; k++)
+				mean[k] += (x[k] - mean[k]) * eta;
+
+			moved[closestCenter] = true;
+		}
+
+		/* Set new centers */
 		for (int j = 0; j < numCenters; j++)
-			VectorArraySet(centers, j, VectorArrayGet(newCenters, j));
+		{
+			if (!moved[j])
+				continue;
 
-		if (changes == 0 && iteration != 0)
-			break;
+			typeInfo->updateCenter(VectorArrayGet(centers, j), dimensions, agg + ((int64) j * dimensions));
+
+			/* Normalize if needed */
+			if (normprocinfo != NULL)
+			{
+				MemoryContext oldCtx = MemoryContextSwitchTo(normCtx);
+
+				NormCenter(typeInfo, collation, VectorArrayGet(centers, j), centers->itemsize);
+
+				MemoryContextSwitchTo(oldCtx);
+				MemoryContextReset(normCtx);
+			}
+		}
+
+		state.batchStart += batchSize;
 	}
+
+	MemoryContextDelete(normCtx);
 }
 
 /*
@@ -564,7 +1025,7 @@ CheckCenters(Relation index, VectorArray centers, const IvfflatTypeInfo * typeIn
  * We use spherical k-means for inner product and cosine
  */
 void
-IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int kmeans, int nworkers)
 {
 	MemoryContext kmeansCtx = AllocSetContextCreate(CurrentMemoryContext,
 													"Ivfflat kmeans temporary context",
@@ -573,11 +1034,153 @@ IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const Iv
 
 	if (samples->length == 0)
 		RandomCenters(index, centers, typeInfo);
+	else if (kmeans == IVFFLAT_KMEANS_MINIBATCH)
+		MiniBatchKmeans(index, samples, centers, typeInfo, nworkers);
 	else
-		ElkanKmeans(index, samples, centers, typeInfo);
+		ElkanKmeans(index, samples, centers, typeInfo, nworkers);
 
 	CheckCenters(index, centers, typeInfo);
 
 	MemoryContextSwitchTo(oldCtx);
 	MemoryContextDelete(kmeansCtx);
 }
+
+/*
+ * Run Lloyd's algorithm on one subspace
+ */
+static void
+PqSubspaceKmeans(const float *x, int numSamples, int dimensions, int offset, int dsub, float *codewords)
+{
+	int			k = IVFFLAT_PQ_CODEWORDS;
+	int		   *closestCodewords = (int *) palloc(sizeof(int) * Max(numSamples, 1));
+	int		   *codewordCounts = (int *) palloc(sizeof(int) * k);
+	float	   *agg = (float *) palloc(sizeof(float) * k * dsub);
+
+	/* Pick random samples as initial codewords */
+	for (int c = 0; c < k; c++)
+	{
+		if (numSamples > 0)
+		{
+			const float *sample = x + (Size) (RandomInt() % numSamples) * dimensions + offset;
+
+			for (int d = 0; d < dsub; d++)
+				codewords[c * dsub + d] = sample[d];
+		}
+		else
+		{
+			for (int d = 0; d < dsub; d++)
+				codewords[c * dsub + d] = (float) RandomDouble();
+		}
+	}
+
+	for (int i = 0; i < numSamples; i++)
+		closestCodewords[i] = -1;
+
+	for (int iteration = 0; iteration < IVFFLAT_PQ_ITERATIONS && numSamples > 0; iteration++)
+	{
+		int			changes = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (int j = 0; j < k * dsub; j++)
+			agg[j] = 0.0;
+
+		for (int c = 0; c < k; c++)
+			codewordCounts[c] = 0;
+
+		/* Assign samples to the closest codeword */
+		for (int i = 0; i < numSamples; i++)
+		{
+			const float *sample = x + (Size) i * dimensions + offset;
+			float		minDistance = FLT_MAX;
+			int			closest = 0;
+
+			for (int c = 0; c < k; c++)
+			{
+				float		distance = 0.0;
+
+				for (int d = 0; d < dsub; d++)
+				{
+					float		diff = sample[d] - codewords[c * dsub + d];
+
+					distance += diff * diff;
+				}
+
+				if (distance < minDistance)
+				{
+					minDistance = distance;
+					closest = c;
+				}
+			}
+
+			if (closestCodewords[i] != closest)
+			{
+				closestCodewords[i] = closest;
+				changes++;
+			}
+
+			codewordCounts[closest]++;
+			for (int d = 0; d < dsub; d++)
+				agg[closest * dsub + d] += sample[d];
+		}
+
+		if (changes == 0)
+			break;
+
+		/* Move codewords to the mean, and reseed empty ones */
+		for (int c = 0; c < k; c++)
+		{
+			if (codewordCounts[c] > 0)
+			{
+				for (int d = 0; d < dsub; d++)
+					codewords[c * dsub + d] = agg[c * dsub + d] / codewordCounts[c];
+			}
+			else
+			{
+				const float *sample = x + (Size) (RandomInt() % numSamples) * dimensions + offset;
+
+				for (int d = 0; d < dsub; d++)
+					codewords[c * dsub + d] = sample[d];
+			}
+		}
+	}
+
+	pfree(closestCodewords);
+	pfree(codewordCounts);
+	pfree(agg);
+}
+
+/*
+ * Train product quantization codebooks
+ *
+ * Each subspace is clustered independently on L2 distance, which also
+ * works for inner product since distances are decomposed per subspace
+ */
+void
+IvfflatPqTrain(VectorArray samples, const IvfflatTypeInfo * typeInfo, IvfflatQuantizer quantizer)
+{
+	int			dimensions = quantizer->dimensions;
+	int			numSamples = samples->length;
+	float	   *x = (float *) palloc_extended(sizeof(float) * Max(numSamples, 1) * dimensions, MCXT_ALLOC_HUGE);
+
+	for (int i = 0; i < numSamples; i++)
+		IvfflatValueToFloat(typeInfo, PointerGetDatum(VectorArrayGet(samples, i)), dimensions, x + (Size) i * dimensions);
+
+	IvfflatPqTrainFloats(x, numSamples, quantizer);
+
+	pfree(x);
+}
+
+/*
+ * Train product quantization codebooks on samples already converted to
+ * floats, laid out one after another
+ */
+void
+IvfflatPqTrainFloats(const float *x, int numSamples, IvfflatQuantizer quantizer)
+{
+	int			dimensions = quantizer->dimensions;
+	int			dsub = quantizer->pqDsub;
+
+	for (int j = 0; j < quantizer->pqM; j++)
+		PqSubspaceKmeans(x, numSamples, dimensions, j * dsub, dsub, quantizer->codebook + j * IVFFLAT_PQ_CODEWORDS * dsub);
+}
@@ -0,0 +1,420 @@
+#include "postgres.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "access/generic_xlog.h"
+#include "halfvec.h"
+#include "ivfflat.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+/*
+ * Get the quantizer metric for a distance function
+ *
+ * Returns -1 if distances cannot be computed on quantized values
+ */
+int
+IvfflatGetQuantizerMetric(FmgrInfo *procinfo)
+{
+	if (procinfo->fn_addr == vector_l2_squared_distance ||
+		procinfo->fn_addr == halfvec_l2_squared_distance)
+		return IVFFLAT_METRIC_L2;
+
+	if (procinfo->fn_addr == vector_negative_inner_product ||
+		procinfo->fn_addr == halfvec_negative_inner_product)
+		return IVFFLAT_METRIC_IP;
+
+	return -1;
+}
+
+/*
+ * Allocate a quantizer
+ */
+IvfflatQuantizer
+IvfflatQuantizerInit(int quantizer, int dimensions, int pqM)
+{
+	Size		size = MAXALIGN(sizeof(IvfflatQuantizerData));
+	IvfflatQuantizer q;
+
+	if (quantizer == IVFFLAT_QUANTIZER_PQ)
+		size += sizeof(float) * IVFFLAT_PQ_CODEWORDS * dimensions;
+
+	q = (IvfflatQuantizer) palloc0(size);
+	q->quantizer = quantizer;
+	q->dimensions = dimensions;
+
+	if (quantizer == IVFFLAT_QUANTIZER_PQ)
+	{
+		q->pqM = pqM;
+		q->pqDsub = dimensions / pqM;
+		q->codebook = (float *) ((char *) q + MAXALIGN(sizeof(IvfflatQuantizerData)));
+	}
+
+	return q;
+}
+
+/*
+ * Copy trained parameters to a quantizer of the same shape
+ */
+void
+IvfflatQuantizerCopy(IvfflatQuantizer dst, const IvfflatQuantizerData * src)
+{
+	Assert(dst->quantizer == src->quantizer && dst->dimensions == src->dimensions);
+
+	if (src->quantizer == IVFFLAT_QUANTIZER_PQ)
+		memcpy(dst->codebook, src->codebook, sizeof(float) * IVFFLAT_PQ_CODEWORDS * src->dimensions);
+
+	dst->sq8Min = src->sq8Min;
+	dst->sq8Scale = src->sq8Scale;
+}
+
+/*
+ * Get the size of quantized values
+ */
+Size
+IvfflatQuantizedSize(const IvfflatQuantizerData * quantizer)
+{
+	if (quantizer->quantizer == IVFFLAT_QUANTIZER_PQ)
+		return quantizer->pqM;
+
+	return IVFFLAT_SQ8_SIZE(quantizer->dimensions);
+}
+
+/*
+ * Train scalar quantization
+ *
+ * A single range for all dimensions keeps distances on codes integer
+ */
+static void
+Sq8Train(VectorArray samples, const IvfflatTypeInfo * typeInfo, IvfflatQuantizer quantizer)
+{
+	int			dimensions = quantizer->dimensions;
+	float	   *x = (float *) palloc(sizeof(float) * dimensions);
+	float		minValue = FLT_MAX;
+	float		maxValue = -FLT_MAX;
+
+	for (int i = 0; i < samples->length; i++)
+	{
+		IvfflatValueToFloat(typeInfo, PointerGetDatum(VectorArrayGet(samples, i)), dimensions, x);
+
+		for (int k = 0; k < dimensions; k++)
+		{
+			if (x[k] < minValue)
+				minValue = x[k];
+
+			if (x[k] > maxValue)
+				maxValue = x[k];
+		}
+	}
+
+	/* Use the range of unit vectors without samples */
+	if (samples->length == 0)
+	{
+		minValue = -1;
+		maxValue = 1;
+	}
+
+	quantizer->sq8Min = minValue;
+	quantizer->sq8Scale = (maxValue - minValue) / IVFFLAT_SQ8_LEVELS;
+
+	/* All values are the same */
+	if (quantizer->sq8Scale <= 0)
+		quantizer->sq8Scale = 1;
+
+	pfree(x);
+}
+
+/*
+ * Train the quantizer
+ */
+void
+IvfflatTrainQuantizer(VectorArray samples, const IvfflatTypeInfo * typeInfo, IvfflatQuantizer quantizer)
+{
+	if (quantizer->quantizer == IVFFLAT_QUANTIZER_PQ)
+		IvfflatPqTrain(samples, typeInfo, quantizer);
+	else
+		Sq8Train(samples, typeInfo, quantizer);
+}
+
+/*
+ * Squared L2 distance between subvectors
+ */
+static inline float
+SubvectorL2SquaredDistance(const float *a, const float *b, int dsub)
+{
+	float		distance = 0.0;
+
+	for (int d = 0; d < dsub; d++)
+	{
+		float		diff = a[d] - b[d];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+/*
+ * Encode a vector with the nearest codeword in each subspace
+ */
+static void
+PqEncode(const IvfflatQuantizerData * quantizer, const float *x, uint8 *codes)
+{
+	int			dsub = quantizer->pqDsub;
+
+	for (int j = 0; j < quantizer->pqM; j++)
+	{
+		const float *sub = x + j * dsub;
+		const float *codewords = quantizer->codebook + j * IVFFLAT_PQ_CODEWORDS * dsub;
+		float		minDistance = FLT_MAX;
+		int			closest = 0;
+
+		for (int k = 0; k < IVFFLAT_PQ_CODEWORDS; k++)
+		{
+			float		distance = SubvectorL2SquaredDistance(sub, codewords + k * dsub, dsub);
+
+			if (distance < minDistance)
+			{
+				minDistance = distance;
+				closest = k;
+			}
+		}
+
+		codes[j] = (uint8) closest;
+	}
+}
+
+/*
+ * Encode a vector as one byte per dimension
+ */
+static void
+Sq8Encode(const IvfflatQuantizerData * quantizer, const float *x, IvfflatSq8Codes codes)
+{
+	uint32		sum = 0;
+
+	for (int k = 0; k < quantizer->dimensions; k++)
+	{
+		float		level = rintf((x[k] - quantizer->sq8Min) / quantizer->sq8Scale);
+		uint8		code;
+
+		/* Values outside the trained range are clamped */
+		if (level < 0)
+			code = 0;
+		else if (level > IVFFLAT_SQ8_LEVELS)
+			code = IVFFLAT_SQ8_LEVELS;
+		else
+			code = (uint8) level;
+
+		codes->x[k] = code;
+		sum += code;
+	}
+
+	codes->sum = sum;
+}
+
+/*
+ * Quantize a vector
+ */
+void
+IvfflatQuantize(const IvfflatQuantizerData * quantizer, const float *x, uint8 *codes)
+{
+	if (quantizer->quantizer == IVFFLAT_QUANTIZER_PQ)
+		PqEncode(quantizer, x, codes);
+	else
+		Sq8Encode(quantizer, x, (IvfflatSq8Codes) codes);
+}
+
+/*
+ * Compute the asymmetric distance table for a query
+ *
+ * The distance to an encoded vector is the sum of one entry per subspace
+ */
+void
+IvfflatPqComputeTable(const IvfflatQuantizerData * quantizer, int metric, const float *x, float *table)
+{
+	int			dsub = quantizer->pqDsub;
+
+	for (int j = 0; j < quantizer->pqM; j++)
+	{
+		const float *sub = x + j * dsub;
+		const float *codewords = quantizer->codebook + j * IVFFLAT_PQ_CODEWORDS * dsub;
+		float	   *row = table + j * IVFFLAT_PQ_CODEWORDS;
+
+		for (int k = 0; k < IVFFLAT_PQ_CODEWORDS; k++)
+		{
+			const float *codeword = codewords + k * dsub;
+
+			if (metric == IVFFLAT_METRIC_L2)
+				row[k] = SubvectorL2SquaredDistance(sub, codeword, dsub);
+			else
+			{
+				float		dp = 0.0;
+
+				for (int d = 0; d < dsub; d++)
+					dp += sub[d] * codeword[d];
+
+				row[k] = -dp;
+			}
+		}
+	}
+}
+
+/*
+ * Form an index tuple with quantized values
+ *
+ * The codes follow the header directly since the tuple is never deformed
+ */
+IndexTuple
+IvfflatFormQuantizedTuple(const IvfflatQuantizerData * quantizer, const uint8 *codes)
+{
+	Size		codesSize = IvfflatQuantizedSize(quantizer);
+	Size		size = IVFFLAT_QUANTIZED_TUPLE_SIZE(codesSize);
+	IndexTuple	itup = (IndexTuple) palloc0(size);
+
+	itup->t_info = size;
+	memcpy(IvfflatQuantizedTupleCodes(itup), codes, codesSize);
+
+	return itup;
+}
+
+/*
+ * Write the codebook after the list pages and record it in the metapage
+ */
+void
+IvfflatWriteCodebook(Relation index, IvfflatQuantizer quantizer, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber startPage;
+	IvfflatMetaPage metap;
+	int			total = IVFFLAT_PQ_CODEWORDS * quantizer->dimensions;
+	int			offset = 0;
+
+	buf = IvfflatNewBuffer(index, forkNum);
+	IvfflatInitRegisterPage(index, &buf, &page, &state);
+	startPage = BufferGetBlockNumber(buf);
+
+	while (offset < total)
+	{
+		int			count = Min(total - offset, (int) IVFFLAT_CODEBOOK_CHUNK_SIZE);
+		Size		itemsz = sizeof(float) * count;
+
+		/* Check for free space */
+		if (PageGetFreeSpace(page) < itemsz)
+			IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+
+		/* Add the item */
+		if (PageAddItem(page, (Item) (quantizer->codebook + offset), itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		offset += count;
+	}
+
+	IvfflatCommitBuffer(buf, state);
+
+	/* Update the metapage */
+	buf = ReadBufferExtended(index, forkNum, IVFFLAT_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = IvfflatPageGetMeta(page);
+	metap->codebookPage = startPage;
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Load the codebook
+ */
+static void
+LoadCodebook(Relation index, IvfflatQuantizer quantizer, BlockNumber nextblkno)
+{
+	int			total = IVFFLAT_PQ_CODEWORDS * quantizer->dimensions;
+	int			offset = 0;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		buf = ReadBuffer(index, nextblkno);
+		Page		page;
+		OffsetNumber maxoffno;
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			ItemId		itemid = PageGetItemId(page, offno);
+			int			count = ItemIdGetLength(itemid) / sizeof(float);
+
+			if (offset + count > total)
+				elog(ERROR, "ivfflat codebook is not valid");
+
+			memcpy(quantizer->codebook + offset, PageGetItem(page, itemid), sizeof(float) * count);
+			offset += count;
+		}
+
+		nextblkno = IvfflatPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	if (offset != total)
+		elog(ERROR, "ivfflat codebook is not valid");
+}
+
+/*
+ * Get the quantizer for an index
+ *
+ * Quantizers are immutable after the build, so they are cached in the
+ * relcache entry and released with it
+ */
+const		IvfflatQuantizerData *
+IvfflatGetQuantizer(Relation index)
+{
+	if (index->rd_amcache == NULL)
+	{
+		Buffer		buf;
+		Page		page;
+		IvfflatMetaPage metap;
+		int			quantizer;
+		int			dimensions;
+		int			pqM;
+		BlockNumber codebookPage;
+		float		sq8Min;
+		float		sq8Scale;
+		IvfflatQuantizer q;
+		MemoryContext oldCtx;
+
+		buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		metap = IvfflatPageGetMeta(page);
+
+		if (unlikely(metap->magicNumber != IVFFLAT_MAGIC_NUMBER))
+			elog(ERROR, "ivfflat index is not valid");
+
+		quantizer = metap->quantizer;
+		dimensions = metap->dimensions;
+		pqM = metap->pqM;
+		codebookPage = metap->codebookPage;
+		sq8Min = metap->sq8Min;
+		sq8Scale = metap->sq8Scale;
+		UnlockReleaseBuffer(buf);
+
+		oldCtx = MemoryContextSwitchTo(index->rd_indexcxt);
+		q = IvfflatQuantizerInit(quantizer, dimensions, pqM);
+		MemoryContextSwitchTo(oldCtx);
+
+		if (quantizer == IVFFLAT_QUANTIZER_PQ)
+			LoadCodebook(index, q, codebookPage);
+
+		q->sq8Min = sq8Min;
+		q->sq8Scale = sq8Scale;
+
+		index->rd_amcache = q;
+	}
+
+	return (const IvfflatQuantizerData *) index->rd_amcache;
+}
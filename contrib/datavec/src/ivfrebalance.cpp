@@ -0,0 +1,1189 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "access/transam.h"
+#include "commands/defrem.h"
+#include "commands/vacuum.h"
+#include "funcapi.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/memutils.h"
+
+/*
+ * Rebalancing replaces the pages of a list with a new chain and then swaps
+ * the list tuples in a single WAL record. Scans that read the lists before
+ * the swap keep reading the old chains, so no scan sees a tuple twice. The
+ * first list page is locked exclusively for the swap since scans keep it
+ * share locked while reading the lists.
+ *
+ * The swap stores the next xid on the metapage. Once it is older than every
+ * running transaction, no scan can still read the old chains, and vacuum
+ * moves the pages that are not reachable from the lists to the free list
+ * for new pages. Generic WAL records cannot cancel conflicting queries on
+ * standbys, so standbys rely on hot_standby_feedback to hold back the xid.
+ *
+ * Other writers are excluded with ShareRowExclusiveLock on the index, which
+ * conflicts with the RowExclusiveLock taken for inserts and vacuum but not
+ * with scans.
+ */
+
+#define IVFFLAT_REBALANCE_SAMPLES	10000
+
+/*
+ * List loaded for rebalancing
+ */
+typedef struct RebalanceList
+{
+	ListInfo	listInfo;
+	BlockNumber startPage;
+	int64		tuples;
+	BlockNumber pages;
+	Pointer		center;
+	bool		removed;
+}			RebalanceList;
+
+typedef struct RebalanceState
+{
+	Relation	index;
+	const		IvfflatTypeInfo *typeInfo;
+	FmgrInfo   *procinfo;
+	FmgrInfo   *kmeansnormprocinfo;
+	Oid			collation;
+	int			dimensions;
+	Size		itemsize;
+	bool		quantized;
+	BufferAccessStrategy bas;
+
+	/* Lists */
+	RebalanceList *lists;
+	int			length;			/* lists loaded or added */
+	int			listCount;		/* lists not removed */
+}			RebalanceState;
+
+/*
+ * New chain of entry pages
+ */
+typedef struct ChainWriter
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber startPage;
+	int64		tuples;
+}			ChainWriter;
+
+typedef struct SampleState
+{
+	RebalanceState *rs;
+	VectorArray samples;
+	int64		step;
+	int64		seen;
+}			SampleState;
+
+typedef struct MergeCopyState
+{
+	RebalanceState *rs;
+	ChainWriter writer;
+}			MergeCopyState;
+
+typedef struct AssignState
+{
+	RebalanceState *rs;
+	Datum		centers[2];
+	ChainWriter writers[2];
+}			AssignState;
+
+typedef void (*ChainCallback) (IndexTuple itup, void *arg);
+
+/*
+ * Count the tuples and pages of a list
+ */
+static void
+CountList(Relation index, BlockNumber blkno, BufferAccessStrategy bas, int64 *tuples, BlockNumber *pages)
+{
+	*tuples = 0;
+	*pages = 0;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		*tuples += PageGetMaxOffsetNumber(page);
+		(*pages)++;
+
+		blkno = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Read the lists with their sizes
+ *
+ * Centers are only copied if itemsize is not zero. Room is left for each
+ * list to be split once.
+ */
+static RebalanceList *
+ReadLists(Relation index, Size itemsize, BufferAccessStrategy bas, int *length)
+{
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	int			lists;
+	int			maxlen;
+	RebalanceList *result;
+
+	IvfflatGetMetaPageInfo(index, &lists, NULL);
+	maxlen = lists * 2;
+	result = (RebalanceList *) palloc(sizeof(RebalanceList) * maxlen);
+	*length = 0;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+			RebalanceList *rl;
+
+			/* Lists may have been added since the metapage was read */
+			if (*length == maxlen)
+			{
+				maxlen *= 2;
+				result = (RebalanceList *) repalloc(result, sizeof(RebalanceList) * maxlen);
+			}
+
+			rl = &result[(*length)++];
+			rl->listInfo.blkno = nextblkno;
+			rl->listInfo.offno = offno;
+			rl->startPage = list->startPage;
+			rl->center = NULL;
+			rl->removed = false;
+
+			if (itemsize > 0)
+			{
+				rl->center = (Pointer) palloc(itemsize);
+				memcpy(rl->center, &list->center, VARSIZE_ANY(&list->center));
+			}
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	if (maxlen < *length * 2)
+		result = (RebalanceList *) repalloc(result, sizeof(RebalanceList) * *length * 2);
+
+	for (int i = 0; i < *length; i++)
+		CountList(index, result[i].startPage, bas, &result[i].tuples, &result[i].pages);
+
+	return result;
+}
+
+/*
+ * Call a function for each tuple of a chain
+ */
+static void
+ScanChain(Relation index, BlockNumber blkno, BufferAccessStrategy bas, ChainCallback callback, void *arg)
+{
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+			callback((IndexTuple) PageGetItem(page, PageGetItemId(page, offno)), arg);
+
+		blkno = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Start a new chain
+ *
+ * Other writers are excluded, so the relation can be extended without the
+ * extension lock
+ */
+static void
+ChainStart(Relation index, ChainWriter * writer)
+{
+	writer->buf = IvfflatNewBuffer(index, MAIN_FORKNUM);
+	IvfflatInitRegisterPage(index, &writer->buf, &writer->page, &writer->state);
+	writer->startPage = BufferGetBlockNumber(writer->buf);
+	writer->tuples = 0;
+}
+
+/*
+ * Add a tuple to a chain
+ */
+static void
+ChainAdd(Relation index, ChainWriter * writer, IndexTuple itup)
+{
+	Size		itemsz = MAXALIGN(IndexTupleSize(itup));
+
+	if (PageGetFreeSpace(writer->page) < itemsz)
+		IvfflatAppendPage(index, &writer->buf, &writer->page, &writer->state, MAIN_FORKNUM);
+
+	if (PageAddItem(writer->page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	writer->tuples++;
+}
+
+/*
+ * Finish a chain and return its last page
+ */
+static BlockNumber
+ChainFinish(ChainWriter * writer, BlockNumber nextblkno)
+{
+	BlockNumber insertPage = BufferGetBlockNumber(writer->buf);
+
+	IvfflatPageGetOpaque(writer->page)->nextblkno = nextblkno;
+	IvfflatCommitBuffer(writer->buf, writer->state);
+	return insertPage;
+}
+
+/*
+ * Register a list page for the swap
+ *
+ * The first list page is already locked by the caller
+ */
+static Page
+RegisterListPage(Relation index, GenericXLogState *state, Buffer headBuf, BlockNumber blkno, Buffer *bufs, Page *pages, int *nbufs)
+{
+	Buffer		buf;
+
+	for (int i = 0; i < *nbufs; i++)
+	{
+		if (BufferGetBlockNumber(bufs[i]) == blkno)
+			return pages[i];
+	}
+
+	if (blkno == IVFFLAT_HEAD_BLKNO)
+		buf = headBuf;
+	else
+	{
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	}
+
+	bufs[*nbufs] = buf;
+	pages[*nbufs] = GenericXLogRegisterBuffer(state, buf, 0);
+	return pages[(*nbufs)++];
+}
+
+/*
+ * Update the number of lists and list generation on the metapage
+ */
+static Buffer
+RegisterMetaPage(Relation index, GenericXLogState *state, int lists)
+{
+	Buffer		buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	Page		page;
+	IvfflatMetaPage metap;
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	IvfflatExtendMetaPage(page);
+	metap = IvfflatPageGetMeta(page);
+	metap->lists = lists;
+
+	/* Lets pins detect stale centers, including on standbys */
+	metap->listGeneration++;
+
+	/* Scans that started before this may still read the old chains */
+	metap->replacedXid = ReadNewTransactionId();
+	return buf;
+}
+
+/*
+ * Commit the swap and release the buffers
+ */
+static void
+FinishSwap(Relation index, GenericXLogState *state, Buffer headBuf, Buffer metaBuf, Buffer *bufs, int nbufs)
+{
+	GenericXLogFinish(state);
+
+	for (int i = 0; i < nbufs; i++)
+	{
+		if (bufs[i] != headBuf)
+			UnlockReleaseBuffer(bufs[i]);
+	}
+	UnlockReleaseBuffer(metaBuf);
+	UnlockReleaseBuffer(headBuf);
+
+	IvfflatInvalidateCenterCache(index);
+}
+
+/*
+ * Add pages to the free list
+ */
+static void
+PushFreePages(Relation index, BlockNumber *blknos, int n, BufferAccessStrategy bas)
+{
+	Buffer		metaBuf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	Buffer		bufs[MAX_GENERIC_XLOG_PAGES - 1];
+	GenericXLogState *state;
+	Page		page;
+	IvfflatMetaPage metap;
+
+	LockBuffer(metaBuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, metaBuf, 0);
+	IvfflatExtendMetaPage(page);
+	metap = IvfflatPageGetMeta(page);
+
+	for (int i = 0; i < n; i++)
+	{
+		bufs[i] = ReadBufferExtended(index, MAIN_FORKNUM, blknos[i], RBM_NORMAL, bas);
+		LockBuffer(bufs[i], BUFFER_LOCK_EXCLUSIVE);
+		page = GenericXLogRegisterBuffer(state, bufs[i], GENERIC_XLOG_FULL_IMAGE);
+		IvfflatInitPage(bufs[i], page);
+		IvfflatPageGetOpaque(page)->nextblkno = metap->freePage;
+		metap->freePage = blknos[i];
+	}
+
+	GenericXLogFinish(state);
+
+	for (int i = 0; i < n; i++)
+		UnlockReleaseBuffer(bufs[i]);
+	UnlockReleaseBuffer(metaBuf);
+}
+
+/*
+ * Add the pages of a chain that no scan has read to the free list
+ */
+static void
+FreeChain(Relation index, BlockNumber blkno, BufferAccessStrategy bas)
+{
+	BlockNumber blknos[MAX_GENERIC_XLOG_PAGES - 1];
+	int			n = 0;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		blknos[n++] = blkno;
+		blkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+		UnlockReleaseBuffer(buf);
+
+		if (n == lengthof(blknos))
+		{
+			PushFreePages(index, blknos, n, bas);
+			n = 0;
+		}
+	}
+
+	if (n > 0)
+		PushFreePages(index, blknos, n, bas);
+}
+
+/*
+ * Mark the pages of a chain as reachable
+ */
+static void
+MarkChain(Relation index, BlockNumber blkno, BufferAccessStrategy bas, bool *reachable, BlockNumber nblocks)
+{
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+
+		if (blkno >= nblocks)
+			elog(ERROR, "ivfflat index \"%s\" has an invalid page chain", RelationGetRelationName(index));
+
+		/* The rest of the chain is already marked */
+		if (reachable[blkno])
+			break;
+
+		vacuum_delay_point();
+
+		reachable[blkno] = true;
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		blkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Normalize a center for spherical k-means
+ */
+static void
+NormCenter(RebalanceState * rs, Pointer center)
+{
+	Datum		value;
+
+	if (rs->kmeansnormprocinfo == NULL || !IvfflatCheckNorm(rs->kmeansnormprocinfo, rs->collation, PointerGetDatum(center)))
+		return;
+
+	value = IvfflatNormValue(rs->typeInfo, rs->collation, PointerGetDatum(center));
+	if (VARSIZE_ANY(DatumGetPointer(value)) > rs->itemsize)
+		elog(ERROR, "safety check failed");
+
+	memcpy(center, DatumGetPointer(value), VARSIZE_ANY(DatumGetPointer(value)));
+}
+
+/*
+ * Copy a tuple to a chain
+ */
+static void
+CopyTuple(IndexTuple itup, void *arg)
+{
+	MergeCopyState *cs = (MergeCopyState *) arg;
+
+	ChainAdd(cs->rs->index, &cs->writer, itup);
+}
+
+/*
+ * Add a tuple to the samples
+ */
+static void
+SampleTuple(IndexTuple itup, void *arg)
+{
+	SampleState *ss = (SampleState *) arg;
+	RebalanceState *rs = ss->rs;
+	VectorArray samples = ss->samples;
+	Datum		value;
+	bool		isnull;
+
+	if (ss->seen++ % ss->step != 0 || samples->length == samples->maxlen)
+		return;
+
+	value = index_getattr(itup, 1, RelationGetDescr(rs->index), &isnull);
+	value = PointerGetDatum(PG_DETOAST_DATUM(value));
+
+	/* Spherical k-means expects unit vectors */
+	if (rs->kmeansnormprocinfo != NULL)
+	{
+		if (!IvfflatCheckNorm(rs->kmeansnormprocinfo, rs->collation, value))
+			return;
+
+		value = IvfflatNormValue(rs->typeInfo, rs->collation, value);
+	}
+
+	VectorArraySet(samples, samples->length++, DatumGetPointer(value));
+}
+
+/*
+ * Add a tuple to the chain of the closest center
+ */
+static void
+AssignTuple(IndexTuple itup, void *arg)
+{
+	AssignState *as = (AssignState *) arg;
+	RebalanceState *rs = as->rs;
+	Datum		value;
+	bool		isnull;
+	double		distance0;
+	double		distance1;
+
+	value = index_getattr(itup, 1, RelationGetDescr(rs->index), &isnull);
+	distance0 = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, value, as->centers[0]));
+	distance1 = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, value, as->centers[1]));
+
+	ChainAdd(rs->index, &as->writers[distance1 < distance0 ? 1 : 0], itup);
+}
+
+/*
+ * Split a list in two with k-means on a sample of its tuples
+ *
+ * Returns false if the tuples could not be split
+ */
+static bool
+SplitList(RebalanceState * rs, int i, MemoryContext tmpCtx)
+{
+	Relation	index = rs->index;
+	RebalanceList *rl = &rs->lists[i];
+	RebalanceList *newrl = &rs->lists[rs->length];
+	MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+	int64		maxSamples;
+	SampleState ss;
+	AssignState as;
+	VectorArray centers;
+	BlockNumber insertPages[2];
+	Size		listSize = MAXALIGN(IVFFLAT_LIST_SIZE(rs->itemsize));
+	IvfflatList newList;
+	Buffer		headBuf;
+	Buffer		lastBuf;
+	Buffer		metaBuf;
+	Buffer		bufs[MAX_GENERIC_XLOG_PAGES];
+	Page		pages[MAX_GENERIC_XLOG_PAGES];
+	int			nbufs = 0;
+	GenericXLogState *state;
+	BlockNumber lastblkno;
+	Page		page;
+	IvfflatList list;
+	OffsetNumber offno;
+
+	/* Sample tuples */
+	maxSamples = Min(rl->tuples, IVFFLAT_REBALANCE_SAMPLES);
+	maxSamples = Min(maxSamples, (int64) u_sess->attr.attr_memory.maintenance_work_mem * 1024L / (int64) rs->itemsize);
+	if (maxSamples < 2)
+	{
+		MemoryContextSwitchTo(oldCtx);
+		return false;
+	}
+
+	ss.rs = rs;
+	ss.samples = VectorArrayInit((int) maxSamples, rs->dimensions, rs->itemsize);
+	ss.step = Max(rl->tuples / maxSamples, 1);
+	ss.seen = 0;
+	ScanChain(index, rl->startPage, rs->bas, SampleTuple, &ss);
+
+	if (ss.samples->length < 2)
+	{
+		MemoryContextSwitchTo(oldCtx);
+		return false;
+	}
+
+	/* Train two centers */
+	centers = VectorArrayInit(2, rs->dimensions, rs->itemsize);
+	IvfflatKmeans(index, ss.samples, centers, rs->typeInfo, IVFFLAT_KMEANS_ELKAN, 0);
+
+	as.rs = rs;
+	as.centers[0] = PointerGetDatum(VectorArrayGet(centers, 0));
+	as.centers[1] = PointerGetDatum(VectorArrayGet(centers, 1));
+
+	if (DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, as.centers[0], as.centers[1])) == 0)
+	{
+		MemoryContextSwitchTo(oldCtx);
+		return false;
+	}
+
+	/* Write the tuples to new chains */
+	ChainStart(index, &as.writers[0]);
+	ChainStart(index, &as.writers[1]);
+	ScanChain(index, rl->startPage, rs->bas, AssignTuple, &as);
+	insertPages[0] = ChainFinish(&as.writers[0], InvalidBlockNumber);
+	insertPages[1] = ChainFinish(&as.writers[1], InvalidBlockNumber);
+
+	/* No scan can see the chains, so their pages are free right away */
+	if (as.writers[0].tuples == 0 || as.writers[1].tuples == 0)
+	{
+		FreeChain(index, as.writers[0].startPage, rs->bas);
+		FreeChain(index, as.writers[1].startPage, rs->bas);
+		MemoryContextSwitchTo(oldCtx);
+		return false;
+	}
+
+	newList = (IvfflatList) palloc0(listSize);
+	newList->startPage = as.writers[1].startPage;
+	newList->insertPage = insertPages[1];
+	memcpy(&newList->center, VectorArrayGet(centers, 1), VARSIZE_ANY(VectorArrayGet(centers, 1)));
+
+	/* Swap */
+	headBuf = ReadBuffer(index, IVFFLAT_HEAD_BLKNO);
+	LockBuffer(headBuf, BUFFER_LOCK_EXCLUSIVE);
+
+	lastblkno = IVFFLAT_HEAD_BLKNO;
+	for (;;)
+	{
+		BlockNumber nextblkno;
+		Buffer		buf;
+
+		if (lastblkno == IVFFLAT_HEAD_BLKNO)
+			nextblkno = IvfflatPageGetOpaque(BufferGetPage(headBuf))->nextblkno;
+		else
+		{
+			buf = ReadBuffer(index, lastblkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			nextblkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+			UnlockReleaseBuffer(buf);
+		}
+
+		if (!BlockNumberIsValid(nextblkno))
+			break;
+
+		lastblkno = nextblkno;
+	}
+
+	/* Add a list page first if needed, which readers skip while it is empty */
+	lastBuf = headBuf;
+	if (lastblkno != IVFFLAT_HEAD_BLKNO)
+	{
+		lastBuf = ReadBuffer(index, lastblkno);
+		LockBuffer(lastBuf, BUFFER_LOCK_EXCLUSIVE);
+	}
+
+	if (PageGetFreeSpace(BufferGetPage(lastBuf)) < listSize)
+	{
+		Buffer		newbuf;
+		Page		newpage;
+
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, lastBuf, 0);
+		newbuf = IvfflatNewBuffer(index, MAIN_FORKNUM);
+		newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+		IvfflatInitPage(newbuf, newpage);
+		IvfflatPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newbuf);
+		GenericXLogFinish(state);
+
+		lastblkno = BufferGetBlockNumber(newbuf);
+		UnlockReleaseBuffer(newbuf);
+	}
+
+	if (lastBuf != headBuf)
+		UnlockReleaseBuffer(lastBuf);
+
+	state = GenericXLogStart(index);
+
+	/* Register the first list page so replay also locks it */
+	RegisterListPage(index, state, headBuf, IVFFLAT_HEAD_BLKNO, bufs, pages, &nbufs);
+
+	page = RegisterListPage(index, state, headBuf, rl->listInfo.blkno, bufs, pages, &nbufs);
+	list = (IvfflatList) PageGetItem(page, PageGetItemId(page, rl->listInfo.offno));
+	list->startPage = as.writers[0].startPage;
+	list->insertPage = insertPages[0];
+	memcpy(&list->center, VectorArrayGet(centers, 0), VARSIZE_ANY(VectorArrayGet(centers, 0)));
+
+	page = RegisterListPage(index, state, headBuf, lastblkno, bufs, pages, &nbufs);
+	offno = PageAddItem(page, (Item) newList, listSize, InvalidOffsetNumber, false, false);
+	if (offno == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	metaBuf = RegisterMetaPage(index, state, rs->listCount + 1);
+	FinishSwap(index, state, headBuf, metaBuf, bufs, nbufs);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Update lists */
+	newrl->listInfo.blkno = lastblkno;
+	newrl->listInfo.offno = offno;
+	newrl->startPage = as.writers[1].startPage;
+	newrl->tuples = as.writers[1].tuples;
+	newrl->center = (Pointer) palloc(rs->itemsize);
+	memcpy(newrl->center, VectorArrayGet(centers, 1), VARSIZE_ANY(VectorArrayGet(centers, 1)));
+	newrl->removed = false;
+
+	rl->startPage = as.writers[0].startPage;
+	rl->tuples = as.writers[0].tuples;
+	memcpy(rl->center, VectorArrayGet(centers, 0), VARSIZE_ANY(VectorArrayGet(centers, 0)));
+
+	rs->length++;
+	rs->listCount++;
+	return true;
+}
+
+/*
+ * Merge a list into the list with the closest center
+ *
+ * The tuples of the list are copied to a new chain that continues with the
+ * chain of the other list, and the center of the other list moves to the
+ * weighted mean of both centers.
+ */
+static void
+MergeList(RebalanceState * rs, int i, MemoryContext tmpCtx)
+{
+	Relation	index = rs->index;
+	RebalanceList *source = &rs->lists[i];
+	RebalanceList *target = NULL;
+	MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+	double		minDistance = 0;
+	BlockNumber startPage = InvalidBlockNumber;
+	Pointer		center = (Pointer) palloc(rs->itemsize);
+	Buffer		headBuf;
+	Buffer		metaBuf;
+	Buffer		bufs[MAX_GENERIC_XLOG_PAGES];
+	Page		pages[MAX_GENERIC_XLOG_PAGES];
+	int			nbufs = 0;
+	GenericXLogState *state;
+	Page		page;
+	IvfflatList list;
+
+	/* Find the closest list */
+	for (int j = 0; j < rs->length; j++)
+	{
+		RebalanceList *rl = &rs->lists[j];
+		double		distance;
+
+		if (j == i || rl->removed)
+			continue;
+
+		distance = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, PointerGetDatum(source->center), PointerGetDatum(rl->center)));
+		if (target == NULL || distance < minDistance)
+		{
+			target = rl;
+			minDistance = distance;
+		}
+	}
+
+	/* Copy the tuples */
+	if (source->tuples > 0)
+	{
+		MergeCopyState	cs;
+
+		cs.rs = rs;
+		ChainStart(index, &cs.writer);
+		ScanChain(index, source->startPage, rs->bas, CopyTuple, &cs);
+		ChainFinish(&cs.writer, target->startPage);
+		startPage = cs.writer.startPage;
+	}
+
+	/* Move the center */
+	memcpy(center, target->center, VARSIZE_ANY(target->center));
+	if (target->tuples + source->tuples > 0)
+	{
+		float	   *x = (float *) palloc0(sizeof(float) * rs->dimensions);
+		float	   *y = (float *) palloc0(sizeof(float) * rs->dimensions);
+		double		total = (double) (target->tuples + source->tuples);
+
+		rs->typeInfo->sumCenter(target->center, x);
+		rs->typeInfo->sumCenter(source->center, y);
+
+		for (int k = 0; k < rs->dimensions; k++)
+			x[k] = (float) ((x[k] * target->tuples + y[k] * source->tuples) / total);
+
+		rs->typeInfo->updateCenter(center, rs->dimensions, x);
+		NormCenter(rs, center);
+	}
+
+	/* Swap */
+	headBuf = ReadBuffer(index, IVFFLAT_HEAD_BLKNO);
+	LockBuffer(headBuf, BUFFER_LOCK_EXCLUSIVE);
+
+	state = GenericXLogStart(index);
+
+	/* Register the first list page so replay also locks it */
+	RegisterListPage(index, state, headBuf, IVFFLAT_HEAD_BLKNO, bufs, pages, &nbufs);
+
+	page = RegisterListPage(index, state, headBuf, target->listInfo.blkno, bufs, pages, &nbufs);
+	list = (IvfflatList) PageGetItem(page, PageGetItemId(page, target->listInfo.offno));
+	if (BlockNumberIsValid(startPage))
+		list->startPage = startPage;
+	memcpy(&list->center, center, VARSIZE_ANY(center));
+
+	page = RegisterListPage(index, state, headBuf, source->listInfo.blkno, bufs, pages, &nbufs);
+	PageIndexTupleDelete(page, source->listInfo.offno);
+
+	metaBuf = RegisterMetaPage(index, state, rs->listCount - 1);
+	FinishSwap(index, state, headBuf, metaBuf, bufs, nbufs);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Update lists */
+	if (BlockNumberIsValid(startPage))
+		target->startPage = startPage;
+	target->tuples += source->tuples;
+	memcpy(target->center, center, VARSIZE_ANY(center));
+
+	/* Tuples after the removed one move up */
+	for (int j = 0; j < rs->length; j++)
+	{
+		RebalanceList *rl = &rs->lists[j];
+
+		if (!rl->removed && rl->listInfo.blkno == source->listInfo.blkno && rl->listInfo.offno > source->listInfo.offno)
+			rl->listInfo.offno--;
+	}
+
+	source->removed = true;
+	rs->listCount--;
+}
+
+/*
+ * Compare list sizes
+ */
+static int
+CompareListSizes(const void *a, const void *b, void *arg)
+{
+	const		RebalanceList *lists = (const RebalanceList *) arg;
+	int64		ta = lists[*(const int *) a].tuples;
+	int64		tb = lists[*(const int *) b].tuples;
+
+	if (ta < tb)
+		return -1;
+
+	if (ta > tb)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Split lists larger than ratio times the average size and merge lists
+ * smaller than the average size divided by ratio
+ *
+ * Must be called with ShareRowExclusiveLock on the index. Returns the number
+ * of lists split or merged.
+ */
+int
+IvfflatRebalance(Relation index, double ratio)
+{
+	MemoryContext rebalanceCtx = AllocSetContextCreate(CurrentMemoryContext,
+													   "Ivfflat rebalance context",
+													   ALLOCSET_DEFAULT_SIZES);
+	MemoryContext tmpCtx = AllocSetContextCreate(rebalanceCtx,
+												 "Ivfflat rebalance temporary context",
+												 ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(rebalanceCtx);
+	RebalanceState rs;
+	int64		total = 0;
+	double		average;
+	int		   *order;
+	int			length;
+	int			changed = 0;
+
+	rs.index = index;
+	rs.typeInfo = IvfflatGetTypeInfo(index);
+	rs.procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	rs.kmeansnormprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	rs.collation = index->rd_indcollation[0];
+	IvfflatGetMetaPageInfo(index, NULL, &rs.dimensions);
+	rs.itemsize = rs.typeInfo->itemSize(rs.dimensions);
+	rs.quantized = IvfflatGetQuantizer(index)->quantizer != IVFFLAT_QUANTIZER_NONE;
+	rs.bas = GetAccessStrategy(BAS_BULKREAD);
+	rs.lists = ReadLists(index, rs.itemsize, rs.bas, &rs.length);
+	rs.listCount = rs.length;
+
+	for (int i = 0; i < rs.length; i++)
+		total += rs.lists[i].tuples;
+
+	if (total == 0)
+	{
+		FreeAccessStrategy(rs.bas);
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextDelete(rebalanceCtx);
+		return 0;
+	}
+
+	average = (double) total / rs.length;
+
+	order = (int *) palloc(sizeof(int) * rs.length);
+	for (int i = 0; i < rs.length; i++)
+		order[i] = i;
+
+	qsort_arg(order, rs.length, sizeof(int), CompareListSizes, rs.lists);
+
+	/* Merge small lists first, smallest first */
+	length = rs.length;
+	for (int i = 0; i < length && rs.listCount > 1; i++)
+	{
+		RebalanceList *rl = &rs.lists[order[i]];
+
+		/* Sizes change as lists are merged */
+		if (rl->removed || rl->tuples >= average / ratio)
+			continue;
+
+		MergeList(&rs, order[i], tmpCtx);
+		MemoryContextReset(tmpCtx);
+		changed++;
+	}
+
+	/* Tuples of quantized indexes cannot be used to train centers */
+	if (!rs.quantized)
+	{
+		qsort_arg(order, length, sizeof(int), CompareListSizes, rs.lists);
+
+		/* Split large lists, largest first */
+		for (int i = length - 1; i >= 0 && rs.listCount < IVFFLAT_MAX_LISTS; i--)
+		{
+			RebalanceList *rl = &rs.lists[order[i]];
+
+			if (rl->removed)
+				continue;
+
+			if (rl->tuples <= average * ratio)
+				break;
+
+			if (SplitList(&rs, order[i], tmpCtx))
+				changed++;
+			MemoryContextReset(tmpCtx);
+		}
+	}
+
+	FreeAccessStrategy(rs.bas);
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(rebalanceCtx);
+
+	return changed;
+}
+
+/*
+ * Move pages of replaced lists to the free list once no scan can still read
+ * them
+ *
+ * Must be called with ShareRowExclusiveLock on the index, so no pages are
+ * added or taken while the lists are walked. Pages of crashed inserts and
+ * builds are also reclaimed, since they are not reachable either.
+ */
+void
+IvfflatReclaimPages(Relation index)
+{
+	BufferAccessStrategy bas;
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+	GenericXLogState *state;
+	TransactionId replacedXid = InvalidTransactionId;
+	BlockNumber freePage = InvalidBlockNumber;
+	BlockNumber codebookPage;
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	BlockNumber nblocks;
+	BlockNumber *startPages;
+	int			nstartPages = 0;
+	int			maxStartPages;
+	bool	   *reachable;
+	BlockNumber blknos[MAX_GENERIC_XLOG_PAGES - 1];
+	int			n = 0;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+	if (((PageHeader) page)->pd_lower >= ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page)
+	{
+		replacedXid = metap->replacedXid;
+		freePage = metap->freePage;
+	}
+	codebookPage = metap->codebookPage;
+	maxStartPages = Max(metap->lists, 1);
+	UnlockReleaseBuffer(buf);
+
+	/* Wait for scans that started before the last swap */
+	if (!TransactionIdIsValid(replacedXid) ||
+		!TransactionIdPrecedes(replacedXid, u_sess->utils_cxt.RecentGlobalXmin))
+		return;
+
+	bas = GetAccessStrategy(BAS_BULKREAD);
+	nblocks = RelationGetNumberOfBlocks(index);
+	reachable = (bool *) palloc0(sizeof(bool) * nblocks);
+	reachable[IVFFLAT_METAPAGE_BLKNO] = true;
+
+	/* Mark list pages */
+	startPages = (BlockNumber *) palloc(sizeof(BlockNumber) * maxStartPages);
+	while (BlockNumberIsValid(nextblkno))
+	{
+		OffsetNumber maxoffno;
+
+		if (nextblkno >= nblocks || reachable[nextblkno])
+			elog(ERROR, "ivfflat index \"%s\" has an invalid page chain", RelationGetRelationName(index));
+
+		reachable[nextblkno] = true;
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, nextblkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offno));
+
+			if (nstartPages == maxStartPages)
+			{
+				maxStartPages *= 2;
+				startPages = (BlockNumber *) repalloc(startPages, sizeof(BlockNumber) * maxStartPages);
+			}
+			startPages[nstartPages++] = list->startPage;
+		}
+
+		nextblkno = IvfflatPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Mark entry pages, the codebook, and pages already free */
+	for (int i = 0; i < nstartPages; i++)
+		MarkChain(index, startPages[i], bas, reachable, nblocks);
+	MarkChain(index, codebookPage, bas, reachable, nblocks);
+	MarkChain(index, freePage, bas, reachable, nblocks);
+
+	for (BlockNumber blkno = 0; blkno < nblocks; blkno++)
+	{
+		if (reachable[blkno])
+			continue;
+
+		vacuum_delay_point();
+
+		blknos[n++] = blkno;
+		if (n == lengthof(blknos))
+		{
+			PushFreePages(index, blknos, n, bas);
+			n = 0;
+		}
+	}
+
+	if (n > 0)
+		PushFreePages(index, blknos, n, bas);
+
+	/* Nothing is left to reclaim until the next swap */
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = IvfflatPageGetMeta(page);
+	metap->replacedXid = InvalidTransactionId;
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+
+	pfree(reachable);
+	pfree(startPages);
+	FreeAccessStrategy(bas);
+}
+
+/*
+ * Store the size of the lists on the metapage for the planner
+ *
+ * Queries probe lists in proportion to the rows near them, so the expected
+ * size of a probed list is the mean size weighted by size, which is larger
+ * than the mean when lists are skewed.
+ */
+void
+IvfflatUpdateListStats(Relation index)
+{
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	RebalanceList *lists;
+	int			length;
+	double		total = 0;
+	double		squares = 0;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	IvfflatMetaPage metap;
+
+	lists = ReadLists(index, 0, bas, &length);
+	for (int i = 0; i < length; i++)
+	{
+		total += lists[i].tuples;
+		squares += (double) lists[i].tuples * lists[i].tuples;
+	}
+	pfree(lists);
+	FreeAccessStrategy(bas);
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	IvfflatExtendMetaPage(page);
+	metap = IvfflatPageGetMeta(page);
+
+	metap->statsTuples = (float) total;
+	metap->statsListTuples = total > 0 ? (float) (squares / total) : 0;
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Rebalance the lists of an ivfflat index
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(ivfflat_rebalance);
+Datum
+ivfflat_rebalance(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	double		ratio = PG_GETARG_FLOAT8(1);
+	Relation	index;
+	int			changed;
+
+	if (!(ratio > 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ratio must be greater than 1")));
+
+	/* Allow scans, but not inserts or vacuum */
+	index = index_open(relid, ShareRowExclusiveLock);
+	if (index->rd_rel->relam != get_am_oid("ivfflat", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+	if (!pg_class_ownercheck(relid, GetUserId()))
+		aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS, RelationGetRelationName(index));
+
+	changed = IvfflatRebalance(index, ratio);
+
+	index_close(index, NoLock);
+
+	PG_RETURN_INT32(changed);
+}
+
+/*
+ * Get the size of each list of an ivfflat index
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(ivfflat_list_stats);
+Datum
+ivfflat_list_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	RebalanceList *lists;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid			relid = PG_GETARG_OID(0);
+		MemoryContext oldCtx;
+		Relation	index;
+		TupleDesc	tupdesc;
+		BufferAccessStrategy bas;
+		int			length;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		index = index_open(relid, AccessShareLock);
+		if (index->rd_rel->relam != get_am_oid("ivfflat", false))
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+		IvfflatCheckTablePrivilege(index);
+
+		bas = GetAccessStrategy(BAS_BULKREAD);
+		funcctx->user_fctx = ReadLists(index, 0, bas, &length);
+		funcctx->max_calls = length;
+		FreeAccessStrategy(bas);
+
+		index_close(index, AccessShareLock);
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	lists = (RebalanceList *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		RebalanceList *rl = &lists[funcctx->call_cntr];
+		Datum		values[3];
+		bool		nulls[3] = {false, false, false};
+
+		values[0] = Int32GetDatum((int32) funcctx->call_cntr + 1);
+		values[1] = Int64GetDatum(rl->tuples);
+		values[2] = Int32GetDatum((int32) rl->pages);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -2,12 +2,22 @@
 
 #include <float.h>
 
+#include "access/heapam.h"
 #include "access/relscan.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
 #include "lib/pairingheap.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
+#include "parser/parse_coerce.h"
 #include "pgstat.h"
+#include "sq8utils.h"
 #include "storage/buf/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/rel_gs.h"
+#include "utils/snapmgr.h"
 
 /*
  * Compare list distances
@@ -24,6 +34,143 @@ CompareLists(const pairingheap_node *a, const pairingheap_node *b, void *arg)
 	return 0;
 }
 
+/*
+ * Compare scan list distances, closest first
+ */
+static int
+CompareScanListDistances(const void *a, const void *b)
+{
+	return -CompareLists(&((const IvfflatScanList *) a)->ph_node, &((const IvfflatScanList *) b)->ph_node, NULL);
+}
+
+/*
+ * Compare item distances with tid tie-breaker
+ */
+static int
+CompareScanItems(const void *a, const void *b)
+{
+	const		IvfflatScanItem *ia = (const IvfflatScanItem *) a;
+	const		IvfflatScanItem *ib = (const IvfflatScanItem *) b;
+
+	if (ia->distance > ib->distance)
+		return 1;
+
+	if (ia->distance < ib->distance)
+		return -1;
+
+	return ItemPointerCompare((ItemPointer) &ia->tid, (ItemPointer) &ib->tid);
+}
+
+/*
+ * Check if an item belongs above another in the heap
+ *
+ * Bounded scans keep the furthest item on top so it can be replaced, and
+ * unbounded scans keep the nearest item on top so it can be returned
+ */
+static inline bool
+HeapItemAbove(const IvfflatScanItem * a, const IvfflatScanItem * b, bool bounded)
+{
+	int			cmp = CompareScanItems(a, b);
+
+	return bounded ? cmp > 0 : cmp < 0;
+}
+
+/*
+ * Move an item up the heap
+ */
+static void
+SiftUpItem(IvfflatScanItem * items, int i, bool bounded)
+{
+	IvfflatScanItem item = items[i];
+
+	while (i > 0)
+	{
+		int			parent = (i - 1) / 2;
+
+		if (!HeapItemAbove(&item, &items[parent], bounded))
+			break;
+
+		items[i] = items[parent];
+		i = parent;
+	}
+
+	items[i] = item;
+}
+
+/*
+ * Move an item down the heap
+ */
+static void
+SiftDownItem(IvfflatScanItem * items, int length, int i, bool bounded)
+{
+	IvfflatScanItem item = items[i];
+
+	for (;;)
+	{
+		int			child = 2 * i + 1;
+
+		if (child >= length)
+			break;
+
+		if (child + 1 < length && HeapItemAbove(&items[child + 1], &items[child], bounded))
+			child++;
+
+		if (!HeapItemAbove(&items[child], &item, bounded))
+			break;
+
+		items[i] = items[child];
+		i = child;
+	}
+
+	items[i] = item;
+}
+
+/*
+ * Get the maximum memory for items
+ */
+static Size
+GetMaxItemsSize(void)
+{
+	return Min((Size) u_sess->attr.attr_memory.work_mem * 1024L, MaxAllocSize);
+}
+
+/*
+ * Add a list to the heap if it is one of the closest
+ */
+static void
+AddScanList(IvfflatScanOpaque so, BlockNumber startPage, double distance, int *listCount, double *maxDistance)
+{
+	IvfflatScanList *scanlist;
+
+	if (*listCount < so->probes)
+	{
+		scanlist = &so->lists[*listCount];
+		scanlist->startPage = startPage;
+		scanlist->distance = distance;
+		(*listCount)++;
+
+		/* Add to heap */
+		pairingheap_add(so->listQueue, &scanlist->ph_node);
+
+		/* Calculate max distance */
+		if (*listCount == so->probes)
+			*maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
+	}
+	else if (distance < *maxDistance)
+	{
+		/* Remove */
+		scanlist = (IvfflatScanList *) pairingheap_remove_first(so->listQueue);
+
+		/* Reuse */
+		scanlist->startPage = startPage;
+		scanlist->distance = distance;
+		pairingheap_add(so->listQueue, &scanlist->ph_node);
+
+		/* Update max distance */
+		*maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
+	}
+}
+
 /*
  * Get lists and sort by distance
  */
@@ -34,16 +181,49 @@ GetScanLists(IndexScanDesc scan, Datum value)
 	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
 	int			listCount = 0;
 	double		maxDistance = DBL_MAX;
+	IvfflatCenterCache *cache;
+	Buffer		headBuf;
+
+	/* Use cached centers to avoid reading list pages */
+	cache = IvfflatPinCenterCache(scan->indexRelation);
+	if (cache != NULL)
+	{
+		double	   *distances = (double *) palloc(sizeof(double) * cache->listCount);
+
+		/* Distances are zero without a value */
+		if (DatumGetPointer(value) == NULL)
+			MemSet(distances, 0, sizeof(double) * cache->listCount);
+		else
+			IvfflatCenterCacheDistances(cache, so->typeInfo, so->procinfo, so->collation, value, distances);
+
+		for (int i = 0; i < cache->listCount; i++)
+			AddScanList(so, cache->startPages[i], distances[i], &listCount, &maxDistance);
+
+		IvfflatUnpinCenterCache(cache);
+		pfree(distances);
+
+		so->listCount = listCount;
+		return;
+	}
+
+	/*
+	 * Search all list pages, keeping the first one locked so rebalancing
+	 * cannot change the lists in between
+	 */
+	headBuf = ReadBuffer(scan->indexRelation, IVFFLAT_HEAD_BLKNO);
+	LockBuffer(headBuf, BUFFER_LOCK_SHARE);
 
-	/* Search all list pages */
 	while (BlockNumberIsValid(nextblkno))
 	{
-		Buffer		cbuf;
+		Buffer		cbuf = headBuf;
 		Page		cpage;
 		OffsetNumber maxoffno;
 
-		cbuf = ReadBuffer(scan->indexRelation, nextblkno);
-		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		if (nextblkno != IVFFLAT_HEAD_BLKNO)
+		{
+			cbuf = ReadBuffer(scan->indexRelation, nextblkno);
+			LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		}
 		cpage = BufferGetPage(cbuf);
 
 		maxoffno = PageGetMaxOffsetNumber(cpage);
@@ -56,132 +236,778 @@ GetScanLists(IndexScanDesc scan, Datum value)
 			/* Use procinfo from the index instead of scan key for performance */
 			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(&list->center), value));
 
-			if (listCount < so->probes)
-			{
-				IvfflatScanList *scanlist;
+			AddScanList(so, list->startPage, distance, &listCount, &maxDistance);
+		}
 
-				scanlist = &so->lists[listCount];
-				scanlist->startPage = list->startPage;
-				scanlist->distance = distance;
-				listCount++;
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
 
-				/* Add to heap */
-				pairingheap_add(so->listQueue, &scanlist->ph_node);
+		if (cbuf != headBuf)
+			UnlockReleaseBuffer(cbuf);
+	}
 
-				/* Calculate max distance */
-				if (listCount == so->probes)
-					maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
-			}
-			else if (distance < maxDistance)
-			{
-				IvfflatScanList *scanlist;
+	UnlockReleaseBuffer(headBuf);
+
+	so->listCount = listCount;
+}
+
+/*
+ * Zero distance
+ */
+static Datum
+ZeroDistance(FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2)
+{
+	return Float8GetDatum(0.0);
+}
 
-				/* Remove */
-				scanlist = (IvfflatScanList *) pairingheap_remove_first(so->listQueue);
+/*
+ * Prepare the query for a quantized index
+ *
+ * Product quantization uses a distance table, and scalar quantization
+ * quantizes the query so distances can be computed on codes
+ */
+static void
+GetScanQuery(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	const		IvfflatQuantizerData *quantizer;
+	float	   *x;
+
+	/* Distances are zero */
+	if (DatumGetPointer(value) == NULL)
+		return;
 
-				/* Reuse */
-				scanlist->startPage = list->startPage;
-				scanlist->distance = distance;
-				pairingheap_add(so->listQueue, &scanlist->ph_node);
+	quantizer = IvfflatGetQuantizer(scan->indexRelation);
+	x = (float *) palloc(sizeof(float) * so->dimensions);
+	IvfflatValueToFloat(so->typeInfo, value, so->dimensions, x);
 
-				/* Update max distance */
-				maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
+	if (so->quantizer == IVFFLAT_QUANTIZER_PQ)
+		IvfflatPqComputeTable(quantizer, so->metric, x, so->pqTable);
+	else
+	{
+		IvfflatSq8Codes codes = (IvfflatSq8Codes) palloc(IVFFLAT_SQ8_SIZE(so->dimensions));
+
+		IvfflatQuantize(quantizer, x, (uint8 *) codes);
+		memcpy(so->sq8Query, codes->x, so->dimensions);
+		so->sq8QuerySum = codes->sum;
+		so->sq8Min = quantizer->sq8Min;
+		so->sq8Scale = quantizer->sq8Scale;
+		pfree(codes);
+	}
+
+	pfree(x);
+}
+
+/*
+ * Get the approximate distance for a quantized tuple
+ */
+static inline double
+GetQuantizedDistance(IvfflatScanOpaque so, IndexTuple itup)
+{
+	uint8	   *codes = IvfflatQuantizedTupleCodes(itup);
+
+	if (so->distfunc == ZeroDistance)
+		return 0.0;
+
+	if (so->quantizer == IVFFLAT_QUANTIZER_PQ)
+		return IvfflatPqDistance(so->pqTable, so->pqM, codes);
+	else
+	{
+		IvfflatSq8Codes sq8 = (IvfflatSq8Codes) codes;
+		double		min = so->sq8Min;
+		double		scale = so->sq8Scale;
+
+		if (so->metric == IVFFLAT_METRIC_L2)
+			return scale * scale * Sq8L2SquaredDistance(so->dimensions, so->sq8Query, sq8->x);
+		else
+		{
+			/* Expand (min + scale * a) . (min + scale * b) */
+			double		ip = so->dimensions * min * min +
+				min * scale * ((double) so->sq8QuerySum + sq8->sum) +
+				scale * scale * Sq8InnerProduct(so->dimensions, so->sq8Query, sq8->x);
+
+			return -ip;
+		}
+	}
+}
+
+/*
+ * Get the exact distance for a heap tuple
+ */
+static bool
+GetHeapDistance(IndexScanDesc scan, ItemPointer tid, AttrNumber attnum, Datum value, double *distance)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	Relation	heapRel = scan->heapRelation;
+	ItemPointerData htid = *tid;
+	HeapTupleData tuple;
+	Buffer		buf;
+	bool		allDead;
+	bool		found = false;
+
+	/* Follow the HOT chain to the visible version */
+	if (!heap_hot_search(&htid, heapRel, scan->xs_snapshot, &allDead))
+		return false;
+
+	tuple.t_self = htid;
+	if (heap_fetch(heapRel, scan->xs_snapshot, &tuple, &buf, false, NULL))
+	{
+		bool		isnull;
+		Datum		datum = heap_getattr(&tuple, attnum, RelationGetDescr(heapRel), &isnull);
+
+		if (!isnull)
+		{
+			datum = PointerGetDatum(PG_DETOAST_DATUM(datum));
+
+			if (so->normprocinfo != NULL)
+				datum = IvfflatNormValue(so->typeInfo, so->collation, datum);
+
+			*distance = DatumGetFloat8(FunctionCall2Coll(so->procinfo, so->collation, datum, value));
+			found = true;
+		}
+
+		ReleaseBuffer(buf);
+	}
+
+	return found;
+}
+
+/*
+ * Get the distances for all tuples on a page at once
+ */
+static void
+GetPageDistances(IvfflatScanOpaque so, TupleDesc tupdesc, Page page, OffsetNumber maxoffno, Datum value)
+{
+	int			n = 0;
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+		bool		isnull;
+
+		so->batchValues[n++] = index_getattr(itup, 1, tupdesc, &isnull);
+	}
+
+	if (so->distfunc == ZeroDistance)
+	{
+		for (int i = 0; i < n; i++)
+			so->batchDistances[i] = 0.0;
+	}
+	else if (so->typeInfo->distanceBatch != NULL)
+		so->typeInfo->distanceBatch(so->procinfo, so->collation, value, so->batchValues, n, so->batchDistances);
+	else
+	{
+		for (int i = 0; i < n; i++)
+			so->batchDistances[i] = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, so->batchValues[i], value));
+	}
+}
+
+/*
+ * Add an item to the sort
+ */
+static void
+PutSortItem(IvfflatScanOpaque so, IvfflatScanItem * item)
+{
+	ExecClearTuple(so->slot);
+	so->slot->tts_values[0] = Float8GetDatum(item->distance);
+	so->slot->tts_isnull[0] = false;
+	so->slot->tts_values[1] = PointerGetDatum(&item->tid);
+	so->slot->tts_isnull[1] = false;
+	ExecStoreVirtualTuple(so->slot);
+
+	tuplesort_puttupleslot(so->sortstate, so->slot);
+}
+
+/*
+ * Move items to a sort when they no longer fit in memory
+ */
+static void
+SpillItems(IvfflatScanOpaque so)
+{
+	AttrNumber	attNums[] = {1};
+	Oid			sortOperators[] = {FLOAT8LTOID};
+	Oid			sortCollations[] = {InvalidOid};
+	bool		nullsFirstFlags[] = {false};
+
+	so->sortstate = tuplesort_begin_heap(so->tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, u_sess->attr.attr_memory.work_mem, NULL, false);
+
+	for (int i = 0; i < so->itemsLength; i++)
+		PutSortItem(so, &so->items[i]);
+
+	so->itemsLength = 0;
+}
+
+/*
+ * Add an item to the heap of closest items
+ */
+static void
+AddBoundedItem(IvfflatScanOpaque so, IvfflatScanItem * item)
+{
+	if (so->itemsLength < so->maxItems)
+	{
+		so->items[so->itemsLength] = *item;
+		SiftUpItem(so->items, so->itemsLength++, true);
+	}
+	else if (CompareScanItems(item, &so->items[0]) < 0)
+	{
+		so->items[0] = *item;
+		SiftDownItem(so->items, so->itemsLength, 0, true);
+	}
+}
+
+/*
+ * Add an item for an index tuple
+ */
+static void
+AddScanItem(IvfflatScanOpaque so, ItemPointer tid, double distance)
+{
+	IvfflatScanItem item;
+
+	item.tid = *tid;
+	item.distance = distance;
+
+	so->tuples++;
+
+	/* Range searches only keep items within the radius */
+	if (so->range && distance > so->radius)
+		return;
+
+	/* Skip items that were already returned when scanning again */
+	if (so->hasLastItem && CompareScanItems(&item, &so->lastItem) <= 0)
+		return;
+
+	so->matched++;
+
+	if (so->sortstate != NULL)
+		PutSortItem(so, &item);
+	else if (so->bounded)
+		AddBoundedItem(so, &item);
+	else
+	{
+		if (so->itemsLength == so->maxItems)
+		{
+			Size		size = sizeof(IvfflatScanItem) * so->maxItems * 2;
+
+			if (size > GetMaxItemsSize())
+			{
+				SpillItems(so);
+				PutSortItem(so, &item);
+				return;
 			}
+
+			so->items = (IvfflatScanItem *) repalloc(so->items, size);
+			so->maxItems *= 2;
 		}
 
-		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+		so->items[so->itemsLength++] = item;
+	}
+}
+
+/*
+ * Scan a list
+ */
+static void
+ScanList(IvfflatScanOpaque so, Relation index, BlockNumber startPage, Datum value, BufferAccessStrategy bas)
+{
+	TupleDesc	tupdesc = RelationGetDescr(index);
+	BlockNumber searchPage = startPage;
 
-		UnlockReleaseBuffer(cbuf);
+	/* Search all entry pages for list */
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, searchPage, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		if (so->quantizer == IVFFLAT_QUANTIZER_NONE)
+			GetPageDistances(so, tupdesc, page, maxoffno, value);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+			double		distance;
+
+			/*
+			 * Use procinfo from the index instead of scan key for
+			 * performance
+			 */
+			if (so->quantizer != IVFFLAT_QUANTIZER_NONE)
+				distance = GetQuantizedDistance(so, itup);
+			else
+				distance = so->batchDistances[offno - FirstOffsetNumber];
+
+			AddScanItem(so, &itup->t_tid, distance);
+		}
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
 	}
 }
 
 /*
- * Get items
+ * Scan lists claimed from shared state
  */
 static void
-GetScanItems(IndexScanDesc scan, Datum value)
+IvfflatParallelScanLists(IvfflatScanShared * ivfshared, Relation index)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) palloc0(sizeof(IvfflatScanOpaqueData));
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	Datum		value = PointerGetDatum(ivfshared->value);
+	int			participant;
+
+	/* Look up support functions within the participant */
+	so->typeInfo = IvfflatGetTypeInfo(index);
+	so->dimensions = ivfshared->dimensions;
+	so->procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	so->collation = index->rd_indcollation[0];
+	so->distfunc = ivfshared->value == NULL ? ZeroDistance : FunctionCall2Coll;
+
+	/* Quantized queries are prepared by the leader */
+	so->quantizer = ivfshared->quantizer;
+	so->metric = ivfshared->metric;
+	so->pqM = ivfshared->pqM;
+	so->pqTable = ivfshared->pqTable;
+	so->sq8Min = ivfshared->sq8Min;
+	so->sq8Scale = ivfshared->sq8Scale;
+	so->sq8QuerySum = ivfshared->sq8QuerySum;
+	so->sq8Query = ivfshared->sq8Query;
+
+	so->batchValues = (Datum *) palloc(sizeof(Datum) * MaxIndexTuplesPerPage);
+	so->batchDistances = (double *) palloc(sizeof(double) * MaxIndexTuplesPerPage);
+
+	/* Keep the closest items for this participant */
+	so->items = (IvfflatScanItem *) palloc(sizeof(IvfflatScanItem) * ivfshared->maxItems);
+	so->maxItems = ivfshared->maxItems;
+	so->bounded = true;
+	so->lastItem = ivfshared->lastItem;
+	so->hasLastItem = ivfshared->hasLastItem;
+
+	SpinLockAcquire(&ivfshared->mutex);
+	participant = ivfshared->nparticipants++;
+	SpinLockRelease(&ivfshared->mutex);
+
+	for (;;)
+	{
+		int			list;
+
+		SpinLockAcquire(&ivfshared->mutex);
+		list = ivfshared->nextList++;
+		SpinLockRelease(&ivfshared->mutex);
+
+		if (list >= ivfshared->listCount)
+			break;
+
+		ScanList(so, index, ivfshared->startPages[list], value, bas);
+	}
+
+	/* Record results */
+	memcpy(&ivfshared->items[participant * ivfshared->maxItems], so->items, sizeof(IvfflatScanItem) * so->itemsLength);
+
+	SpinLockAcquire(&ivfshared->mutex);
+	ivfshared->itemsLength[participant] = so->itemsLength;
+	ivfshared->tuples += so->tuples;
+	ivfshared->matched += so->matched;
+	SpinLockRelease(&ivfshared->mutex);
+
+	FreeAccessStrategy(bas);
+	pfree(so->items);
+	pfree(so->batchValues);
+	pfree(so->batchDistances);
+	pfree(so);
+}
+
+/*
+ * Perform work within a launched parallel process
+ */
+void
+IvfflatParallelScanMain(const BgWorkerContext *bwc)
+{
+	IvfflatScanShared *ivfshared = (IvfflatScanShared *) bwc->bgshared;
+	Relation	index;
+
+	/* Open relation within worker */
+	index = index_open(ivfshared->indexrelid, NoLock);
+
+	IvfflatParallelScanLists(ivfshared, index);
+
+	/* Close relation within worker */
+	index_close(index, NoLock);
+}
+
+/*
+ * Initialize shared state for a parallel scan
+ *
+ * Everything is in a single allocation, which is freed when the workers
+ * quit
+ */
+static IvfflatScanShared *
+IvfflatParallelScanInitshared(IndexScanDesc scan, Datum value, int nparticipants)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
-	TupleDesc	tupdesc = RelationGetDescr(scan->indexRelation);
-	double		tuples = 0;
-	TupleTableSlot *slot = MakeSingleTupleTableSlot(so->tupdesc);
+	IvfflatScanShared *ivfshared;
+	Size		valueSize = DatumGetPointer(value) == NULL ? 0 : VARSIZE_ANY(DatumGetPointer(value));
+	Size		pqTableSize = so->pqTable == NULL ? 0 : sizeof(float) * so->pqM * IVFFLAT_PQ_CODEWORDS;
+	Size		sq8QuerySize = so->sq8Query == NULL ? 0 : so->dimensions;
+	Size		size;
+	char	   *ptr;
+
+	size = MAXALIGN(sizeof(IvfflatScanShared));
+	size += MAXALIGN(sizeof(BlockNumber) * so->listCount);
+	size += MAXALIGN(sizeof(IvfflatScanItem) * so->maxItems * nparticipants);
+	size += MAXALIGN(sizeof(int) * nparticipants);
+	size += MAXALIGN(valueSize) + MAXALIGN(pqTableSize) + MAXALIGN(sq8QuerySize);
+
+	ptr = (char *) MemoryContextAllocZero(INSTANCE_GET_MEM_CXT_GROUP(MEMORY_CONTEXT_STORAGE), size);
+	ivfshared = (IvfflatScanShared *) ptr;
+	ptr += MAXALIGN(sizeof(IvfflatScanShared));
+
+	/* Initialize immutable state */
+	ivfshared->indexrelid = RelationGetRelid(scan->indexRelation);
+	ivfshared->dimensions = so->dimensions;
+	ivfshared->maxItems = so->maxItems;
+	ivfshared->lastItem = so->lastItem;
+	ivfshared->hasLastItem = so->hasLastItem;
+	ivfshared->quantizer = so->quantizer;
+	ivfshared->metric = so->metric;
+	ivfshared->pqM = so->pqM;
+	ivfshared->sq8Min = so->sq8Min;
+	ivfshared->sq8Scale = so->sq8Scale;
+	ivfshared->sq8QuerySum = so->sq8QuerySum;
+
+	ivfshared->listCount = so->listCount;
+	ivfshared->startPages = (BlockNumber *) ptr;
+	for (int i = 0; i < so->listCount; i++)
+		ivfshared->startPages[i] = so->lists[i].startPage;
+	ptr += MAXALIGN(sizeof(BlockNumber) * so->listCount);
+
+	ivfshared->items = (IvfflatScanItem *) ptr;
+	ptr += MAXALIGN(sizeof(IvfflatScanItem) * so->maxItems * nparticipants);
+
+	ivfshared->itemsLength = (int *) ptr;
+	ptr += MAXALIGN(sizeof(int) * nparticipants);
+
+	ivfshared->value = NULL;
+	if (valueSize > 0)
+	{
+		ivfshared->value = ptr;
+		memcpy(ptr, DatumGetPointer(value), valueSize);
+		ptr += MAXALIGN(valueSize);
+	}
 
-	/*
-	 * Reuse same set of shared buffers for scan
-	 *
-	 * See postgres/src/backend/storage/buffer/README for description
-	 */
-	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	ivfshared->pqTable = NULL;
+	if (pqTableSize > 0)
+	{
+		ivfshared->pqTable = (float *) ptr;
+		memcpy(ptr, so->pqTable, pqTableSize);
+		ptr += MAXALIGN(pqTableSize);
+	}
+
+	ivfshared->sq8Query = NULL;
+	if (sq8QuerySize > 0)
+	{
+		ivfshared->sq8Query = (uint8 *) ptr;
+		memcpy(ptr, so->sq8Query, sq8QuerySize);
+	}
+
+	/* Initialize mutable state */
+	SpinLockInit(&ivfshared->mutex);
+	ivfshared->nparticipants = 0;
+	ivfshared->nextList = 0;
+	ivfshared->tuples = 0;
+	ivfshared->matched = 0;
+
+	return ivfshared;
+}
+
+/*
+ * Scan the probed lists with workers
+ *
+ * Each participant keeps the closest items from the lists it scans, and
+ * the leader merges them
+ */
+static bool
+ParallelScanLists(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	IvfflatScanShared *ivfshared;
+	int			request = Min(ivfflat_scan_workers, so->listCount - 1);
+	int			nworkers;
+
+	/* Workers keep a bounded number of items and cannot spill */
+	if (request <= 0 || !so->bounded || IsBgWorkerProcess())
+		return false;
+
+	/* Each participant needs room for its items */
+	if (sizeof(IvfflatScanItem) * so->maxItems * (request + 1) > MaxAllocSize)
+		return false;
+
+	ivfshared = IvfflatParallelScanInitshared(scan, value, request + 1);
+
+	nworkers = LaunchBackgroundWorkers(request, ivfshared, IvfflatParallelScanMain, NULL);
+
+	/* If no workers were successfully launched, back out (do serial scan) */
+	if (nworkers == 0)
+	{
+		pfree_ext(ivfshared);
+		return false;
+	}
+
+	/* Log participants */
+	ereport(DEBUG1, (errmsg("using %d parallel workers", nworkers)));
+
+	/* Participate as a worker */
+	IvfflatParallelScanLists(ivfshared, scan->indexRelation);
+
+	BgworkerListWaitFinish(&nworkers);
+	pg_memory_barrier();
+
+	/* Merge items */
+	for (int i = 0; i < ivfshared->nparticipants; i++)
+	{
+		IvfflatScanItem *items = &ivfshared->items[i * ivfshared->maxItems];
+
+		for (int j = 0; j < ivfshared->itemsLength[i]; j++)
+			AddBoundedItem(so, &items[j]);
+	}
+
+	so->tuples = ivfshared->tuples;
+	so->matched = ivfshared->matched;
+
+	/* Shut down workers, which frees the shared state */
+	BgworkerListSyncQuit();
 
-	/* Search closest probes lists */
-	while (!pairingheap_is_empty(so->listQueue))
+	return true;
+}
+
+/*
+ * Scan lists for a range search
+ *
+ * Lists are scanned from the closest center. After ivfflat.probes lists,
+ * scanning continues as long as the previous list had items within the
+ * radius.
+ */
+static void
+ScanRangeLists(IndexScanDesc scan, Datum value, BufferAccessStrategy bas)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	bool		found = true;
+
+	/* The list queue is not needed after the lists are chosen */
+	qsort(so->lists, so->listCount, sizeof(IvfflatScanList), CompareScanListDistances);
+
+	for (int i = 0; i < so->listCount; i++)
 	{
-		BlockNumber searchPage = ((IvfflatScanList *) pairingheap_remove_first(so->listQueue))->startPage;
+		double		matched = so->matched;
+
+		if (i >= ivfflat_probes && !found)
+			break;
+
+		ScanList(so, scan->indexRelation, so->lists[i].startPage, value, bas);
+		found = so->matched > matched;
+	}
+}
 
-		/* Search all entry pages for list */
-		while (BlockNumberIsValid(searchPage))
+/*
+ * Scan the probed lists
+ */
+static void
+ScanLists(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+	so->tuples = 0;
+	so->matched = 0;
+
+	if (!ParallelScanLists(scan, value))
+	{
+		/*
+		 * Reuse same set of shared buffers for scan
+		 *
+		 * See postgres/src/backend/storage/buffer/README for description
+		 */
+		BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+
+		if (so->range)
+			ScanRangeLists(scan, value, bas);
+		else
 		{
-			Buffer		buf;
-			Page		page;
-			OffsetNumber maxoffno;
+			/* Search closest probes lists */
+			for (int i = 0; i < so->listCount; i++)
+				ScanList(so, scan->indexRelation, so->lists[i].startPage, value, bas);
+		}
+
+		FreeAccessStrategy(bas);
+	}
+
+	if (so->sortstate != NULL)
+		tuplesort_performsort(so->sortstate);
+	else if (so->bounded)
+		qsort(so->items, so->itemsLength, sizeof(IvfflatScanItem), CompareScanItems);
+	else
+	{
+		/* Build a heap so items are only sorted as they are requested */
+		for (int i = so->itemsLength / 2 - 1; i >= 0; i--)
+			SiftDownItem(so->items, so->itemsLength, i, false);
+	}
+}
 
-			buf = ReadBufferExtended(scan->indexRelation, MAIN_FORKNUM, searchPage, RBM_NORMAL, bas);
-			LockBuffer(buf, BUFFER_LOCK_SHARE);
-			page = BufferGetPage(buf);
-			maxoffno = PageGetMaxOffsetNumber(page);
+/*
+ * Get the next item in approximate distance order
+ */
+static bool
+GetNextItem(IndexScanDesc scan, IvfflatScanItem * item)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	if (so->sortstate != NULL)
+	{
+		if (!tuplesort_gettupleslot(so->sortstate, true, so->slot, NULL))
+			return false;
+
+		item->tid = *((ItemPointer) DatumGetPointer(heap_slot_getattr(so->slot, 2, &so->isnull)));
+		item->distance = DatumGetFloat8(heap_slot_getattr(so->slot, 1, &so->isnull));
+	}
+	else if (so->bounded)
+	{
+		if (so->itemsIndex == so->itemsLength)
+		{
+			/* No items left */
+			if (so->matched <= so->itemsLength)
+				return false;
 
-			for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+			/* The caller needs more items than the bound, so scan again */
+			if (sizeof(IvfflatScanItem) * so->maxItems * 2 <= GetMaxItemsSize())
 			{
-				IndexTuple	itup;
-				Datum		datum;
-				bool		isnull;
-				ItemId		itemid = PageGetItemId(page, offno);
-
-				itup = (IndexTuple) PageGetItem(page, itemid);
-				datum = index_getattr(itup, 1, tupdesc, &isnull);
-
-				/*
-				 * Add virtual tuple
-				 *
-				 * Use procinfo from the index instead of scan key for
-				 * performance
-				 */
-				ExecClearTuple(slot);
-				slot->tts_values[0] = so->distfunc(so->procinfo, so->collation, datum, value);
-				slot->tts_isnull[0] = false;
-				slot->tts_values[1] = PointerGetDatum(&itup->t_tid);
-				slot->tts_isnull[1] = false;
-				ExecStoreVirtualTuple(slot);
-
-				tuplesort_puttupleslot(so->sortstate, slot);
-
-				tuples++;
+				so->items = (IvfflatScanItem *) repalloc(so->items, sizeof(IvfflatScanItem) * so->maxItems * 2);
+				so->maxItems *= 2;
 			}
+			else
+				so->bounded = false;
 
-			searchPage = IvfflatPageGetOpaque(page)->nextblkno;
-
-			UnlockReleaseBuffer(buf);
+			ScanLists(scan, so->value);
+			return GetNextItem(scan, item);
 		}
+
+		*item = so->items[so->itemsIndex++];
 	}
+	else
+	{
+		if (so->itemsLength == 0)
+			return false;
 
-	FreeAccessStrategy(bas);
+		*item = so->items[0];
+		so->items[0] = so->items[--so->itemsLength];
+		SiftDownItem(so->items, so->itemsLength, 0, false);
+	}
+
+	so->lastItem = *item;
+	so->hasLastItem = true;
+	return true;
+}
+
+/*
+ * Rerank the closest candidates with exact distances from the heap
+ *
+ * Candidates are returned first in exact order, then the rest of the
+ * sort in approximate order
+ */
+static void
+RerankItems(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	AttrNumber	attnum = index->rd_index->indkey.values[0];
+	int			maxItems = ivfflat_rerank_candidates;
+
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
+
+	if (maxItems == 0 || so->tuples == 0 || DatumGetPointer(value) == NULL)
+		return;
+
+	/* Expression indexes and non-heap tables keep the approximate order */
+	if (scan->heapRelation == NULL || attnum == InvalidAttrNumber || !RelationIsAstoreFormat(scan->heapRelation))
+		return;
+
+	if (maxItems > so->tuples)
+		maxItems = (int) so->tuples;
+
+	if (so->rerank != NULL)
+		pfree(so->rerank);
+	so->rerank = (IvfflatScanItem *) palloc(sizeof(IvfflatScanItem) * maxItems);
+
+	while (so->rerankLength < maxItems && GetNextItem(scan, &so->rerank[so->rerankLength]))
+	{
+		IvfflatScanItem *item = &so->rerank[so->rerankLength++];
+
+		/* Tuples that are not visible keep the approximate distance */
+		GetHeapDistance(scan, &item->tid, attnum, value, &item->distance);
+	}
+
+	qsort(so->rerank, so->rerankLength, sizeof(IvfflatScanItem), CompareScanItems);
+}
+
+/*
+ * Get items
+ */
+static void
+GetScanItems(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	int64		bound = scan->xs_bound;
+
+	/* Prepare the query once */
+	if (so->quantizer != IVFFLAT_QUANTIZER_NONE)
+	{
+		GetScanQuery(scan, value);
+
+		/* Reranking needs more candidates than the caller */
+		if (bound > 0 && bound < ivfflat_rerank_candidates)
+			bound = ivfflat_rerank_candidates;
+	}
+
+	/*
+	 * Keep only the closest items when the caller needs a limited number.
+	 * Otherwise, keep all items in a heap so they are only sorted as they
+	 * are requested.
+	 */
+	so->bounded = bound > 0 && sizeof(IvfflatScanItem) * bound <= GetMaxItemsSize();
+	so->maxItems = so->bounded ? (int) bound : IVFFLAT_SCAN_ITEMS_INITIAL;
+
+	if (so->items != NULL)
+		pfree(so->items);
+	so->items = (IvfflatScanItem *) palloc(sizeof(IvfflatScanItem) * so->maxItems);
 
-	if (tuples < 100)
+	ScanLists(scan, value);
+
+	if (so->tuples < 100)
 		ereport(DEBUG1,
 				(errmsg("index scan found few tuples"),
 				 errdetail("Index may have been created with little data."),
 				 errhint("Recreate the index and possibly decrease lists.")));
 
-	tuplesort_performsort(so->sortstate);
+	if (so->quantizer != IVFFLAT_QUANTIZER_NONE)
+		RerankItems(scan, value);
 }
 
 /*
- * Zero distance
+ * Free the scan value if it was allocated
  */
-static Datum
-ZeroDistance(FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2)
+static void
+FreeScanValue(IvfflatScanOpaque so)
 {
-	return Float8GetDatum(0.0);
+	if (so->valueAllocated)
+		pfree(DatumGetPointer(so->value));
+
+	so->value = PointerGetDatum(NULL);
+	so->valueAllocated = false;
 }
 
 /*
@@ -225,24 +1051,25 @@ ivfflatbeginscan_internal(Relation index, int nkeys, int norderbys)
 	IvfflatScanOpaque so;
 	int			lists;
 	int			dimensions;
-	AttrNumber	attNums[] = {1};
-	Oid			sortOperators[] = {FLOAT8LTOID};
-	Oid			sortCollations[] = {InvalidOid};
-	bool		nullsFirstFlags[] = {false};
 	int			probes = ivfflat_probes;
+	const		IvfflatQuantizerData *quantizer;
 
 	scan = RelationGetIndexScan(index, nkeys, norderbys);
 
 	/* Get lists and dimensions from metapage */
 	IvfflatGetMetaPageInfo(index, &lists, &dimensions);
 
-	if (probes > lists)
+	/* Range searches can scan every list */
+	if (probes > lists || nkeys > 0)
 		probes = lists;
 
 	so = (IvfflatScanOpaque) palloc(offsetof(IvfflatScanOpaqueData, lists) + probes * sizeof(IvfflatScanList));
 	so->typeInfo = IvfflatGetTypeInfo(index);
 	so->first = true;
+	so->value = PointerGetDatum(NULL);
+	so->valueAllocated = false;
 	so->probes = probes;
+	so->listCount = 0;
 	so->dimensions = dimensions;
 
 	/* Set support functions */
@@ -250,13 +1077,40 @@ ivfflatbeginscan_internal(Relation index, int nkeys, int norderbys)
 	so->normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC);
 	so->collation = index->rd_indcollation[0];
 
-	/* Create tuple description for sorting */
+	/* Set quantizer */
+	quantizer = IvfflatGetQuantizer(index);
+	so->quantizer = quantizer->quantizer;
+	so->pqM = quantizer->pqM;
+	so->metric = IvfflatGetQuantizerMetric(so->procinfo);
+	so->pqTable = NULL;
+	so->sq8Query = NULL;
+	if (so->quantizer == IVFFLAT_QUANTIZER_PQ)
+		so->pqTable = (float *) palloc(sizeof(float) * so->pqM * IVFFLAT_PQ_CODEWORDS);
+	else if (so->quantizer == IVFFLAT_QUANTIZER_SQ8)
+		so->sq8Query = (uint8 *) palloc(so->dimensions);
+
+	/* Distances are computed a page at a time */
+	so->batchValues = (Datum *) palloc(sizeof(Datum) * MaxIndexTuplesPerPage);
+	so->batchDistances = (double *) palloc(sizeof(double) * MaxIndexTuplesPerPage);
+
+	so->rerank = NULL;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
+
+	so->items = NULL;
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+	so->maxItems = 0;
+	so->bounded = false;
+	so->hasLastItem = false;
+	so->range = false;
+	so->radius = get_float8_infinity();
+
+	/* Create tuple description for sorting when items do not fit in memory */
 	so->tupdesc = CreateTemplateTupleDesc(2, false);
 	TupleDescInitEntry(so->tupdesc, (AttrNumber) 1, "distance", FLOAT8OID, -1, 0);
 	TupleDescInitEntry(so->tupdesc, (AttrNumber) 2, "heaptid", TIDOID, -1, 0);
-
-	/* Prep sort */
-	so->sortstate = tuplesort_begin_heap(so->tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, u_sess->attr.attr_memory.work_mem, NULL, false);
+	so->sortstate = NULL;
 
 	so->slot = MakeSingleTupleTableSlot(so->tupdesc);
 
@@ -275,12 +1129,20 @@ ivfflatrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orde
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 
-#if PG_VERSION_NUM >= 130000
-	if (!so->first)
-		tuplesort_reset(so->sortstate);
-#endif
+	if (so->sortstate != NULL)
+	{
+		tuplesort_end(so->sortstate);
+		so->sortstate = NULL;
+	}
+
+	FreeScanValue(so);
 
 	so->first = true;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+	so->hasLastItem = false;
 	pairingheap_reset(so->listQueue);
 
 	if (keys && scan->numberOfKeys > 0)
@@ -288,6 +1150,18 @@ ivfflatrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orde
 
 	if (orderbys && scan->numberOfOrderBys > 0)
 		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+
+	/* Get radius in distances of the support function */
+	so->range = false;
+	so->radius = get_float8_infinity();
+	for (int i = 0; i < scan->numberOfKeys; i++)
+	{
+		if (scan->keyData[i].sk_strategy == IVFFLAT_RANGE_STRATEGY)
+		{
+			so->range = true;
+			so->radius = Min(so->radius, DatumGetFloat8(scan->keyData[i].sk_argument));
+		}
+	}
 }
 
 /*
@@ -297,6 +1171,7 @@ bool
 ivfflatgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	IvfflatScanItem item;
 
 	/*
 	 * Index can be used to scan backward, but Postgres doesn't support
@@ -306,8 +1181,6 @@ ivfflatgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 
 	if (so->first)
 	{
-		Datum		value;
-
 		/* Count index scan for stats */
 		pgstat_count_index_scan(scan->indexRelation);
 
@@ -320,21 +1193,30 @@ ivfflatgettuple_internal(IndexScanDesc scan, ScanDirection dir)
 		if (!IsMVCCSnapshot(scan->xs_snapshot))
 			elog(ERROR, "non-MVCC snapshots are not supported with ivfflat");
 
-		value = GetScanValue(scan);
-		IvfflatBench("GetScanLists", GetScanLists(scan, value));
-		IvfflatBench("GetScanItems", GetScanItems(scan, value));
-		so->first = false;
+		/* Quantized distances are approximate */
+		if (so->range && so->quantizer != IVFFLAT_QUANTIZER_NONE)
+			elog(ERROR, "range search is not supported for quantized ivfflat indexes");
+
+		/* Keep the value in case more items are needed */
+		so->value = GetScanValue(scan);
+		so->valueAllocated = DatumGetPointer(so->value) != NULL && so->value != scan->orderByData->sk_argument;
 
-		/* Clean up if we allocated a new value */
-		if (value != scan->orderByData->sk_argument)
-			pfree(DatumGetPointer(value));
+		IvfflatBench("GetScanLists", GetScanLists(scan, so->value));
+		IvfflatBench("GetScanItems", GetScanItems(scan, so->value));
+		so->first = false;
 	}
 
-	if (tuplesort_gettupleslot(so->sortstate, true, so->slot, NULL))
+	/* Return reranked candidates first */
+	if (so->rerankIndex < so->rerankLength)
 	{
-		ItemPointer heaptid = (ItemPointer) DatumGetPointer(heap_slot_getattr(so->slot, 2, &so->isnull));
+		scan->xs_ctup.t_self = so->rerank[so->rerankIndex++].tid;
+		scan->xs_recheck = false;
+		return true;
+	}
 
-		scan->xs_ctup.t_self = *heaptid;
+	if (GetNextItem(scan, &item))
+	{
+		scan->xs_ctup.t_self = item.tid;
 		scan->xs_recheck = false;
 		return true;
 	}
@@ -351,8 +1233,113 @@ ivfflatendscan_internal(IndexScanDesc scan)
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 
 	pairingheap_free(so->listQueue);
-	tuplesort_end(so->sortstate);
+
+	if (so->sortstate != NULL)
+		tuplesort_end(so->sortstate);
+
+	if (so->items != NULL)
+		pfree(so->items);
+
+	FreeScanValue(so);
+
+	if (so->pqTable != NULL)
+		pfree(so->pqTable);
+
+	if (so->sq8Query != NULL)
+		pfree(so->sq8Query);
+
+	pfree(so->batchValues);
+	pfree(so->batchDistances);
+
+	if (so->rerank != NULL)
+		pfree(so->rerank);
 
 	pfree(so);
 	scan->opaque = NULL;
 }
+
+/*
+ * Find all rows within a distance of a query
+ *
+ * The radius is in units of the operator of the opclass. Lists are scanned
+ * from the closest center until one has no rows within the radius, so the
+ * result is approximate like other searches.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(ivfflat_range_search);
+Datum
+ivfflat_range_search(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Datum		q = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(1)));
+	double		radius = PG_GETARG_FLOAT8(2);
+	Oid			queryType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	Snapshot	snapshot = GetActiveSnapshot();
+	Relation	index;
+	Relation	heap;
+	IndexScanDesc scan;
+	ScanKeyData key;
+	ScanKeyData orderby;
+	ItemPointer tids;
+	Datum	   *elems;
+	int			n = 0;
+	int			maxTids = 64;
+	AclResult	aclresult;
+
+	if (isnan(radius))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("radius must not be NaN")));
+
+	index = index_open(relid, AccessShareLock);
+	if (index->rd_rel->relam != get_am_oid("ivfflat", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+	if (!IsBinaryCoercible(queryType, index->rd_opcintype[0]))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("query type %s does not match index type %s",
+						format_type_be(queryType), format_type_be(index->rd_opcintype[0]))));
+
+	heap = heap_open(index->rd_index->indrelid, AccessShareLock);
+
+	aclresult = pg_class_aclcheck(RelationGetRelid(heap), GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(heap));
+
+	MemSet(&key, 0, sizeof(ScanKeyData));
+	key.sk_attno = 1;
+	key.sk_strategy = IVFFLAT_RANGE_STRATEGY;
+	key.sk_argument = Float8GetDatum(IvfflatRangeDistance(index, radius));
+
+	MemSet(&orderby, 0, sizeof(ScanKeyData));
+	orderby.sk_attno = 1;
+	orderby.sk_argument = q;
+
+	tids = (ItemPointer) palloc(sizeof(ItemPointerData) * maxTids);
+
+	scan = index_beginscan(heap, index, snapshot, 1, 1);
+	index_rescan(scan, &key, 1, &orderby, 1);
+
+	while (index_getnext(scan, ForwardScanDirection) != NULL)
+	{
+		if (n == maxTids)
+		{
+			maxTids *= 2;
+			tids = (ItemPointer) repalloc(tids, sizeof(ItemPointerData) * maxTids);
+		}
+
+		tids[n++] = scan->xs_ctup.t_self;
+	}
+
+	index_endscan(scan);
+	heap_close(heap, AccessShareLock);
+	index_close(index, AccessShareLock);
+
+	elems = (Datum *) palloc(sizeof(Datum) * Max(n, 1));
+	for (int i = 0; i < n; i++)
+		elems[i] = PointerGetDatum(&tids[i]);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, n, TIDOID, sizeof(ItemPointerData), false, 's'));
+}
@@ -1,13 +1,17 @@
 #include "postgres.h"
 
 #include "access/generic_xlog.h"
+#include "access/reloptions.h"
 #include "bitvec.h"
 #include "catalog/pg_type.h"
 #include "fmgr.h"
 #include "halfutils.h"
 #include "halfvec.h"
 #include "ivfflat.h"
+#include "miscadmin.h"
 #include "storage/buf/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
 
 /*
  * Allocate a vector array
@@ -52,6 +56,104 @@ IvfflatGetLists(Relation index)
 	return IVFFLAT_DEFAULT_LISTS;
 }
 
+/*
+ * Get the list size ratio for rebalancing during vacuum
+ */
+double
+IvfflatGetRebalanceRatio(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+
+	if (opts)
+		return opts->rebalanceRatio;
+
+	return IVFFLAT_DEFAULT_REBALANCE_RATIO;
+}
+
+/*
+ * Get the quantizer for list entries
+ */
+int
+IvfflatGetQuantizerType(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return IVFFLAT_QUANTIZER_NONE;
+
+	value = GET_STRING_RELOPTION(opts, quantizer);
+	if (value != NULL && strcmp(value, "pq") == 0)
+		return IVFFLAT_QUANTIZER_PQ;
+
+	if (value != NULL && strcmp(value, "sq8") == 0)
+		return IVFFLAT_QUANTIZER_SQ8;
+
+	return IVFFLAT_QUANTIZER_NONE;
+}
+
+/*
+ * Get the k-means algorithm for building lists
+ */
+int
+IvfflatGetKmeans(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return IVFFLAT_KMEANS_ELKAN;
+
+	value = GET_STRING_RELOPTION(opts, kmeans);
+	if (value != NULL && strcmp(value, "minibatch") == 0)
+		return IVFFLAT_KMEANS_MINIBATCH;
+
+	return IVFFLAT_KMEANS_ELKAN;
+}
+
+/*
+ * Get the relation to copy centers from
+ */
+char *
+IvfflatGetCentroidsFrom(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+	char	   *value;
+
+	if (opts == NULL)
+		return NULL;
+
+	value = GET_STRING_RELOPTION(opts, centroidsFrom);
+	if (value == NULL || value[0] == '\0')
+		return NULL;
+
+	return value;
+}
+
+/*
+ * Get the number of product quantization subquantizers
+ *
+ * Defaults to the largest divisor of dimensions that is at most
+ * dimensions / 4 so each code covers at least four dimensions
+ */
+int
+IvfflatGetPqM(Relation index, int dimensions)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+	int			m;
+
+	if (opts && opts->pqM != IVFFLAT_DEFAULT_PQ_M)
+		return opts->pqM;
+
+	for (m = Max(dimensions / 4, 1); m > 1; m--)
+	{
+		if (dimensions % m == 0)
+			break;
+	}
+
+	return m;
+}
+
 /*
  * Get proc
  */
@@ -64,6 +166,27 @@ IvfflatOptionalProcInfo(Relation index, uint16 procnum)
 	return index_getprocinfo(index, 1, procnum);
 }
 
+/*
+ * Convert a distance of the operator to a distance of the support function
+ *
+ * L2 distance is squared, and cosine distance is the negative inner product
+ * of normalized values minus one.
+ */
+double
+IvfflatRangeDistance(Relation index, double radius)
+{
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+
+	if (procinfo->fn_addr == vector_l2_squared_distance ||
+		procinfo->fn_addr == halfvec_l2_squared_distance)
+		return radius < 0 ? -1 : radius * radius;
+
+	if (IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC) != NULL)
+		return radius - 1;
+
+	return radius;
+}
+
 /*
  * Normalize value
  */
@@ -82,14 +205,86 @@ IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value)
 	return DatumGetFloat8(FunctionCall1Coll(procinfo, collation, value)) > 0;
 }
 
+/*
+ * Convert a value to floats
+ */
+void
+IvfflatValueToFloat(const IvfflatTypeInfo * typeInfo, Datum value, int dimensions, float *x)
+{
+	for (int k = 0; k < dimensions; k++)
+		x[k] = 0.0;
+
+	typeInfo->sumCenter(DatumGetPointer(value), x);
+}
+
+/*
+ * Take a page from the free list
+ *
+ * Returns InvalidBuffer if the free list is empty
+ */
+static Buffer
+GetFreeBuffer(Relation index)
+{
+	Buffer		metaBuf;
+	Buffer		buf = InvalidBuffer;
+	Page		page;
+	IvfflatMetaPage metap;
+	GenericXLogState *state;
+
+	metaBuf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(metaBuf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(metaBuf);
+	metap = IvfflatPageGetMeta(page);
+
+	/* Metapages of older indexes end before the free list */
+	if (((PageHeader) page)->pd_lower < ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page ||
+		!BlockNumberIsValid(metap->freePage))
+	{
+		UnlockReleaseBuffer(metaBuf);
+		return InvalidBuffer;
+	}
+
+	/* Recheck with an exclusive lock, since inserts also take pages */
+	LockBuffer(metaBuf, BUFFER_LOCK_UNLOCK);
+	LockBuffer(metaBuf, BUFFER_LOCK_EXCLUSIVE);
+	metap = IvfflatPageGetMeta(page);
+
+	if (BlockNumberIsValid(metap->freePage))
+	{
+		buf = ReadBuffer(index, metap->freePage);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+		/* The page is lost on a crash before the caller links it */
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, metaBuf, 0);
+		metap = IvfflatPageGetMeta(page);
+		metap->freePage = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+		GenericXLogFinish(state);
+	}
+
+	UnlockReleaseBuffer(metaBuf);
+	return buf;
+}
+
 /*
  * New buffer
+ *
+ * Reuses pages of replaced lists before extending the relation
  */
 Buffer
 IvfflatNewBuffer(Relation index, ForkNumber forkNum)
 {
-	Buffer		buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
+	Buffer		buf;
 
+	/* The first page is the metapage */
+	if (forkNum == MAIN_FORKNUM && RelationGetNumberOfBlocks(index) > IVFFLAT_METAPAGE_BLKNO)
+	{
+		buf = GetFreeBuffer(index);
+		if (BufferIsValid(buf))
+			return buf;
+	}
+
+	buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
 	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 	return buf;
 }
@@ -155,6 +350,50 @@ IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **st
 	*buf = newbuf;
 }
 
+/*
+ * Read the centers from the list pages
+ */
+VectorArray
+IvfflatReadCenters(Relation index)
+{
+	const IvfflatTypeInfo *typeInfo = IvfflatGetTypeInfo(index);
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	VectorArray centers;
+	int			lists;
+	int			dimensions;
+
+	IvfflatGetMetaPageInfo(index, &lists, &dimensions);
+	centers = VectorArrayInit(lists, dimensions, typeInfo->itemSize(dimensions));
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+
+			if (centers->length == centers->maxlen)
+				elog(ERROR, "ivfflat index has more lists than expected");
+
+			VectorArraySet(centers, centers->length++, (Pointer) &list->center);
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	return centers;
+}
+
 /*
  * Get the metapage info
  */
@@ -182,6 +421,80 @@ IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions)
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Get the list statistics
+ */
+void
+IvfflatGetListStats(Relation index, double *tuples, double *listTuples)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+
+	/* Metapages of older indexes end before the statistics */
+	if (((PageHeader) page)->pd_lower >= ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page)
+	{
+		*tuples = metap->statsTuples;
+		*listTuples = metap->statsListTuples;
+	}
+	else
+	{
+		*tuples = 0;
+		*listTuples = 0;
+	}
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Extend the metapage of an older index to the current size
+ */
+void
+IvfflatExtendMetaPage(Page page)
+{
+	IvfflatMetaPage metap = IvfflatPageGetMeta(page);
+	PageHeader	phdr = (PageHeader) page;
+
+	/* Other new fields are zero */
+	if (phdr->pd_lower < ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page)
+	{
+		metap->freePage = InvalidBlockNumber;
+		metap->replacedXid = InvalidTransactionId;
+	}
+
+	phdr->pd_lower = ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page;
+}
+
+/*
+ * Get the list generation
+ */
+uint32
+IvfflatGetListGeneration(Relation index)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+	uint32		generation = 0;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+
+	/* Lists of older indexes have never been swapped */
+	if (((PageHeader) page)->pd_lower >= ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page)
+		generation = metap->listGeneration;
+
+	UnlockReleaseBuffer(buf);
+
+	return generation;
+}
+
 /*
  * Update the start or insert page of a list
  */
@@ -335,7 +648,8 @@ IvfflatGetTypeInfo(Relation index)
 			.normalize = l2_normalize,
 			.itemSize = VectorItemSize,
 			.updateCenter = VectorUpdateCenter,
-			.sumCenter = VectorSumCenter
+			.sumCenter = VectorSumCenter,
+			.distanceBatch = VectorDistanceBatch
 		};
 
 		return (&typeInfo);
@@ -353,7 +667,8 @@ ivfflat_halfvec_support(PG_FUNCTION_ARGS)
 		.normalize = halfvec_l2_normalize,
 		.itemSize = HalfvecItemSize,
 		.updateCenter = HalfvecUpdateCenter,
-		.sumCenter = HalfvecSumCenter
+		.sumCenter = HalfvecSumCenter,
+		.distanceBatch = HalfvecDistanceBatch
 	};
 
 	PG_RETURN_POINTER(&typeInfo);
@@ -368,8 +683,24 @@ ivfflat_bit_support(PG_FUNCTION_ARGS)
 		.normalize = NULL,
 		.itemSize = BitItemSize,
 		.updateCenter = BitUpdateCenter,
-		.sumCenter = BitSumCenter
+		.sumCenter = BitSumCenter,
+		.distanceBatch = NULL
 	};
 
 	PG_RETURN_POINTER(&typeInfo);
 };
+
+/*
+ * Check the user can read the table of an index
+ *
+ * Centers and list sizes are derived from the rows of the table
+ */
+void
+IvfflatCheckTablePrivilege(Relation index)
+{
+	Oid			heapOid = index->rd_index->indrelid;
+	AclResult	aclresult = pg_class_aclcheck(heapOid, GetUserId(), ACL_SELECT);
+
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, get_rel_name(heapOid));
+}
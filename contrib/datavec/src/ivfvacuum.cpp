@@ -4,6 +4,7 @@
 #include "commands/vacuum.h"
 #include "ivfflat.h"
 #include "storage/buf/bufmgr.h"
+#include "storage/lmgr.h"
 
 /*
  * Bulk delete tuples from the index
@@ -119,8 +120,7 @@ ivfflatbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 			/*
 			 * Update after all tuples deleted.
 			 *
-			 * We don't add or delete items from lists pages, so offset won't
-			 * change.
+			 * Rebalancing cannot run during vacuum, so offset won't change.
 			 */
 			if (BlockNumberIsValid(insertPage))
 			{
@@ -142,9 +142,29 @@ IndexBulkDeleteResult *
 ivfflatvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 {
 	Relation	rel = info->index;
+	double		ratio;
 
+	/* Also called by ANALYZE */
 	if (info->analyze_only)
+	{
+		IvfflatUpdateListStats(rel);
 		return stats;
+	}
+
+	/*
+	 * Reclaim pages of replaced lists and rebalance lists if enabled,
+	 * skipping if inserts are running
+	 */
+	ratio = IvfflatGetRebalanceRatio(rel);
+	if (ConditionalLockRelation(rel, ShareRowExclusiveLock))
+	{
+		IvfflatReclaimPages(rel);
+		if (ratio > 1)
+			IvfflatRebalance(rel, ratio);
+		UnlockRelation(rel, ShareRowExclusiveLock);
+	}
+
+	IvfflatUpdateListStats(rel);
 
 	/* stats is NULL if ambulkdelete not called */
 	/* OK to return NULL if index not changed */
@@ -0,0 +1,311 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/amapi.h"
+#include "access/reloptions.h"
+#include "commands/vacuum.h"
+#include "miscadmin.h"
+#include "sparseinv.h"
+#include "utils/guc.h"
+#include "utils/selfuncs.h"
+
+#if PG_VERSION_NUM < 150000
+#define MarkGUCPrefixReserved(x) EmitWarningsOnPlaceholders(x)
+#endif
+
+int			sparseinv_top_k;
+static relopt_kind sparseinv_relopt_kind;
+
+/*
+ * Initialize index options and variables
+ */
+void
+SparseinvInit(void)
+{
+	/* No options, but unknown options are still rejected */
+	sparseinv_relopt_kind = add_reloption_kind();
+
+	DefineCustomIntVariable("sparseinv.top_k", "Sets the max number of results for search",
+							"Valid range is 1..10000.", &sparseinv_top_k,
+							SPARSEINV_DEFAULT_TOP_K, SPARSEINV_MIN_TOP_K, SPARSEINV_MAX_TOP_K, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	MarkGUCPrefixReserved("sparseinv");
+}
+
+/*
+ * Estimate the cost of an index scan
+ */
+static void
+sparseinvcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_count,
+							   Cost *indexStartupCost, Cost *indexTotalCost,
+							   Selectivity *indexSelectivity, double *indexCorrelation)
+{
+	GenericCosts costs;
+
+	/* Never use index without order */
+	if (path->indexorderbys == NULL)
+	{
+		*indexStartupCost = DBL_MAX;
+		*indexTotalCost = DBL_MAX;
+		*indexSelectivity = 0;
+		*indexCorrelation = 0;
+		return;
+	}
+
+	MemSet(&costs, 0, sizeof(costs));
+
+	/* Pruning skips most postings, but all lists of the query are read */
+	costs.numIndexTuples = Min(sparseinv_top_k, path->indexinfo->tuples);
+
+	genericcostestimate(root, path, loop_count, costs.numIndexTuples, &costs.indexStartupCost,
+						&costs.indexTotalCost, &costs.indexSelectivity, &costs.indexCorrelation);
+
+	/* Use total cost since most work happens before first tuple is returned */
+	*indexStartupCost = costs.indexTotalCost;
+	*indexTotalCost = costs.indexTotalCost;
+	*indexSelectivity = costs.indexSelectivity;
+	*indexCorrelation = costs.indexCorrelation;
+}
+
+/*
+ * Parse and validate the reloptions
+ */
+static bytea *
+sparseinvoptions_internal(Datum reloptions, bool validate)
+{
+	relopt_value *options;
+	int			numoptions;
+
+	options = parseRelOptions(reloptions, validate, sparseinv_relopt_kind, &numoptions);
+	if (options != NULL)
+		pfree(options);
+
+	return NULL;
+}
+
+/*
+ * Validate catalog entries for the specified operator class
+ */
+static bool
+sparseinvvalidate_internal(Oid opclassoid)
+{
+	return true;
+}
+
+/*
+ * Define index handler
+ *
+ * See https://www.postgresql.org/docs/current/index-api.html
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvhandler);
+Datum
+sparseinvhandler(PG_FUNCTION_ARGS)
+{
+	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+	amroutine->amstrategies = 0;
+	amroutine->amsupport = 1;
+#if PG_VERSION_NUM >= 130000
+	amroutine->amoptsprocnum = 0;
+#endif
+	amroutine->amcanorder = false;
+	amroutine->amcanorderbyop = true;
+	amroutine->amcanbackward = false;	/* can change direction mid-scan */
+	amroutine->amcanunique = false;
+	amroutine->amcanmulticol = false;
+	amroutine->amoptionalkey = true;
+	amroutine->amsearcharray = false;
+	amroutine->amsearchnulls = false;
+	amroutine->amstorage = false;
+	amroutine->amclusterable = false;
+	amroutine->ampredlocks = false;
+	amroutine->amcanparallel = false;
+	amroutine->amcaninclude = false;
+#if PG_VERSION_NUM >= 130000
+	amroutine->amusemaintenanceworkmem = false; /* not used during VACUUM */
+	amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
+#endif
+	amroutine->amkeytype = InvalidOid;
+
+	/* Interface functions */
+	errno_t rc;
+	rc = strcpy_s(amroutine->ambuildfuncname, NAMEDATALEN, "sparseinvbuild");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->ambuildemptyfuncname, NAMEDATALEN, "sparseinvbuildempty");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->aminsertfuncname, NAMEDATALEN, "sparseinvinsert");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->ambulkdeletefuncname, NAMEDATALEN, "sparseinvbulkdelete");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amvacuumcleanupfuncname, NAMEDATALEN, "sparseinvvacuumcleanup");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amcostestimatefuncname, NAMEDATALEN, "sparseinvcostestimate");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amoptionsfuncname, NAMEDATALEN, "sparseinvoptions");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amvalidatefuncname, NAMEDATALEN, "sparseinvvalidate");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->ambeginscanfuncname, NAMEDATALEN, "sparseinvbeginscan");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amrescanfuncname, NAMEDATALEN, "sparseinvrescan");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amgettuplefuncname, NAMEDATALEN, "sparseinvgettuple");
+	securec_check(rc, "\0", "\0");
+	rc = strcpy_s(amroutine->amendscanfuncname, NAMEDATALEN, "sparseinvendscan");
+	securec_check(rc, "\0", "\0");
+
+	PG_RETURN_POINTER(amroutine);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvbuild);
+Datum
+sparseinvbuild(PG_FUNCTION_ARGS)
+{
+	Relation heap = (Relation)PG_GETARG_POINTER(0);
+	Relation index = (Relation)PG_GETARG_POINTER(1);
+	IndexInfo *indexinfo = (IndexInfo *)PG_GETARG_POINTER(2);
+	IndexBuildResult *result = sparseinvbuild_internal(heap, index, indexinfo);
+
+	PG_RETURN_POINTER(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvbuildempty);
+Datum
+sparseinvbuildempty(PG_FUNCTION_ARGS)
+{
+	Relation index = (Relation)PG_GETARG_POINTER(0);
+	sparseinvbuildempty_internal(index);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvinsert);
+Datum
+sparseinvinsert(PG_FUNCTION_ARGS)
+{
+	Relation rel = (Relation)PG_GETARG_POINTER(0);
+	Datum * values = (Datum *)PG_GETARG_POINTER(1);
+	bool *isnull = (bool *)PG_GETARG_POINTER(2);
+	ItemPointer ht_ctid = (ItemPointer)PG_GETARG_POINTER(3);
+	Relation heaprel = (Relation)PG_GETARG_POINTER(4);
+	IndexUniqueCheck checkunique = (IndexUniqueCheck)PG_GETARG_INT32(5);
+	bool result = sparseinvinsert_internal(rel, values, isnull, ht_ctid, heaprel, checkunique);
+
+	PG_RETURN_BOOL(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvbulkdelete);
+Datum
+sparseinvbulkdelete(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo *info = (IndexVacuumInfo *)PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult *volatile stats = (IndexBulkDeleteResult *)PG_GETARG_POINTER(1);
+	IndexBulkDeleteCallback callback = (IndexBulkDeleteCallback)PG_GETARG_POINTER(2);
+	void *callback_state = (void *)PG_GETARG_POINTER(3);
+	stats = sparseinvbulkdelete_internal(info, stats, callback, callback_state);
+
+	PG_RETURN_POINTER(stats);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvvacuumcleanup);
+Datum
+sparseinvvacuumcleanup(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo *info = (IndexVacuumInfo *)PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult *stats = (IndexBulkDeleteResult *)PG_GETARG_POINTER(1);
+	stats = sparseinvvacuumcleanup_internal(info, stats);
+
+	PG_RETURN_POINTER(stats);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvcostestimate);
+Datum
+sparseinvcostestimate(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	IndexPath *path = (IndexPath *)PG_GETARG_POINTER(1);
+	double loopcount = (double)PG_GETARG_FLOAT8(2);
+	Cost *startupcost = (Cost *)PG_GETARG_POINTER(3);
+	Cost *totalcost = (Cost *)PG_GETARG_POINTER(4);
+	Selectivity *selectivity = (Selectivity *)PG_GETARG_POINTER(5);
+	double *correlation = (double *)PG_GETARG_POINTER(6);
+	sparseinvcostestimate_internal(root, path, loopcount, startupcost, totalcost, selectivity, correlation);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvoptions);
+Datum
+sparseinvoptions(PG_FUNCTION_ARGS)
+{
+	Datum reloptions = PG_GETARG_DATUM(0);
+	bool validate = PG_GETARG_BOOL(1);
+	bytea *result = sparseinvoptions_internal(reloptions, validate);
+
+	if (NULL != result)
+		PG_RETURN_BYTEA_P(result);
+
+	PG_RETURN_NULL();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvvalidate);
+Datum
+sparseinvvalidate(PG_FUNCTION_ARGS)
+{
+	Oid opclassoid = PG_GETARG_OID(0);
+	bool result = sparseinvvalidate_internal(opclassoid);
+
+	PG_RETURN_BOOL(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvbeginscan);
+Datum
+sparseinvbeginscan(PG_FUNCTION_ARGS)
+{
+	Relation rel = (Relation)PG_GETARG_POINTER(0);
+	int nkeys = PG_GETARG_INT32(1);
+	int norderbys = PG_GETARG_INT32(2);
+	IndexScanDesc scan = sparseinvbeginscan_internal(rel, nkeys, norderbys);
+
+	PG_RETURN_POINTER(scan);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvrescan);
+Datum
+sparseinvrescan(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc scan = (IndexScanDesc)PG_GETARG_POINTER(0);
+	ScanKey scankey = (ScanKey)PG_GETARG_POINTER(1);
+	int nkeys = PG_GETARG_INT32(2);
+	ScanKey orderbys = (ScanKey)PG_GETARG_POINTER(3);
+	int norderbys = PG_GETARG_INT32(4);
+	sparseinvrescan_internal(scan, scankey, nkeys, orderbys, norderbys);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvgettuple);
+Datum
+sparseinvgettuple(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc scan = (IndexScanDesc)PG_GETARG_POINTER(0);
+	ScanDirection direction = (ScanDirection)PG_GETARG_INT32(1);
+
+	if (NULL == scan)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid arguments for function sparseinvgettuple")));
+
+	bool result = sparseinvgettuple_internal(scan, direction);
+
+	PG_RETURN_BOOL(result);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(sparseinvendscan);
+Datum
+sparseinvendscan(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc scan = (IndexScanDesc)PG_GETARG_POINTER(0);
+	sparseinvendscan_internal(scan);
+
+	PG_RETURN_VOID();
+}
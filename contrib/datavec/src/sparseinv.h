@@ -0,0 +1,210 @@
+#ifndef SPARSEINV_H
+#define SPARSEINV_H
+
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "nodes/execnodes.h"
+#include "sparsevec.h"
+#include "utils/tuplesort.h"
+#include "vector.h"
+
+/* Support functions */
+#define SPARSEINV_DISTANCE_PROC 1
+
+#define SPARSEINV_VERSION	1
+#define SPARSEINV_MAGIC_NUMBER 0x5BA251A1
+#define SPARSEINV_PAGE_ID	0xFF93
+
+/* Must correspond to page numbers since page lock is used */
+#define SPARSEINV_SCAN_LOCK		1
+
+/* Preserved page numbers */
+#define SPARSEINV_METAPAGE_BLKNO	0
+
+/* Inverted index parameters */
+#define SPARSEINV_DEFAULT_TOP_K	100
+#define SPARSEINV_MIN_TOP_K	1
+#define SPARSEINV_MAX_TOP_K	10000
+#define SPARSEINV_MIN_BUCKETS	16
+
+/* Page flags */
+#define SPARSEINV_DIRECTORY	(1 << 0)
+#define SPARSEINV_POSTING	(1 << 1)
+#define SPARSEINV_DELETED	(1 << 2)
+
+/* Build phases */
+/* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
+#define PROGRESS_SPARSEINV_PHASE_LOAD	2
+
+#define SPARSEINV_PAGE_CAPACITY \
+	(BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(SparseinvPageOpaqueData)))
+#define SPARSEINV_POSTINGS_PER_PAGE	(SPARSEINV_PAGE_CAPACITY / sizeof(SparseinvPosting))
+#define SPARSEINV_TERMS_PER_PAGE	(SPARSEINV_PAGE_CAPACITY / sizeof(SparseinvTermData))
+
+#define SparseinvPageGetOpaque(page)	((SparseinvPageOpaque) PageGetSpecialPointer(page))
+#define SparseinvPageGetMeta(page)	((SparseinvMetaPageData *) PageGetContents(page))
+#define SparseinvPageGetPostings(page)	((SparseinvPosting *) PageGetContents(page))
+#define SparseinvPageGetTerms(page)	((SparseinvTermData *) PageGetContents(page))
+#define SparseinvPageGetCount(page, type) \
+	((int) ((((PageHeader) (page))->pd_lower - ((char *) PageGetContents(page) - (char *) (page))) / sizeof(type)))
+#define SparseinvPageSetCount(page, type, count) \
+	(((PageHeader) (page))->pd_lower = ((char *) PageGetContents(page) - (char *) (page)) + (count) * sizeof(type))
+
+/* Variables */
+extern int	sparseinv_top_k;
+
+typedef struct SparseinvMetaPageData
+{
+	uint32		magicNumber;
+	uint32		version;
+	uint32		buckets;
+	BlockNumber directoryPage;	/* first page of bucket 0 */
+}			SparseinvMetaPageData;
+
+typedef SparseinvMetaPageData * SparseinvMetaPage;
+
+typedef struct SparseinvPageOpaqueData
+{
+	BlockNumber nextblkno;
+	float		maxWeight;		/* of postings on the page */
+	float		minWeight;
+	uint16		flags;
+	uint16		page_id;		/* for identification of sparseinv indexes */
+}			SparseinvPageOpaqueData;
+
+typedef SparseinvPageOpaqueData * SparseinvPageOpaque;
+
+typedef struct SparseinvPosting
+{
+	ItemPointerData heaptid;
+	float		weight;
+}			SparseinvPosting;
+
+/*
+ * Posting list for a dimension
+ *
+ * Postings written by build and vacuum are sorted by heap tid, which scans
+ * need to evaluate lists together. Inserts append to a separate pending list
+ * instead, which scans sort in memory and vacuum merges into the sorted list.
+ * Weights bound the contribution of the dimension to any score.
+ */
+typedef struct SparseinvTermData
+{
+	int32		dim;
+	uint32		count;
+	float		maxWeight;
+	float		minWeight;
+	BlockNumber sortedPage;
+	BlockNumber pendingPage;
+	BlockNumber pendingTail;
+}			SparseinvTermData;
+
+typedef SparseinvTermData * SparseinvTerm;
+
+typedef struct SparseinvBuildState
+{
+	/* Info */
+	Relation	heap;
+	Relation	index;
+	IndexInfo  *indexInfo;
+	ForkNumber	forkNum;
+
+	/* Statistics */
+	double		indtuples;
+	double		reltuples;
+
+	/* Sorting */
+	Tuplesortstate *sortstate;
+	TupleDesc	tupdesc;
+	TupleTableSlot *slot;
+
+	/* Terms */
+	SparseinvTermData *terms;
+	int			termCount;
+	int			maxTerms;
+
+	/* Memory */
+	MemoryContext tmpCtx;
+}			SparseinvBuildState;
+
+typedef struct SparseinvVacuumState
+{
+	/* Info */
+	Relation	index;
+	IndexBulkDeleteResult *stats;
+	IndexBulkDeleteCallback callback;
+	void	   *callback_state;
+
+	/* Settings */
+	BufferAccessStrategy bas;
+
+	/* Meta page */
+	SparseinvMetaPageData metap;
+
+	/* Pages of replaced lists */
+	BlockNumber *freePages;
+	int			freeCount;
+	int			maxFree;
+
+	/* Memory */
+	MemoryContext tmpCtx;
+}			SparseinvVacuumState;
+
+typedef struct SparseinvResult
+{
+	ItemPointerData heaptid;
+	float		distance;
+}			SparseinvResult;
+
+typedef struct SparseinvScanOpaqueData
+{
+	bool		first;
+	SparseinvResult *results;
+	int			resultCount;
+	int			resultPos;
+	MemoryContext tmpCtx;
+}			SparseinvScanOpaqueData;
+
+typedef SparseinvScanOpaqueData * SparseinvScanOpaque;
+
+/* Methods */
+Buffer		SparseinvNewBuffer(Relation index, ForkNumber forkNum);
+void		SparseinvInitPage(Buffer buf, Page page, uint16 flags);
+void		SparseinvInit(void);
+void		SparseinvGetMetaPageInfo(Relation index, SparseinvMetaPage metap);
+BlockNumber SparseinvBucketPage(const SparseinvMetaPageData * metap, int32 dim);
+bool		SparseinvFindTerm(Relation index, const SparseinvMetaPageData * metap, int32 dim, SparseinvTerm term);
+void		SparseinvUpdateWeights(SparseinvTerm term, float weight);
+int			SparseinvComparePostings(const void *a, const void *b);
+SparseinvPosting *SparseinvReadPostings(Relation index, BlockNumber blkno, int *count, BufferAccessStrategy bas);
+void		SparseinvInsertTupleOnDisk(Relation index, SparseVector * vec, ItemPointer heaptid);
+
+extern "C" {
+    Datum sparseinvhandler(PG_FUNCTION_ARGS);
+    Datum sparseinvbuild(PG_FUNCTION_ARGS);
+    Datum sparseinvbuildempty(PG_FUNCTION_ARGS);
+    Datum sparseinvinsert(PG_FUNCTION_ARGS);
+    Datum sparseinvbulkdelete(PG_FUNCTION_ARGS);
+    Datum sparseinvvacuumcleanup(PG_FUNCTION_ARGS);
+    Datum sparseinvcostestimate(PG_FUNCTION_ARGS);
+    Datum sparseinvoptions(PG_FUNCTION_ARGS);
+    Datum sparseinvvalidate(PG_FUNCTION_ARGS);
+    Datum sparseinvbeginscan(PG_FUNCTION_ARGS);
+    Datum sparseinvrescan(PG_FUNCTION_ARGS);
+    Datum sparseinvgettuple(PG_FUNCTION_ARGS);
+    Datum sparseinvendscan(PG_FUNCTION_ARGS);
+}
+
+/* Index access methods */
+IndexBuildResult *sparseinvbuild_internal(Relation heap, Relation index, IndexInfo *indexInfo);
+void		sparseinvbuildempty_internal(Relation index);
+bool		sparseinvinsert_internal(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heap, IndexUniqueCheck checkUnique);
+IndexBulkDeleteResult *sparseinvbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state);
+IndexBulkDeleteResult *sparseinvvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats);
+IndexScanDesc sparseinvbeginscan_internal(Relation index, int nkeys, int norderbys);
+void		sparseinvrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
+bool		sparseinvgettuple_internal(IndexScanDesc scan, ScanDirection dir);
+void		sparseinvendscan_internal(IndexScanDesc scan);
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * The inverted index build happens in three steps:
+ *
+ * 1. Sort
+ *
+ * The table is scanned and a (dimension, heap tid, weight) posting is added
+ * to a tuplesort for each non-zero element.
+ *
+ * 2. Posting pages
+ *
+ * Postings are read back in order and the postings of each dimension are
+ * written to a chain of pages sorted by heap tid. Each page keeps the range
+ * of its weights so scans can bound the scores on the page, and the
+ * directory entry of each dimension is kept in memory.
+ *
+ * 3. Directory pages
+ *
+ * Directory entries are hashed into buckets of pages, which are written
+ * about half full to leave room for dimensions added by inserts, and the
+ * meta page is written last.
+ *
+ * After we have finished building the index, we perform one more scan through
+ * the index and write all the pages to the WAL.
+ */
+#include "postgres.h"
+
+#include "access/xloginsert.h"
+#include "catalog/index.h"
+#include "catalog/pg_operator.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "sparseinv.h"
+#include "storage/buf/bufmgr.h"
+#include "utils/hashutils.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_progress.h"
+#else
+#include "pgstat.h"
+#endif
+
+#if PG_VERSION_NUM >= 130000
+#define CALLBACK_ITEM_POINTER ItemPointer tid
+#else
+#define CALLBACK_ITEM_POINTER HeapTuple hup
+#endif
+
+#define PROGRESS_CREATEIDX_TUPLES_DONE 0
+
+/* Directory entry with its bucket */
+typedef struct SparseinvBuildTerm
+{
+	uint32		bucket;
+	SparseinvTermData term;
+}			SparseinvBuildTerm;
+
+/*
+ * Callback for table_index_build_scan
+ */
+static void
+BuildCallback(Relation index, CALLBACK_ITEM_POINTER, Datum *values,
+			  const bool *isnull, bool tupleIsAlive, void *state)
+{
+	SparseinvBuildState *buildstate = (SparseinvBuildState *) state;
+	TupleTableSlot *slot = buildstate->slot;
+	MemoryContext oldCtx;
+	SparseVector *vec;
+	float	   *weights;
+
+#if PG_VERSION_NUM < 130000
+	ItemPointer tid = &hup->t_self;
+#endif
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	/* Use memory context */
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+	/* Detoast once for all calls */
+	vec = DatumGetSparseVector(values[0]);
+	weights = SPARSEVEC_VALUES(vec);
+
+	for (int i = 0; i < vec->nnz; i++)
+	{
+		ExecClearTuple(slot);
+		slot->tts_values[0] = Int32GetDatum(vec->indices[i]);
+		slot->tts_isnull[0] = false;
+		slot->tts_values[1] = PointerGetDatum(tid);
+		slot->tts_isnull[1] = false;
+		slot->tts_values[2] = Float4GetDatum(weights[i]);
+		slot->tts_isnull[2] = false;
+		ExecStoreVirtualTuple(slot);
+
+		tuplesort_puttupleslot(buildstate->sortstate, slot);
+	}
+
+	UpdateProgress(PROGRESS_CREATEIDX_TUPLES_DONE, ++buildstate->indtuples);
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+}
+
+/*
+ * Create the meta page
+ */
+static void
+CreateMetaPage(Relation index, uint32 buckets, BlockNumber directoryPage, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	SparseinvMetaPage metap;
+
+	buf = ReadBufferExtended(index, forkNum, SPARSEINV_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	SparseinvInitPage(buf, page, 0);
+
+	/* Set metapage data */
+	metap = SparseinvPageGetMeta(page);
+	metap->magicNumber = SPARSEINV_MAGIC_NUMBER;
+	metap->version = SPARSEINV_VERSION;
+	metap->buckets = buckets;
+	metap->directoryPage = directoryPage;
+
+	((PageHeader) page)->pd_lower =
+		((char *) metap + sizeof(SparseinvMetaPageData)) - (char *) page;
+
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Add a new page to a chain
+ */
+static Buffer
+AppendPage(Relation index, Buffer buf, uint16 flags, ForkNumber forkNum)
+{
+	Buffer		newbuf = SparseinvNewBuffer(index, forkNum);
+
+	SparseinvInitPage(newbuf, BufferGetPage(newbuf), flags);
+
+	if (BufferIsValid(buf))
+	{
+		SparseinvPageGetOpaque(BufferGetPage(buf))->nextblkno = BufferGetBlockNumber(newbuf);
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	return newbuf;
+}
+
+/*
+ * Add a directory entry for a dimension
+ */
+static SparseinvTerm
+AddTerm(SparseinvBuildState * buildstate, int32 dim)
+{
+	SparseinvTerm term;
+
+	if (buildstate->termCount == buildstate->maxTerms)
+	{
+		buildstate->maxTerms *= 2;
+		buildstate->terms = (SparseinvTermData *) repalloc_huge(buildstate->terms, sizeof(SparseinvTermData) * buildstate->maxTerms);
+	}
+
+	term = &buildstate->terms[buildstate->termCount++];
+	term->dim = dim;
+	term->count = 0;
+	term->maxWeight = 0;
+	term->minWeight = 0;
+	term->sortedPage = InvalidBlockNumber;
+	term->pendingPage = InvalidBlockNumber;
+	term->pendingTail = InvalidBlockNumber;
+
+	return term;
+}
+
+/*
+ * Write the postings of each dimension to a chain of pages
+ */
+static void
+CreatePostingPages(SparseinvBuildState * buildstate)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	TupleTableSlot *slot = MakeSingleTupleTableSlot(buildstate->tupdesc);
+	SparseinvTerm term = NULL;
+	Buffer		buf = InvalidBuffer;
+	Page		page = NULL;
+	int			count = 0;
+
+	while (tuplesort_gettupleslot(buildstate->sortstate, true, slot, NULL))
+	{
+		bool		isnull;
+		int32		dim = DatumGetInt32(heap_slot_getattr(slot, 1, &isnull));
+		ItemPointer heaptid = (ItemPointer) DatumGetPointer(heap_slot_getattr(slot, 2, &isnull));
+		float		weight = DatumGetFloat4(heap_slot_getattr(slot, 3, &isnull));
+		SparseinvPosting *posting;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Start a chain for each dimension */
+		if (term == NULL || term->dim != dim)
+		{
+			if (BufferIsValid(buf))
+			{
+				MarkBufferDirty(buf);
+				UnlockReleaseBuffer(buf);
+				buf = InvalidBuffer;
+			}
+
+			term = AddTerm(buildstate, dim);
+		}
+
+		if (!BufferIsValid(buf) || count == (int) SPARSEINV_POSTINGS_PER_PAGE)
+		{
+			buf = AppendPage(index, buf, SPARSEINV_POSTING, forkNum);
+			page = BufferGetPage(buf);
+			count = 0;
+
+			if (!BlockNumberIsValid(term->sortedPage))
+				term->sortedPage = BufferGetBlockNumber(buf);
+		}
+
+		posting = &SparseinvPageGetPostings(page)[count];
+		posting->heaptid = *heaptid;
+		posting->weight = weight;
+
+		if (count == 0 || weight > SparseinvPageGetOpaque(page)->maxWeight)
+			SparseinvPageGetOpaque(page)->maxWeight = weight;
+		if (count == 0 || weight < SparseinvPageGetOpaque(page)->minWeight)
+			SparseinvPageGetOpaque(page)->minWeight = weight;
+
+		SparseinvPageSetCount(page, SparseinvPosting, ++count);
+
+		SparseinvUpdateWeights(term, weight);
+		term->count++;
+	}
+
+	if (BufferIsValid(buf))
+	{
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+}
+
+/*
+ * Compare directory entries by bucket
+ */
+static int
+CompareBuildTerms(const void *a, const void *b)
+{
+	const SparseinvBuildTerm *ta = (const SparseinvBuildTerm *) a;
+	const SparseinvBuildTerm *tb = (const SparseinvBuildTerm *) b;
+
+	if (ta->bucket != tb->bucket)
+		return ta->bucket < tb->bucket ? -1 : 1;
+
+	if (ta->term.dim != tb->term.dim)
+		return ta->term.dim < tb->term.dim ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Write the directory and meta pages
+ */
+static void
+CreateDirectoryPages(SparseinvBuildState * buildstate)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	int			termsPerBucket = SPARSEINV_TERMS_PER_PAGE / 2;
+	uint32		buckets = Max((buildstate->termCount + termsPerBucket - 1) / termsPerBucket, SPARSEINV_MIN_BUCKETS);
+	BlockNumber directoryPage = InvalidBlockNumber;
+	SparseinvBuildTerm *sorted;
+	int			pos = 0;
+
+	/* Bucket pages must be contiguous */
+	for (uint32 i = 0; i < buckets; i++)
+	{
+		Buffer		buf = SparseinvNewBuffer(index, forkNum);
+
+		SparseinvInitPage(buf, BufferGetPage(buf), SPARSEINV_DIRECTORY);
+
+		if (i == 0)
+			directoryPage = BufferGetBlockNumber(buf);
+		else if (BufferGetBlockNumber(buf) != directoryPage + i)
+			elog(ERROR, "sparseinv directory pages are not contiguous");
+
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	sorted = (SparseinvBuildTerm *) palloc_huge(CurrentMemoryContext, sizeof(SparseinvBuildTerm) * Max(buildstate->termCount, 1));
+	for (int i = 0; i < buildstate->termCount; i++)
+	{
+		sorted[i].bucket = murmurhash32((uint32) buildstate->terms[i].dim) % buckets;
+		sorted[i].term = buildstate->terms[i];
+	}
+	qsort(sorted, buildstate->termCount, sizeof(SparseinvBuildTerm), CompareBuildTerms);
+
+	for (uint32 bucket = 0; bucket < buckets; bucket++)
+	{
+		Buffer		buf = ReadBufferExtended(index, forkNum, directoryPage + bucket, RBM_NORMAL, NULL);
+		Page		page;
+		int			count = 0;
+
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+
+		for (; pos < buildstate->termCount && sorted[pos].bucket == bucket; pos++)
+		{
+			/* Overflow pages do not need to be contiguous */
+			if (count == (int) SPARSEINV_TERMS_PER_PAGE)
+			{
+				buf = AppendPage(index, buf, SPARSEINV_DIRECTORY, forkNum);
+				page = BufferGetPage(buf);
+				count = 0;
+			}
+
+			SparseinvPageGetTerms(page)[count] = sorted[pos].term;
+			SparseinvPageSetCount(page, SparseinvTermData, ++count);
+		}
+
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	pfree(sorted);
+
+	CreateMetaPage(index, buckets, directoryPage, forkNum);
+}
+
+/*
+ * Initialize the build state
+ */
+static void
+InitBuildState(SparseinvBuildState * buildstate, Relation heap, Relation index, IndexInfo *indexInfo, ForkNumber forkNum)
+{
+	AttrNumber	attNums[] = {1, 2};
+	Oid			sortOperators[] = {INT4LTOID, TIDLessOperator};
+	Oid			sortCollations[] = {InvalidOid, InvalidOid};
+	bool		nullsFirstFlags[] = {false, false};
+
+	buildstate->heap = heap;
+	buildstate->index = index;
+	buildstate->indexInfo = indexInfo;
+	buildstate->forkNum = forkNum;
+
+	buildstate->reltuples = 0;
+	buildstate->indtuples = 0;
+
+	/* Dimension, heap tid and weight */
+	buildstate->tupdesc = CreateTemplateTupleDesc(3, false);
+	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 1, "dim", INT4OID, -1, 0);
+	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
+	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 3, "weight", FLOAT4OID, -1, 0);
+
+	buildstate->slot = MakeSingleTupleTableSlot(buildstate->tupdesc);
+	buildstate->sortstate = tuplesort_begin_heap(buildstate->tupdesc, 2, attNums, sortOperators, sortCollations, nullsFirstFlags,
+												 u_sess->attr.attr_memory.maintenance_work_mem, false, 0, 0, 1, NULL);
+
+	buildstate->maxTerms = 1024;
+	buildstate->termCount = 0;
+	buildstate->terms = (SparseinvTermData *) palloc(sizeof(SparseinvTermData) * buildstate->maxTerms);
+
+	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+											   "Sparseinv build temporary context",
+											   ALLOCSET_DEFAULT_SIZES);
+}
+
+/*
+ * Free resources
+ */
+static void
+FreeBuildState(SparseinvBuildState * buildstate)
+{
+	tuplesort_end(buildstate->sortstate);
+	ExecDropSingleTupleTableSlot(buildstate->slot);
+	pfree(buildstate->terms);
+	MemoryContextDelete(buildstate->tmpCtx);
+}
+
+/*
+ * Build the index
+ */
+static void
+BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
+		   SparseinvBuildState * buildstate, ForkNumber forkNum)
+{
+	Buffer		buf;
+
+	InitBuildState(buildstate, heap, index, indexInfo, forkNum);
+
+	/* Reserve the meta page */
+	buf = SparseinvNewBuffer(index, forkNum);
+	if (BufferGetBlockNumber(buf) != SPARSEINV_METAPAGE_BLKNO)
+		elog(ERROR, "sparseinv meta page is not the first page");
+	SparseinvInitPage(buf, BufferGetPage(buf), 0);
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	/* Sort postings */
+	if (heap != NULL)
+		buildstate->reltuples = IndexBuildHeapScan(heap, index, indexInfo,
+												   true, BuildCallback, (void *) buildstate, NULL);
+
+	tuplesort_performsort(buildstate->sortstate);
+
+	/* Write pages */
+	CreatePostingPages(buildstate);
+	CreateDirectoryPages(buildstate);
+
+	if (RelationNeedsWAL(index) || forkNum == INIT_FORKNUM)
+		log_newpage_range(index, forkNum, 0, RelationGetNumberOfBlocksInFork(index, forkNum), true);
+
+	FreeBuildState(buildstate);
+}
+
+/*
+ * Build the index for a logged table
+ */
+IndexBuildResult *
+sparseinvbuild_internal(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	IndexBuildResult *result;
+	SparseinvBuildState buildstate;
+
+	BuildIndex(heap, index, indexInfo, &buildstate, MAIN_FORKNUM);
+
+	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+	result->heap_tuples = buildstate.reltuples;
+	result->index_tuples = buildstate.indtuples;
+
+	return result;
+}
+
+/*
+ * Build the index for an unlogged table
+ */
+void
+sparseinvbuildempty_internal(Relation index)
+{
+	IndexInfo  *indexInfo = BuildIndexInfo(index);
+	SparseinvBuildState buildstate;
+
+	BuildIndex(NULL, index, indexInfo, &buildstate, INIT_FORKNUM);
+}
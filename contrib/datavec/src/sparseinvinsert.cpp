@@ -0,0 +1,204 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "sparseinv.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Add a new page to the WAL record
+ */
+static Page
+AddPage(Relation index, GenericXLogState *state, uint16 flags, Buffer *buf)
+{
+	Page		page;
+
+	LockRelationForExtension(index, ExclusiveLock);
+	*buf = SparseinvNewBuffer(index, MAIN_FORKNUM);
+	UnlockRelationForExtension(index, ExclusiveLock);
+
+	page = GenericXLogRegisterBuffer(state, *buf, GENERIC_XLOG_FULL_IMAGE);
+	SparseinvInitPage(*buf, page, flags);
+	return page;
+}
+
+/*
+ * Add a posting to the pending list of a dimension
+ *
+ * The first page of the bucket is locked for the whole insert, which
+ * serializes changes to the directory entries of the bucket and their lists.
+ */
+static void
+InsertPosting(Relation index, const SparseinvMetaPageData * metap, int32 dim, float weight, ItemPointer heaptid)
+{
+	Buffer		bucketBuf;
+	Buffer		buf;
+	Buffer		newDirBuf = InvalidBuffer;
+	Buffer		tailBuf = InvalidBuffer;
+	Buffer		newBuf = InvalidBuffer;
+	Page		page;
+	Page		postingPage;
+	GenericXLogState *state;
+	SparseinvTerm term = NULL;
+	SparseinvPosting *posting;
+	int			count;
+
+	bucketBuf = ReadBuffer(index, SparseinvBucketPage(metap, dim));
+	LockBuffer(bucketBuf, BUFFER_LOCK_EXCLUSIVE);
+	buf = bucketBuf;
+
+	/* Find the directory page of the dimension or the last page of the bucket */
+	for (;;)
+	{
+		BlockNumber nextblkno;
+
+		page = BufferGetPage(buf);
+		count = SparseinvPageGetCount(page, SparseinvTermData);
+
+		for (int i = 0; i < count; i++)
+		{
+			if (SparseinvPageGetTerms(page)[i].dim == dim)
+			{
+				term = &SparseinvPageGetTerms(page)[i];
+				break;
+			}
+		}
+
+		nextblkno = SparseinvPageGetOpaque(page)->nextblkno;
+		if (term != NULL || !BlockNumberIsValid(nextblkno))
+			break;
+
+		if (buf != bucketBuf)
+			UnlockReleaseBuffer(buf);
+
+		buf = ReadBuffer(index, nextblkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	}
+
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	if (term != NULL)
+		term = &SparseinvPageGetTerms(page)[term - SparseinvPageGetTerms(BufferGetPage(buf))];
+	else
+	{
+		/* Add a directory entry, extending the bucket if needed */
+		if (count == (int) SPARSEINV_TERMS_PER_PAGE)
+		{
+			Page		newDirPage = AddPage(index, state, SPARSEINV_DIRECTORY, &newDirBuf);
+
+			SparseinvPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newDirBuf);
+			page = newDirPage;
+			count = 0;
+		}
+
+		term = &SparseinvPageGetTerms(page)[count];
+		term->dim = dim;
+		term->count = 0;
+		term->maxWeight = 0;
+		term->minWeight = 0;
+		term->sortedPage = InvalidBlockNumber;
+		term->pendingPage = InvalidBlockNumber;
+		term->pendingTail = InvalidBlockNumber;
+		SparseinvPageSetCount(page, SparseinvTermData, count + 1);
+	}
+
+	/* Find space on the last pending page */
+	if (BlockNumberIsValid(term->pendingTail))
+	{
+		tailBuf = ReadBuffer(index, term->pendingTail);
+		LockBuffer(tailBuf, BUFFER_LOCK_EXCLUSIVE);
+		postingPage = GenericXLogRegisterBuffer(state, tailBuf, 0);
+
+		if (SparseinvPageGetCount(postingPage, SparseinvPosting) == (int) SPARSEINV_POSTINGS_PER_PAGE)
+		{
+			Page		tailPage = postingPage;
+
+			postingPage = AddPage(index, state, SPARSEINV_POSTING, &newBuf);
+			SparseinvPageGetOpaque(tailPage)->nextblkno = BufferGetBlockNumber(newBuf);
+			term->pendingTail = BufferGetBlockNumber(newBuf);
+		}
+	}
+	else
+	{
+		postingPage = AddPage(index, state, SPARSEINV_POSTING, &newBuf);
+		term->pendingPage = BufferGetBlockNumber(newBuf);
+		term->pendingTail = BufferGetBlockNumber(newBuf);
+	}
+
+	/* Add the posting */
+	count = SparseinvPageGetCount(postingPage, SparseinvPosting);
+	posting = &SparseinvPageGetPostings(postingPage)[count];
+	posting->heaptid = *heaptid;
+	posting->weight = weight;
+
+	if (count == 0 || weight > SparseinvPageGetOpaque(postingPage)->maxWeight)
+		SparseinvPageGetOpaque(postingPage)->maxWeight = weight;
+	if (count == 0 || weight < SparseinvPageGetOpaque(postingPage)->minWeight)
+		SparseinvPageGetOpaque(postingPage)->minWeight = weight;
+
+	SparseinvPageSetCount(postingPage, SparseinvPosting, count + 1);
+
+	/* Update the directory entry */
+	SparseinvUpdateWeights(term, weight);
+	term->count++;
+
+	/* Commit */
+	GenericXLogFinish(state);
+
+	if (BufferIsValid(newBuf))
+		UnlockReleaseBuffer(newBuf);
+	if (BufferIsValid(tailBuf))
+		UnlockReleaseBuffer(tailBuf);
+	if (BufferIsValid(newDirBuf))
+		UnlockReleaseBuffer(newDirBuf);
+	if (buf != bucketBuf)
+		UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(bucketBuf);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+void
+SparseinvInsertTupleOnDisk(Relation index, SparseVector * vec, ItemPointer heaptid)
+{
+	SparseinvMetaPageData metap;
+	float	   *weights = SPARSEVEC_VALUES(vec);
+
+	SparseinvGetMetaPageInfo(index, &metap);
+
+	for (int i = 0; i < vec->nnz; i++)
+		InsertPosting(index, &metap, vec->indices[i], weights[i], heaptid);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+bool
+sparseinvinsert_internal(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+						 Relation heap, IndexUniqueCheck checkUnique)
+{
+	MemoryContext oldCtx;
+	MemoryContext insertCtx;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return false;
+
+	/* Create memory context */
+	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Sparseinv insert temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(insertCtx);
+
+	/* Insert tuple */
+	SparseinvInsertTupleOnDisk(index, DatumGetSparseVector(values[0]), heap_tid);
+
+	/* Delete memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(insertCtx);
+
+	return false;
+}
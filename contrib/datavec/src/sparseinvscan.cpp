@@ -0,0 +1,555 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/relscan.h"
+#include "pgstat.h"
+#include "sparseinv.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Position in the posting lists of a query dimension
+ *
+ * The sorted list is read one page at a time so pages can be skipped, and
+ * the pending list is loaded and sorted up front.
+ */
+typedef struct SparseinvCursor
+{
+	float		qw;				/* query weight */
+	float		bound;			/* max contribution to a score */
+	BlockNumber nextblkno;
+	SparseinvPosting *page;
+	int			pageCount;
+	int			pagePos;
+	float		pageBound;		/* max contribution of postings on the page */
+	SparseinvPosting *pending;
+	int			pendingCount;
+	int			pendingPos;
+}			SparseinvCursor;
+
+/* Candidate in the top-k heap */
+typedef struct SparseinvCandidate
+{
+	ItemPointerData heaptid;
+	double		score;
+}			SparseinvCandidate;
+
+/*
+ * Get the max contribution of a query weight for a range of weights
+ */
+static inline float
+ContributionBound(float qw, float maxWeight, float minWeight)
+{
+	float		bound = qw > 0 ? qw * maxWeight : qw * minWeight;
+
+	return Max(bound, 0);
+}
+
+/*
+ * Load the next non-empty page of the sorted list
+ */
+static void
+LoadPage(Relation index, SparseinvCursor * c, BufferAccessStrategy bas)
+{
+	c->pageCount = 0;
+	c->pagePos = 0;
+
+	while (BlockNumberIsValid(c->nextblkno))
+	{
+		Buffer		buf;
+		Page		page;
+		SparseinvPageOpaque opaque;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, c->nextblkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		opaque = SparseinvPageGetOpaque(page);
+
+		c->pageCount = SparseinvPageGetCount(page, SparseinvPosting);
+		memcpy(c->page, SparseinvPageGetPostings(page), sizeof(SparseinvPosting) * c->pageCount);
+		c->pageBound = ContributionBound(c->qw, opaque->maxWeight, opaque->minWeight);
+		c->nextblkno = opaque->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+
+		if (c->pageCount > 0)
+			break;
+	}
+}
+
+/*
+ * Get the posting with the lowest heap tid
+ */
+static inline SparseinvPosting *
+CursorCurrent(SparseinvCursor * c)
+{
+	SparseinvPosting *a = c->pagePos < c->pageCount ? &c->page[c->pagePos] : NULL;
+	SparseinvPosting *b = c->pendingPos < c->pendingCount ? &c->pending[c->pendingPos] : NULL;
+
+	if (a == NULL)
+		return b;
+
+	if (b == NULL)
+		return a;
+
+	return ItemPointerCompare(&a->heaptid, &b->heaptid) <= 0 ? a : b;
+}
+
+/*
+ * Move past the current posting
+ */
+static void
+CursorAdvance(Relation index, SparseinvCursor * c, BufferAccessStrategy bas)
+{
+	SparseinvPosting *p = CursorCurrent(c);
+
+	if (p == NULL)
+		return;
+
+	if (p == &c->page[c->pagePos] && c->pagePos < c->pageCount)
+	{
+		if (++c->pagePos == c->pageCount)
+			LoadPage(index, c, bas);
+	}
+	else
+		c->pendingPos++;
+}
+
+/*
+ * Move to the first posting with a heap tid greater than or equal to tid
+ *
+ * Pages that end before tid are skipped.
+ */
+static void
+CursorSeek(Relation index, SparseinvCursor * c, ItemPointer tid, BufferAccessStrategy bas)
+{
+	int			lo;
+	int			hi;
+
+	while (c->pendingPos < c->pendingCount && ItemPointerCompare(&c->pending[c->pendingPos].heaptid, tid) < 0)
+		c->pendingPos++;
+
+	while (c->pagePos < c->pageCount && ItemPointerCompare(&c->page[c->pageCount - 1].heaptid, tid) < 0)
+	{
+		if (BlockNumberIsValid(c->nextblkno))
+			LoadPage(index, c, bas);
+		else
+			c->pagePos = c->pageCount;
+	}
+
+	/* Binary search within the page */
+	lo = c->pagePos;
+	hi = c->pageCount;
+	while (lo < hi)
+	{
+		int			mid = lo + (hi - lo) / 2;
+
+		if (ItemPointerCompare(&c->page[mid].heaptid, tid) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	c->pagePos = lo;
+}
+
+/*
+ * Get the max contribution of the current position of a cursor
+ */
+static inline float
+CursorBound(SparseinvCursor * c)
+{
+	if (c->pendingPos < c->pendingCount)
+		return c->bound;
+
+	if (c->pagePos < c->pageCount)
+		return c->pageBound;
+
+	return 0;
+}
+
+/*
+ * Compare cursors by bound
+ */
+static int
+CompareCursors(const void *a, const void *b)
+{
+	float		ba = ((const SparseinvCursor *) a)->bound;
+	float		bb = ((const SparseinvCursor *) b)->bound;
+
+	if (ba < bb)
+		return -1;
+
+	if (ba > bb)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Restore the min-heap property from the root
+ */
+static void
+SiftDown(SparseinvCandidate * heap, int n)
+{
+	int			i = 0;
+
+	for (;;)
+	{
+		int			smallest = i;
+		int			l = 2 * i + 1;
+		int			r = 2 * i + 2;
+		SparseinvCandidate tmp;
+
+		if (l < n && heap[l].score < heap[smallest].score)
+			smallest = l;
+		if (r < n && heap[r].score < heap[smallest].score)
+			smallest = r;
+
+		if (smallest == i)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+/*
+ * Add a candidate to a min-heap that is not full
+ */
+static void
+SiftUp(SparseinvCandidate * heap, int n)
+{
+	int			i = n - 1;
+
+	while (i > 0)
+	{
+		int			parent = (i - 1) / 2;
+		SparseinvCandidate tmp;
+
+		if (heap[parent].score <= heap[i].score)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/*
+ * Compare candidates by score, highest first
+ */
+static int
+CompareCandidates(const void *a, const void *b)
+{
+	double		sa = ((const SparseinvCandidate *) a)->score;
+	double		sb = ((const SparseinvCandidate *) b)->score;
+
+	if (sa > sb)
+		return -1;
+
+	if (sa < sb)
+		return 1;
+
+	return ItemPointerCompare((ItemPointer) &((const SparseinvCandidate *) a)->heaptid,
+							  (ItemPointer) &((const SparseinvCandidate *) b)->heaptid);
+}
+
+/*
+ * Open a cursor for each query dimension in the index
+ */
+static int
+OpenCursors(Relation index, SparseVector * q, SparseinvCursor * cursors, BufferAccessStrategy bas)
+{
+	SparseinvMetaPageData metap;
+	float	   *qx = SPARSEVEC_VALUES(q);
+	int			n = 0;
+
+	SparseinvGetMetaPageInfo(index, &metap);
+
+	for (int i = 0; i < q->nnz; i++)
+	{
+		SparseinvTermData term;
+		SparseinvCursor *c;
+
+		if (qx[i] == 0 || !SparseinvFindTerm(index, &metap, q->indices[i], &term) || term.count == 0)
+			continue;
+
+		c = &cursors[n++];
+		c->qw = qx[i];
+		c->bound = ContributionBound(qx[i], term.maxWeight, term.minWeight);
+		c->nextblkno = term.sortedPage;
+		c->page = (SparseinvPosting *) palloc(sizeof(SparseinvPosting) * SPARSEINV_POSTINGS_PER_PAGE);
+		LoadPage(index, c, bas);
+
+		/* Inserts append in any order */
+		c->pending = SparseinvReadPostings(index, term.pendingPage, &c->pendingCount, bas);
+		c->pendingPos = 0;
+		qsort(c->pending, c->pendingCount, sizeof(SparseinvPosting), SparseinvComparePostings);
+	}
+
+	return n;
+}
+
+/*
+ * Find the rows with the highest inner product with MaxScore
+ *
+ * Cursors are ordered by the max contribution of their dimension. Once k
+ * candidates are found, the lowest score in the heap is a threshold, and the
+ * prefix of cursors whose bounds sum to at most the threshold cannot produce
+ * a result on their own. Only rows in the remaining essential lists are
+ * scored, and the non-essential lists are only searched while the score can
+ * still exceed the threshold, using the bound of the current page.
+ */
+static int
+GetScanResults(Relation index, SparseVector * q, int k, SparseinvCandidate * heap)
+{
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	SparseinvCursor *cursors = (SparseinvCursor *) palloc(sizeof(SparseinvCursor) * Max(q->nnz, 1));
+	double	   *prefix = (double *) palloc(sizeof(double) * Max(q->nnz, 1));
+	int			n = OpenCursors(index, q, cursors, bas);
+	int			count = 0;
+
+	qsort(cursors, n, sizeof(SparseinvCursor), CompareCursors);
+	for (int i = 0; i < n; i++)
+		prefix[i] = (i > 0 ? prefix[i - 1] : 0) + cursors[i].bound;
+
+	for (;;)
+	{
+		bool		full = count == k;
+		double		threshold = full ? heap[0].score : -DBL_MAX;
+		int			essential = 0;
+		ItemPointerData tid;
+		bool		found = false;
+		bool		pruned = false;
+		double		score = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Skip lists that cannot produce a result on their own */
+		if (full)
+		{
+			while (essential < n && prefix[essential] <= threshold)
+				essential++;
+		}
+
+		/* Get the next row from the essential lists */
+		for (int i = essential; i < n; i++)
+		{
+			SparseinvPosting *p = CursorCurrent(&cursors[i]);
+
+			if (p != NULL && (!found || ItemPointerCompare(&p->heaptid, &tid) < 0))
+			{
+				tid = p->heaptid;
+				found = true;
+			}
+		}
+
+		if (!found)
+			break;
+
+		for (int i = essential; i < n; i++)
+		{
+			SparseinvPosting *p = CursorCurrent(&cursors[i]);
+
+			if (p != NULL && ItemPointerEquals(&p->heaptid, &tid))
+			{
+				score += (double) cursors[i].qw * p->weight;
+				CursorAdvance(index, &cursors[i], bas);
+			}
+		}
+
+		/* Search the non-essential lists, highest bound first */
+		for (int i = essential - 1; i >= 0; i--)
+		{
+			double		rest = i > 0 ? prefix[i - 1] : 0;
+			SparseinvPosting *p;
+
+			if (score + prefix[i] <= threshold)
+			{
+				pruned = true;
+				break;
+			}
+
+			CursorSeek(index, &cursors[i], &tid, bas);
+
+			if (score + CursorBound(&cursors[i]) + rest <= threshold)
+			{
+				pruned = true;
+				break;
+			}
+
+			p = CursorCurrent(&cursors[i]);
+			if (p != NULL && ItemPointerEquals(&p->heaptid, &tid))
+				score += (double) cursors[i].qw * p->weight;
+		}
+
+		if (pruned)
+			continue;
+
+		if (!full)
+		{
+			heap[count].heaptid = tid;
+			heap[count].score = score;
+			SiftUp(heap, ++count);
+		}
+		else if (score > threshold)
+		{
+			heap[0].heaptid = tid;
+			heap[0].score = score;
+			SiftDown(heap, count);
+		}
+	}
+
+	FreeAccessStrategy(bas);
+
+	qsort(heap, count, sizeof(SparseinvCandidate), CompareCandidates);
+	return count;
+}
+
+/*
+ * Get scan results
+ */
+static void
+GetScanItems(IndexScanDesc scan)
+{
+	SparseinvScanOpaque so = (SparseinvScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	SparseVector *q;
+	SparseinvCandidate *heap;
+	int			count;
+
+	so->resultCount = 0;
+	so->resultPos = 0;
+
+	/* No results for null queries */
+	if (scan->orderByData->sk_flags & SK_ISNULL)
+		return;
+
+	q = DatumGetSparseVector(scan->orderByData->sk_argument);
+	heap = (SparseinvCandidate *) palloc(sizeof(SparseinvCandidate) * sparseinv_top_k);
+
+	/* Prevent vacuum from freeing pages of lists being read */
+	LockPage(index, SPARSEINV_SCAN_LOCK, ShareLock);
+	count = GetScanResults(index, q, sparseinv_top_k, heap);
+	UnlockPage(index, SPARSEINV_SCAN_LOCK, ShareLock);
+
+	so->results = (SparseinvResult *) palloc(sizeof(SparseinvResult) * Max(count, 1));
+	for (int i = 0; i < count; i++)
+	{
+		so->results[i].heaptid = heap[i].heaptid;
+		so->results[i].distance = (float) -heap[i].score;
+	}
+	so->resultCount = count;
+}
+
+/*
+ * Prepare for an index scan
+ */
+IndexScanDesc
+sparseinvbeginscan_internal(Relation index, int nkeys, int norderbys)
+{
+	IndexScanDesc scan;
+	SparseinvScanOpaque so;
+
+	scan = RelationGetIndexScan(index, nkeys, norderbys);
+
+	so = (SparseinvScanOpaque) palloc(sizeof(SparseinvScanOpaqueData));
+	so->first = true;
+	so->results = NULL;
+	so->resultCount = 0;
+	so->resultPos = 0;
+	so->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+									   "Sparseinv scan temporary context",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	scan->opaque = so;
+
+	return scan;
+}
+
+/*
+ * Start or restart an index scan
+ */
+void
+sparseinvrescan_internal(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+	SparseinvScanOpaque so = (SparseinvScanOpaque) scan->opaque;
+
+	so->first = true;
+	so->results = NULL;
+	so->resultCount = 0;
+	so->resultPos = 0;
+	MemoryContextReset(so->tmpCtx);
+
+	if (keys && scan->numberOfKeys > 0)
+		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+}
+
+/*
+ * Fetch the next tuple in the given scan
+ */
+bool
+sparseinvgettuple_internal(IndexScanDesc scan, ScanDirection dir)
+{
+	SparseinvScanOpaque so = (SparseinvScanOpaque) scan->opaque;
+	MemoryContext oldCtx = MemoryContextSwitchTo(so->tmpCtx);
+
+	/*
+	 * Index can be used to scan backward, but Postgres doesn't support
+	 * backward scan on operators
+	 */
+	Assert(ScanDirectionIsForward(dir));
+
+	if (so->first)
+	{
+		/* Count index scan for stats */
+		pgstat_count_index_scan(scan->indexRelation);
+
+		/* Safety check */
+		if (scan->orderByData == NULL)
+			elog(ERROR, "cannot scan sparseinv index without order");
+
+		/* Requires MVCC-compliant snapshot as not able to maintain a pin */
+		/* https://www.postgresql.org/docs/current/index-locking.html */
+		if (!IsMVCCSnapshot(scan->xs_snapshot))
+			elog(ERROR, "non-MVCC snapshots are not supported with sparseinv");
+
+		GetScanItems(scan);
+		so->first = false;
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+
+	if (so->resultPos < so->resultCount)
+	{
+		scan->xs_ctup.t_self = so->results[so->resultPos++].heaptid;
+		scan->xs_recheck = false;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * End a scan and release resources
+ */
+void
+sparseinvendscan_internal(IndexScanDesc scan)
+{
+	SparseinvScanOpaque so = (SparseinvScanOpaque) scan->opaque;
+
+	MemoryContextDelete(so->tmpCtx);
+
+	pfree(so);
+	scan->opaque = NULL;
+}
@@ -0,0 +1,200 @@
+#include "postgres.h"
+
+#include "sparseinv.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/indexfsm.h"
+#include "storage/lmgr.h"
+#include "utils/hashutils.h"
+#include "utils/rel.h"
+
+/*
+ * New buffer
+ *
+ * Pages freed by vacuum are reused before the relation is extended. The
+ * caller must hold the relation extension lock when extending is possible.
+ */
+Buffer
+SparseinvNewBuffer(Relation index, ForkNumber forkNum)
+{
+	Buffer		buf;
+
+	if (forkNum == MAIN_FORKNUM)
+	{
+		for (;;)
+		{
+			BlockNumber blkno = GetFreeIndexPage(index);
+			Page		page;
+
+			if (!BlockNumberIsValid(blkno))
+				break;
+
+			buf = ReadBuffer(index, blkno);
+
+			/* Skip pages another backend is using */
+			if (ConditionalLockBuffer(buf))
+			{
+				page = BufferGetPage(buf);
+				if (PageIsNew(page) || (SparseinvPageGetOpaque(page)->flags & SPARSEINV_DELETED))
+					return buf;
+
+				LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+			}
+
+			ReleaseBuffer(buf);
+		}
+	}
+
+	buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	return buf;
+}
+
+/*
+ * Init page
+ */
+void
+SparseinvInitPage(Buffer buf, Page page, uint16 flags)
+{
+	PageInit(page, BufferGetPageSize(buf), sizeof(SparseinvPageOpaqueData));
+	SparseinvPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+	SparseinvPageGetOpaque(page)->maxWeight = 0;
+	SparseinvPageGetOpaque(page)->minWeight = 0;
+	SparseinvPageGetOpaque(page)->flags = flags;
+	SparseinvPageGetOpaque(page)->page_id = SPARSEINV_PAGE_ID;
+}
+
+/*
+ * Get a copy of the metapage
+ */
+void
+SparseinvGetMetaPageInfo(Relation index, SparseinvMetaPage metap)
+{
+	Buffer		buf;
+	Page		page;
+
+	buf = ReadBuffer(index, SPARSEINV_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	memcpy(metap, SparseinvPageGetMeta(page), sizeof(SparseinvMetaPageData));
+	UnlockReleaseBuffer(buf);
+
+	if (unlikely(metap->magicNumber != SPARSEINV_MAGIC_NUMBER))
+		elog(ERROR, "sparseinv index is not valid");
+}
+
+/*
+ * Get the first directory page of the bucket for a dimension
+ */
+BlockNumber
+SparseinvBucketPage(const SparseinvMetaPageData * metap, int32 dim)
+{
+	return metap->directoryPage + murmurhash32((uint32) dim) % metap->buckets;
+}
+
+/*
+ * Find the directory entry for a dimension
+ */
+bool
+SparseinvFindTerm(Relation index, const SparseinvMetaPageData * metap, int32 dim, SparseinvTerm term)
+{
+	BlockNumber blkno = SparseinvBucketPage(metap, dim);
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf = ReadBuffer(index, blkno);
+		Page		page;
+		SparseinvTermData *terms;
+		int			count;
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		terms = SparseinvPageGetTerms(page);
+		count = SparseinvPageGetCount(page, SparseinvTermData);
+
+		for (int i = 0; i < count; i++)
+		{
+			if (terms[i].dim == dim)
+			{
+				memcpy(term, &terms[i], sizeof(SparseinvTermData));
+				UnlockReleaseBuffer(buf);
+				return true;
+			}
+		}
+
+		blkno = SparseinvPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	return false;
+}
+
+/*
+ * Include a weight in the bounds of a term
+ */
+void
+SparseinvUpdateWeights(SparseinvTerm term, float weight)
+{
+	if (term->count == 0)
+	{
+		term->maxWeight = weight;
+		term->minWeight = weight;
+	}
+	else
+	{
+		if (weight > term->maxWeight)
+			term->maxWeight = weight;
+		if (weight < term->minWeight)
+			term->minWeight = weight;
+	}
+}
+
+/*
+ * Compare postings by heap tid
+ */
+int
+SparseinvComparePostings(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) &((const SparseinvPosting *) a)->heaptid,
+							  (ItemPointer) &((const SparseinvPosting *) b)->heaptid);
+}
+
+/*
+ * Read all postings of a page chain
+ */
+SparseinvPosting *
+SparseinvReadPostings(Relation index, BlockNumber blkno, int *count, BufferAccessStrategy bas)
+{
+	int			capacity = SPARSEINV_POSTINGS_PER_PAGE;
+	SparseinvPosting *postings = (SparseinvPosting *) palloc(sizeof(SparseinvPosting) * capacity);
+	int			n = 0;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		int			pageCount;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		pageCount = SparseinvPageGetCount(page, SparseinvPosting);
+
+		if (n + pageCount > capacity)
+		{
+			capacity = Max(capacity * 2, n + pageCount);
+			postings = (SparseinvPosting *) repalloc_huge(postings, sizeof(SparseinvPosting) * capacity);
+		}
+
+		memcpy(postings + n, SparseinvPageGetPostings(page), sizeof(SparseinvPosting) * pageCount);
+		n += pageCount;
+
+		blkno = SparseinvPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	*count = n;
+	return postings;
+}
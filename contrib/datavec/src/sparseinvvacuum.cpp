@@ -0,0 +1,404 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "commands/vacuum.h"
+#include "sparseinv.h"
+#include "storage/buf/bufmgr.h"
+#include "storage/indexfsm.h"
+#include "storage/lmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Read the postings of a list, remembering its pages
+ */
+static SparseinvPosting *
+ReadList(SparseinvVacuumState * vacuumstate, BlockNumber blkno, int *count)
+{
+	Relation	index = vacuumstate->index;
+	int			capacity = SPARSEINV_POSTINGS_PER_PAGE;
+	SparseinvPosting *postings = (SparseinvPosting *) palloc(sizeof(SparseinvPosting) * capacity);
+	int			n = 0;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		int			pageCount;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		pageCount = SparseinvPageGetCount(page, SparseinvPosting);
+
+		if (n + pageCount > capacity)
+		{
+			capacity = Max(capacity * 2, n + pageCount);
+			postings = (SparseinvPosting *) repalloc_huge(postings, sizeof(SparseinvPosting) * capacity);
+		}
+
+		memcpy(postings + n, SparseinvPageGetPostings(page), sizeof(SparseinvPosting) * pageCount);
+		n += pageCount;
+
+		/* Free after scans using the list finish */
+		if (vacuumstate->freeCount == vacuumstate->maxFree)
+		{
+			vacuumstate->maxFree *= 2;
+			vacuumstate->freePages = (BlockNumber *) repalloc_huge(vacuumstate->freePages, sizeof(BlockNumber) * vacuumstate->maxFree);
+		}
+		vacuumstate->freePages[vacuumstate->freeCount++] = blkno;
+
+		blkno = SparseinvPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	*count = n;
+	return postings;
+}
+
+/*
+ * Remove postings of deleted heap tids
+ */
+static int
+RemoveDeleted(SparseinvVacuumState * vacuumstate, SparseinvPosting * postings, int count)
+{
+	int			n = 0;
+
+	if (vacuumstate->callback == NULL)
+		return count;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (vacuumstate->callback(&postings[i].heaptid, vacuumstate->callback_state, InvalidOid, InvalidBktId))
+			vacuumstate->stats->tuples_removed++;
+		else
+			postings[n++] = postings[i];
+	}
+
+	return n;
+}
+
+/*
+ * Write a sorted list
+ *
+ * Pages are written from last to first so each page is complete when it is
+ * logged. Returns the first page.
+ */
+static BlockNumber
+WriteList(Relation index, SparseinvPosting * postings, int count)
+{
+	BlockNumber nextblkno = InvalidBlockNumber;
+	int			perPage = SPARSEINV_POSTINGS_PER_PAGE;
+	int			pages = (count + perPage - 1) / perPage;
+
+	for (int p = pages - 1; p >= 0; p--)
+	{
+		int			start = p * perPage;
+		int			pageCount = Min(count - start, perPage);
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		SparseinvPageOpaque opaque;
+
+		LockRelationForExtension(index, ExclusiveLock);
+		buf = SparseinvNewBuffer(index, MAIN_FORKNUM);
+		UnlockRelationForExtension(index, ExclusiveLock);
+
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+		SparseinvInitPage(buf, page, SPARSEINV_POSTING);
+		opaque = SparseinvPageGetOpaque(page);
+
+		memcpy(SparseinvPageGetPostings(page), postings + start, sizeof(SparseinvPosting) * pageCount);
+		SparseinvPageSetCount(page, SparseinvPosting, pageCount);
+
+		opaque->maxWeight = postings[start].weight;
+		opaque->minWeight = postings[start].weight;
+		for (int i = start + 1; i < start + pageCount; i++)
+		{
+			if (postings[i].weight > opaque->maxWeight)
+				opaque->maxWeight = postings[i].weight;
+			if (postings[i].weight < opaque->minWeight)
+				opaque->minWeight = postings[i].weight;
+		}
+		opaque->nextblkno = nextblkno;
+
+		GenericXLogFinish(state);
+
+		nextblkno = BufferGetBlockNumber(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	return nextblkno;
+}
+
+/*
+ * Merge two sorted lists
+ */
+static SparseinvPosting *
+MergeLists(SparseinvPosting * a, int na, SparseinvPosting * b, int nb)
+{
+	SparseinvPosting *merged = (SparseinvPosting *) palloc_huge(CurrentMemoryContext, sizeof(SparseinvPosting) * Max(na + nb, 1));
+	int			i = 0;
+	int			j = 0;
+	int			n = 0;
+
+	while (i < na || j < nb)
+	{
+		if (j == nb || (i < na && ItemPointerCompare(&a[i].heaptid, &b[j].heaptid) <= 0))
+			merged[n++] = a[i++];
+		else
+			merged[n++] = b[j++];
+	}
+
+	return merged;
+}
+
+/*
+ * Rewrite the lists of a directory entry if it has deleted or pending postings
+ *
+ * Returns true if the entry was updated
+ */
+static bool
+VacuumTerm(SparseinvVacuumState * vacuumstate, SparseinvTerm term)
+{
+	Relation	index = vacuumstate->index;
+	SparseinvPosting *sorted;
+	SparseinvPosting *pending;
+	SparseinvPosting *merged;
+	int			sortedCount;
+	int			pendingCount;
+	int			freeStart = vacuumstate->freeCount;
+	int			liveSorted;
+	int			livePending;
+	int			count;
+
+	sorted = ReadList(vacuumstate, term->sortedPage, &sortedCount);
+	pending = ReadList(vacuumstate, term->pendingPage, &pendingCount);
+
+	liveSorted = RemoveDeleted(vacuumstate, sorted, sortedCount);
+	livePending = RemoveDeleted(vacuumstate, pending, pendingCount);
+
+	/* Nothing to do */
+	if (liveSorted == sortedCount && pendingCount == 0)
+	{
+		vacuumstate->freeCount = freeStart;
+		vacuumstate->stats->num_index_tuples += sortedCount;
+		return false;
+	}
+
+	qsort(pending, livePending, sizeof(SparseinvPosting), SparseinvComparePostings);
+	merged = MergeLists(sorted, liveSorted, pending, livePending);
+	count = liveSorted + livePending;
+
+	term->sortedPage = WriteList(index, merged, count);
+	term->pendingPage = InvalidBlockNumber;
+	term->pendingTail = InvalidBlockNumber;
+	term->count = 0;
+	term->maxWeight = 0;
+	term->minWeight = 0;
+	for (int i = 0; i < count; i++)
+	{
+		SparseinvUpdateWeights(term, merged[i].weight);
+		term->count++;
+	}
+
+	vacuumstate->stats->num_index_tuples += count;
+	return true;
+}
+
+/*
+ * Rewrite the lists of a bucket
+ *
+ * The first page of the bucket stays locked so inserts cannot add postings
+ * to lists being rewritten. Scans only hold buffer locks on one page at a
+ * time, so they wait for the bucket without holding up the rewrite.
+ */
+static void
+VacuumBucket(SparseinvVacuumState * vacuumstate, BlockNumber bucketPage)
+{
+	Relation	index = vacuumstate->index;
+	Buffer		bucketBuf;
+	Buffer		buf;
+	BlockNumber nextblkno;
+
+	bucketBuf = ReadBufferExtended(index, MAIN_FORKNUM, bucketPage, RBM_NORMAL, vacuumstate->bas);
+	LockBuffer(bucketBuf, BUFFER_LOCK_EXCLUSIVE);
+	buf = bucketBuf;
+
+	for (;;)
+	{
+		Page		page = BufferGetPage(buf);
+		int			count = SparseinvPageGetCount(page, SparseinvTermData);
+
+		for (int i = 0; i < count; i++)
+		{
+			SparseinvTermData term;
+			MemoryContext oldCtx;
+			bool		updated;
+
+			memcpy(&term, &SparseinvPageGetTerms(page)[i], sizeof(SparseinvTermData));
+
+			oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
+			updated = VacuumTerm(vacuumstate, &term);
+			MemoryContextSwitchTo(oldCtx);
+			MemoryContextReset(vacuumstate->tmpCtx);
+
+			if (updated)
+			{
+				GenericXLogState *state = GenericXLogStart(index);
+
+				page = GenericXLogRegisterBuffer(state, buf, 0);
+				memcpy(&SparseinvPageGetTerms(page)[i], &term, sizeof(SparseinvTermData));
+				GenericXLogFinish(state);
+
+				page = BufferGetPage(buf);
+			}
+		}
+
+		nextblkno = SparseinvPageGetOpaque(page)->nextblkno;
+		if (buf != bucketBuf)
+			UnlockReleaseBuffer(buf);
+
+		if (!BlockNumberIsValid(nextblkno))
+			break;
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, nextblkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	}
+
+	UnlockReleaseBuffer(bucketBuf);
+}
+
+/*
+ * Free the pages of replaced lists
+ */
+static void
+FreePages(SparseinvVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+
+	if (vacuumstate->freeCount == 0)
+		return;
+
+	/* Wait for scans that may still read the replaced lists */
+	LockPage(index, SPARSEINV_SCAN_LOCK, ExclusiveLock);
+	UnlockPage(index, SPARSEINV_SCAN_LOCK, ExclusiveLock);
+
+	for (int i = 0; i < vacuumstate->freeCount; i++)
+	{
+		BlockNumber blkno = vacuumstate->freePages[i];
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+		SparseinvPageGetOpaque(page)->flags = SPARSEINV_DELETED;
+		SparseinvPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+		SparseinvPageSetCount(page, SparseinvPosting, 0);
+		GenericXLogFinish(state);
+		UnlockReleaseBuffer(buf);
+
+		RecordFreeIndexPage(index, blkno);
+	}
+
+	vacuumstate->stats->pages_deleted += vacuumstate->freeCount;
+	vacuumstate->freeCount = 0;
+}
+
+/*
+ * Initialize the vacuum state
+ */
+static void
+InitVacuumState(SparseinvVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
+{
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	vacuumstate->index = info->index;
+	vacuumstate->stats = stats;
+	vacuumstate->callback = callback;
+	vacuumstate->callback_state = callback_state;
+	vacuumstate->bas = GetAccessStrategy(BAS_BULKREAD);
+	vacuumstate->maxFree = 1024;
+	vacuumstate->freeCount = 0;
+	vacuumstate->freePages = (BlockNumber *) palloc(sizeof(BlockNumber) * vacuumstate->maxFree);
+	vacuumstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												"Sparseinv vacuum temporary context",
+												ALLOCSET_DEFAULT_SIZES);
+
+	SparseinvGetMetaPageInfo(vacuumstate->index, &vacuumstate->metap);
+}
+
+/*
+ * Free resources
+ */
+static void
+FreeVacuumState(SparseinvVacuumState * vacuumstate)
+{
+	pfree(vacuumstate->freePages);
+	FreeAccessStrategy(vacuumstate->bas);
+	MemoryContextDelete(vacuumstate->tmpCtx);
+}
+
+/*
+ * Remove deleted postings and merge pending lists into sorted lists
+ */
+static IndexBulkDeleteResult *
+VacuumIndex(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+			IndexBulkDeleteCallback callback, void *callback_state)
+{
+	SparseinvVacuumState vacuumstate;
+
+	InitVacuumState(&vacuumstate, info, stats, callback, callback_state);
+
+	/* Postings are counted again */
+	vacuumstate.stats->num_index_tuples = 0;
+
+	for (uint32 i = 0; i < vacuumstate.metap.buckets; i++)
+		VacuumBucket(&vacuumstate, vacuumstate.metap.directoryPage + i);
+
+	FreePages(&vacuumstate);
+
+	FreeVacuumState(&vacuumstate);
+
+	return vacuumstate.stats;
+}
+
+/*
+ * Bulk delete tuples from the index
+ */
+IndexBulkDeleteResult *
+sparseinvbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+							 IndexBulkDeleteCallback callback, void *callback_state)
+{
+	return VacuumIndex(info, stats, callback, callback_state);
+}
+
+/*
+ * Clean up after a VACUUM operation
+ */
+IndexBulkDeleteResult *
+sparseinvvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	Relation	rel = info->index;
+
+	if (info->analyze_only)
+		return stats;
+
+	/* Merge pending lists if ambulkdelete not called */
+	if (stats == NULL)
+		stats = VacuumIndex(info, NULL, NULL, NULL);
+
+	IndexFreeSpaceMapVacuum(rel);
+
+	stats->num_pages = RelationGetNumberOfBlocks(rel);
+
+	return stats;
+}
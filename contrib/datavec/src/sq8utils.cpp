@@ -0,0 +1,361 @@
+#include "postgres.h"
+
+#include "halfvec.h"			/* for USE_DISPATCH */
+#include "sq8utils.h"
+
+#if defined(USE_DISPATCH)
+#define SQ8_DISPATCH
+#endif
+
+#ifdef SQ8_DISPATCH
+#include <immintrin.h>
+
+#if defined(USE__GET_CPUID)
+#include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512_VNNI
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512bw,avx512vnni")))
+#endif
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define SQ8_NEON
+
+/* Dot product instructions are optional before Armv8.4 */
+#if defined(__linux__) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 10
+#include <sys/auxv.h>
+#define SQ8_NEON_DOTPROD_DISPATCH
+#define TARGET_NEON_DOTPROD __attribute__((target("+dotprod")))
+
+#ifndef HWCAP_ASIMDDP
+#define HWCAP_ASIMDDP (1 << 20)
+#endif
+#endif
+#endif
+
+uint32		(*Sq8L2SquaredDistance) (int dim, const uint8 *ax, const uint8 *bx);
+uint32		(*Sq8InnerProduct) (int dim, const uint8 *ax, const uint8 *bx);
+
+static uint32
+Sq8L2SquaredDistanceDefault(int dim, const uint8 *ax, const uint8 *bx)
+{
+	uint32		distance = 0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		int			diff = (int) ax[i] - (int) bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+static uint32
+Sq8InnerProductDefault(int dim, const uint8 *ax, const uint8 *bx)
+{
+	uint32		distance = 0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += (uint32) ax[i] * (uint32) bx[i];
+
+	return distance;
+}
+
+#ifdef SQ8_DISPATCH
+/*
+ * Codes are widened to 16 bits, so products of pairs fit in 32 bits
+ */
+TARGET_AVX2 static uint32
+Sq8L2SquaredDistanceAvx2(int dim, const uint8 *ax, const uint8 *bx)
+{
+	uint32		distance;
+	int			i;
+	int32		s[8];
+	int			count = (dim / 32) * 32;
+	__m256i		dist0 = _mm256_setzero_si256();
+	__m256i		dist1 = _mm256_setzero_si256();
+
+	for (i = 0; i < count; i += 32)
+	{
+		__m256i		a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (ax + i)));
+		__m256i		b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (bx + i)));
+		__m256i		a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (ax + i + 16)));
+		__m256i		b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (bx + i + 16)));
+		__m256i		d0 = _mm256_sub_epi16(a0, b0);
+		__m256i		d1 = _mm256_sub_epi16(a1, b1);
+
+		dist0 = _mm256_add_epi32(dist0, _mm256_madd_epi16(d0, d0));
+		dist1 = _mm256_add_epi32(dist1, _mm256_madd_epi16(d1, d1));
+	}
+
+	_mm256_storeu_si256((__m256i *) s, _mm256_add_epi32(dist0, dist1));
+
+	distance = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	return distance + Sq8L2SquaredDistanceDefault(dim - i, ax + i, bx + i);
+}
+
+TARGET_AVX2 static uint32
+Sq8InnerProductAvx2(int dim, const uint8 *ax, const uint8 *bx)
+{
+	uint32		distance;
+	int			i;
+	int32		s[8];
+	int			count = (dim / 32) * 32;
+	__m256i		dist0 = _mm256_setzero_si256();
+	__m256i		dist1 = _mm256_setzero_si256();
+
+	for (i = 0; i < count; i += 32)
+	{
+		__m256i		a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (ax + i)));
+		__m256i		b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (bx + i)));
+		__m256i		a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (ax + i + 16)));
+		__m256i		b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (bx + i + 16)));
+
+		dist0 = _mm256_add_epi32(dist0, _mm256_madd_epi16(a0, b0));
+		dist1 = _mm256_add_epi32(dist1, _mm256_madd_epi16(a1, b1));
+	}
+
+	_mm256_storeu_si256((__m256i *) s, _mm256_add_epi32(dist0, dist1));
+
+	distance = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	return distance + Sq8InnerProductDefault(dim - i, ax + i, bx + i);
+}
+
+TARGET_AVX512_VNNI static uint32
+Sq8L2SquaredDistanceAvx512Vnni(int dim, const uint8 *ax, const uint8 *bx)
+{
+	int			i;
+	int			count = (dim / 64) * 64;
+	__m512i		dist0 = _mm512_setzero_si512();
+	__m512i		dist1 = _mm512_setzero_si512();
+
+	for (i = 0; i < count; i += 64)
+	{
+		__m512i		a0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (ax + i)));
+		__m512i		b0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (bx + i)));
+		__m512i		a1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (ax + i + 32)));
+		__m512i		b1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (bx + i + 32)));
+		__m512i		d0 = _mm512_sub_epi16(a0, b0);
+		__m512i		d1 = _mm512_sub_epi16(a1, b1);
+
+		dist0 = _mm512_dpwssd_epi32(dist0, d0, d0);
+		dist1 = _mm512_dpwssd_epi32(dist1, d1, d1);
+	}
+
+	return (uint32) _mm512_reduce_add_epi32(_mm512_add_epi32(dist0, dist1)) +
+		Sq8L2SquaredDistanceDefault(dim - i, ax + i, bx + i);
+}
+
+TARGET_AVX512_VNNI static uint32
+Sq8InnerProductAvx512Vnni(int dim, const uint8 *ax, const uint8 *bx)
+{
+	int			i;
+	int			count = (dim / 64) * 64;
+	__m512i		dist0 = _mm512_setzero_si512();
+	__m512i		dist1 = _mm512_setzero_si512();
+
+	for (i = 0; i < count; i += 64)
+	{
+		__m512i		a0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (ax + i)));
+		__m512i		b0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (bx + i)));
+		__m512i		a1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (ax + i + 32)));
+		__m512i		b1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (bx + i + 32)));
+
+		dist0 = _mm512_dpwssd_epi32(dist0, a0, b0);
+		dist1 = _mm512_dpwssd_epi32(dist1, a1, b1);
+	}
+
+	return (uint32) _mm512_reduce_add_epi32(_mm512_add_epi32(dist0, dist1)) +
+		Sq8InnerProductDefault(dim - i, ax + i, bx + i);
+}
+#endif
+
+#ifdef SQ8_NEON
+static uint32
+Sq8L2SquaredDistanceNeon(int dim, const uint8 *ax, const uint8 *bx)
+{
+	int			i;
+	int			count = (dim / 16) * 16;
+	uint32x4_t	dist0 = vdupq_n_u32(0);
+	uint32x4_t	dist1 = vdupq_n_u32(0);
+
+	for (i = 0; i < count; i += 16)
+	{
+		uint8x16_t	diff = vabdq_u8(vld1q_u8(ax + i), vld1q_u8(bx + i));
+
+		dist0 = vpadalq_u16(dist0, vmull_u8(vget_low_u8(diff), vget_low_u8(diff)));
+		dist1 = vpadalq_u16(dist1, vmull_high_u8(diff, diff));
+	}
+
+	return vaddvq_u32(vaddq_u32(dist0, dist1)) +
+		Sq8L2SquaredDistanceDefault(dim - i, ax + i, bx + i);
+}
+
+static uint32
+Sq8InnerProductNeon(int dim, const uint8 *ax, const uint8 *bx)
+{
+	int			i;
+	int			count = (dim / 16) * 16;
+	uint32x4_t	dist0 = vdupq_n_u32(0);
+	uint32x4_t	dist1 = vdupq_n_u32(0);
+
+	for (i = 0; i < count; i += 16)
+	{
+		uint8x16_t	a = vld1q_u8(ax + i);
+		uint8x16_t	b = vld1q_u8(bx + i);
+
+		dist0 = vpadalq_u16(dist0, vmull_u8(vget_low_u8(a), vget_low_u8(b)));
+		dist1 = vpadalq_u16(dist1, vmull_high_u8(a, b));
+	}
+
+	return vaddvq_u32(vaddq_u32(dist0, dist1)) +
+		Sq8InnerProductDefault(dim - i, ax + i, bx + i);
+}
+#endif
+
+#ifdef SQ8_NEON_DOTPROD_DISPATCH
+TARGET_NEON_DOTPROD static uint32
+Sq8L2SquaredDistanceNeonDotprod(int dim, const uint8 *ax, const uint8 *bx)
+{
+	int			i;
+	int			count = (dim / 32) * 32;
+	uint32x4_t	dist0 = vdupq_n_u32(0);
+	uint32x4_t	dist1 = vdupq_n_u32(0);
+
+	for (i = 0; i < count; i += 32)
+	{
+		uint8x16_t	d0 = vabdq_u8(vld1q_u8(ax + i), vld1q_u8(bx + i));
+		uint8x16_t	d1 = vabdq_u8(vld1q_u8(ax + i + 16), vld1q_u8(bx + i + 16));
+
+		dist0 = vdotq_u32(dist0, d0, d0);
+		dist1 = vdotq_u32(dist1, d1, d1);
+	}
+
+	return vaddvq_u32(vaddq_u32(dist0, dist1)) +
+		Sq8L2SquaredDistanceDefault(dim - i, ax + i, bx + i);
+}
+
+TARGET_NEON_DOTPROD static uint32
+Sq8InnerProductNeonDotprod(int dim, const uint8 *ax, const uint8 *bx)
+{
+	int			i;
+	int			count = (dim / 32) * 32;
+	uint32x4_t	dist0 = vdupq_n_u32(0);
+	uint32x4_t	dist1 = vdupq_n_u32(0);
+
+	for (i = 0; i < count; i += 32)
+	{
+		dist0 = vdotq_u32(dist0, vld1q_u8(ax + i), vld1q_u8(bx + i));
+		dist1 = vdotq_u32(dist1, vld1q_u8(ax + i + 16), vld1q_u8(bx + i + 16));
+	}
+
+	return vaddvq_u32(vaddq_u32(dist0, dist1)) +
+		Sq8InnerProductDefault(dim - i, ax + i, bx + i);
+}
+#endif
+
+#ifdef SQ8_DISPATCH
+#define CPU_FEATURE_OSXSAVE		(1 << 27)	/* F1 ECX */
+#define CPU_FEATURE_AVX2		(1 << 5)	/* F7,0 EBX */
+#define CPU_FEATURE_AVX512F		(1 << 16)	/* F7,0 EBX */
+#define CPU_FEATURE_AVX512BW	(1 << 30)	/* F7,0 EBX */
+#define CPU_FEATURE_AVX512VNNI	(1 << 11)	/* F7,0 ECX */
+
+#ifdef _MSC_VER
+#define TARGET_XSAVE
+#else
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+
+/*
+ * Get the extended features, or zero if the registers are not enabled
+ */
+TARGET_XSAVE static void
+GetCpuFeatures(unsigned int *ebx, unsigned int *ecx, unsigned int xcr0)
+{
+	unsigned int exx[4] = {0, 0, 0, 0};
+
+	*ebx = 0;
+	*ecx = 0;
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid(1, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuid(exx, 1);
+#endif
+
+	/* Check OS supports XSAVE */
+	if ((exx[2] & CPU_FEATURE_OSXSAVE) != CPU_FEATURE_OSXSAVE)
+		return;
+
+	/* Check registers are enabled */
+	if ((_xgetbv(0) & xcr0) != xcr0)
+		return;
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid_count(7, 0, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuidex(exx, 7, 0);
+#endif
+
+	*ebx = exx[1];
+	*ecx = exx[2];
+}
+#endif
+
+void
+Sq8Init(void)
+{
+	Sq8L2SquaredDistance = Sq8L2SquaredDistanceDefault;
+	Sq8InnerProduct = Sq8InnerProductDefault;
+
+#ifdef SQ8_DISPATCH
+	{
+		unsigned int ebx;
+		unsigned int ecx;
+
+		/* XMM and YMM */
+		GetCpuFeatures(&ebx, &ecx, 0x06);
+		if ((ebx & CPU_FEATURE_AVX2) == CPU_FEATURE_AVX2)
+		{
+			Sq8L2SquaredDistance = Sq8L2SquaredDistanceAvx2;
+			Sq8InnerProduct = Sq8InnerProductAvx2;
+		}
+
+		/* XMM, YMM, and ZMM */
+		GetCpuFeatures(&ebx, &ecx, 0xe6);
+		if ((ebx & (CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512BW)) == (CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512BW) &&
+			(ecx & CPU_FEATURE_AVX512VNNI) == CPU_FEATURE_AVX512VNNI)
+		{
+			Sq8L2SquaredDistance = Sq8L2SquaredDistanceAvx512Vnni;
+			Sq8InnerProduct = Sq8InnerProductAvx512Vnni;
+		}
+	}
+#endif
+
+#ifdef SQ8_NEON
+	Sq8L2SquaredDistance = Sq8L2SquaredDistanceNeon;
+	Sq8InnerProduct = Sq8InnerProductNeon;
+
+#ifdef SQ8_NEON_DOTPROD_DISPATCH
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMDDP)
+	{
+		Sq8L2SquaredDistance = Sq8L2SquaredDistanceNeonDotprod;
+		Sq8InnerProduct = Sq8InnerProductNeonDotprod;
+	}
+#endif
+#endif
+}
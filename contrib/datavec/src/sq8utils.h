@@ -0,0 +1,11 @@
+#ifndef SQ8UTILS_H
+#define SQ8UTILS_H
+
+#include "postgres.h"
+
+extern uint32 (*Sq8L2SquaredDistance) (int dim, const uint8 *ax, const uint8 *bx);
+extern uint32 (*Sq8InnerProduct) (int dim, const uint8 *ax, const uint8 *bx);
+
+void		Sq8Init(void);
+
+#endif
@@ -5,6 +5,7 @@
 #include "bitutils.h"
 #include "bitvec.h"
 #include "catalog/pg_type.h"
+#include "diskann.h"
 #include "fmgr.h"
 #include "halfutils.h"
 #include "halfvec.h"
@@ -14,12 +15,15 @@
 #include "libpq/pqformat.h"
 #include "port.h"				/* for strtof() */
 #include "shortest_dec.h"
+#include "sparseinv.h"
 #include "sparsevec.h"
+#include "sq8utils.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
 #include "utils/numeric.h"
 #include "vector.h"
+#include "vectorutils.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
@@ -33,12 +37,6 @@
 #define STATE_DIMS(x) (ARR_DIMS(x)[0] - 1)
 #define CreateStateDatums(dim) palloc(sizeof(Datum) * (dim + 1))
 
-#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
-#define VECTOR_TARGET_CLONES __attribute__((target_clones("default", "fma")))
-#else
-#define VECTOR_TARGET_CLONES
-#endif
-
 PG_MODULE_MAGIC;
 
 /*
@@ -50,8 +48,12 @@ _PG_init(void)
 {
 	BitvecInit();
 	HalfvecInit();
+	Sq8Init();
+	VectorInit();
 	HnswInit();
 	IvfflatInit();
+	DiskannInit();
+	SparseinvInit();
 }
 
 /*
@@ -564,22 +566,6 @@ halfvec_to_vector(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(result);
 }
 
-VECTOR_TARGET_CLONES static float
-VectorL2SquaredDistance(int dim, float *ax, float *bx)
-{
-	float		distance = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-	{
-		float		diff = ax[i] - bx[i];
-
-		distance += diff * diff;
-	}
-
-	return distance;
-}
-
 /*
  * Get the L2 distance between vectors
  */
@@ -611,18 +597,6 @@ vector_l2_squared_distance(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) VectorL2SquaredDistance(a->dim, a->x, b->x));
 }
 
-VECTOR_TARGET_CLONES static float
-VectorInnerProduct(int dim, float *ax, float *bx)
-{
-	float		distance = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-		distance += ax[i] * bx[i];
-
-	return distance;
-}
-
 /*
  * Get the inner product of two vectors
  */
@@ -653,25 +627,6 @@ vector_negative_inner_product(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) -VectorInnerProduct(a->dim, a->x, b->x));
 }
 
-VECTOR_TARGET_CLONES static double
-VectorCosineSimilarity(int dim, float *ax, float *bx)
-{
-	float		similarity = 0.0;
-	float		norma = 0.0;
-	float		normb = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-	{
-		similarity += ax[i] * bx[i];
-		norma += ax[i] * ax[i];
-		normb += bx[i] * bx[i];
-	}
-
-	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
-	return (double) similarity / sqrt((double) norma * (double) normb);
-}
-
 /*
  * Get the cosine distance between two vectors
  */
@@ -728,19 +683,6 @@ vector_spherical_distance(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8(acos(distance) / M_PI);
 }
 
-/* Does not require FMA, but keep logic simple */
-VECTOR_TARGET_CLONES static float
-VectorL1Distance(int dim, float *ax, float *bx)
-{
-	float		distance = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-		distance += fabsf(ax[i] - bx[i]);
-
-	return distance;
-}
-
 /*
  * Get the L1 distance between two vectors
  */
@@ -756,6 +698,88 @@ l1_distance(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) VectorL1Distance(a->dim, a->x, b->x));
 }
 
+/*
+ * Get the distances from q to many vectors
+ *
+ * Resolves the distance function once per batch instead of going through
+ * fmgr for each value, and prefetches the next value
+ */
+void
+VectorDistanceBatch(FmgrInfo *procinfo, Oid collation, Datum q, Datum *values, int n, double *distances)
+{
+	Vector	   *a;
+	float		(*distance) (int dim, float *ax, float *bx);
+	bool		negate = false;
+	bool		root = false;
+	bool		spherical = false;
+
+	if (procinfo->fn_addr == vector_l2_squared_distance)
+		distance = VectorL2SquaredDistance;
+	else if (procinfo->fn_addr == vector_negative_inner_product)
+	{
+		distance = VectorInnerProduct;
+		negate = true;
+	}
+	else if (procinfo->fn_addr == l2_distance)
+	{
+		distance = VectorL2SquaredDistance;
+		root = true;
+	}
+	else if (procinfo->fn_addr == vector_spherical_distance)
+	{
+		distance = VectorInnerProduct;
+		spherical = true;
+	}
+	else if (procinfo->fn_addr == l1_distance)
+		distance = VectorL1Distance;
+	else
+	{
+		for (int i = 0; i < n; i++)
+			distances[i] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, values[i]));
+		return;
+	}
+
+	a = DatumGetVector(q);
+
+	for (int i = 0; i < n; i++)
+	{
+		Vector	   *b;
+		float		d;
+
+		if (i + 1 < n)
+			VECTOR_PREFETCH(DatumGetPointer(values[i + 1]));
+
+		b = DatumGetVector(values[i]);
+		CheckDims(a, b);
+
+		d = distance(a->dim, a->x, b->x);
+		if (negate)
+			distances[i] = (double) -d;
+		else if (root)
+			distances[i] = sqrt((double) d);
+		else if (spherical)
+		{
+			double		similarity = (double) d;
+
+			/* Prevent NaN with acos with loss of precision */
+			if (similarity > 1)
+				similarity = 1;
+			else if (similarity < -1)
+				similarity = -1;
+
+			distances[i] = acos(similarity) / M_PI;
+		}
+		else
+			distances[i] = (double) d;
+
+		if ((Pointer) b != DatumGetPointer(values[i]))
+			pfree(b);
+	}
+
+	if ((Pointer) a != DatumGetPointer(q))
+		pfree(a);
+}
+
 /*
  * Get the dimensions of a vector
  */
@@ -0,0 +1,781 @@
+#include "postgres.h"
+
+#include <math.h>
+
+#include "halfvec.h"			/* for USE_DISPATCH and USE_TARGET_CLONES */
+#include "vectorutils.h"
+
+#if defined(USE_DISPATCH)
+#define VECTOR_DISPATCH
+#endif
+
+#ifdef VECTOR_DISPATCH
+#include <immintrin.h>
+
+#if defined(USE__GET_CPUID)
+#include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define TARGET_AVX2_FMA
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2_FMA __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define VECTOR_NEON
+
+/* Only use SVE when the compiler targets it */
+#if defined(__ARM_FEATURE_SVE)
+#include <arm_sve.h>
+#define VECTOR_SVE
+#endif
+#endif
+
+#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
+#define VECTOR_TARGET_CLONES __attribute__((target_clones("default", "fma")))
+#else
+#define VECTOR_TARGET_CLONES
+#endif
+
+float		(*VectorL2SquaredDistance) (int dim, float *ax, float *bx);
+float		(*VectorInnerProduct) (int dim, float *ax, float *bx);
+double		(*VectorCosineSimilarity) (int dim, float *ax, float *bx);
+float		(*VectorL1Distance) (int dim, float *ax, float *bx);
+
+VECTOR_TARGET_CLONES static float
+VectorL2SquaredDistanceDefault(int dim, float *ax, float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+VECTOR_TARGET_CLONES static float
+VectorInnerProductDefault(int dim, float *ax, float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+
+VECTOR_TARGET_CLONES static double
+VectorCosineSimilarityDefault(int dim, float *ax, float *bx)
+{
+	float		similarity = 0.0;
+	float		norma = 0.0;
+	float		normb = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+/* Does not require FMA, but keep logic simple */
+VECTOR_TARGET_CLONES static float
+VectorL1DistanceDefault(int dim, float *ax, float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+
+#ifdef VECTOR_DISPATCH
+/*
+ * Sum the lanes of a register
+ */
+TARGET_AVX2_FMA static inline float
+HorizontalSumAvx2(__m256 x)
+{
+	__m128		s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
+}
+
+/*
+ * Use four accumulators to hide the latency of FMA
+ */
+TARGET_AVX2_FMA static float
+VectorL2SquaredDistanceAvx2(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		distance;
+	__m256		dist0 = _mm256_setzero_ps();
+	__m256		dist1 = _mm256_setzero_ps();
+	__m256		dist2 = _mm256_setzero_ps();
+	__m256		dist3 = _mm256_setzero_ps();
+
+	for (; i + 32 <= dim; i += 32)
+	{
+		__m256		diff0 = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i));
+		__m256		diff1 = _mm256_sub_ps(_mm256_loadu_ps(ax + i + 8), _mm256_loadu_ps(bx + i + 8));
+		__m256		diff2 = _mm256_sub_ps(_mm256_loadu_ps(ax + i + 16), _mm256_loadu_ps(bx + i + 16));
+		__m256		diff3 = _mm256_sub_ps(_mm256_loadu_ps(ax + i + 24), _mm256_loadu_ps(bx + i + 24));
+
+		dist0 = _mm256_fmadd_ps(diff0, diff0, dist0);
+		dist1 = _mm256_fmadd_ps(diff1, diff1, dist1);
+		dist2 = _mm256_fmadd_ps(diff2, diff2, dist2);
+		dist3 = _mm256_fmadd_ps(diff3, diff3, dist3);
+	}
+
+	for (; i + 8 <= dim; i += 8)
+	{
+		__m256		diff = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i));
+
+		dist0 = _mm256_fmadd_ps(diff, diff, dist0);
+	}
+
+	dist0 = _mm256_add_ps(_mm256_add_ps(dist0, dist1), _mm256_add_ps(dist2, dist3));
+	distance = HorizontalSumAvx2(dist0);
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+TARGET_AVX2_FMA static float
+VectorInnerProductAvx2(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		distance;
+	__m256		dist0 = _mm256_setzero_ps();
+	__m256		dist1 = _mm256_setzero_ps();
+	__m256		dist2 = _mm256_setzero_ps();
+	__m256		dist3 = _mm256_setzero_ps();
+
+	for (; i + 32 <= dim; i += 32)
+	{
+		dist0 = _mm256_fmadd_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i), dist0);
+		dist1 = _mm256_fmadd_ps(_mm256_loadu_ps(ax + i + 8), _mm256_loadu_ps(bx + i + 8), dist1);
+		dist2 = _mm256_fmadd_ps(_mm256_loadu_ps(ax + i + 16), _mm256_loadu_ps(bx + i + 16), dist2);
+		dist3 = _mm256_fmadd_ps(_mm256_loadu_ps(ax + i + 24), _mm256_loadu_ps(bx + i + 24), dist3);
+	}
+
+	for (; i + 8 <= dim; i += 8)
+		dist0 = _mm256_fmadd_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i), dist0);
+
+	dist0 = _mm256_add_ps(_mm256_add_ps(dist0, dist1), _mm256_add_ps(dist2, dist3));
+	distance = HorizontalSumAvx2(dist0);
+
+	for (; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+
+/*
+ * Compute the dot product and both norms in a single pass
+ */
+TARGET_AVX2_FMA static double
+VectorCosineSimilarityAvx2(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		similarity;
+	float		norma;
+	float		normb;
+	__m256		sim0 = _mm256_setzero_ps();
+	__m256		sim1 = _mm256_setzero_ps();
+	__m256		na0 = _mm256_setzero_ps();
+	__m256		na1 = _mm256_setzero_ps();
+	__m256		nb0 = _mm256_setzero_ps();
+	__m256		nb1 = _mm256_setzero_ps();
+
+	for (; i + 16 <= dim; i += 16)
+	{
+		__m256		a0 = _mm256_loadu_ps(ax + i);
+		__m256		b0 = _mm256_loadu_ps(bx + i);
+		__m256		a1 = _mm256_loadu_ps(ax + i + 8);
+		__m256		b1 = _mm256_loadu_ps(bx + i + 8);
+
+		sim0 = _mm256_fmadd_ps(a0, b0, sim0);
+		na0 = _mm256_fmadd_ps(a0, a0, na0);
+		nb0 = _mm256_fmadd_ps(b0, b0, nb0);
+		sim1 = _mm256_fmadd_ps(a1, b1, sim1);
+		na1 = _mm256_fmadd_ps(a1, a1, na1);
+		nb1 = _mm256_fmadd_ps(b1, b1, nb1);
+	}
+
+	for (; i + 8 <= dim; i += 8)
+	{
+		__m256		a0 = _mm256_loadu_ps(ax + i);
+		__m256		b0 = _mm256_loadu_ps(bx + i);
+
+		sim0 = _mm256_fmadd_ps(a0, b0, sim0);
+		na0 = _mm256_fmadd_ps(a0, a0, na0);
+		nb0 = _mm256_fmadd_ps(b0, b0, nb0);
+	}
+
+	similarity = HorizontalSumAvx2(_mm256_add_ps(sim0, sim1));
+	norma = HorizontalSumAvx2(_mm256_add_ps(na0, na1));
+	normb = HorizontalSumAvx2(_mm256_add_ps(nb0, nb1));
+
+	for (; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+TARGET_AVX2_FMA static float
+VectorL1DistanceAvx2(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		distance;
+	__m256		sign = _mm256_set1_ps(-0.0f);
+	__m256		dist0 = _mm256_setzero_ps();
+	__m256		dist1 = _mm256_setzero_ps();
+	__m256		dist2 = _mm256_setzero_ps();
+	__m256		dist3 = _mm256_setzero_ps();
+
+	for (; i + 32 <= dim; i += 32)
+	{
+		__m256		diff0 = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i));
+		__m256		diff1 = _mm256_sub_ps(_mm256_loadu_ps(ax + i + 8), _mm256_loadu_ps(bx + i + 8));
+		__m256		diff2 = _mm256_sub_ps(_mm256_loadu_ps(ax + i + 16), _mm256_loadu_ps(bx + i + 16));
+		__m256		diff3 = _mm256_sub_ps(_mm256_loadu_ps(ax + i + 24), _mm256_loadu_ps(bx + i + 24));
+
+		dist0 = _mm256_add_ps(dist0, _mm256_andnot_ps(sign, diff0));
+		dist1 = _mm256_add_ps(dist1, _mm256_andnot_ps(sign, diff1));
+		dist2 = _mm256_add_ps(dist2, _mm256_andnot_ps(sign, diff2));
+		dist3 = _mm256_add_ps(dist3, _mm256_andnot_ps(sign, diff3));
+	}
+
+	for (; i + 8 <= dim; i += 8)
+	{
+		__m256		diff = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i));
+
+		dist0 = _mm256_add_ps(dist0, _mm256_andnot_ps(sign, diff));
+	}
+
+	dist0 = _mm256_add_ps(_mm256_add_ps(dist0, dist1), _mm256_add_ps(dist2, dist3));
+	distance = HorizontalSumAvx2(dist0);
+
+	for (; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+
+/*
+ * The remainder is handled with a masked load, so there is no scalar tail
+ */
+TARGET_AVX512 static float
+VectorL2SquaredDistanceAvx512(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	__m512		dist0 = _mm512_setzero_ps();
+	__m512		dist1 = _mm512_setzero_ps();
+	__m512		dist2 = _mm512_setzero_ps();
+	__m512		dist3 = _mm512_setzero_ps();
+
+	for (; i + 64 <= dim; i += 64)
+	{
+		__m512		diff0 = _mm512_sub_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i));
+		__m512		diff1 = _mm512_sub_ps(_mm512_loadu_ps(ax + i + 16), _mm512_loadu_ps(bx + i + 16));
+		__m512		diff2 = _mm512_sub_ps(_mm512_loadu_ps(ax + i + 32), _mm512_loadu_ps(bx + i + 32));
+		__m512		diff3 = _mm512_sub_ps(_mm512_loadu_ps(ax + i + 48), _mm512_loadu_ps(bx + i + 48));
+
+		dist0 = _mm512_fmadd_ps(diff0, diff0, dist0);
+		dist1 = _mm512_fmadd_ps(diff1, diff1, dist1);
+		dist2 = _mm512_fmadd_ps(diff2, diff2, dist2);
+		dist3 = _mm512_fmadd_ps(diff3, diff3, dist3);
+	}
+
+	for (; i + 16 <= dim; i += 16)
+	{
+		__m512		diff = _mm512_sub_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i));
+
+		dist0 = _mm512_fmadd_ps(diff, diff, dist0);
+	}
+
+	if (i < dim)
+	{
+		__mmask16	mask = (__mmask16) ((1 << (dim - i)) - 1);
+		__m512		diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, ax + i), _mm512_maskz_loadu_ps(mask, bx + i));
+
+		dist1 = _mm512_fmadd_ps(diff, diff, dist1);
+	}
+
+	dist0 = _mm512_add_ps(_mm512_add_ps(dist0, dist1), _mm512_add_ps(dist2, dist3));
+	return _mm512_reduce_add_ps(dist0);
+}
+
+TARGET_AVX512 static float
+VectorInnerProductAvx512(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	__m512		dist0 = _mm512_setzero_ps();
+	__m512		dist1 = _mm512_setzero_ps();
+	__m512		dist2 = _mm512_setzero_ps();
+	__m512		dist3 = _mm512_setzero_ps();
+
+	for (; i + 64 <= dim; i += 64)
+	{
+		dist0 = _mm512_fmadd_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i), dist0);
+		dist1 = _mm512_fmadd_ps(_mm512_loadu_ps(ax + i + 16), _mm512_loadu_ps(bx + i + 16), dist1);
+		dist2 = _mm512_fmadd_ps(_mm512_loadu_ps(ax + i + 32), _mm512_loadu_ps(bx + i + 32), dist2);
+		dist3 = _mm512_fmadd_ps(_mm512_loadu_ps(ax + i + 48), _mm512_loadu_ps(bx + i + 48), dist3);
+	}
+
+	for (; i + 16 <= dim; i += 16)
+		dist0 = _mm512_fmadd_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i), dist0);
+
+	if (i < dim)
+	{
+		__mmask16	mask = (__mmask16) ((1 << (dim - i)) - 1);
+
+		dist1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, ax + i), _mm512_maskz_loadu_ps(mask, bx + i), dist1);
+	}
+
+	dist0 = _mm512_add_ps(_mm512_add_ps(dist0, dist1), _mm512_add_ps(dist2, dist3));
+	return _mm512_reduce_add_ps(dist0);
+}
+
+TARGET_AVX512 static double
+VectorCosineSimilarityAvx512(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		similarity;
+	float		norma;
+	float		normb;
+	__m512		sim0 = _mm512_setzero_ps();
+	__m512		sim1 = _mm512_setzero_ps();
+	__m512		na0 = _mm512_setzero_ps();
+	__m512		na1 = _mm512_setzero_ps();
+	__m512		nb0 = _mm512_setzero_ps();
+	__m512		nb1 = _mm512_setzero_ps();
+
+	for (; i + 32 <= dim; i += 32)
+	{
+		__m512		a0 = _mm512_loadu_ps(ax + i);
+		__m512		b0 = _mm512_loadu_ps(bx + i);
+		__m512		a1 = _mm512_loadu_ps(ax + i + 16);
+		__m512		b1 = _mm512_loadu_ps(bx + i + 16);
+
+		sim0 = _mm512_fmadd_ps(a0, b0, sim0);
+		na0 = _mm512_fmadd_ps(a0, a0, na0);
+		nb0 = _mm512_fmadd_ps(b0, b0, nb0);
+		sim1 = _mm512_fmadd_ps(a1, b1, sim1);
+		na1 = _mm512_fmadd_ps(a1, a1, na1);
+		nb1 = _mm512_fmadd_ps(b1, b1, nb1);
+	}
+
+	for (; i < dim; i += 16)
+	{
+		__mmask16	mask = dim - i >= 16 ? (__mmask16) 0xFFFF : (__mmask16) ((1 << (dim - i)) - 1);
+		__m512		a0 = _mm512_maskz_loadu_ps(mask, ax + i);
+		__m512		b0 = _mm512_maskz_loadu_ps(mask, bx + i);
+
+		sim0 = _mm512_fmadd_ps(a0, b0, sim0);
+		na0 = _mm512_fmadd_ps(a0, a0, na0);
+		nb0 = _mm512_fmadd_ps(b0, b0, nb0);
+	}
+
+	similarity = _mm512_reduce_add_ps(_mm512_add_ps(sim0, sim1));
+	norma = _mm512_reduce_add_ps(_mm512_add_ps(na0, na1));
+	normb = _mm512_reduce_add_ps(_mm512_add_ps(nb0, nb1));
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+TARGET_AVX512 static float
+VectorL1DistanceAvx512(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	__m512		dist0 = _mm512_setzero_ps();
+	__m512		dist1 = _mm512_setzero_ps();
+	__m512		dist2 = _mm512_setzero_ps();
+	__m512		dist3 = _mm512_setzero_ps();
+
+	for (; i + 64 <= dim; i += 64)
+	{
+		dist0 = _mm512_add_ps(dist0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i))));
+		dist1 = _mm512_add_ps(dist1, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(ax + i + 16), _mm512_loadu_ps(bx + i + 16))));
+		dist2 = _mm512_add_ps(dist2, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(ax + i + 32), _mm512_loadu_ps(bx + i + 32))));
+		dist3 = _mm512_add_ps(dist3, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(ax + i + 48), _mm512_loadu_ps(bx + i + 48))));
+	}
+
+	for (; i < dim; i += 16)
+	{
+		__mmask16	mask = dim - i >= 16 ? (__mmask16) 0xFFFF : (__mmask16) ((1 << (dim - i)) - 1);
+		__m512		diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, ax + i), _mm512_maskz_loadu_ps(mask, bx + i));
+
+		dist0 = _mm512_add_ps(dist0, _mm512_abs_ps(diff));
+	}
+
+	dist0 = _mm512_add_ps(_mm512_add_ps(dist0, dist1), _mm512_add_ps(dist2, dist3));
+	return _mm512_reduce_add_ps(dist0);
+}
+#endif
+
+#ifdef VECTOR_NEON
+/*
+ * NEON is part of the base architecture, so no dispatch is needed
+ */
+static float
+VectorL2SquaredDistanceNeon(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		distance;
+	float32x4_t dist0 = vdupq_n_f32(0);
+	float32x4_t dist1 = vdupq_n_f32(0);
+	float32x4_t dist2 = vdupq_n_f32(0);
+	float32x4_t dist3 = vdupq_n_f32(0);
+
+	for (; i + 16 <= dim; i += 16)
+	{
+		float32x4_t diff0 = vsubq_f32(vld1q_f32(ax + i), vld1q_f32(bx + i));
+		float32x4_t diff1 = vsubq_f32(vld1q_f32(ax + i + 4), vld1q_f32(bx + i + 4));
+		float32x4_t diff2 = vsubq_f32(vld1q_f32(ax + i + 8), vld1q_f32(bx + i + 8));
+		float32x4_t diff3 = vsubq_f32(vld1q_f32(ax + i + 12), vld1q_f32(bx + i + 12));
+
+		dist0 = vfmaq_f32(dist0, diff0, diff0);
+		dist1 = vfmaq_f32(dist1, diff1, diff1);
+		dist2 = vfmaq_f32(dist2, diff2, diff2);
+		dist3 = vfmaq_f32(dist3, diff3, diff3);
+	}
+
+	for (; i + 4 <= dim; i += 4)
+	{
+		float32x4_t diff = vsubq_f32(vld1q_f32(ax + i), vld1q_f32(bx + i));
+
+		dist0 = vfmaq_f32(dist0, diff, diff);
+	}
+
+	distance = vaddvq_f32(vaddq_f32(vaddq_f32(dist0, dist1), vaddq_f32(dist2, dist3)));
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+static float
+VectorInnerProductNeon(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		distance;
+	float32x4_t dist0 = vdupq_n_f32(0);
+	float32x4_t dist1 = vdupq_n_f32(0);
+	float32x4_t dist2 = vdupq_n_f32(0);
+	float32x4_t dist3 = vdupq_n_f32(0);
+
+	for (; i + 16 <= dim; i += 16)
+	{
+		dist0 = vfmaq_f32(dist0, vld1q_f32(ax + i), vld1q_f32(bx + i));
+		dist1 = vfmaq_f32(dist1, vld1q_f32(ax + i + 4), vld1q_f32(bx + i + 4));
+		dist2 = vfmaq_f32(dist2, vld1q_f32(ax + i + 8), vld1q_f32(bx + i + 8));
+		dist3 = vfmaq_f32(dist3, vld1q_f32(ax + i + 12), vld1q_f32(bx + i + 12));
+	}
+
+	for (; i + 4 <= dim; i += 4)
+		dist0 = vfmaq_f32(dist0, vld1q_f32(ax + i), vld1q_f32(bx + i));
+
+	distance = vaddvq_f32(vaddq_f32(vaddq_f32(dist0, dist1), vaddq_f32(dist2, dist3)));
+
+	for (; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+
+static double
+VectorCosineSimilarityNeon(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		similarity;
+	float		norma;
+	float		normb;
+	float32x4_t sim0 = vdupq_n_f32(0);
+	float32x4_t sim1 = vdupq_n_f32(0);
+	float32x4_t na0 = vdupq_n_f32(0);
+	float32x4_t na1 = vdupq_n_f32(0);
+	float32x4_t nb0 = vdupq_n_f32(0);
+	float32x4_t nb1 = vdupq_n_f32(0);
+
+	for (; i + 8 <= dim; i += 8)
+	{
+		float32x4_t a0 = vld1q_f32(ax + i);
+		float32x4_t b0 = vld1q_f32(bx + i);
+		float32x4_t a1 = vld1q_f32(ax + i + 4);
+		float32x4_t b1 = vld1q_f32(bx + i + 4);
+
+		sim0 = vfmaq_f32(sim0, a0, b0);
+		na0 = vfmaq_f32(na0, a0, a0);
+		nb0 = vfmaq_f32(nb0, b0, b0);
+		sim1 = vfmaq_f32(sim1, a1, b1);
+		na1 = vfmaq_f32(na1, a1, a1);
+		nb1 = vfmaq_f32(nb1, b1, b1);
+	}
+
+	similarity = vaddvq_f32(vaddq_f32(sim0, sim1));
+	norma = vaddvq_f32(vaddq_f32(na0, na1));
+	normb = vaddvq_f32(vaddq_f32(nb0, nb1));
+
+	for (; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+static float
+VectorL1DistanceNeon(int dim, float *ax, float *bx)
+{
+	int			i = 0;
+	float		distance;
+	float32x4_t dist0 = vdupq_n_f32(0);
+	float32x4_t dist1 = vdupq_n_f32(0);
+	float32x4_t dist2 = vdupq_n_f32(0);
+	float32x4_t dist3 = vdupq_n_f32(0);
+
+	for (; i + 16 <= dim; i += 16)
+	{
+		dist0 = vaddq_f32(dist0, vabdq_f32(vld1q_f32(ax + i), vld1q_f32(bx + i)));
+		dist1 = vaddq_f32(dist1, vabdq_f32(vld1q_f32(ax + i + 4), vld1q_f32(bx + i + 4)));
+		dist2 = vaddq_f32(dist2, vabdq_f32(vld1q_f32(ax + i + 8), vld1q_f32(bx + i + 8)));
+		dist3 = vaddq_f32(dist3, vabdq_f32(vld1q_f32(ax + i + 12), vld1q_f32(bx + i + 12)));
+	}
+
+	for (; i + 4 <= dim; i += 4)
+		dist0 = vaddq_f32(dist0, vabdq_f32(vld1q_f32(ax + i), vld1q_f32(bx + i)));
+
+	distance = vaddvq_f32(vaddq_f32(vaddq_f32(dist0, dist1), vaddq_f32(dist2, dist3)));
+
+	for (; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+#endif
+
+#ifdef VECTOR_SVE
+/*
+ * Vector length is only known at runtime, so the loop is predicated
+ */
+static float
+VectorL2SquaredDistanceSve(int dim, float *ax, float *bx)
+{
+	svfloat32_t dist = svdup_n_f32(0);
+
+	for (int i = 0; i < dim; i += (int) svcntw())
+	{
+		svbool_t	pg = svwhilelt_b32(i, dim);
+		svfloat32_t diff = svsub_f32_x(pg, svld1_f32(pg, ax + i), svld1_f32(pg, bx + i));
+
+		dist = svmla_f32_m(pg, dist, diff, diff);
+	}
+
+	return svaddv_f32(svptrue_b32(), dist);
+}
+
+static float
+VectorInnerProductSve(int dim, float *ax, float *bx)
+{
+	svfloat32_t dist = svdup_n_f32(0);
+
+	for (int i = 0; i < dim; i += (int) svcntw())
+	{
+		svbool_t	pg = svwhilelt_b32(i, dim);
+
+		dist = svmla_f32_m(pg, dist, svld1_f32(pg, ax + i), svld1_f32(pg, bx + i));
+	}
+
+	return svaddv_f32(svptrue_b32(), dist);
+}
+
+static double
+VectorCosineSimilaritySve(int dim, float *ax, float *bx)
+{
+	svfloat32_t sim = svdup_n_f32(0);
+	svfloat32_t na = svdup_n_f32(0);
+	svfloat32_t nb = svdup_n_f32(0);
+	float		similarity;
+	float		norma;
+	float		normb;
+
+	for (int i = 0; i < dim; i += (int) svcntw())
+	{
+		svbool_t	pg = svwhilelt_b32(i, dim);
+		svfloat32_t a = svld1_f32(pg, ax + i);
+		svfloat32_t b = svld1_f32(pg, bx + i);
+
+		sim = svmla_f32_m(pg, sim, a, b);
+		na = svmla_f32_m(pg, na, a, a);
+		nb = svmla_f32_m(pg, nb, b, b);
+	}
+
+	similarity = svaddv_f32(svptrue_b32(), sim);
+	norma = svaddv_f32(svptrue_b32(), na);
+	normb = svaddv_f32(svptrue_b32(), nb);
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+static float
+VectorL1DistanceSve(int dim, float *ax, float *bx)
+{
+	svfloat32_t dist = svdup_n_f32(0);
+
+	for (int i = 0; i < dim; i += (int) svcntw())
+	{
+		svbool_t	pg = svwhilelt_b32(i, dim);
+
+		dist = svadd_f32_m(pg, dist, svabd_f32_x(pg, svld1_f32(pg, ax + i), svld1_f32(pg, bx + i)));
+	}
+
+	return svaddv_f32(svptrue_b32(), dist);
+}
+#endif
+
+#ifdef VECTOR_DISPATCH
+#define CPU_FEATURE_FMA			(1 << 12)	/* F1 ECX */
+#define CPU_FEATURE_OSXSAVE		(1 << 27)	/* F1 ECX */
+#define CPU_FEATURE_AVX2		(1 << 5)	/* F7,0 EBX */
+#define CPU_FEATURE_AVX512F		(1 << 16)	/* F7,0 EBX */
+
+#ifdef _MSC_VER
+#define TARGET_XSAVE
+#else
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+
+/*
+ * Get the basic and extended features, or zero if the registers are not
+ * enabled
+ */
+TARGET_XSAVE static void
+GetCpuFeatures(unsigned int *ecx1, unsigned int *ebx7, unsigned int xcr0)
+{
+	unsigned int exx[4] = {0, 0, 0, 0};
+
+	*ecx1 = 0;
+	*ebx7 = 0;
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid(1, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuid(exx, 1);
+#endif
+
+	/* Check OS supports XSAVE */
+	if ((exx[2] & CPU_FEATURE_OSXSAVE) != CPU_FEATURE_OSXSAVE)
+		return;
+
+	/* Check registers are enabled */
+	if ((_xgetbv(0) & xcr0) != xcr0)
+		return;
+
+	*ecx1 = exx[2];
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid_count(7, 0, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuidex(exx, 7, 0);
+#endif
+
+	*ebx7 = exx[1];
+}
+#endif
+
+void
+VectorInit(void)
+{
+	VectorL2SquaredDistance = VectorL2SquaredDistanceDefault;
+	VectorInnerProduct = VectorInnerProductDefault;
+	VectorCosineSimilarity = VectorCosineSimilarityDefault;
+	VectorL1Distance = VectorL1DistanceDefault;
+
+#ifdef VECTOR_DISPATCH
+	{
+		unsigned int ecx1;
+		unsigned int ebx7;
+
+		/* XMM and YMM */
+		GetCpuFeatures(&ecx1, &ebx7, 0x06);
+		if ((ecx1 & CPU_FEATURE_FMA) == CPU_FEATURE_FMA &&
+			(ebx7 & CPU_FEATURE_AVX2) == CPU_FEATURE_AVX2)
+		{
+			VectorL2SquaredDistance = VectorL2SquaredDistanceAvx2;
+			VectorInnerProduct = VectorInnerProductAvx2;
+			VectorCosineSimilarity = VectorCosineSimilarityAvx2;
+			/* Does not require FMA, but keep logic simple */
+			VectorL1Distance = VectorL1DistanceAvx2;
+		}
+
+		/* XMM, YMM, and ZMM */
+		GetCpuFeatures(&ecx1, &ebx7, 0xe6);
+		if ((ebx7 & CPU_FEATURE_AVX512F) == CPU_FEATURE_AVX512F)
+		{
+			VectorL2SquaredDistance = VectorL2SquaredDistanceAvx512;
+			VectorInnerProduct = VectorInnerProductAvx512;
+			VectorCosineSimilarity = VectorCosineSimilarityAvx512;
+			VectorL1Distance = VectorL1DistanceAvx512;
+		}
+	}
+#endif
+
+#ifdef VECTOR_NEON
+	VectorL2SquaredDistance = VectorL2SquaredDistanceNeon;
+	VectorInnerProduct = VectorInnerProductNeon;
+	VectorCosineSimilarity = VectorCosineSimilarityNeon;
+	VectorL1Distance = VectorL1DistanceNeon;
+#endif
+
+#ifdef VECTOR_SVE
+	VectorL2SquaredDistance = VectorL2SquaredDistanceSve;
+	VectorInnerProduct = VectorInnerProductSve;
+	VectorCosineSimilarity = VectorCosineSimilaritySve;
+	VectorL1Distance = VectorL1DistanceSve;
+#endif
+}
@@ -0,0 +1,13 @@
+#ifndef VECTORUTILS_H
+#define VECTORUTILS_H
+
+#include "postgres.h"
+
+extern float (*VectorL2SquaredDistance) (int dim, float *ax, float *bx);
+extern float (*VectorInnerProduct) (int dim, float *ax, float *bx);
+extern double (*VectorCosineSimilarity) (int dim, float *ax, float *bx);
+extern float (*VectorL1Distance) (int dim, float *ax, float *bx);
+
+void		VectorInit(void);
+
+#endif
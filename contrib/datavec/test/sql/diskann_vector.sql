@@ -0,0 +1,78 @@
+SET enable_seqscan = off;
+
+-- L2
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING diskann (val vector_l2_ops);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+SELECT COUNT(*) FROM t;
+
+TRUNCATE t;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- inner product
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING diskann (val vector_ip_ops);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <#> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <#> (SELECT NULL::vector)) t2;
+
+DROP TABLE t;
+
+-- cosine
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING diskann (val vector_cosine_ops);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <=> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <=> '[0,0,0]') t2;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <=> (SELECT NULL::vector)) t2;
+
+DROP TABLE t;
+
+-- unlogged
+
+CREATE UNLOGGED TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING diskann (val vector_l2_ops);
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- options
+
+CREATE TABLE t (val vector(3));
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (max_degree = 3);
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (max_degree = 513);
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (build_list_size = 3);
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (build_list_size = 1001);
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (alpha = 0.5);
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (max_degree = 64, build_list_size = 32);
+CREATE INDEX ON t USING diskann (val vector_l2_ops) WITH (pq_m = 2);
+
+SHOW diskann.search_list_size;
+
+SET diskann.search_list_size = 0;
+SET diskann.search_list_size = 1001;
+
+SHOW diskann.beam_width;
+
+SET diskann.beam_width = 0;
+SET diskann.beam_width = 65;
+
+DROP TABLE t;
@@ -9,9 +9,13 @@ CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1);
 INSERT INTO t (val) VALUES ('[1,2,4]');
 
 SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT * FROM t ORDER BY val <-> '[3,3,3]' LIMIT 2;
 SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
 SELECT COUNT(*) FROM t;
 
+DELETE FROM t WHERE val = '[1,2,3]';
+SELECT * FROM t ORDER BY val <-> '[3,3,3]' LIMIT 2;
+
 TRUNCATE t;
 SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
@@ -54,12 +58,76 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
 DROP TABLE t;
 
+-- product quantization
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, quantizer = 'pq');
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+SET ivfflat.rerank_candidates = 0;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[3,3,3]') t2;
+RESET ivfflat.rerank_candidates;
+
+DROP TABLE t;
+
+-- scalar quantization
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, quantizer = 'sq8');
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+SET ivfflat.rerank_candidates = 0;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[3,3,3]') t2;
+RESET ivfflat.rerank_candidates;
+
+DROP TABLE t;
+
+-- rebalance
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) SELECT '[0,0,0]' FROM generate_series(1, 10);
+INSERT INTO t (val) SELECT '[10,10,10]' FROM generate_series(1, 10);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 2);
+
+INSERT INTO t (val) SELECT '[20,20,20]' FROM generate_series(1, 100);
+
+SELECT tuples FROM ivfflat_list_stats('t_val_idx') ORDER BY tuples;
+SELECT ivfflat_rebalance('t_val_idx', 1.5);
+SELECT COUNT(*), SUM(tuples) FROM ivfflat_list_stats('t_val_idx');
+SELECT COUNT(*) FROM ivfflat_lists WHERE indexrelid = 't_val_idx'::regclass;
+
+SET ivfflat.probes = 2;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[20,20,20]') t2;
+SELECT * FROM t ORDER BY val <-> '[0,0,0]' LIMIT 2;
+RESET ivfflat.probes;
+
+SELECT ivfflat_rebalance('t_val_idx', 1);
+
+DROP TABLE t;
+
 -- options
 
 CREATE TABLE t (val vector(3));
 CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 0);
 CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 32769);
 
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (quantizer = 'sq');
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (pq_m = 4001);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (quantizer = 'pq', pq_m = 2);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (rebalance_ratio = 1001);
+
 SHOW ivfflat.probes;
+SHOW ivfflat.rerank_candidates;
+SHOW ivfflat.center_cache_size;
 
 DROP TABLE t;
@@ -0,0 +1,46 @@
+SET enable_seqscan = off;
+
+-- inner product
+
+CREATE TABLE t (val sparsevec(3));
+INSERT INTO t (val) VALUES ('{}/3'), ('{1:1,2:2,3:3}/3'), ('{1:1,2:1,3:1}/3'), (NULL);
+CREATE INDEX ON t USING sparseinv (val sparsevec_ip_ops);
+
+INSERT INTO t (val) VALUES ('{1:1,2:2,3:4}/3');
+
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/3';
+SELECT * FROM t ORDER BY val <#> '{1:-1}/3';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <#> '{}/3') t2;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <#> (SELECT NULL::sparsevec)) t2;
+SELECT COUNT(*) FROM t;
+
+DELETE FROM t WHERE val = '{1:1,2:2,3:3}/3';
+VACUUM t;
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/3';
+
+TRUNCATE t;
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/3';
+
+DROP TABLE t;
+
+-- unlogged
+
+CREATE UNLOGGED TABLE t (val sparsevec(3));
+INSERT INTO t (val) VALUES ('{}/3'), ('{1:1,2:2,3:3}/3'), ('{1:1,2:1,3:1}/3'), (NULL);
+CREATE INDEX ON t USING sparseinv (val sparsevec_ip_ops);
+
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/3';
+
+DROP TABLE t;
+
+-- options
+
+CREATE TABLE t (val sparsevec(3));
+CREATE INDEX ON t USING sparseinv (val sparsevec_ip_ops) WITH (lists = 1);
+
+SHOW sparseinv.top_k;
+
+SET sparseinv.top_k = 0;
+SET sparseinv.top_k = 10001;
+
+DROP TABLE t;
@@ -96,4 +96,12 @@ for my $i (1 .. 10)
 	test_index_replay("insert $i");
 }
 
+# Test replica does not keep cached centers of swapped lists
+$node_primary->safe_psql("postgres", "SELECT ivfflat_rebalance('tst_v_idx', 1.1);");
+test_index_replay('rebalance');
+$node_primary->safe_psql("postgres",
+	"INSERT INTO tst SELECT i % 10, ARRAY[$array_sql] FROM generate_series(200001, 210000) i;"
+);
+test_index_replay('insert after rebalance');
+
 done_testing();
@@ -0,0 +1,73 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $nc = 50;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim), c int4);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql], i % $nc FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+
+# Generate query
+my @r = ();
+for (1 .. $dim)
+{
+	push(@r, rand());
+}
+my $query = "[" . join(",", @r) . "]";
+my $c = int(rand() * $nc);
+
+# Test filtering without iterative scans
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT COUNT(*) FROM (SELECT i FROM tst WHERE c = $c ORDER BY v <-> '$query' LIMIT $limit) t;
+));
+cmp_ok($count, '<', $limit);
+
+foreach my $mode ('strict_order', 'relaxed_order')
+{
+	# Test filtering returns all results
+	$count = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.iterative_scan = $mode;
+		SELECT COUNT(*) FROM (SELECT i FROM tst WHERE c = $c ORDER BY v <-> '$query' LIMIT $limit) t;
+	));
+	is($count, $limit);
+
+	# Test max scan tuples stops expanding the graph
+	$count = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.iterative_scan = $mode;
+		SET hnsw.max_scan_tuples = 1;
+		SELECT COUNT(*) FROM (SELECT i FROM tst WHERE c = $c ORDER BY v <-> '$query') t;
+	));
+	cmp_ok($count, '<', 10000 / $nc);
+}
+
+# Test strict order
+my $res = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.iterative_scan = strict_order;
+	SELECT v <-> '$query' FROM tst WHERE c = $c ORDER BY v <-> '$query' LIMIT $limit;
+));
+my @distances = split("\n", $res);
+my @sorted = sort { $a <=> $b } @distances;
+is_deeply(\@distances, \@sorted);
+
+done_testing();
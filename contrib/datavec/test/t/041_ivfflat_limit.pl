@@ -0,0 +1,75 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# A single list makes index scans exact
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1);");
+
+# Generate query
+my @r = ();
+for (1 .. $dim)
+{
+	push(@r, rand());
+}
+my $query = "[" . join(",", @r) . "]";
+
+sub test_limit
+{
+	my ($sql, $settings, $name) = @_;
+
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		$sql
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		$settings
+		$sql
+	));
+	is($actual, $expected, $name);
+}
+
+my $explain = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	EXPLAIN SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+));
+like($explain, qr/Index Scan using idx/);
+
+# Test bounded scan
+test_limit("SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;", "", "bounded");
+
+# Test offset
+test_limit("SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit OFFSET 100;", "", "offset");
+
+# Test bounded scan that needs more rows when closest rows are not visible
+$node->safe_psql("postgres", qq(
+	DELETE FROM tst WHERE i IN (SELECT i FROM tst ORDER BY v <-> '$query' LIMIT 100);
+));
+test_limit("SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;", "", "bounded with deleted rows");
+
+# Test unbounded scan
+test_limit("SELECT i FROM tst ORDER BY v <-> '$query';", "", "unbounded");
+
+# Test unbounded scan that does not fit in memory
+test_limit("SELECT i FROM tst ORDER BY v <-> '$query';", "SET work_mem = '64kB';", "unbounded with sort");
+
+done_testing();
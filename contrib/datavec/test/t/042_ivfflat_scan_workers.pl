@@ -0,0 +1,70 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate query
+my @r = ();
+for (1 .. $dim)
+{
+	push(@r, rand());
+}
+my $query = "[" . join(",", @r) . "]";
+
+sub test_workers
+{
+	my ($sql, $name) = @_;
+
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 10;
+		$sql
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 10;
+		SET ivfflat.scan_workers = 4;
+		$sql
+	));
+	is($actual, $expected, $name);
+}
+
+for my $quantizer ("none", "sq8")
+{
+	# Build index
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10, quantizer = '$quantizer');");
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.scan_workers = 4;
+		EXPLAIN SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan using idx/);
+
+	# Results should match a serial scan
+	test_workers("SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;", "$quantizer limit");
+	test_workers("SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit OFFSET 500;", "$quantizer offset");
+	test_workers("SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$query') t;", "$quantizer unbounded");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+done_testing();
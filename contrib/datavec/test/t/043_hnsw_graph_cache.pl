@@ -0,0 +1,102 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+
+# Generate queries
+my @queries = ();
+for (1 .. 10)
+{
+	my @r = ();
+	for (1 .. $dim)
+	{
+		push(@r, rand());
+	}
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+sub run_queries
+{
+	my ($mode) = @_;
+
+	$node->safe_psql("postgres", "ALTER INDEX idx SET (graph_cache = '$mode');");
+
+	my @results = ();
+	foreach (@queries)
+	{
+		push(@results, $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		)));
+	}
+	return join("\n", @results);
+}
+
+sub test_modes
+{
+	my ($name) = @_;
+
+	my $expected = run_queries("off");
+	foreach my $mode ("upper", "all")
+	{
+		# Run twice to use the cached graph
+		is(run_queries($mode), $expected, "$name $mode");
+		is(run_queries($mode), $expected, "$name $mode cached");
+	}
+}
+
+test_modes("build");
+
+# Test cache is rebuilt after inserts
+$node->safe_psql("postgres", "ALTER INDEX idx SET (graph_cache = 'all');");
+run_queries("all");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(10001, 12000) i;"
+);
+test_modes("insert");
+
+# Test cache is kept after a few inserts
+my $start = 12001;
+foreach my $mode ("upper", "all")
+{
+	run_queries($mode);
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series($start, $start + 9) i;"
+	);
+	$start += 10;
+	is(run_queries($mode), run_queries("off"), "few inserts $mode");
+}
+
+# Test cache is rebuilt after vacuum
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 3 = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+test_modes("vacuum");
+
+# Test cache of old relfilenode is replaced after reindex
+$node->safe_psql("postgres", "REINDEX INDEX idx;");
+test_modes("reindex");
+
+# Test invalid value
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "ALTER INDEX idx SET (graph_cache = 'none');");
+like($stderr, qr/invalid value for graph_cache/);
+
+done_testing();
@@ -0,0 +1,113 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+
+sub test_recall
+{
+	my ($probes, $min, $name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = $probes;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+
+		my @expected_ids = split("\n", $expected[$i]);
+		my %expected_set = map { $_ => 1 } @expected_ids;
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $name);
+}
+
+# Initialize node
+$node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 100000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Get exact results
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		WITH top AS (
+			SELECT v <-> '$_' AS distance FROM tst ORDER BY distance LIMIT $limit
+		)
+		SELECT i FROM tst WHERE (v <-> '$_') <= (SELECT MAX(distance) FROM top)
+	));
+	push(@expected, $res);
+}
+
+# Test mini-batch k-means
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (kmeans = 'minibatch');");
+test_recall(1, 0.65, "minibatch");
+test_recall(10, 0.95, "minibatch");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Test k-means with parallel workers
+$node->safe_psql("postgres", "ALTER TABLE tst SET (parallel_workers = 4);");
+foreach my $kmeans ("elkan", "minibatch")
+{
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (kmeans = '$kmeans');");
+	test_recall(1, 0.65, "$kmeans parallel");
+	test_recall(10, 0.95, "$kmeans parallel");
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+$node->safe_psql("postgres", "ALTER TABLE tst RESET (parallel_workers);");
+
+# Test mini-batch k-means fits where Elkan does not
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET maintenance_work_mem = '64MB';
+	CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1000);
+));
+like($stderr, qr/memory required is/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET maintenance_work_mem = '64MB';
+	CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1000, kmeans = 'minibatch');
+));
+is($ret, 0, $stderr);
+test_recall(10, 0.80, "minibatch low memory");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Test invalid value
+($ret, $stdout, $stderr) = $node->psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (kmeans = 'lloyd');");
+like($stderr, qr/invalid value for kmeans/);
+
+done_testing();
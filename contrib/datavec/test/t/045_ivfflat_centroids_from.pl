@@ -0,0 +1,105 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $lists = 10;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create tables
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE TABLE tst2 (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst2 SELECT i, ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+);
+
+# Train centers once
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = $lists);");
+my $centers = $node->safe_psql("postgres", "SELECT * FROM ivfflat_centers('idx');");
+my $count = $node->safe_psql("postgres", "SELECT COUNT(*) FROM ivfflat_centers('idx');");
+is($count, $lists);
+
+# Copy from an index
+$node->safe_psql("postgres", "CREATE INDEX idx2 ON tst2 USING ivfflat (v vector_l2_ops) WITH (centroids_from = 'idx');");
+is($node->safe_psql("postgres", "SELECT * FROM ivfflat_centers('idx2');"), $centers, "index centers");
+
+# Copy from a table
+$node->safe_psql("postgres", "CREATE TABLE centers AS SELECT * FROM ivfflat_centers('idx');");
+$node->safe_psql("postgres", "DROP INDEX idx2;");
+$node->safe_psql("postgres", "CREATE INDEX idx2 ON tst2 USING ivfflat (v vector_l2_ops) WITH (centroids_from = 'centers');");
+is($node->safe_psql("postgres", "SELECT * FROM ivfflat_centers('idx2');"), $centers, "table centers");
+
+# Rebuild keeps centers
+$node->safe_psql("postgres", "REINDEX INDEX idx2;");
+is($node->safe_psql("postgres", "SELECT * FROM ivfflat_centers('idx2');"), $centers, "reindex centers");
+
+# Results should match a sequential scan when probing all lists
+my @r = ();
+for (1 .. $dim)
+{
+	push(@r, rand());
+}
+my $query = "[" . join(",", @r) . "]";
+my $expected = $node->safe_psql("postgres", qq(
+	SET enable_indexscan = off;
+	SELECT i FROM tst2 ORDER BY v <-> '$query' LIMIT $limit;
+));
+my $actual = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = $lists;
+	SELECT i FROM tst2 ORDER BY v <-> '$query' LIMIT $limit;
+));
+is($actual, $expected, "results");
+
+# Test errors
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "CREATE INDEX ON tst2 USING ivfflat (v vector_l2_ops) WITH (centroids_from = 'missing');");
+like($stderr, qr/does not exist/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "CREATE INDEX ON tst2 USING ivfflat (v vector_l2_ops) WITH (lists = 3, centroids_from = 'idx');");
+like($stderr, qr/lists is 3, but centroids_from has $lists centers/);
+
+$node->safe_psql("postgres", "CREATE INDEX idx3 ON tst2 USING ivfflat (v vector_l2_ops) WITH (lists = $lists, centroids_from = 'idx');");
+$node->safe_psql("postgres", "DROP INDEX idx3;");
+
+$node->safe_psql("postgres", "CREATE TABLE small (v vector(2));");
+$node->safe_psql("postgres", "INSERT INTO small VALUES ('[1,2]');");
+($ret, $stdout, $stderr) = $node->psql("postgres", "CREATE INDEX ON tst2 USING ivfflat (v vector_l2_ops) WITH (centroids_from = 'small');");
+like($stderr, qr/centroids_from has 2 dimensions, expected 3/);
+
+$node->safe_psql("postgres", "CREATE TABLE empty (v vector(3));");
+($ret, $stdout, $stderr) = $node->psql("postgres", "CREATE INDEX ON tst2 USING ivfflat (v vector_l2_ops) WITH (centroids_from = 'empty');");
+like($stderr, qr/centroids_from has no centers/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT * FROM ivfflat_centers('tst');");
+like($stderr, qr/is not an ivfflat index/);
+
+# Test privileges
+$node->safe_psql("postgres", "CREATE USER centers_user PASSWORD 'Datavec\@123';");
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET ROLE centers_user PASSWORD 'Datavec\@123';
+	SELECT * FROM ivfflat_centers('idx');
+));
+like($stderr, qr/permission denied for relation tst/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET ROLE centers_user PASSWORD 'Datavec\@123';
+	CREATE TABLE own (v vector($dim));
+	INSERT INTO own VALUES ('[1,2,3]');
+	CREATE INDEX ON own USING ivfflat (v vector_l2_ops) WITH (centroids_from = 'idx');
+));
+like($stderr, qr/permission denied for relation tst/);
+
+done_testing();
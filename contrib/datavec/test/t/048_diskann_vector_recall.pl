@@ -0,0 +1,157 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random() * random()') x 3);
+
+sub test_recall
+{
+	my ($min, $operator, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+sub get_expected
+{
+	my ($operator) = @_;
+
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v $operator '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+# Initialize node
+$node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Check each index type
+my @operators = ("<->", "<#>", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_ip_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+	my $min = $operator eq "<#>" ? 0.95 : 0.98;
+
+	get_expected($operator);
+
+	# Build index in memory
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING diskann (v $opclass);");
+	test_recall($min, $operator, "$operator build");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Build index partly on disk
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET maintenance_work_mem = '1MB';
+		CREATE INDEX idx ON tst USING diskann (v $opclass);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/diskann graph no longer fits into maintenance_work_mem/);
+	test_recall($min - 0.05, $operator, "$operator build on disk");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test inserts into an empty index, which navigates without codes
+$node->safe_psql("postgres", "CREATE TABLE tst2 (i int4, v vector(3));");
+$node->safe_psql("postgres", "CREATE INDEX ON tst2 USING diskann (v vector_l2_ops) WITH (max_degree = 16, build_list_size = 32);");
+$node->safe_psql("postgres", "INSERT INTO tst2 SELECT * FROM tst WHERE i <= 2000;");
+$node->safe_psql("postgres", "DROP TABLE tst;");
+$node->safe_psql("postgres", "ALTER TABLE tst2 RENAME TO tst;");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+
+get_expected("<->");
+test_recall(0.95, "<->", "insert");
+
+# Test vacuum
+$node->safe_psql("postgres", "DROP TABLE tst;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING diskann (v vector_l2_ops);");
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i > 2500;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+get_expected("<->");
+test_recall(0.95, "<->", "after vacuum");
+
+# Test inserts after vacuum
+my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('tst_v_idx');");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(10001, 11000) i;"
+);
+is($node->safe_psql("postgres", "SELECT pg_relation_size('tst_v_idx');"), $size, "nodes reused");
+
+get_expected("<->");
+test_recall(0.95, "<->", "insert after vacuum");
+
+# Test without cached codes
+$node->append_conf('postgresql.conf', "diskann.pq_cache_size = 0");
+$node->reload;
+
+test_recall(0.95, "<->", "without cache");
+
+done_testing();
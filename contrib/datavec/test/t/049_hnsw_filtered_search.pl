@@ -0,0 +1,125 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $nc = 100;
+my $limit = 10;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim), c int4);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql], i % $nc FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres", "CREATE INDEX attribute_idx ON tst (c);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+
+sub test_recall
+{
+	my ($exact_limit, $min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $j (1 .. 10)
+	{
+		my @r = ();
+		for (1 .. $dim)
+		{
+			push(@r, rand());
+		}
+		my $query = "[" . join(",", @r) . "]";
+		my $c = int(rand() * $nc);
+
+		my @expected = split("\n", $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst WHERE c = $c ORDER BY v <-> '$query' LIMIT $limit;
+		)));
+
+		my @actual = split("\n", $node->safe_psql("postgres", qq(
+			SET hnsw.filter_exact_limit = $exact_limit;
+			SELECT i FROM tst WHERE ctid = ANY(
+				hnsw_filtered_search('idx', '$query'::vector, ARRAY(SELECT ctid FROM tst WHERE c = $c), $limit)
+			) ORDER BY v <-> '$query';
+		)));
+
+		# Results must all match the filter
+		my $matching = $node->safe_psql("postgres", qq(
+			SELECT COUNT(*) FROM tst WHERE i IN (@{[join(",", @actual, 0)]}) AND c != $c;
+		));
+		is($matching, 0);
+
+		my %actual_set = map { $_ => 1 } @actual;
+		foreach (@expected)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, $operator, $min, "exact_limit $exact_limit");
+}
+
+# Search the graph
+test_recall(0, 0.90, ">=");
+
+# Scan exactly
+test_recall(1000, 1.00, "==");
+
+# Test empty filter
+my $count = $node->safe_psql("postgres", qq(
+	SELECT array_length(hnsw_filtered_search('idx', '[1,1,1]'::vector, ARRAY[]::tid[], $limit), 1);
+));
+is($count, "");
+
+# Test HOT-updated rows
+$node->safe_psql("postgres", "CREATE TABLE hot (i int4, v vector($dim), c int4) WITH (fillfactor = 50);");
+$node->safe_psql("postgres",
+	"INSERT INTO hot SELECT i, ARRAY[$array_sql], i % 10 FROM generate_series(1, 1000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX hot_idx ON hot USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres", "UPDATE hot SET i = i + 1000 WHERE c = 1;");
+for my $exact_limit (0, 1000)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET hnsw.filter_exact_limit = $exact_limit;
+		SET hnsw.ef_search = 100;
+		SELECT COUNT(*), MIN(i) > 1000 FROM hot WHERE ctid = ANY(
+			hnsw_filtered_search('hot_idx', '[1,1,1]'::vector, ARRAY(SELECT ctid FROM hot WHERE c = 1), $limit)
+		);
+	));
+	is($res, "$limit|t", "hot updates exact_limit $exact_limit");
+}
+
+# Test privileges
+$node->safe_psql("postgres", "CREATE USER filter_user PASSWORD 'Datavec\@123';");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET ROLE filter_user PASSWORD 'Datavec\@123';
+	SELECT hnsw_filtered_search('idx', '[1,1,1]'::vector, ARRAY[]::tid[], 1);
+));
+like($stderr, qr/permission denied for relation tst/);
+
+# Test errors
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_filtered_search('attribute_idx', '[1,1,1]'::vector, ARRAY[]::tid[], 1);");
+like($stderr, qr/is not an hnsw index/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_filtered_search('idx', '[1,1,1]'::halfvec, ARRAY[]::tid[], 1);");
+like($stderr, qr/query type halfvec does not match index type vector/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_filtered_search('idx', '[1,1,1]'::vector, ARRAY[]::tid[], -1);");
+like($stderr, qr/k must be greater than or equal to zero/);
+
+done_testing();
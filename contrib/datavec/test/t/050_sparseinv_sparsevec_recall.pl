@@ -0,0 +1,125 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 10;
+my $dim = 100;
+my $vector_sql = "ARRAY(SELECT CASE WHEN random() < 0.1 THEN random() ELSE 0 END FROM generate_series(1, $dim))::vector::sparsevec";
+
+sub get_expected
+{
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <#> '$_', i LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v <#> '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan using idx/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <#> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v sparsevec($dim));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT $vector_sql FROM generate_series(1, 10000) g WHERE g > 0;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my @elements = ();
+	for my $j (1 .. $dim)
+	{
+		if (rand() < 0.2)
+		{
+			push(@elements, "$j:" . rand());
+		}
+	}
+	push(@elements, "1:1") if (!@elements);
+	push(@queries, "{" . join(",", @elements) . "}/$dim");
+}
+
+# Build
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING sparseinv (v sparsevec_ip_ops);");
+get_expected();
+test_recall(0.99, "build");
+
+# Insert into pending lists
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=500",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent INSERTs",
+	{
+		"050_sparseinv_sparsevec_recall" => "INSERT INTO tst (v) SELECT $vector_sql;"
+	}
+);
+get_expected();
+test_recall(0.99, "insert");
+
+# Merge pending lists and remove deleted rows
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 2 = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+get_expected();
+test_recall(0.99, "vacuum");
+
+# Reuse freed pages
+my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+$node->safe_psql("postgres", "INSERT INTO tst (v) SELECT $vector_sql FROM generate_series(1, 1000) g WHERE g > 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+my $new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+cmp_ok($new_size, "<=", $size * 1.1, "reuse pages");
+get_expected();
+test_recall(0.99, "reuse");
+
+done_testing();
@@ -0,0 +1,136 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 32;
+
+my $array_sql = join(",", ('random() - 0.5') x $dim);
+
+sub test_recall
+{
+	my ($ef_search, $min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.ef_search = $ef_search;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan using idx on tst/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.ef_search = $ef_search;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+
+		my @expected_ids = split("\n", $expected[$i]);
+		my %expected_set = map { $_ => 1 } @expected_ids;
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "$operator ef_search = $ef_search");
+}
+
+# Initialize node
+$node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my @r = ();
+	for (1 .. $dim)
+	{
+		push(@r, rand() - 0.5);
+	}
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Check each index type
+my @operators = ("<->", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	# Build index
+	$node->safe_psql("postgres", qq(
+		CREATE INDEX idx ON tst USING hnsw (v $opclass) WITH (quantizer = 'binary');
+	));
+
+	# Add rows after build to test inserts
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(10001, 12000) i;"
+	);
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			WITH top AS (
+				SELECT v $operator '$_' AS distance FROM tst ORDER BY distance LIMIT $limit
+			)
+			SELECT i FROM tst WHERE (v $operator '$_') <= (SELECT MAX(distance) FROM top)
+		));
+		push(@expected, $res);
+	}
+
+	# Test approximate results
+	test_recall(100, 0.6, $operator);
+	test_recall(400, 0.9, $operator);
+
+	# Test results are in order of full precision distance
+	my $distances = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.ef_search = 400;
+		SELECT v $operator '$queries[0]' FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	my @distances = split("\n", $distances);
+	my $ordered = 1;
+	for my $j (1 .. $#distances)
+	{
+		$ordered = 0 if ($distances[$j] < $distances[$j - 1]);
+	}
+	ok($ordered, "$operator ordered");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i > 10000;");
+}
+
+# Test types without binary quantization
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "CREATE TABLE tst2 (v halfvec(3)); CREATE INDEX ON tst2 USING hnsw (v halfvec_l2_ops) WITH (quantizer = 'binary');");
+like($stderr, qr/binary quantizer is only supported for vector/);
+
+done_testing();
@@ -0,0 +1,119 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+sub test_recall
+{
+	my ($function, $radius, $min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $j (1 .. 10)
+	{
+		my @r = ();
+		for (1 .. $dim)
+		{
+			push(@r, rand());
+		}
+		my $query = "[" . join(",", @r) . "]";
+
+		my @expected = split("\n", $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst WHERE v $operator '$query' < $radius;
+		)));
+
+		my @actual = split("\n", $node->safe_psql("postgres", qq(
+			SELECT i FROM tst WHERE ctid = ANY($function('idx', '$query'::vector, $radius));
+		)));
+
+		# Results must all be within the radius
+		my $outside = $node->safe_psql("postgres", qq(
+			SELECT COUNT(*) FROM tst WHERE i IN (@{[join(",", @actual, 0)]}) AND v $operator '$query' > $radius + 1e-6;
+		));
+		is($outside, 0);
+
+		my %actual_set = map { $_ => 1 } @actual;
+		foreach (@expected)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "$function $operator radius $radius");
+}
+
+# Check each index type
+my @operators = ("<->", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_cosine_ops");
+my @radii = (0.15, 0.01);
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+	my $radius = $radii[$i];
+
+	# Radius is larger than ef_search results
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v $opclass);");
+	test_recall("hnsw_range_search", $radius, 0.95, $operator);
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Radius spans several lists
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v $opclass) WITH (lists = 100);");
+	test_recall("ivfflat_range_search", $radius, 0.85, $operator);
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test empty results
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+my $count = $node->safe_psql("postgres", qq(
+	SELECT array_length(hnsw_range_search('idx', '[1,1,1]'::vector, -1), 1);
+));
+is($count, "");
+
+# Test privileges
+$node->safe_psql("postgres", "CREATE INDEX ivfflat_idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1);");
+$node->safe_psql("postgres", "CREATE USER range_user PASSWORD 'Datavec\@123';");
+foreach (["hnsw_range_search", "idx"], ["ivfflat_range_search", "ivfflat_idx"])
+{
+	my ($function, $index) = @$_;
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET ROLE range_user PASSWORD 'Datavec\@123';
+		SELECT $function('$index', '[1,1,1]'::vector, 1);
+	));
+	like($stderr, qr/permission denied for relation tst/, "$function privileges");
+}
+
+# Test errors
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT ivfflat_range_search('idx', '[1,1,1]'::vector, 1);");
+like($stderr, qr/is not an ivfflat index/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_range_search('idx', '[1,1,1]'::halfvec, 1);");
+like($stderr, qr/query type halfvec does not match index type vector/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_range_search('idx', '[1,1,1]'::vector, 'NaN');");
+like($stderr, qr/radius must not be NaN/);
+
+done_testing();
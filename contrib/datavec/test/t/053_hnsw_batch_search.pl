@@ -0,0 +1,120 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $limit = 10;
+my $nqueries = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE TABLE queries (q int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO queries SELECT q, ARRAY[$array_sql] FROM generate_series(1, $nqueries) q;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+
+sub test_recall
+{
+	my ($min) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $res = $node->safe_psql("postgres", qq(
+		SELECT r.query, tst.i FROM hnsw_batch_search('idx', ARRAY(SELECT v FROM queries ORDER BY q), $limit) r
+		JOIN tst ON tst.ctid = r.id;
+	));
+
+	my %actual = ();
+	foreach (split("\n", $res))
+	{
+		my ($query, $i) = split(/\|/, $_);
+		push(@{$actual{$query}}, $i);
+	}
+
+	for my $q (1 .. $nqueries)
+	{
+		my @expected = split("\n", $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> (SELECT v FROM queries WHERE q = $q) LIMIT $limit;
+		)));
+
+		my @actual_ids = @{$actual{$q} || []};
+		cmp_ok(scalar(@actual_ids), "<=", $limit);
+
+		my %actual_set = map { $_ => 1 } @actual_ids;
+		foreach (@expected)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "batch search");
+}
+
+# Search without a graph cache
+test_recall(0.90);
+
+# Search with the upper layers cached
+$node->safe_psql("postgres", "ALTER INDEX idx SET (graph_cache = 'upper');");
+test_recall(0.90);
+
+# Test results are in order of distance
+my $distances = $node->safe_psql("postgres", qq(
+	WITH r AS (
+		SELECT row_number() OVER () AS n, id FROM hnsw_batch_search('idx', ARRAY['[0.5,0.5,0.5]'::vector], $limit)
+	)
+	SELECT tst.v <-> '[0.5,0.5,0.5]' FROM r JOIN tst ON tst.ctid = r.id ORDER BY r.n;
+));
+my @distances = split("\n", $distances);
+my $ordered = 1;
+for my $j (1 .. $#distances)
+{
+	$ordered = 0 if ($distances[$j] < $distances[$j - 1]);
+}
+ok($ordered, "ordered");
+
+# Test null and empty queries
+my $count = $node->safe_psql("postgres", qq(
+	SELECT COUNT(*) FROM hnsw_batch_search('idx', ARRAY[NULL, '[1,1,1]']::vector[], $limit) WHERE query = 1;
+));
+is($count, 0);
+
+$count = $node->safe_psql("postgres", qq(
+	SELECT COUNT(*) FROM hnsw_batch_search('idx', ARRAY[]::vector[], $limit);
+));
+is($count, 0);
+
+# Test privileges
+$node->safe_psql("postgres", "CREATE USER batch_user PASSWORD 'Datavec\@123';");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET ROLE batch_user PASSWORD 'Datavec\@123';
+	SELECT * FROM hnsw_batch_search('idx', ARRAY['[1,1,1]'::vector], 1);
+));
+like($stderr, qr/permission denied for relation tst/);
+
+# Test errors
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT * FROM hnsw_batch_search('idx', ARRAY['[1,1,1]'::halfvec], 1);");
+like($stderr, qr/query type halfvec does not match index type vector/);
+
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT * FROM hnsw_batch_search('idx', ARRAY['[1,1,1]'::vector], -1);");
+like($stderr, qr/k must be greater than or equal to zero/);
+
+done_testing();
@@ -0,0 +1,100 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+my $nc = 1000;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim), c int4);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql], i % $nc FROM generate_series(1, 10000) i;"
+);
+
+# Generate query
+my @r = ();
+for (1 .. $dim)
+{
+	push(@r, rand());
+}
+my $query = "[" . join(",", @r) . "]";
+
+sub explain
+{
+	my ($sql, $settings) = @_;
+
+	return $node->safe_psql("postgres", qq(
+		$settings
+		EXPLAIN SELECT i FROM tst $sql;
+	));
+}
+
+for my $type ("hnsw", "ivfflat")
+{
+	my $with = $type eq "ivfflat" ? "WITH (lists = 100)" : "";
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING $type (v vector_l2_ops) $with;");
+
+	# Collect statistics
+	$node->safe_psql("postgres", "ANALYZE tst;");
+
+	my $explain = explain("ORDER BY v <-> '$query' LIMIT $limit");
+	like($explain, qr/Index Scan using idx/, "$type without filter");
+
+	# Few rows removed
+	$explain = explain("WHERE c != 1 ORDER BY v <-> '$query' LIMIT $limit");
+	like($explain, qr/Index Scan using idx/, "$type with few rows removed");
+
+	# Most rows removed
+	$explain = explain("WHERE c = 1 ORDER BY v <-> '$query' LIMIT $limit");
+	like($explain, qr/Seq Scan/, "$type with most rows removed");
+
+	# Collect statistics with vacuum
+	$node->safe_psql("postgres", "VACUUM tst;");
+	$explain = explain("WHERE c = 1 ORDER BY v <-> '$query' LIMIT $limit");
+	like($explain, qr/Seq Scan/, "$type after vacuum");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test cost grows with ef_search
+sub index_cost
+{
+	my ($settings) = @_;
+
+	my $explain = explain("ORDER BY v <-> '$query' LIMIT $limit", "SET enable_seqscan = off; $settings");
+	$explain =~ /Index Scan using idx on tst  \(cost=[\d.]+\.\.([\d.]+)/;
+	return $1;
+}
+
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+cmp_ok(index_cost("SET hnsw.ef_search = 1000;"), ">", index_cost("SET hnsw.ef_search = 40;"), "ef_search");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Test cost grows with probes
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 100);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+cmp_ok(index_cost("SET ivfflat.probes = 10;"), ">", index_cost("SET ivfflat.probes = 1;"), "probes");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Test empty indexes
+$node->safe_psql("postgres", "TRUNCATE tst;");
+$node->safe_psql("postgres", "CREATE INDEX hnsw_idx ON tst USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres", "CREATE INDEX ivfflat_idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1);");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "ANALYZE tst;");
+is($ret, 0, "analyze empty indexes");
+($ret, $stdout, $stderr) = $node->psql("postgres", "VACUUM tst;");
+is($ret, 0, "vacuum empty indexes");
+
+done_testing();
@@ -0,0 +1,76 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $dim = 3;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);");
+
+is($node->safe_psql("postgres", "SELECT COUNT(*), SUM(tuples) FROM ivfflat_lists WHERE indexrelid = 'idx'::regclass;"), "10|10000", "lists");
+
+# Make one list large
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, '[0.5,0.5,0.5]' FROM generate_series(10001, 20000) i;"
+);
+cmp_ok($node->safe_psql("postgres", "SELECT ivfflat_rebalance('idx', 2);"), '>', 0, "rebalance");
+is($node->safe_psql("postgres", "SELECT SUM(tuples) FROM ivfflat_lists WHERE indexrelid = 'idx'::regclass;"), "20000", "tuples after rebalance");
+
+# Pages of replaced lists are reused after vacuum
+$node->safe_psql("postgres", "SELECT txid_current();");
+$node->safe_psql("postgres", "VACUUM tst;");
+my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(20001, 22000) i;"
+);
+is($node->safe_psql("postgres", "SELECT pg_relation_size('idx');"), $size, "pages reused");
+
+# Results should match a sequential scan when probing all lists
+my $lists = $node->safe_psql("postgres", "SELECT COUNT(*) FROM ivfflat_lists WHERE indexrelid = 'idx'::regclass;");
+my $expected = $node->safe_psql("postgres", qq(
+	SET enable_indexscan = off;
+	SELECT i FROM tst ORDER BY v <-> '[0.1,0.2,0.3]' LIMIT 10;
+));
+my $actual = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = $lists;
+	SELECT i FROM tst ORDER BY v <-> '[0.1,0.2,0.3]' LIMIT 10;
+));
+is($actual, $expected, "results after reuse");
+
+# Test privileges
+$node->safe_psql("postgres", "CREATE USER lists_user PASSWORD 'Datavec\@123';");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET ROLE lists_user PASSWORD 'Datavec\@123';
+	SELECT * FROM ivfflat_list_stats('idx');
+));
+like($stderr, qr/permission denied for relation tst/, "list stats privileges");
+
+my $count = $node->safe_psql("postgres", qq(
+	SET ROLE lists_user PASSWORD 'Datavec\@123';
+	SELECT COUNT(*) FROM ivfflat_lists;
+));
+is($count, "0", "lists view privileges");
+
+$node->safe_psql("postgres", "GRANT SELECT ON tst TO lists_user;");
+$count = $node->safe_psql("postgres", qq(
+	SET ROLE lists_user PASSWORD 'Datavec\@123';
+	SELECT COUNT(*) FROM ivfflat_lists;
+));
+is($count, $lists, "lists view with privileges");
+
+done_testing();
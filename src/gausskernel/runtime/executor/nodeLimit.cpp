@@ -320,6 +320,18 @@ static void pass_down_bound(LimitState* node, PlanState* child_node)
             sortState->bounded = true;
             sortState->bound = tuples_needed;
         }
+    } else if (IsA(child_node, IndexScanState)) {
+        /*
+         * An ordered index scan without a qual returns one row per index
+         * tuple, so the access method can limit the work it does up front.
+         * It is only a hint: the access method must still return more
+         * tuples if they are requested (for instance, when some are not
+         * visible).
+         */
+        IndexScanState* isState = (IndexScanState*)child_node;
+
+        if (isState->iss_ScanDesc != NULL && isState->iss_NumOrderByKeys > 0 && child_node->plan->qual == NIL)
+            isState->iss_ScanDesc->xs_bound = (tuples_needed < 0) ? -1 : tuples_needed;
     } else if (IsA(child_node, MergeAppendState)) {
         MergeAppendState* maState = (MergeAppendState*)child_node;
         int i;
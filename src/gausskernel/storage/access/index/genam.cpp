@@ -117,6 +117,7 @@ IndexScanDesc RelationGetIndexScan(Relation index_relation, int nkeys, int norde
     scan->xs_want_xid = false; /* may be set later */
     scan->xs_recheck_itup = false; /* may be set later */
     scan->xs_sampling_scan = false; /* may be set later */
+    scan->xs_bound = -1; /* may be set later */
 
     /*
      * During recovery we ignore killed tuples and don't bother to kill them
@@ -170,6 +170,10 @@ typedef struct IndexScanDescData {
     SPQScanDesc spq_scan;
 #endif
     IndexFetchTableData *xs_heapfetch;
+
+    /* number of tuples the caller needs from an ordered scan, or -1 if unknown */
+    int64 xs_bound;
+
     /* put decompressed heap tuple data into xs_ctbuf_hdr be careful! when malloc memory  should give extra mem for
      *xs_ctbuf_hdr. t_bits which is varlength arr
      */